@@ -0,0 +1,122 @@
+#ifdef _MSC_VER
+#endif
+
+#include "socketchatcoro.h"
+#include "Timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PORT_NUMBER 3011			// kept apart from the TestServer and benchmark ports
+#define ECHO_HIGH_WATERMARK (1024*64)	// Echo coroutines wait for the socket to drain below this before reading more
+
+// Sample for the C++20 coroutine front end (socketchatcoro.h).
+// Runs an echo server and a number of clients in one thread, each connection served by its own
+// coroutine, and reports how long the round trips took.
+//
+// Usage: CoroutineChat [clients] [roundTrips]
+
+#ifdef __cpp_impl_coroutine
+
+using namespace socketchat::coro;
+
+// Sends every message straight back
+static Task echo(Connection *c)
+{
+	while (Message m = co_await c->receiveMessage())
+	{
+		if (m.mText)
+		{
+			c->sendText(m.text());
+		}
+		else
+		{
+			c->sendBinary(m.mData, m.mLength);
+		}
+		co_await c->flush(ECHO_HIGH_WATERMARK);
+	}
+	c->release();
+}
+
+// Hands each accepted connection to an echo coroutine of its own
+static Task serve(Loop &loop)
+{
+	while (Connection *c = co_await loop.accept())
+	{
+		echo(c);
+	}
+}
+
+// Makes 'roundTrips' round trips, one message at a time
+static Task client(Loop &loop, uint32_t index, uint32_t roundTrips, uint32_t &finished, uint32_t &failed)
+{
+	Connection *c = co_await loop.connect("localhost", PORT_NUMBER);
+	if (c)
+	{
+		char message[64];
+		for (uint32_t i = 0; i < roundTrips; i++)
+		{
+			snprintf(message, sizeof(message), "client %d message %d", index, i);
+			c->sendText(message);
+			Message reply = co_await c->receiveMessage();
+			if (!reply || strcmp(reply.text(), message) != 0)
+			{
+				failed++;
+				break;
+			}
+		}
+		c->release();
+	}
+	else
+	{
+		failed++;
+	}
+	finished++;
+}
+
+int main(int argc, const char **argv)
+{
+	uint32_t clients = argc >= 2 ? uint32_t(atoi(argv[1])) : 1000;
+	uint32_t roundTrips = argc >= 3 ? uint32_t(atoi(argv[2])) : 100;
+	socketchat::socketStartup();
+	wsocket::Wsocket *listenSocket = wsocket::Wsocket::create(SOCKET_SERVER, PORT_NUMBER);
+	if (listenSocket)
+	{
+		{
+			Loop loop(listenSocket);
+			serve(loop);
+			uint32_t finished = 0;
+			uint32_t failed = 0;
+			timer::Timer t;
+			for (uint32_t i = 0; i < clients; i++)
+			{
+				client(loop, i, roundTrips, finished, failed);
+			}
+			while (finished < clients)
+			{
+				loop.poll(1);
+			}
+			double seconds = t.peekElapsedSeconds();
+			printf("%d clients made %d round trips each in %0.3f seconds (%0.0f round trips per second); %d failed\n",
+				int(clients), int(roundTrips), seconds, double(clients) * roundTrips / seconds, int(failed));
+		}
+		listenSocket->release();
+	}
+	else
+	{
+		printf("Failed to open server socket on port %d\n", PORT_NUMBER);
+	}
+	socketchat::socketShutdown();
+	return 0;
+}
+
+#else
+
+int main(void)
+{
+	printf("CoroutineChat needs a compiler with C++20 coroutine support.\n");
+	return 0;
+}
+
+#endif
@@ -0,0 +1,2530 @@
+#ifdef _MSC_VER
+#endif
+
+#include "socketchat.h"
+#include "socketchatreactor.h"
+#include "socketchatserver.h"
+#include "wsocket.h"
+#include "wplatform.h"
+#include "FrameScanner.h"
+#include "SimpleBuffer.h"
+#include "SPSC.h"
+#include "SPMC.h"
+#include "Timer.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <string>
+#include <algorithm>
+#include <chrono>
+
+#ifndef _MSC_VER
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#define PORT_NUMBER 3010    // benchmark port number; kept apart from the TestServer port
+
+// Benchmarks for the socketchat library.
+//
+// Usage: SocketChatBench <benchmark> [arguments]
+//
+//   reactor [maxConnections] [server|uringserver]
+//       Compares the cost of one server loop pass using SocketChatReactor against calling
+//       SocketChat::poll on every connection in turn. The reactor cost should track the number
+//       of *active* connections, while the per-connection loop tracks the *total* number.
+//       Passing 'uringserver' runs the server side connections on the io_uring transport.
+//
+//   threaded [maxThreads] [connectionsPerThread] [server|uringserver]
+//       Echo throughput of SocketChatServer with 1, 2, 4 ... maxThreads workers, driven by the same
+//       number of client threads. Each client connection keeps a fixed number of messages in flight.
+//       Throughput should scale close to linearly until the workers run out of cores.
+//
+//   fanout [connections] [messageSize] [server|uringserver]
+//       Cost of broadcasting one message to every connection and pushing it to the sockets, using
+//       sendText (one copy per connection) against sendShared (one shared, reference counted copy).
+//
+//   framing
+//       Loopback throughput of CR/LF text framing against varint length prefixed binary framing,
+//       for small chat lines up to megabyte sized messages.
+//
+//   buffer
+//       Streams data through a heap SimpleBuffer and a mirrored ring SimpleBuffer with a fixed amount
+//       of data always left unconsumed, the pattern which makes the heap buffer compact over and over.
+//
+//   pingpong [roundTrips]
+//       Round trip latency between two processes bouncing a 64 byte message over a pair of shared memory
+//       SPSC rings, copying through read/write against formatting in place with reserve/commit and
+//       peek/release, and against whole message records, and sleeping on the ring's futex against busy
+//       polling it (when there is more than one CPU).
+//
+//   producers [maxThreads] [messagesPerThread]
+//       Several threads sending on one connection while another thread polls it: every call guarded by
+//       one mutex, against the lock-free send queue (SocketChatOptions::mSendQueueSize), polled directly
+//       and with the connection left to a SocketChatReactor which only hears of the sends through the
+//       queue's notifications. Reports the message rate and how often a producer found the queue full.
+//
+//   iothread [roundTrips]
+//       Echo round trip time seen by an application which is busy (asleep) for a while between looks
+//       at its connection: driving the socket from its own 'poll' calls against a connection created
+//       with createThreaded, whose I/O thread sends and receives while the application is away.
+//
+//   scan
+//       Compares the incremental FrameScanner against the original byte at a time CR/LF search,
+//       on a buffer full of short chat lines and on a multi-megabyte message arriving 4KB at a time.
+//
+//   suite [tcp] [uring] [shared] [subprocess] [quick] [file.json]
+//       End to end matrix over transport, message size, connection count and fan-out. Each client keeps
+//       a few messages in flight; the server echoes each one to its sender and copies it to the next
+//       'fanout - 1' connections. Reports delivered messages/sec, MB/sec and p50/p99/p999 round trip
+//       latency, and writes them as JSON to the file (socketchat_bench.json by default). The server runs
+//       on a thread, or with 'subprocess' in a child process. Naming transports limits the run to them.
+//       The 'socketchat_bench' build target runs it and writes socketchat_bench.json in the build directory.
+//
+//   replay [captureFile] [realtime] [binary]
+//       Replays the first stream of a capture file (see Capture.h; 'TestServer capture' writes one) into a
+//       connection, so the parsing and dispatch path runs on recorded traffic with no network in the way.
+//       Goes as fast as it can, a few times over, or with 'realtime' at the pace it was captured. Pass
+//       'binary' for a capture of FRAMING_BINARY traffic. Without a file it first captures a loopback client.
+//
+//   accept [connections]
+//       A connect storm: every client connection is started at once (asynchronous connect) against a reactor
+//       serving the listen socket on a thread of its own, a tenth of them and then all of them. Reports how
+//       long the server took to accept them all, and its longest single pass while it did, with the listen
+//       socket taking one connection off the kernel's queue at a time against a batch at a time
+//       (WsocketOptions::mAcceptBatch).
+//
+//   broadcast [messages]
+//       Publishes messages of mixed sizes through spmc::BroadcastRing rings of awkward sizes, so the writer
+//       wraps over and over with every possible gap at the end of the ring, while reader threads check that
+//       each message arrives whole and in order (none lost, under POLICY_BLOCK) and that nothing was written
+//       past the end of the ring. Reports the message rate for each ring size and policy.
+
+namespace bench
+{
+
+// Raise the open file limit as far as we are allowed; every loopback connection uses two descriptors
+static void raiseFileLimit(void)
+{
+#ifndef _MSC_VER
+	rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+#endif
+}
+
+// Echoes every message straight back to the connection it arrived on
+class EchoConnection : public socketchat::SocketChatCallback
+{
+public:
+	EchoConnection(socketchat::SocketChat *sc,uint32_t &received) : mSocketChat(sc), mReceived(received)
+	{
+	}
+
+	virtual ~EchoConnection(void)
+	{
+	}
+
+	virtual void receiveMessage(const char *message) override final
+	{
+		mReceived++;
+		mSocketChat->sendText(message);
+	}
+
+	socketchat::SocketChat	*mSocketChat{ nullptr };
+	uint32_t				&mReceived;
+};
+
+// Counts messages arriving at the client side
+class CountMessages : public socketchat::SocketChatCallback
+{
+public:
+	virtual void receiveMessage(const char *message) override final
+	{
+		(void)message;
+		mCount++;
+	}
+
+	uint32_t	mCount{ 0 };
+};
+
+class ReactorBench : public socketchat::SocketChatReactorCallback
+{
+public:
+	virtual socketchat::SocketChatCallback *newConnection(socketchat::SocketChat *client) override final
+	{
+		EchoConnection *ec = new EchoConnection(client, mReceived);
+		mServerConnections.push_back(ec);
+		return ec;
+	}
+
+	virtual void connectionClosed(socketchat::SocketChat *client) override final
+	{
+		(void)client;
+	}
+
+	// One round: 'active' clients each send a message; returns the seconds the server spent
+	// until every one of them had been received and echoed
+	double round(uint32_t active, bool useReactor)
+	{
+		for (uint32_t i = 0; i < active; i++)
+		{
+			mClients[i]->sendText("ping");
+			mClients[i]->flush();
+		}
+		mReceived = 0;
+		timer::Timer t;
+		while (mReceived < active)
+		{
+			if (useReactor)
+			{
+				mReactor->poll(0);
+			}
+			else
+			{
+				// A plain server loop also polls the listen socket every pass
+				mServerSocket->pollServer();
+				for (auto &i : mServerConnections)
+				{
+					i->mSocketChat->poll(i, 0);
+				}
+			}
+		}
+		if (useReactor)
+		{
+			// Transports which batch their sends (io_uring) submit them on the next pass
+			mReactor->poll(0);
+		}
+		else
+		{
+			// The echoes were queued during dispatch; the per connection loop sends them on its next pass
+			for (auto &i : mServerConnections)
+			{
+				i->mSocketChat->flush();
+			}
+			mServerSocket->pollServer();
+		}
+		double ret = t.peekElapsedSeconds();
+		// Drain the echoes on the client side (not timed)
+		CountMessages cm;
+		while (cm.mCount < active)
+		{
+			for (uint32_t i = 0; i < active; i++)
+			{
+				mClients[i]->poll(&cm, 0);
+			}
+		}
+		return ret;
+	}
+
+	void run(uint32_t maxConnections,const char *serverType)
+	{
+		raiseFileLimit();
+		mServerSocket = wsocket::Wsocket::create(serverType, PORT_NUMBER);
+		if (!mServerSocket)
+		{
+			printf("Failed to open server socket on port %d\n", PORT_NUMBER);
+			return;
+		}
+		mReactor = socketchat::SocketChatReactor::create(mServerSocket, this);
+
+		const uint32_t totalCounts[] = { 100, 1000, 2500, 5000, 10000 };
+		const uint32_t activeCounts[] = { 1, 10, 100 };
+		const uint32_t rounds = 100;
+
+		printf("%12s %8s %16s %16s\n", "connections", "active", "reactor(us)", "pollEach(us)");
+		for (auto total : totalCounts)
+		{
+			if (total > maxConnections)
+			{
+				break;
+			}
+			// Grow the connection set up to 'total'
+			while (mClients.size() < total)
+			{
+				socketchat::SocketChat *sc = socketchat::SocketChat::create("localhost", PORT_NUMBER);
+				if (!sc)
+				{
+					printf("Failed to connect client %d\n", int(mClients.size()));
+					return;
+				}
+				mClients.push_back(sc);
+				mReactor->poll(0);
+			}
+			while (mServerConnections.size() < total)
+			{
+				mReactor->poll(1);
+			}
+			for (auto active : activeCounts)
+			{
+				if (active > total)
+				{
+					continue;
+				}
+				round(active, true); // warm up; drains any stale readiness
+				double reactorTime = 0;
+				double pollTime = 0;
+				for (uint32_t r = 0; r < rounds; r++)
+				{
+					reactorTime += round(active, true);
+				}
+				for (uint32_t r = 0; r < rounds; r++)
+				{
+					pollTime += round(active, false);
+				}
+				printf("%12d %8d %16.1f %16.1f\n", int(total), int(active),
+					reactorTime * 1e6 / rounds, pollTime * 1e6 / rounds);
+			}
+		}
+	}
+
+	~ReactorBench(void)
+	{
+		for (auto &i : mClients)
+		{
+			delete i;
+		}
+		if (mReactor)
+		{
+			mReactor->release();
+		}
+		for (auto &i : mServerConnections)
+		{
+			delete i->mSocketChat;
+			delete i;
+		}
+		if (mServerSocket)
+		{
+			mServerSocket->release();
+		}
+	}
+
+	uint32_t								mReceived{ 0 };
+	wsocket::Wsocket						*mServerSocket{ nullptr };
+	socketchat::SocketChatReactor			*mReactor{ nullptr };
+	std::vector< socketchat::SocketChat * >	mClients;
+	std::vector< EchoConnection * >			mServerConnections;
+};
+
+#define THREADED_WINDOW 8			// Messages each client connection keeps in flight
+#define THREADED_WARMUP 0.25		// Seconds of traffic before measuring
+#define THREADED_MEASURE 1.0		// Seconds of traffic measured
+
+// Server side of the threaded benchmark; echoes each message back to its sender
+class ThreadedEcho : public socketchat::SocketChatCallback
+{
+public:
+	ThreadedEcho(socketchat::SocketChat *sc) : mSocketChat(sc)
+	{
+	}
+
+	virtual ~ThreadedEcho(void)
+	{
+	}
+
+	virtual void receiveMessage(const char *message) override final
+	{
+		mSocketChat->sendText(message);
+	}
+
+	socketchat::SocketChat	*mSocketChat{ nullptr };
+};
+
+// Client side; counts the echoes and sends a new message for each one so the window stays full
+class ThreadedClient : public socketchat::SocketChatCallback
+{
+public:
+	ThreadedClient(socketchat::SocketChat *sc,std::atomic<uint64_t> &received) : mSocketChat(sc), mReceived(received)
+	{
+	}
+
+	virtual ~ThreadedClient(void)
+	{
+	}
+
+	virtual void receiveMessage(const char *message) override final
+	{
+		mReceived.fetch_add(1, std::memory_order_relaxed);
+		mSocketChat->sendText(message);
+	}
+
+	socketchat::SocketChat	*mSocketChat{ nullptr };
+	std::atomic<uint64_t>	&mReceived;
+};
+
+class ThreadedBench : public socketchat::SocketChatServerCallback
+{
+public:
+	typedef std::unordered_map< socketchat::SocketChat *, ThreadedEcho * > EchoMap;
+
+	virtual socketchat::SocketChatCallback *newConnection(uint32_t worker,socketchat::SocketChat *client) override final
+	{
+		ThreadedEcho *te = new ThreadedEcho(client);
+		mEchoes[worker][client] = te;
+		return te;
+	}
+
+	virtual void connectionClosed(uint32_t worker,socketchat::SocketChat *client) override final
+	{
+		EchoMap::iterator found = mEchoes[worker].find(client);
+		if (found != mEchoes[worker].end())
+		{
+			delete found->second;
+			mEchoes[worker].erase(found);
+		}
+		delete client;
+	}
+
+	// Returns echoed messages per second with 'threads' server workers and as many client threads
+	double measure(uint32_t threads,uint32_t connectionsPerThread,const char *serverType)
+	{
+		mEchoes.clear();
+		mEchoes.resize(threads);
+		socketchat::SocketChatServer *server = socketchat::SocketChatServer::create(serverType, PORT_NUMBER, threads, this, true);
+		if (!server)
+		{
+			printf("Failed to start the server on port %d\n", PORT_NUMBER);
+			return 0;
+		}
+		uint32_t total = threads*connectionsPerThread;
+		std::vector< socketchat::SocketChat * > clients;
+		for (uint32_t i = 0; i < total; i++)
+		{
+			socketchat::SocketChat *sc = socketchat::SocketChat::create("localhost", PORT_NUMBER);
+			if (!sc)
+			{
+				break;
+			}
+			clients.push_back(sc);
+		}
+		while (server->getConnectionCount() < clients.size())
+		{
+			wplatform::sleepNano(1000000);
+		}
+
+		std::atomic<uint64_t> received{ 0 };
+		std::atomic<bool> exit{ false };
+		std::vector< std::thread * > clientThreads;
+		for (uint32_t t = 0; t < threads; t++)
+		{
+			clientThreads.push_back(new std::thread([&, t]()
+			{
+				// Each client thread drives its own slice of the connections from its own reactor
+				socketchat::SocketChatReactor *reactor = socketchat::SocketChatReactor::create(nullptr, nullptr);
+				std::vector< ThreadedClient * > callbacks;
+				for (size_t i = t; i < clients.size(); i += threads)
+				{
+					ThreadedClient *tc = new ThreadedClient(clients[i], received);
+					callbacks.push_back(tc);
+					for (uint32_t j = 0; j < THREADED_WINDOW; j++)
+					{
+						clients[i]->sendText("ping");
+					}
+					reactor->addConnection(clients[i], tc);
+				}
+				while (!exit)
+				{
+					reactor->poll(1);
+				}
+				reactor->release();
+				for (auto &i : callbacks)
+				{
+					delete i;
+				}
+			}));
+		}
+
+		timer::Timer warmup;
+		while (warmup.peekElapsedSeconds() < THREADED_WARMUP)
+		{
+			wplatform::sleepNano(1000000);
+		}
+		uint64_t start = received;
+		timer::Timer t;
+		while (t.peekElapsedSeconds() < THREADED_MEASURE)
+		{
+			wplatform::sleepNano(1000000);
+		}
+		double ret = double(received - start) / t.peekElapsedSeconds();
+
+		exit = true;
+		for (auto &i : clientThreads)
+		{
+			i->join();
+			delete i;
+		}
+		for (auto &i : clients)
+		{
+			delete i;
+		}
+		server->release();
+		return ret;
+	}
+
+	void run(uint32_t maxThreads,uint32_t connectionsPerThread,const char *serverType)
+	{
+		raiseFileLimit();
+		printf("%8s %12s %16s %16s\n", "threads", "connections", "messages/sec", "perThread");
+		for (uint32_t threads = 1; threads <= maxThreads; threads *= 2)
+		{
+			double rate = measure(threads, connectionsPerThread, serverType);
+			printf("%8d %12d %16.0f %16.0f\n", int(threads), int(threads*connectionsPerThread), rate, rate / threads);
+		}
+	}
+
+	std::vector< EchoMap >	mEchoes;	// One map per server worker, only touched by that worker
+};
+
+// Server side of the fan-out benchmark; accepts connections and ignores what they send
+class FanoutBench : public socketchat::SocketChatReactorCallback
+{
+public:
+	virtual socketchat::SocketChatCallback *newConnection(socketchat::SocketChat *client) override final
+	{
+		mServerConnections.push_back(client);
+		return nullptr;
+	}
+
+	virtual void connectionClosed(socketchat::SocketChat *client) override final
+	{
+		(void)client;
+	}
+
+	// Broadcasts one message; returns the seconds spent queueing it and making one pass over the sockets
+	double round(const std::string &message, bool useShared)
+	{
+		timer::Timer t;
+		if (useShared)
+		{
+			socketchat::SharedMessage *sm = socketchat::SharedMessage::create(message.c_str());
+			for (auto &i : mServerConnections)
+			{
+				i->sendShared(sm);
+			}
+			sm->release();
+		}
+		else
+		{
+			for (auto &i : mServerConnections)
+			{
+				i->sendText(message.c_str());
+			}
+		}
+		mReactor->poll(0);
+		double ret = t.peekElapsedSeconds();
+		// Finish sending and drain every client (not timed)
+		CountMessages cm;
+		while (cm.mCount < mClients.size())
+		{
+			mReactor->poll(0);
+			for (auto &i : mClients)
+			{
+				i->poll(&cm, 0);
+			}
+		}
+		return ret;
+	}
+
+	void run(uint32_t connections,uint32_t messageSize,const char *serverType)
+	{
+		raiseFileLimit();
+		mServerSocket = wsocket::Wsocket::create(serverType, PORT_NUMBER);
+		if (!mServerSocket)
+		{
+			printf("Failed to open server socket on port %d\n", PORT_NUMBER);
+			return;
+		}
+		mReactor = socketchat::SocketChatReactor::create(mServerSocket, this);
+		while (mClients.size() < connections)
+		{
+			socketchat::SocketChat *sc = socketchat::SocketChat::create("localhost", PORT_NUMBER);
+			if (!sc)
+			{
+				printf("Failed to connect client %d\n", int(mClients.size()));
+				return;
+			}
+			mClients.push_back(sc);
+			mReactor->poll(0);
+		}
+		while (mServerConnections.size() < connections)
+		{
+			mReactor->poll(1);
+		}
+		std::string message(messageSize, 'x');
+		const uint32_t rounds = 20;
+		round(message, true); // warm up
+		double textTime = 0;
+		double sharedTime = 0;
+		for (uint32_t r = 0; r < rounds; r++)
+		{
+			textTime += round(message, false);
+			sharedTime += round(message, true);
+		}
+		printf("%12s %12s %16s %16s\n", "connections", "messageSize", "sendText(us)", "sendShared(us)");
+		printf("%12d %12d %16.1f %16.1f\n", int(connections), int(messageSize), textTime * 1e6 / rounds, sharedTime * 1e6 / rounds);
+	}
+
+	~FanoutBench(void)
+	{
+		for (auto &i : mClients)
+		{
+			delete i;
+		}
+		if (mReactor)
+		{
+			mReactor->release();
+		}
+		for (auto &i : mServerConnections)
+		{
+			delete i;
+		}
+		if (mServerSocket)
+		{
+			mServerSocket->release();
+		}
+	}
+
+	wsocket::Wsocket						*mServerSocket{ nullptr };
+	socketchat::SocketChatReactor			*mReactor{ nullptr };
+	std::vector< socketchat::SocketChat * >	mClients;
+	std::vector< socketchat::SocketChat * >	mServerConnections;
+};
+
+#define FRAMING_TOTAL_BYTES (1024*1024*32)	// Bytes sent per framing test
+
+// Counts messages in either framing mode
+class FramingCounter : public socketchat::SocketChatCallback
+{
+public:
+	virtual void receiveMessage(const char *message) override final
+	{
+		(void)message;
+		mCount++;
+	}
+
+	virtual void receiveBinary(const void *data, uint32_t dataLen) override final
+	{
+		(void)data;
+		(void)dataLen;
+		mCount++;
+	}
+
+	uint32_t	mCount{ 0 };
+};
+
+class FramingBench : public socketchat::SocketChatReactorCallback
+{
+public:
+	virtual socketchat::SocketChatCallback *newConnection(socketchat::SocketChat *client) override final
+	{
+		mServerConnection = client;
+		return &mCounter;
+	}
+
+	virtual void connectionClosed(socketchat::SocketChat *client) override final
+	{
+		(void)client;
+	}
+
+	// Returns the seconds taken to send 'count' messages of 'messageSize' bytes and receive them all
+	double measure(socketchat::FramingMode framing, uint32_t messageSize, uint32_t count)
+	{
+		socketchat::SocketChatOptions options;
+		options.mFraming = framing;
+		wsocket::Wsocket *serverSocket = wsocket::Wsocket::create(SOCKET_SERVER, PORT_NUMBER);
+		if (!serverSocket)
+		{
+			printf("Failed to open server socket on port %d\n", PORT_NUMBER);
+			return 0;
+		}
+		socketchat::SocketChatReactor *reactor = socketchat::SocketChatReactor::create(serverSocket, this, options);
+		socketchat::SocketChat *client = socketchat::SocketChat::create("localhost", PORT_NUMBER, options);
+		mServerConnection = nullptr;
+		mCounter.mCount = 0;
+		while (client && !mServerConnection)
+		{
+			reactor->poll(1);
+		}
+		double ret = 0;
+		if (client)
+		{
+			std::string message(messageSize, 'x');
+			timer::Timer t;
+			uint32_t sent = 0;
+			while (mCounter.mCount < count)
+			{
+				// Keep a bounded amount queued so the transmit buffer does not have to hold everything
+				while (sent < count && client->getTransmitBufferSize() < 1024 * 1024)
+				{
+					if (framing == socketchat::FRAMING_BINARY)
+					{
+						client->sendBinary(message.c_str(), messageSize);
+					}
+					else
+					{
+						client->sendText(message.c_str());
+					}
+					sent++;
+				}
+				client->flush();
+				reactor->poll(0);
+			}
+			ret = t.peekElapsedSeconds();
+			delete client;
+		}
+		reactor->release();
+		delete mServerConnection;
+		serverSocket->release();
+		return ret;
+	}
+
+	void run(void)
+	{
+		const uint32_t sizes[] = { 32, 1024, 64 * 1024, 1024 * 1024 };
+		printf("%12s %10s %16s %16s\n", "messageSize", "count", "text(MB/s)", "binary(MB/s)");
+		for (auto size : sizes)
+		{
+			uint32_t count = FRAMING_TOTAL_BYTES / size;
+			double textTime = measure(socketchat::FRAMING_TEXT, size, count);
+			double binaryTime = measure(socketchat::FRAMING_BINARY, size, count);
+			double mb = double(size) * count / (1024 * 1024);
+			printf("%12d %10d %16.1f %16.1f\n", int(size), int(count), mb / textTime, mb / binaryTime);
+		}
+	}
+
+	socketchat::SocketChat	*mServerConnection{ nullptr };
+	FramingCounter			mCounter;
+};
+
+#define BUFFER_STREAM_BYTES (1024ull*1024*1024)	// Bytes pushed through each buffer
+#define BUFFER_CHUNK_SIZE (1024*4)					// Bytes added and consumed per step (one socket read)
+
+class BufferBench
+{
+public:
+	// Returns the seconds taken to stream BUFFER_STREAM_BYTES through the buffer while keeping 'backlog' bytes unconsumed
+	double stream(simplebuffer::BufferType type, uint32_t backlog)
+	{
+		simplebuffer::SimpleBuffer *sb = simplebuffer::SimpleBuffer::create(1024 * 16, 1024 * 1024 * 64, type);
+		uint8_t *dest = sb->confirmCapacity(backlog);
+		memset(dest, 0, backlog);
+		sb->addBuffer(nullptr, backlog);
+		uint64_t checksum = 0;
+		timer::Timer t;
+		for (uint64_t i = 0; i < BUFFER_STREAM_BYTES; i += BUFFER_CHUNK_SIZE)
+		{
+			dest = sb->confirmCapacity(BUFFER_CHUNK_SIZE);
+			dest[0] = uint8_t(i);	// stands in for the socket writing into the buffer
+			sb->addBuffer(nullptr, BUFFER_CHUNK_SIZE);
+			uint32_t dataLen;
+			const uint8_t *data = sb->getData(dataLen);
+			checksum += data[0];
+			sb->consume(BUFFER_CHUNK_SIZE);
+		}
+		double ret = t.peekElapsedSeconds();
+		if (checksum == 1) // keep the reads from being optimized away
+		{
+			printf(" ");
+		}
+		sb->release();
+		return ret;
+	}
+
+	void run(void)
+	{
+		const uint32_t backlogs[] = { 1024, 1024 * 8, 1024 * 12, 1024 * 60, 1024 * 1024 };
+		double gb = double(BUFFER_STREAM_BYTES) / (1024.0 * 1024 * 1024);
+		printf("%12s %16s %16s\n", "backlog", "heap(GB/s)", "mirrored(GB/s)");
+		for (auto backlog : backlogs)
+		{
+			double heapTime = stream(simplebuffer::BUFFER_HEAP, backlog);
+			double mirroredTime = stream(simplebuffer::BUFFER_MIRRORED, backlog);
+			printf("%12d %16.2f %16.2f\n", int(backlog), gb / heapTime, gb / mirroredTime);
+		}
+	}
+};
+
+#define PINGPONG_RING_SIZE (1024*64)		// Bytes in each direction's ring (including its header)
+#define PINGPONG_MESSAGE_SIZE 64			// Bytes in each message
+#define PINGPONG_ROUND_TRIPS 100000			// Default number of round trips measured
+
+// How the pingpong benchmark moves messages through the rings
+enum PingPongApi
+{
+	PINGPONG_COPY,			// read/write
+	PINGPONG_IN_PLACE,		// reserve/commit and peek/release
+	PINGPONG_RECORDS,		// one record per message
+};
+
+class PingPongBench
+{
+public:
+	PingPongBench(uint32_t roundTrips) : mRoundTrips(roundTrips)
+	{
+	}
+
+	void run(void)
+	{
+#ifdef _MSC_VER
+		printf("The pingpong benchmark needs fork and is not available on this platform.\n");
+#else
+		bool multiCore = std::thread::hardware_concurrency() > 1;
+		printf("%-24s %12s %12s %12s\n", "mode", "mean(us)", "p50(us)", "p99(us)");
+		measure("read/write, wait", PINGPONG_COPY, false);
+		measure("reserve/peek, wait", PINGPONG_IN_PLACE, false);
+		measure("records, wait", PINGPONG_RECORDS, false);
+		if (multiCore)
+		{
+			measure("read/write, busy", PINGPONG_COPY, true);
+			measure("reserve/peek, busy", PINGPONG_IN_PLACE, true);
+			measure("records, busy", PINGPONG_RECORDS, true);
+		}
+		else
+		{
+			printf("Busy polling skipped; with one CPU the peer cannot run while we spin.\n");
+		}
+#endif
+	}
+
+#ifndef _MSC_VER
+	void measure(const char *mode, PingPongApi api, bool busyPoll)
+	{
+		mApi = api;
+		mBusyPoll = busyPoll;
+		void *memory = mmap(nullptr, PINGPONG_RING_SIZE * 2, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED)
+		{
+			printf("Failed to map the shared rings\n");
+			return;
+		}
+		uint8_t *ping = (uint8_t *)memory;
+		uint8_t *pong = ping + PINGPONG_RING_SIZE;
+		// Set up both ring headers before the fork; the child only attaches
+		spsc::SPSC writer;
+		spsc::SPSC reader;
+		writer.init(ping, PINGPONG_RING_SIZE, true, true);
+		reader.init(pong, PINGPONG_RING_SIZE, false, true);
+		pid_t child = fork();
+		if (child == 0)
+		{
+			spsc::SPSC childReader;
+			spsc::SPSC childWriter;
+			childReader.init(ping, PINGPONG_RING_SIZE, false, false);
+			childWriter.init(pong, PINGPONG_RING_SIZE, true, false);
+			echo(childReader, childWriter);
+			_exit(0);
+		}
+		std::vector< uint64_t > times;
+		times.reserve(mRoundTrips);
+		uint8_t message[PINGPONG_MESSAGE_SIZE];
+		memset(message, 0, sizeof(message));
+		uint32_t mismatches = 0;
+		for (uint32_t i = 0; i <= mRoundTrips; i++)
+		{
+			uint32_t sequence = i == mRoundTrips ? cQuit : i;
+			memcpy(message, &sequence, sizeof(sequence));
+			timer::Timer t;
+			send(writer, message);
+			if (sequence == cQuit)
+			{
+				break;
+			}
+			receive(reader, message);
+			times.push_back(uint64_t(t.peekElapsedSeconds() * 1e9));
+			uint32_t echoed;
+			memcpy(&echoed, message, sizeof(echoed));
+			if (echoed != i)
+			{
+				mismatches++;
+			}
+		}
+		waitpid(child, nullptr, 0);
+		munmap(memory, PINGPONG_RING_SIZE * 2);
+		uint64_t total = 0;
+		for (auto &i : times)
+		{
+			total += i;
+		}
+		std::sort(times.begin(), times.end());
+		printf("%-24s %12.2f %12.2f %12.2f", mode,
+			double(total) / double(times.size()) / 1000.0,
+			double(times[times.size() / 2]) / 1000.0,
+			double(times[times.size() * 99 / 100]) / 1000.0);
+		if (mismatches)
+		{
+			printf("  (%d mismatched replies)", mismatches);
+		}
+		printf("\n");
+	}
+
+	// Child process; bounces every message back until told to quit
+	void echo(spsc::SPSC &reader, spsc::SPSC &writer)
+	{
+		uint8_t message[PINGPONG_MESSAGE_SIZE];
+		for (;;)
+		{
+			if (mApi == PINGPONG_RECORDS)
+			{
+				// Forward the record where it lies
+				waitFor(reader);
+				uint32_t len;
+				uint32_t flags;
+				const uint8_t *data = reader.peekRecord(len, flags);
+				uint32_t sequence;
+				memcpy(&sequence, data, sizeof(sequence));
+				if (sequence == cQuit)
+				{
+					return;
+				}
+				send(writer, data);
+				reader.releaseRecord();
+			}
+			else if (mApi == PINGPONG_IN_PLACE)
+			{
+				// Copy ring to ring, with no intermediate buffer
+				waitFor(reader);
+				uint32_t done = 0;
+				while (done < PINGPONG_MESSAGE_SIZE)
+				{
+					uint32_t len = PINGPONG_MESSAGE_SIZE - done;
+					const uint8_t *data = reader.peek(len);
+					uint32_t sequence = 0;
+					if (done == 0 && len >= sizeof(sequence))
+					{
+						memcpy(&sequence, data, sizeof(sequence));
+						if (sequence == cQuit)
+						{
+							return;
+						}
+					}
+					put(writer, data, len);
+					reader.release(len);
+					done += len;
+				}
+			}
+			else
+			{
+				receive(reader, message);
+				uint32_t sequence;
+				memcpy(&sequence, message, sizeof(sequence));
+				if (sequence == cQuit)
+				{
+					return;
+				}
+				send(writer, message);
+			}
+		}
+	}
+
+	// Waits until a whole message is in the ring; a record is never visible until it is complete
+	void waitFor(spsc::SPSC &reader)
+	{
+		while (reader.size() < PINGPONG_MESSAGE_SIZE)
+		{
+			if (mBusyPoll)
+			{
+				spsc::cpuRelax();
+			}
+			else
+			{
+				reader.waitForData(-1);
+			}
+		}
+	}
+
+	void receive(spsc::SPSC &reader, uint8_t *message)
+	{
+		waitFor(reader);
+		if (mApi == PINGPONG_RECORDS)
+		{
+			uint32_t len;
+			uint32_t flags;
+			const uint8_t *data = reader.peekRecord(len, flags);
+			memcpy(message, data, PINGPONG_MESSAGE_SIZE);
+			reader.releaseRecord();
+		}
+		else if (mApi == PINGPONG_IN_PLACE)
+		{
+			uint32_t done = 0;
+			while (done < PINGPONG_MESSAGE_SIZE)
+			{
+				uint32_t len = PINGPONG_MESSAGE_SIZE - done;
+				const uint8_t *data = reader.peek(len);
+				memcpy(message + done, data, len);
+				reader.release(len);
+				done += len;
+			}
+		}
+		else
+		{
+			reader.read(message, PINGPONG_MESSAGE_SIZE);
+		}
+	}
+
+	void send(spsc::SPSC &writer, const uint8_t *message)
+	{
+		if (mApi == PINGPONG_RECORDS)
+		{
+			while (!writer.writeRecord(message, PINGPONG_MESSAGE_SIZE, 0))
+			{
+				writer.waitForSpace(mBusyPoll ? 0 : -1);
+			}
+		}
+		else if (mApi == PINGPONG_IN_PLACE)
+		{
+			put(writer, message, PINGPONG_MESSAGE_SIZE);
+		}
+		else
+		{
+			writer.write(message, PINGPONG_MESSAGE_SIZE);
+		}
+	}
+
+	// Formats straight into the ring; a message which meets the end of the ring is committed in two pieces
+	void put(spsc::SPSC &writer, const uint8_t *data, uint32_t dataLen)
+	{
+		while (dataLen)
+		{
+			uint32_t len = dataLen;
+			uint8_t *dest = writer.reserve(len);
+			if (!dest)
+			{
+				writer.waitForSpace(mBusyPoll ? 0 : -1);
+				continue;
+			}
+			memcpy(dest, data, len);
+			writer.commit(len);
+			data += len;
+			dataLen -= len;
+		}
+	}
+#endif
+
+	const uint32_t	cQuit = 0xFFFFFFFF;
+	uint32_t		mRoundTrips{ PINGPONG_ROUND_TRIPS };
+	PingPongApi		mApi{ PINGPONG_COPY };
+	bool			mBusyPoll{ false };
+};
+
+#define PRODUCER_QUEUE_SIZE 4096			// Entries in the send queue
+#define PRODUCER_MESSAGES (1024*64)			// Default number of messages each producer sends
+#define PRODUCER_MESSAGE_SIZE 64			// Bytes in each message
+#define PRODUCER_REACTOR_WAIT 100			// Milliseconds the reactor may sleep; the send queue has to wake it
+#define PRODUCER_STALL_TIME 5				// Seconds without progress before a run is given up
+
+// How the producer benchmark's connection is sent on and driven
+enum ProducerMode
+{
+	PRODUCER_MUTEX,		// every send and poll under one mutex
+	PRODUCER_QUEUE,		// send queue, polled directly
+	PRODUCER_REACTOR,	// send queue, flushed by a reactor
+};
+
+// Application threads sending on one connection at once
+class ProducerBench : public socketchat::SocketChatReactorCallback
+{
+public:
+	virtual socketchat::SocketChatCallback *newConnection(socketchat::SocketChat *client) override final
+	{
+		mServerConnection = client;
+		return &mCounter;
+	}
+
+	virtual void connectionClosed(socketchat::SocketChat *client) override final
+	{
+		(void)client;
+	}
+
+	// Returns the seconds taken for 'producers' threads to send 'messagesPerThread' messages each and
+	// for the server to receive them all, or zero if they stopped arriving
+	double measure(uint32_t producers, uint32_t messagesPerThread, ProducerMode mode, uint32_t &retries)
+	{
+		bool queued = mode != PRODUCER_MUTEX;
+		socketchat::SocketChatOptions options;
+		options.mSendQueueSize = queued ? PRODUCER_QUEUE_SIZE : 0;
+		wsocket::Wsocket *serverSocket = wsocket::Wsocket::create(SOCKET_SERVER, PORT_NUMBER);
+		if (!serverSocket)
+		{
+			printf("Failed to open server socket on port %d\n", PORT_NUMBER);
+			return 0;
+		}
+		socketchat::SocketChatReactor *reactor = socketchat::SocketChatReactor::create(serverSocket, this);
+		socketchat::SocketChat *client = socketchat::SocketChat::create("localhost", PORT_NUMBER, options);
+		mServerConnection = nullptr;
+		mCounter.mCount = 0;
+		while (client && !mServerConnection)
+		{
+			reactor->poll(1);
+		}
+		double ret = 0;
+		std::atomic<uint32_t> fullCount(0);
+		if (client && mode == PRODUCER_REACTOR)
+		{
+			reactor->addConnection(client, nullptr);
+		}
+		if (client)
+		{
+			std::mutex clientMutex;
+			std::atomic<bool> stop(false);
+			std::string message(PRODUCER_MESSAGE_SIZE, 'x');
+			std::vector< std::thread * > threads;
+			timer::Timer t;
+			for (uint32_t i = 0; i < producers; i++)
+			{
+				threads.push_back(new std::thread([&]()
+				{
+					for (uint32_t j = 0; j < messagesPerThread; j++)
+					{
+						for (;;)
+						{
+							bool sent;
+							if (queued)
+							{
+								sent = client->sendText(message.c_str());
+							}
+							else
+							{
+								std::lock_guard< std::mutex > guard(clientMutex);
+								sent = client->sendText(message.c_str());
+							}
+							if (sent)
+							{
+								break;
+							}
+							fullCount++;
+							if (stop)
+							{
+								return; // nothing is draining the queue any more
+							}
+							std::this_thread::yield();
+						}
+					}
+				}));
+			}
+			uint32_t total = producers * messagesPerThread;
+			uint32_t lastCount = 0;
+			timer::Timer progress;
+			bool stalled = false;
+			while (mCounter.mCount < total)
+			{
+				if (mode == PRODUCER_REACTOR)
+				{
+					reactor->poll(PRODUCER_REACTOR_WAIT);
+				}
+				else
+				{
+					if (queued)
+					{
+						client->poll(nullptr, 0);
+					}
+					else
+					{
+						std::lock_guard< std::mutex > guard(clientMutex);
+						client->poll(nullptr, 0);
+					}
+					reactor->poll(0);
+				}
+				if (mCounter.mCount != lastCount)
+				{
+					lastCount = mCounter.mCount;
+					progress.reset();
+				}
+				else if (progress.peekElapsedSeconds() > PRODUCER_STALL_TIME)
+				{
+					stalled = true;
+					break;
+				}
+			}
+			ret = stalled ? 0 : t.peekElapsedSeconds();
+			stop = true;
+			for (auto &i : threads)
+			{
+				i->join();
+				delete i;
+			}
+			if (mode == PRODUCER_REACTOR)
+			{
+				reactor->removeConnection(client);
+			}
+			delete client;
+		}
+		reactor->release();
+		delete mServerConnection;
+		serverSocket->release();
+		retries = fullCount;
+		return ret;
+	}
+
+	void run(uint32_t maxThreads, uint32_t messagesPerThread)
+	{
+		printf("%10s %12s %16s %16s %16s %12s\n", "producers", "messages", "mutex(msg/s)", "queue(msg/s)", "reactor(msg/s)", "queueFull");
+		for (uint32_t producers = 1; producers <= maxThreads; producers *= 2)
+		{
+			uint32_t retries;
+			double mutexTime = measure(producers, messagesPerThread, PRODUCER_MUTEX, retries);
+			double queueTime = measure(producers, messagesPerThread, PRODUCER_QUEUE, retries);
+			uint32_t reactorRetries;
+			double reactorTime = measure(producers, messagesPerThread, PRODUCER_REACTOR, reactorRetries);
+			double total = double(producers) * messagesPerThread;
+			printf("%10d %12d %16.0f %16.0f %16.0f %12d\n", int(producers), int(total), total / mutexTime, total / queueTime,
+				reactorTime > 0 ? total / reactorTime : 0.0, int(retries));
+		}
+	}
+
+	socketchat::SocketChat	*mServerConnection{ nullptr };
+	FramingCounter			mCounter;
+};
+
+#define IOTHREAD_ROUND_TRIPS 2000		// Default number of round trips measured
+#define IOTHREAD_WORK_US 500			// Microseconds the application is busy between looks at the connection
+
+class IoThreadBench : public socketchat::SocketChatReactorCallback
+{
+public:
+	virtual socketchat::SocketChatCallback *newConnection(socketchat::SocketChat *client) override final
+	{
+		mServerConnection = client;
+		mEcho = new EchoConnection(client, mReceived);
+		return mEcho;
+	}
+
+	virtual void connectionClosed(socketchat::SocketChat *client) override final
+	{
+		(void)client;
+	}
+
+	void measure(const char *mode, bool threaded, uint32_t roundTrips)
+	{
+		wsocket::Wsocket *serverSocket = wsocket::Wsocket::create(SOCKET_SERVER, PORT_NUMBER);
+		if (!serverSocket)
+		{
+			printf("Failed to open server socket on port %d\n", PORT_NUMBER);
+			return;
+		}
+		socketchat::SocketChatReactor *reactor = socketchat::SocketChatReactor::create(serverSocket, this);
+		std::atomic<bool> quit(false);
+		std::thread server([&]()
+		{
+			while (!quit)
+			{
+				reactor->poll(1);
+			}
+		});
+		socketchat::SocketChat *client = threaded ? socketchat::SocketChat::createThreaded("localhost", PORT_NUMBER) : socketchat::SocketChat::create("localhost", PORT_NUMBER);
+		if (client)
+		{
+			CountMessages counter;
+			std::vector< uint64_t > times;
+			// The first round trip also waits for the connection to be accepted
+			for (uint32_t i = 0; i <= roundTrips; i++)
+			{
+				timer::Timer t;
+				counter.mCount = 0;
+				client->sendText("ping");
+				for (;;)
+				{
+					// The application gets on with something else before it looks at the connection again
+					std::this_thread::sleep_for(std::chrono::microseconds(IOTHREAD_WORK_US));
+					if (threaded)
+					{
+						client->tryReceive(&counter);
+					}
+					else
+					{
+						client->poll(&counter, 0);
+					}
+					if (counter.mCount)
+					{
+						break;
+					}
+				}
+				if (i)
+				{
+					times.push_back(uint64_t(t.peekElapsedSeconds() * 1e9));
+				}
+			}
+			std::sort(times.begin(), times.end());
+			uint64_t total = 0;
+			for (auto &i : times)
+			{
+				total += i;
+			}
+			printf("%-24s %12.2f %12.2f %12.2f\n", mode,
+				double(total) / double(times.size()) / 1000.0,
+				double(times[times.size() / 2]) / 1000.0,
+				double(times[times.size() * 99 / 100]) / 1000.0);
+			delete client;
+		}
+		quit = true;
+		server.join();
+		reactor->release();
+		delete mServerConnection;
+		delete mEcho;
+		mServerConnection = nullptr;
+		mEcho = nullptr;
+		serverSocket->release();
+	}
+
+	void run(uint32_t roundTrips)
+	{
+		printf("Application busy for %dus between looks at the connection\n", IOTHREAD_WORK_US);
+		printf("%-24s %12s %12s %12s\n", "mode", "mean(us)", "p50(us)", "p99(us)");
+		measure("application poll", false, roundTrips);
+		measure("I/O thread", true, roundTrips);
+	}
+
+	socketchat::SocketChat	*mServerConnection{ nullptr };
+	EchoConnection			*mEcho{ nullptr };
+	uint32_t				mReceived{ 0 };
+};
+
+#define SCAN_LINE_COUNT (1024*64)		// Short chat lines in the line test
+#define SCAN_PAYLOAD_SIZE (1024*1024*4)	// Size of the large message
+#define SCAN_READ_SIZE (1024*4)			// Bytes per simulated socket read
+
+// The search SocketChat used before FrameScanner; always starts at the front of the buffer
+static uint32_t legacyFind(const uint8_t *data, uint32_t dataLen)
+{
+	if (dataLen < 2)
+	{
+		return framescanner::cNotFound;
+	}
+	for (uint32_t i = 0; i < (dataLen - 1); i++)
+	{
+		if (data[i] == 13 &&
+			data[i + 1] == 10)
+		{
+			return i;
+		}
+	}
+	return framescanner::cNotFound;
+}
+
+class ScanBench
+{
+public:
+	// Dispatches every line in the buffer; returns the number of messages found
+	uint32_t scanLines(const std::vector< uint8_t > &buffer, bool useScanner)
+	{
+		framescanner::FrameScanner scanner;
+		uint32_t offset = 0;
+		uint32_t ret = 0;
+		uint32_t dataLen = uint32_t(buffer.size());
+		for (;;)
+		{
+			const uint8_t *data = &buffer[offset];
+			uint32_t len = dataLen - offset;
+			uint32_t end = useScanner ? scanner.scan(data, len) : legacyFind(data, len);
+			if (end == framescanner::cNotFound)
+			{
+				break;
+			}
+			ret++;
+			offset += end + 2;
+			scanner.consume(end + 2);
+		}
+		return ret;
+	}
+
+	// Searches after every simulated read, the way SocketChat::poll does while a large message trickles in
+	uint32_t scanPayload(const std::vector< uint8_t > &buffer, bool useScanner)
+	{
+		framescanner::FrameScanner scanner;
+		uint32_t dataLen = uint32_t(buffer.size());
+		for (uint32_t received = SCAN_READ_SIZE; ; received += SCAN_READ_SIZE)
+		{
+			if (received > dataLen)
+			{
+				received = dataLen;
+			}
+			uint32_t end = useScanner ? scanner.scan(&buffer[0], received) : legacyFind(&buffer[0], received);
+			if (end != framescanner::cNotFound || received == dataLen)
+			{
+				return end;
+			}
+		}
+	}
+
+	void run(void)
+	{
+#if FRAME_SCANNER_AVX2
+		printf("FrameScanner is using AVX2\n");
+#elif FRAME_SCANNER_SSE2
+		printf("FrameScanner is using SSE2\n");
+#else
+		printf("FrameScanner is using the scalar fallback\n");
+#endif
+		// Short chat lines of varying length
+		std::vector< uint8_t > lines;
+		for (uint32_t i = 0; i < SCAN_LINE_COUNT; i++)
+		{
+			uint32_t len = 8 + (i * 7) % 56;
+			for (uint32_t j = 0; j < len; j++)
+			{
+				lines.push_back(uint8_t('a' + (i + j) % 26));
+			}
+			lines.push_back(13);
+			lines.push_back(10);
+		}
+		// A large message with lone CRs and LFs sprinkled through it, terminated at the very end
+		std::vector< uint8_t > payload(SCAN_PAYLOAD_SIZE);
+		for (uint32_t i = 0; i < SCAN_PAYLOAD_SIZE; i++)
+		{
+			payload[i] = uint8_t('a' + i % 26);
+			if ((i % 1000) == 0)
+			{
+				payload[i] = (i % 2000) ? 13 : 10;
+			}
+		}
+		payload[SCAN_PAYLOAD_SIZE - 2] = 13;
+		payload[SCAN_PAYLOAD_SIZE - 1] = 10;
+
+		printf("%-28s %14s %14s %10s\n", "test", "legacy(ms)", "scanner(ms)", "speedup");
+		{
+			const uint32_t repeat = 20;
+			uint32_t legacyCount = 0;
+			uint32_t scannerCount = 0;
+			timer::Timer t;
+			for (uint32_t r = 0; r < repeat; r++)
+			{
+				legacyCount += scanLines(lines, false);
+			}
+			double legacyTime = t.getElapsedSeconds();
+			for (uint32_t r = 0; r < repeat; r++)
+			{
+				scannerCount += scanLines(lines, true);
+			}
+			double scannerTime = t.getElapsedSeconds();
+			if (legacyCount != scannerCount)
+			{
+				printf("Mismatch: legacy found %d lines, scanner found %d\n", legacyCount, scannerCount);
+			}
+			printf("%-28s %14.3f %14.3f %9.1fx\n", "64K chat lines", legacyTime * 1000 / repeat, scannerTime * 1000 / repeat, legacyTime / scannerTime);
+		}
+		{
+			const uint32_t repeat = 3;
+			uint32_t legacyEnd = 0;
+			uint32_t scannerEnd = 0;
+			timer::Timer t;
+			for (uint32_t r = 0; r < repeat; r++)
+			{
+				legacyEnd = scanPayload(payload, false);
+			}
+			double legacyTime = t.getElapsedSeconds();
+			for (uint32_t r = 0; r < repeat; r++)
+			{
+				scannerEnd = scanPayload(payload, true);
+			}
+			double scannerTime = t.getElapsedSeconds();
+			if (legacyEnd != scannerEnd)
+			{
+				printf("Mismatch: legacy found the end at %d, scanner at %d\n", legacyEnd, scannerEnd);
+			}
+			printf("%-28s %14.3f %14.3f %9.1fx\n", "4MB message in 4KB reads", legacyTime * 1000 / repeat, scannerTime * 1000 / repeat, legacyTime / scannerTime);
+		}
+	}
+};
+
+#define SUITE_WINDOW 4					// Messages each client connection keeps in flight
+#define SUITE_WARMUP 0.1				// Seconds of traffic before measuring each case
+#define SUITE_MEASURE 0.5				// Seconds measured per case
+#define SUITE_QUICK_MEASURE 0.1			// Seconds measured per case with 'quick'
+#define SUITE_START_TIMEOUT 5.0			// Seconds to wait for a case's server to start and accept its clients
+#define SUITE_DRAIN 0.05				// Seconds to let the messages still in flight arrive before closing
+#define SUITE_MIN_MESSAGE_SIZE 8		// Room for the sender's id and sequence number
+#define SUITE_JSON_FILE "socketchat_bench.json"	// Where the results go unless a file is named
+
+static uint64_t nowNanoseconds(void)
+{
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Server side of the suite. Every message goes back to its sender and is also copied to the next
+// 'fanout - 1' connections, so each message sent costs 'fanout' deliveries.
+class SuiteServer : public socketchat::SocketChatReactorCallback
+{
+public:
+	class Connection : public socketchat::SocketChatCallback
+	{
+	public:
+		virtual ~Connection(void)
+		{
+		}
+
+		virtual void receiveMessage(const char *message) override final
+		{
+			(void)message;
+		}
+
+		virtual void receiveBinary(const void *data, uint32_t dataLen) override final
+		{
+			mServer->forward(mIndex, data, dataLen);
+		}
+
+		SuiteServer				*mServer{ nullptr };
+		socketchat::SocketChat	*mSocketChat{ nullptr };
+		uint32_t				mIndex{ 0 };
+	};
+
+	SuiteServer(uint32_t fanout) : mFanout(fanout)
+	{
+	}
+
+	virtual ~SuiteServer(void)
+	{
+		if (mReactor)
+		{
+			mReactor->release();
+		}
+		for (auto &i : mConnections)
+		{
+			if (i)
+			{
+				delete i->mSocketChat;
+				delete i;
+			}
+		}
+		if (mListenSocket)
+		{
+			mListenSocket->release();
+		}
+	}
+
+	bool start(const char *serverType)
+	{
+		mListenSocket = wsocket::Wsocket::create(serverType, PORT_NUMBER);
+		if (mListenSocket)
+		{
+			socketchat::SocketChatOptions options;
+			options.mFraming = socketchat::FRAMING_BINARY;
+			mReactor = socketchat::SocketChatReactor::create(mListenSocket, this, options);
+		}
+		return mReactor != nullptr;
+	}
+
+	virtual socketchat::SocketChatCallback *newConnection(socketchat::SocketChat *client) override final
+	{
+		Connection *c = new Connection;
+		c->mServer = this;
+		c->mSocketChat = client;
+		c->mIndex = uint32_t(mConnections.size());
+		mConnections.push_back(c);
+		mAccepted++;
+		return c;
+	}
+
+	// Closed connections leave a hole, so the others keep their indices
+	virtual void connectionClosed(socketchat::SocketChat *client) override final
+	{
+		for (auto &i : mConnections)
+		{
+			if (i && i->mSocketChat == client)
+			{
+				delete i->mSocketChat;
+				delete i;
+				i = nullptr;
+				break;
+			}
+		}
+	}
+
+	void forward(uint32_t index, const void *data, uint32_t dataLen)
+	{
+		uint32_t count = uint32_t(mConnections.size());
+		for (uint32_t i = 0; i < mFanout && i < count; i++)
+		{
+			Connection *c = mConnections[(index + i) % count];
+			if (c)
+			{
+				c->mSocketChat->sendBinary(data, dataLen);
+			}
+		}
+	}
+
+	uint32_t						mFanout{ 1 };
+	std::atomic<uint32_t>			mAccepted{ 0 };
+	wsocket::Wsocket				*mListenSocket{ nullptr };
+	socketchat::SocketChatReactor	*mReactor{ nullptr };
+	std::vector< Connection * >		mConnections;
+};
+
+// One case of the suite, and what it measured
+struct SuiteCase
+{
+	const char			*mTransport{ nullptr };
+	uint32_t			mMessageSize{ 0 };
+	uint32_t			mConnections{ 0 };
+	uint32_t			mFanout{ 0 };
+	const char			*mError{ nullptr };		// Why the case could not run, if it could not
+	double				mSeconds{ 0 };
+	uint64_t			mMessagesSent{ 0 };
+	uint64_t			mMessagesDelivered{ 0 };
+	uint64_t			mBytesDelivered{ 0 };
+	histogram::Histogram	mRoundTrip;			// Nanoseconds from a send until the echo reached the sender
+};
+
+// Client side; keeps SUITE_WINDOW messages of its own in flight and times each one's echo.
+// The copies fanned out from other clients are only counted.
+class SuiteClient : public socketchat::SocketChatCallback
+{
+public:
+	SuiteClient(socketchat::SocketChat *sc, uint32_t id, uint32_t messageSize, SuiteCase &result, const bool &measuring, const bool &sending)
+		: mSocketChat(sc), mId(id), mPayload(messageSize, 'x'), mResult(result), mMeasuring(measuring), mSending(sending)
+	{
+	}
+
+	virtual ~SuiteClient(void)
+	{
+	}
+
+	virtual void receiveMessage(const char *message) override final
+	{
+		(void)message;
+	}
+
+	virtual void receiveBinary(const void *data, uint32_t dataLen) override final
+	{
+		uint32_t id;
+		memcpy(&id, data, sizeof(id));
+		if (mMeasuring)
+		{
+			mResult.mMessagesDelivered++;
+			mResult.mBytesDelivered += dataLen;
+		}
+		if (id == mId && mSequence != mReceived)
+		{
+			// Echoes come back in the order they were sent
+			uint64_t now = nowNanoseconds();
+			if (mMeasuring)
+			{
+				mResult.mRoundTrip.record(now - mSendTimes[mReceived % SUITE_WINDOW]);
+			}
+			mReceived++;
+			if (mSending)
+			{
+				send();
+			}
+		}
+	}
+
+	void send(void)
+	{
+		memcpy(&mPayload[0], &mId, sizeof(mId));
+		memcpy(&mPayload[sizeof(mId)], &mSequence, sizeof(mSequence));
+		mSendTimes[mSequence % SUITE_WINDOW] = nowNanoseconds();
+		mSequence++;
+		if (mMeasuring)
+		{
+			mResult.mMessagesSent++;
+		}
+		mSocketChat->sendBinary(&mPayload[0], uint32_t(mPayload.size()));
+	}
+
+	socketchat::SocketChat	*mSocketChat{ nullptr };
+	uint32_t				mId{ 0 };
+	uint32_t				mSequence{ 0 };			// Messages sent
+	uint32_t				mReceived{ 0 };			// Echoes received
+	uint64_t				mSendTimes[SUITE_WINDOW]{};
+	std::string				mPayload;
+	SuiteCase				&mResult;
+	const bool				&mMeasuring;
+	const bool				&mSending;
+};
+
+// Runs every combination of transport, message size, connection count and fan-out, and writes
+// the results as JSON so runs from different builds can be compared by a script.
+// The server runs on a thread of its own, or with 'subprocess' in a child process.
+class SuiteBench
+{
+public:
+	struct Transport
+	{
+		const char	*mName;
+		const char	*mServerType;
+		const char	*mClientHost;
+	};
+
+	void run(int argc, const char **argv)
+	{
+		static const Transport transports[] =
+		{
+			{ "tcp", SOCKET_SERVER, "localhost" },
+			{ "uring", URING_SERVER, "localhost" },
+			{ "shared", SHARED_SERVER, SHARED_CLIENT },
+		};
+		const uint32_t messageSizes[] = { 32, 1024, 16384 };
+		const uint32_t connectionCounts[] = { 1, 16, 128 };
+		const uint32_t fanouts[] = { 1, 8 };
+
+		const char *fileName = SUITE_JSON_FILE;
+		std::vector< const Transport * > selected;
+		for (int i = 0; i < argc; i++)
+		{
+			const Transport *found = nullptr;
+			for (auto &t : transports)
+			{
+				if (strcmp(argv[i], t.mName) == 0)
+				{
+					found = &t;
+				}
+			}
+			if (found)
+			{
+				selected.push_back(found);
+			}
+			else if (strcmp(argv[i], "subprocess") == 0)
+			{
+				mSubprocess = true;
+			}
+			else if (strcmp(argv[i], "quick") == 0)
+			{
+				mMeasureSeconds = SUITE_QUICK_MEASURE;
+			}
+			else
+			{
+				fileName = argv[i];
+			}
+		}
+		if (selected.empty())
+		{
+			for (auto &t : transports)
+			{
+				selected.push_back(&t);
+			}
+		}
+		raiseFileLimit();
+
+		std::vector< SuiteCase * > results;
+		printf("%-8s %8s %12s %7s %14s %10s %10s %10s %10s\n", "transport", "size", "connections", "fanout",
+			"messages/sec", "MB/sec", "p50(us)", "p99(us)", "p999(us)");
+		for (auto &t : selected)
+		{
+			for (auto size : messageSizes)
+			{
+				for (auto connections : connectionCounts)
+				{
+					for (auto fanout : fanouts)
+					{
+						if (fanout > connections)
+						{
+							continue;
+						}
+						SuiteCase *sc = new SuiteCase;
+						sc->mTransport = t->mName;
+						sc->mMessageSize = size;
+						sc->mConnections = connections;
+						sc->mFanout = fanout;
+						measure(*t, *sc);
+						report(*sc);
+						results.push_back(sc);
+					}
+				}
+			}
+		}
+
+		FILE *fph = fopen(fileName, "wb");
+		if (fph)
+		{
+			writeJson(fph, results);
+			fclose(fph);
+			printf("Wrote %s\n", fileName);
+		}
+		else
+		{
+			printf("Failed to open '%s' for writing\n", fileName);
+		}
+		for (auto &i : results)
+		{
+			delete i;
+		}
+	}
+
+private:
+	void measure(const Transport &transport, SuiteCase &result)
+	{
+		SuiteServer *server = nullptr;
+		std::thread *serverThread = nullptr;
+		std::atomic<bool> quit{ false };
+#ifndef _MSC_VER
+		pid_t child = -1;
+		int quitPipe[2] = { -1, -1 };
+#endif
+		if (mSubprocess)
+		{
+#ifndef _MSC_VER
+			if (!startChild(transport, result.mFanout, child, quitPipe))
+			{
+				result.mError = "server did not start";
+				return;
+			}
+#else
+			result.mError = "subprocess mode is not supported on this platform";
+			return;
+#endif
+		}
+		else
+		{
+			server = new SuiteServer(result.mFanout);
+			if (!server->start(transport.mServerType))
+			{
+				delete server;
+				result.mError = "server did not start";
+				return;
+			}
+			serverThread = new std::thread([server, &quit]()
+			{
+				while (!quit)
+				{
+					server->mReactor->poll(1);
+				}
+			});
+		}
+
+		bool measuring = false;
+		bool sending = true;
+		socketchat::SocketChatReactor *reactor = socketchat::SocketChatReactor::create(nullptr, nullptr);
+		std::vector< SuiteClient * > clients;
+		socketchat::SocketChatOptions options;
+		options.mFraming = socketchat::FRAMING_BINARY;
+		uint32_t messageSize = result.mMessageSize < SUITE_MIN_MESSAGE_SIZE ? SUITE_MIN_MESSAGE_SIZE : result.mMessageSize;
+		for (uint32_t i = 0; i < result.mConnections; i++)
+		{
+			socketchat::SocketChat *sc = socketchat::SocketChat::create(transport.mClientHost, PORT_NUMBER, options);
+			if (!sc)
+			{
+				result.mError = "client failed to connect";
+				break;
+			}
+			SuiteClient *c = new SuiteClient(sc, i, messageSize, result, measuring, sending);
+			clients.push_back(c);
+			reactor->addConnection(sc, c);
+		}
+		// Every client must be accepted before any sends, or the fan-out would reach fewer of them
+		timer::Timer wait;
+		while (!result.mError && server && server->mAccepted < clients.size())
+		{
+			if (wait.peekElapsedSeconds() > SUITE_START_TIMEOUT)
+			{
+				result.mError = "server did not accept every client";
+			}
+			reactor->poll(1);
+		}
+		if (!result.mError)
+		{
+			for (auto &c : clients)
+			{
+				for (uint32_t i = 0; i < SUITE_WINDOW; i++)
+				{
+					c->send();
+				}
+			}
+			timer::Timer warmup;
+			while (warmup.peekElapsedSeconds() < SUITE_WARMUP)
+			{
+				reactor->poll(1);
+			}
+			measuring = true;
+			timer::Timer t;
+			while (t.peekElapsedSeconds() < mMeasureSeconds)
+			{
+				reactor->poll(1);
+			}
+			measuring = false;
+			result.mSeconds = t.peekElapsedSeconds();
+			// Closing connections with data still arriving can take a while, so let them go quiet first
+			sending = false;
+			timer::Timer drain;
+			while (drain.peekElapsedSeconds() < SUITE_DRAIN)
+			{
+				reactor->poll(1);
+			}
+		}
+
+		reactor->release();
+		for (auto &c : clients)
+		{
+			delete c->mSocketChat;
+			delete c;
+		}
+		if (serverThread)
+		{
+			quit = true;
+			serverThread->join();
+			delete serverThread;
+		}
+		delete server;
+#ifndef _MSC_VER
+		if (child > 0)
+		{
+			::close(quitPipe[1]);
+			waitpid(child, nullptr, 0);
+		}
+#endif
+	}
+
+#ifndef _MSC_VER
+	// Forks a server for one case. The child reports once it is listening and exits when the
+	// parent closes 'quitPipe'.
+	bool startChild(const Transport &transport, uint32_t fanout, pid_t &child, int quitPipe[2])
+	{
+		int readyPipe[2];
+		if (pipe(readyPipe) != 0)
+		{
+			return false;
+		}
+		if (pipe(quitPipe) != 0)
+		{
+			::close(readyPipe[0]);
+			::close(readyPipe[1]);
+			return false;
+		}
+		fflush(stdout);
+		fflush(stderr);
+		child = fork();
+		if (child == 0)
+		{
+			::close(readyPipe[0]);
+			::close(quitPipe[1]);
+			SuiteServer *server = new SuiteServer(fanout);
+			char ready = server->start(transport.mServerType) ? 1 : 0;
+			ssize_t written = ::write(readyPipe[1], &ready, 1);
+			(void)written;
+			::close(readyPipe[1]);
+			if (ready)
+			{
+				pollfd pfd;
+				pfd.fd = quitPipe[0];
+				pfd.events = POLLIN;
+				for (;;)
+				{
+					server->mReactor->poll(1);
+					pfd.revents = 0;
+					if (::poll(&pfd, 1, 0) > 0)
+					{
+						break; // the parent closed its end
+					}
+				}
+			}
+			delete server;
+			_exit(0);
+		}
+		::close(readyPipe[1]);
+		::close(quitPipe[0]);
+		char ready = 0;
+		bool ret = child > 0 && ::read(readyPipe[0], &ready, 1) == 1 && ready;
+		::close(readyPipe[0]);
+		if (!ret && child > 0)
+		{
+			::close(quitPipe[1]);
+			waitpid(child, nullptr, 0);
+			child = -1;
+		}
+		return ret;
+	}
+#endif
+
+	void report(const SuiteCase &sc)
+	{
+		if (sc.mError)
+		{
+			printf("%-8s %8d %12d %7d %s\n", sc.mTransport, int(sc.mMessageSize), int(sc.mConnections), int(sc.mFanout), sc.mError);
+			return;
+		}
+		printf("%-8s %8d %12d %7d %14.0f %10.1f %10.1f %10.1f %10.1f\n", sc.mTransport,
+			int(sc.mMessageSize), int(sc.mConnections), int(sc.mFanout),
+			double(sc.mMessagesDelivered) / sc.mSeconds,
+			double(sc.mBytesDelivered) / sc.mSeconds / (1024 * 1024),
+			double(sc.mRoundTrip.getPercentile(50)) / 1000.0,
+			double(sc.mRoundTrip.getPercentile(99)) / 1000.0,
+			double(sc.mRoundTrip.getPercentile(99.9)) / 1000.0);
+	}
+
+	void writeJson(FILE *fph, const std::vector< SuiteCase * > &results)
+	{
+		fprintf(fph, "{\n");
+		fprintf(fph, "  \"benchmark\": \"socketchat_bench\",\n");
+#if defined(__clang__)
+		fprintf(fph, "  \"compiler\": \"clang %d.%d.%d\",\n", __clang_major__, __clang_minor__, __clang_patchlevel__);
+#elif defined(__GNUC__)
+		fprintf(fph, "  \"compiler\": \"gcc %d.%d.%d\",\n", __GNUC__, __GNUC_MINOR__, __GNUC_PATCHLEVEL__);
+#elif defined(_MSC_VER)
+		fprintf(fph, "  \"compiler\": \"msvc %d\",\n", _MSC_VER);
+#endif
+		fprintf(fph, "  \"cpus\": %d,\n", int(std::thread::hardware_concurrency()));
+		fprintf(fph, "  \"server\": \"%s\",\n", mSubprocess ? "subprocess" : "thread");
+		fprintf(fph, "  \"window\": %d,\n", SUITE_WINDOW);
+		fprintf(fph, "  \"measureSeconds\": %0.3f,\n", mMeasureSeconds);
+		fprintf(fph, "  \"results\": [\n");
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			const SuiteCase &sc = *results[i];
+			fprintf(fph, "    { \"transport\": \"%s\", \"messageSize\": %d, \"connections\": %d, \"fanout\": %d",
+				sc.mTransport, int(sc.mMessageSize), int(sc.mConnections), int(sc.mFanout));
+			if (sc.mError)
+			{
+				fprintf(fph, ", \"error\": \"%s\" }", sc.mError);
+			}
+			else
+			{
+				fprintf(fph, ", \"messagesSent\": %llu, \"messagesDelivered\": %llu, \"messagesPerSecond\": %0.1f, \"megabytesPerSecond\": %0.3f",
+					(unsigned long long)sc.mMessagesSent, (unsigned long long)sc.mMessagesDelivered,
+					double(sc.mMessagesDelivered) / sc.mSeconds,
+					double(sc.mBytesDelivered) / sc.mSeconds / (1024 * 1024));
+				fprintf(fph, ", \"roundTripUs\": { \"count\": %llu, \"mean\": %0.2f, \"p50\": %0.2f, \"p99\": %0.2f, \"p999\": %0.2f, \"max\": %0.2f } }",
+					(unsigned long long)sc.mRoundTrip.getCount(),
+					sc.mRoundTrip.getMean() / 1000.0,
+					double(sc.mRoundTrip.getPercentile(50)) / 1000.0,
+					double(sc.mRoundTrip.getPercentile(99)) / 1000.0,
+					double(sc.mRoundTrip.getPercentile(99.9)) / 1000.0,
+					double(sc.mRoundTrip.getMax()) / 1000.0);
+			}
+			fprintf(fph, "%s\n", i + 1 < results.size() ? "," : "");
+		}
+		fprintf(fph, "  ]\n");
+		fprintf(fph, "}\n");
+	}
+
+	bool	mSubprocess{ false };
+	double	mMeasureSeconds{ SUITE_MEASURE };
+};
+
+#define REPLAY_FILE "socketchat_replay.capture"	// Written by 'replay' when it is not given a capture file
+#define REPLAY_MESSAGES (1024*256)				// Chat lines in the capture it writes
+#define REPLAY_REPEAT 5							// Times a capture is replayed at full speed
+
+// Feeds a capture file through SocketChat's receive, parsing and dispatch path with no network involved
+class ReplayBench : public socketchat::SocketChatReactorCallback
+{
+public:
+	virtual socketchat::SocketChatCallback *newConnection(socketchat::SocketChat *client) override final
+	{
+		mServerConnection = client;
+		return nullptr;
+	}
+
+	virtual void connectionClosed(socketchat::SocketChat *client) override final
+	{
+		(void)client;
+	}
+
+	// Captures a loopback client receiving REPLAY_MESSAGES chat lines of assorted lengths
+	bool record(const char *fileName)
+	{
+		wsocket::Wsocket *serverSocket = wsocket::Wsocket::create(SOCKET_SERVER, PORT_NUMBER);
+		if (!serverSocket)
+		{
+			printf("Failed to open server socket on port %d\n", PORT_NUMBER);
+			return false;
+		}
+		socketchat::SocketChatReactor *reactor = socketchat::SocketChatReactor::create(serverSocket, this);
+		socketchat::SocketChatOptions options;
+		options.mCaptureFile = fileName;
+		socketchat::SocketChat *client = socketchat::SocketChat::create("localhost", PORT_NUMBER, options);
+		bool ret = false;
+		if (client)
+		{
+			while (!mServerConnection)
+			{
+				reactor->poll(1);
+			}
+			CountMessages cm;
+			char line[256];
+			for (uint32_t i = 0; i < REPLAY_MESSAGES; i++)
+			{
+				uint32_t len = 8 + (i * 37) % 200;
+				for (uint32_t j = 0; j < len; j++)
+				{
+					line[j] = char('a' + (i + j) % 26);
+				}
+				line[len] = 0;
+				mServerConnection->sendText(line);
+				if ((i % 1024) == 1023)
+				{
+					reactor->poll(0);
+					client->poll(&cm, 0);
+				}
+			}
+			while (cm.mCount < REPLAY_MESSAGES)
+			{
+				reactor->poll(0);
+				client->poll(&cm, 1);
+			}
+			delete client; // finishes the capture file
+			ret = true;
+		}
+		reactor->release();
+		delete mServerConnection;
+		mServerConnection = nullptr;
+		serverSocket->release();
+		return ret;
+	}
+
+	// Replays the first stream of 'fileName' into a connection; returns false if it could not be opened
+	bool replay(const char *fileName, bool realTime, bool binary)
+	{
+		wsocket::WsocketOptions socketOptions;
+		socketOptions.mPlaybackRealTime = realTime;
+		wsocket::Wsocket *socket = wsocket::Wsocket::create(fileName, socketOptions);
+		if (!socket)
+		{
+			printf("'%s' is not a capture file\n", fileName);
+			return false;
+		}
+		socketchat::SocketChatOptions options;
+		options.mFraming = binary ? socketchat::FRAMING_BINARY : socketchat::FRAMING_TEXT;
+		socketchat::SocketChat *sc = socketchat::SocketChat::create(socket, options);
+		CountMessages cm;
+		timer::Timer t;
+		while (sc->getReadyState() != socketchat::SocketChat::CLOSED)
+		{
+			sc->poll(&cm, 0);
+		}
+		double seconds = t.peekElapsedSeconds();
+		socketchat::SocketChatStats stats;
+		sc->getStats(stats);
+		delete sc;
+		printf("%-10s %12d %12.3f %14.0f %10.1f %10.0f\n", realTime ? "realtime" : "fastest", int(cm.mCount), seconds * 1000,
+			double(stats.mMessagesReceived) / seconds, double(stats.mBytesReceived) / seconds / (1024 * 1024),
+			double(stats.mDispatchTime.getPercentile(50)));
+		return true;
+	}
+
+	void run(const char *fileName, bool realTime, bool binary)
+	{
+		if (!fileName)
+		{
+			fileName = REPLAY_FILE;
+			printf("Capturing %d messages to '%s'\n", REPLAY_MESSAGES, fileName);
+			if (!record(fileName))
+			{
+				return;
+			}
+		}
+		printf("%-10s %12s %12s %14s %10s %10s\n", "pace", "messages", "time(ms)", "messages/sec", "MB/sec", "p50(ns)");
+		if (realTime)
+		{
+			replay(fileName, true, binary);
+			return;
+		}
+		for (uint32_t i = 0; i < REPLAY_REPEAT; i++)
+		{
+			if (!replay(fileName, false, binary))
+			{
+				break;
+			}
+		}
+	}
+
+	socketchat::SocketChat	*mServerConnection{ nullptr };
+};
+
+#define ACCEPT_CONNECTIONS 10000		// Default number of connections in the storm
+#define ACCEPT_TIMEOUT 30.0				// Seconds to wait for a storm to be connected and accepted
+#define ACCEPT_SPARE_FILES 64			// Descriptors left over for everything but the connections
+
+// Times how long a server takes to accept a storm of connections which all arrive at once
+class AcceptBench : public socketchat::SocketChatReactorCallback
+{
+public:
+	// Server thread
+	virtual socketchat::SocketChatCallback *newConnection(socketchat::SocketChat *client) override final
+	{
+		mServerConnections.push_back(client);
+		mAccepted++;
+		return nullptr;
+	}
+
+	virtual void connectionClosed(socketchat::SocketChat *client) override final
+	{
+		(void)client;
+	}
+
+	void measure(uint32_t connections, uint32_t batch)
+	{
+		wsocket::WsocketOptions serverOptions;
+		serverOptions.mAcceptBatch = batch;
+		wsocket::Wsocket *serverSocket = wsocket::Wsocket::create(SOCKET_SERVER, PORT_NUMBER, serverOptions);
+		if (!serverSocket)
+		{
+			printf("Failed to open server socket on port %d\n", PORT_NUMBER);
+			return;
+		}
+		socketchat::SocketChatReactor *reactor = socketchat::SocketChatReactor::create(serverSocket, this);
+		mAccepted = 0;
+		std::atomic<bool> quit(false);
+		double longestPass = 0;
+		std::thread server([&]()
+		{
+			while (!quit)
+			{
+				bool accepting = mAccepted < connections;
+				timer::Timer t;
+				reactor->poll(1);
+				double pass = t.peekElapsedSeconds();
+				if (accepting && pass > longestPass)
+				{
+					longestPass = pass;
+				}
+			}
+		});
+		// Start every connect before looking at any of them
+		timer::Timer t;
+		wsocket::WsocketOptions clientOptions;
+		clientOptions.mConnectAsync = true;
+		clientOptions.mConnectTimeout = uint32_t(ACCEPT_TIMEOUT * 1000);
+		std::vector< wsocket::Wsocket * > clients;
+		uint32_t failed = 0;
+		for (uint32_t i = 0; i < connections; i++)
+		{
+			wsocket::Wsocket *client = wsocket::Wsocket::create("127.0.0.1", PORT_NUMBER, clientOptions);
+			if (client)
+			{
+				clients.push_back(client);
+			}
+			else
+			{
+				failed++;
+			}
+		}
+		std::vector< wsocket::Wsocket * > pending = clients;
+		while (!pending.empty() && t.peekElapsedSeconds() < ACCEPT_TIMEOUT)
+		{
+			for (size_t i = 0; i < pending.size();)
+			{
+				wsocket::ConnectState state = pending[i]->pollConnect(0);
+				if (state == wsocket::CONNECT_PENDING)
+				{
+					i++;
+					continue;
+				}
+				if (state == wsocket::CONNECT_FAILED)
+				{
+					failed++;
+				}
+				pending[i] = pending.back();
+				pending.pop_back();
+			}
+		}
+		uint32_t expected = connections - failed - uint32_t(pending.size());
+		while (mAccepted < expected && t.peekElapsedSeconds() < ACCEPT_TIMEOUT)
+		{
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+		double seconds = t.peekElapsedSeconds();
+		quit = true;
+		server.join();
+		printf("%-8d %12d %10d %12.1f %14.0f %16.3f\n", int(batch), int(connections), int(failed + pending.size()),
+			seconds * 1000, double(mAccepted) / seconds, longestPass * 1000);
+		// The server closes first, so the client sockets are the ones left to reset
+		reactor->release();
+		for (auto &i : mServerConnections)
+		{
+			delete i;
+		}
+		mServerConnections.clear();
+		for (auto &i : clients)
+		{
+#ifndef _MSC_VER
+			// Reset rather than close, so the next storm does not find the client ports still in TIME_WAIT
+			int64_t handle = i->getSocketHandle();
+			if (handle >= 0)
+			{
+				linger l = { 1, 0 };
+				setsockopt(int(handle), SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+			}
+#endif
+			i->release();
+		}
+		serverSocket->release();
+	}
+
+	void run(uint32_t connections)
+	{
+		raiseFileLimit();
+#ifndef _MSC_VER
+		// Both ends of every connection are in this process
+		rlimit rl;
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+			rl.rlim_cur > ACCEPT_SPARE_FILES && connections > (rl.rlim_cur - ACCEPT_SPARE_FILES) / 2)
+		{
+			connections = uint32_t((rl.rlim_cur - ACCEPT_SPARE_FILES) / 2);
+			printf("Limited to %d connections by the open file limit\n", int(connections));
+		}
+#endif
+		printf("%-8s %12s %10s %12s %14s %16s\n", "batch", "connections", "failed", "time(ms)", "accepts/sec", "longest pass(ms)");
+		uint32_t sizes[2] = { connections / 10 ? connections / 10 : 1, connections };
+		for (auto &n : sizes)
+		{
+			measure(n, 1);
+			measure(n, WSOCKET_ACCEPT_BATCH);
+		}
+	}
+
+	std::vector< socketchat::SocketChat * >	mServerConnections;		// Server thread, until it has stopped
+	std::atomic<uint32_t>					mAccepted{ 0 };
+};
+
+#define BROADCAST_MESSAGES 1000000		// Default number of messages published through each ring
+#define BROADCAST_READERS 2				// Reader threads following each ring
+#define BROADCAST_GUARD 4096			// Bytes after the ring which must come through untouched
+#define BROADCAST_GUARD_BYTE 0xA5
+
+class BroadcastBench
+{
+public:
+	void run(uint32_t messages)
+	{
+		// Ring sizes which leave every gap at the end a record can leave
+		const uint32_t ringSizes[] = { 1000, 1008, 4100, 65536 + 24 };
+		const spmc::Policy policies[] = { spmc::POLICY_BLOCK, spmc::POLICY_OVERWRITE, spmc::POLICY_DROP };
+		const char *policyNames[] = { "block", "overwrite", "drop" };
+		printf("%-10s %10s %14s %10s %10s %10s %8s\n", "policy", "ring", "messages/sec", "laps", "lost", "corrupt", "guard");
+		for (uint32_t p = 0; p < 3; p++)
+		{
+			for (auto &ringSize : ringSizes)
+			{
+				measure(policies[p], policyNames[p], ringSize, messages);
+			}
+		}
+	}
+
+	// Message 'sequence' is 8 to 71 bytes: its sequence number, then bytes derived from it
+	static uint32_t messageSize(uint64_t sequence)
+	{
+		return 8 + uint32_t((sequence * 13) % 64);
+	}
+
+	static uint8_t messageByte(uint64_t sequence, uint32_t index)
+	{
+		return uint8_t(sequence * 31 + index);
+	}
+
+	void measure(spmc::Policy policy, const char *policyName, uint32_t ringSize, uint32_t messages)
+	{
+		uint32_t size = spmc::BroadcastRing::getRequiredSize(ringSize);
+		std::vector< uint8_t > memory(size + BROADCAST_GUARD);
+		memset(&memory[size], BROADCAST_GUARD_BYTE, BROADCAST_GUARD);
+		spmc::BroadcastRing writer;
+		if (!writer.init(&memory[0], size, true, true, policy))
+		{
+			printf("Unable to create a %d byte ring\n", int(ringSize));
+			return;
+		}
+		std::atomic<bool> done{ false };
+		std::atomic<uint64_t> lost{ 0 };
+		std::atomic<uint64_t> corrupt{ 0 };
+		std::vector< std::thread * > readers;
+		std::atomic<uint32_t> attached{ 0 };
+		for (uint32_t i = 0; i < BROADCAST_READERS; i++)
+		{
+			readers.push_back(new std::thread([&]()
+			{
+				spmc::BroadcastRing reader;
+				bool ok = reader.init(&memory[0], size, false, false);
+				attached++;
+				if (!ok)
+				{
+					return;
+				}
+				uint8_t data[256];
+				uint64_t expected = 0;
+				for (;;)
+				{
+					uint32_t len;
+					uint32_t flags;
+					if (!reader.read(data, sizeof(data), len, flags))
+					{
+						if (done)
+						{
+							if (!reader.waitForData(0))
+							{
+								break;
+							}
+							continue;
+						}
+						reader.waitForData(1);
+						continue;
+					}
+					uint64_t sequence;
+					memcpy(&sequence, data, sizeof(sequence));
+					bool whole = len == messageSize(sequence) && sequence >= expected;
+					for (uint32_t j = sizeof(sequence); whole && j < len; j++)
+					{
+						whole = data[j] == messageByte(sequence, j);
+					}
+					if (!whole)
+					{
+						corrupt++;
+						continue;
+					}
+					lost += sequence - expected;
+					expected = sequence + 1;
+				}
+				lost += messages - expected;
+			}));
+		}
+		while (attached < BROADCAST_READERS)
+		{
+			std::this_thread::yield();
+		}
+		uint64_t bytes = 0;
+		timer::Timer t;
+		for (uint64_t sequence = 0; sequence < messages; sequence++)
+		{
+			uint32_t len = messageSize(sequence);
+			uint8_t *dest = writer.reserve(len);
+			if (!dest)
+			{
+				continue; // dropped (POLICY_DROP); the readers count the gap
+			}
+			memcpy(dest, &sequence, sizeof(sequence));
+			for (uint32_t j = sizeof(sequence); j < len; j++)
+			{
+				dest[j] = messageByte(sequence, j);
+			}
+			writer.commit(len, 0);
+			bytes += sizeof(spmc::BroadcastRing::RecordHeader) + len;
+		}
+		double seconds = t.peekElapsedSeconds();
+		done = true;
+		for (auto &i : readers)
+		{
+			i->join();
+			delete i;
+		}
+		bool guardIntact = true;
+		for (uint32_t i = 0; i < BROADCAST_GUARD; i++)
+		{
+			guardIntact = guardIntact && memory[size + i] == BROADCAST_GUARD_BYTE;
+		}
+		printf("%-10s %10d %14.0f %10llu %10llu %10llu %8s\n", policyName, int(ringSize), messages / seconds,
+			(unsigned long long)(bytes / ringSize), (unsigned long long)lost.load(), (unsigned long long)corrupt.load(),
+			guardIntact ? "intact" : "OVERRUN");
+	}
+};
+
+}
+
+int main(int argc,const char **argv)
+{
+	const char *benchmark = argc >= 2 ? argv[1] : "reactor";
+
+	socketchat::socketStartup();
+	if (strcmp(benchmark, "reactor") == 0)
+	{
+		uint32_t maxConnections = argc >= 3 ? uint32_t(atoi(argv[2])) : 5000;
+		const char *serverType = argc >= 4 ? argv[3] : SOCKET_SERVER;
+		bench::ReactorBench rb;
+		rb.run(maxConnections, serverType);
+	}
+	else if (strcmp(benchmark, "threaded") == 0)
+	{
+		uint32_t maxThreads = argc >= 3 ? uint32_t(atoi(argv[2])) : std::thread::hardware_concurrency();
+		uint32_t connectionsPerThread = argc >= 4 ? uint32_t(atoi(argv[3])) : 64;
+		const char *serverType = argc >= 5 ? argv[4] : SOCKET_SERVER;
+		bench::ThreadedBench tb;
+		tb.run(maxThreads ? maxThreads : 1, connectionsPerThread, serverType);
+	}
+	else if (strcmp(benchmark, "fanout") == 0)
+	{
+		uint32_t connections = argc >= 3 ? uint32_t(atoi(argv[2])) : 5000;
+		uint32_t messageSize = argc >= 4 ? uint32_t(atoi(argv[3])) : 1024;
+		const char *serverType = argc >= 5 ? argv[4] : SOCKET_SERVER;
+		bench::FanoutBench fb;
+		fb.run(connections, messageSize, serverType);
+	}
+	else if (strcmp(benchmark, "framing") == 0)
+	{
+		bench::FramingBench fb;
+		fb.run();
+	}
+	else if (strcmp(benchmark, "buffer") == 0)
+	{
+		bench::BufferBench bb;
+		bb.run();
+	}
+	else if (strcmp(benchmark, "pingpong") == 0)
+	{
+		uint32_t roundTrips = argc >= 3 ? uint32_t(atoi(argv[2])) : PINGPONG_ROUND_TRIPS;
+		bench::PingPongBench pb(roundTrips ? roundTrips : PINGPONG_ROUND_TRIPS);
+		pb.run();
+	}
+	else if (strcmp(benchmark, "producers") == 0)
+	{
+		uint32_t maxThreads = argc >= 3 ? uint32_t(atoi(argv[2])) : 8;
+		uint32_t messagesPerThread = argc >= 4 ? uint32_t(atoi(argv[3])) : PRODUCER_MESSAGES;
+		bench::ProducerBench pb;
+		pb.run(maxThreads ? maxThreads : 1, messagesPerThread ? messagesPerThread : PRODUCER_MESSAGES);
+	}
+	else if (strcmp(benchmark, "iothread") == 0)
+	{
+		uint32_t roundTrips = argc >= 3 ? uint32_t(atoi(argv[2])) : IOTHREAD_ROUND_TRIPS;
+		bench::IoThreadBench ib;
+		ib.run(roundTrips ? roundTrips : IOTHREAD_ROUND_TRIPS);
+	}
+	else if (strcmp(benchmark, "scan") == 0)
+	{
+		bench::ScanBench sb;
+		sb.run();
+	}
+	else if (strcmp(benchmark, "suite") == 0)
+	{
+		bench::SuiteBench sb;
+		sb.run(argc - 2, argv + 2);
+	}
+	else if (strcmp(benchmark, "replay") == 0)
+	{
+		const char *fileName = nullptr;
+		bool realTime = false;
+		bool binary = false;
+		for (int i = 2; i < argc; i++)
+		{
+			if (strcmp(argv[i], "realtime") == 0)
+			{
+				realTime = true;
+			}
+			else if (strcmp(argv[i], "binary") == 0)
+			{
+				binary = true;
+			}
+			else
+			{
+				fileName = argv[i];
+			}
+		}
+		bench::ReplayBench rb;
+		rb.run(fileName, realTime, binary);
+	}
+	else if (strcmp(benchmark, "accept") == 0)
+	{
+		uint32_t connections = argc >= 3 ? uint32_t(atoi(argv[2])) : ACCEPT_CONNECTIONS;
+		bench::AcceptBench ab;
+		ab.run(connections ? connections : ACCEPT_CONNECTIONS);
+	}
+	else if (strcmp(benchmark, "broadcast") == 0)
+	{
+		uint32_t messages = argc >= 3 ? uint32_t(atoi(argv[2])) : BROADCAST_MESSAGES;
+		bench::BroadcastBench bb;
+		bb.run(messages ? messages : BROADCAST_MESSAGES);
+	}
+	else
+	{
+		printf("Unknown benchmark '%s'. Available: reactor, threaded, fanout, framing, buffer, pingpong, producers, iothread, scan, suite, replay, accept, broadcast\n", benchmark);
+	}
+	socketchat::socketShutdown();
+
+	return 0;
+}
@@ -3,15 +3,35 @@
 #endif
 
 #include "socketchat.h"
+#include "socketchatreactor.h"
 #include "InputLine.h"
 #include "wplatform.h"
+#include "MemoryMap.h"
+#include "SPMC.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#ifndef _MSC_VER
+#include <sys/resource.h>
+#endif
 
 //#define PORT_NUMBER 6379    // Redis port number
 #define PORT_NUMBER 3009    // test port number
 
+// Where 'TestServer tap' mirrors its broadcasts
+#ifdef _MSC_VER
+#define TAP_FILE "socketchat.tap.%d"
+#elif defined(__linux__)
+#define TAP_FILE "/dev/shm/socketchat.tap.%d"
+#else
+#define TAP_FILE "/tmp/socketchat.tap.%d"
+#endif
+
 class ReceiveData : public socketchat::SocketChatCallback
 {
 public:
@@ -21,10 +41,332 @@ public:
 	}
 };
 
+// Follows the server's broadcast stream through its shared memory tap instead of a connection
+static void runTap(uint32_t portNumber)
+{
+	char fileName[512];
+	wplatform::stringFormat(fileName, sizeof(fileName), TAP_FILE, portNumber);
+	uint64_t size = 0;
+	memorymap::MemoryMap *map = memorymap::MemoryMap::createMemoryMap(fileName, size, false, false);
+	if (!map)
+	{
+		printf("Unable to open the broadcast tap '%s'; run the server with 'tap'.\r\n", fileName);
+		return;
+	}
+	{
+		spmc::BroadcastRing tap;
+		if (tap.init(map->getBaseAddress(), uint32_t(size), false, false))
+		{
+			printf("Following the broadcast tap. Type: 'bye' or 'quit' or 'exit' to stop.\r\n");
+			inputline::InputLine *inputLine = inputline::InputLine::create();
+			char *message = new char[tap.getMaxMessageSize()];
+			uint64_t overruns = 0;
+			bool keepRunning = true;
+			while (keepRunning)
+			{
+				const char *data = inputLine->getInputLine();
+				if (data && (strcmp(data, "bye") == 0 || strcmp(data, "exit") == 0 || strcmp(data, "quit") == 0))
+				{
+					keepRunning = false;
+				}
+				uint32_t len;
+				uint32_t flags;
+				while (tap.read(message, tap.getMaxMessageSize(), len, flags))
+				{
+					printf("Tap: %s\r\n", message);
+				}
+				if (tap.getOverrunCount() != overruns)
+				{
+					overruns = tap.getOverrunCount();
+					printf("Fell behind the server; some messages were skipped.\r\n");
+				}
+				tap.waitForData(1);
+			}
+			delete[]message;
+			inputLine->release();
+		}
+		else
+		{
+			printf("'%s' does not hold a broadcast tap, or it has no free reader slots.\r\n", fileName);
+		}
+	}
+	map->release();
+}
+
+#define LOAD_CONNECTIONS 1000		// Defaults for 'load'
+#define LOAD_RATE 100				// Messages per second across all connections
+#define LOAD_SECONDS 10				// Seconds measured, after the ramp up
+#define LOAD_RAMP_SECONDS 2			// Seconds over which connections are opened and the rate climbs to full
+#define LOAD_JITTER 50				// Percent each gap between sends is varied by, either way
+#define LOAD_DRAIN_SECONDS 1.0		// Seconds to wait for stragglers once sending stops
+#define LOAD_PREFIX "#load "		// Start of every stamped message
+
+static uint64_t nowNanoseconds(void)
+{
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Raise the open file limit as far as we are allowed; the load generator needs one descriptor per connection
+static void raiseFileLimit(void)
+{
+#ifndef _MSC_VER
+	rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+#endif
+}
+
+// Opens many connections to the chat server from one event loop and sends at a fixed (open loop) rate,
+// whether or not replies keep up. Each message is stamped with the time it was *meant* to go out, so a
+// stall on our side or the server's still counts against every message it delayed, rather than quietly
+// slowing the sender down (coordinated omission). The server broadcasts each message to every client:
+// the sender's own copy gives the round trip time and the others the broadcast delivery time.
+class LoadGenerator
+{
+public:
+	struct Settings
+	{
+		const char	*mHost{ "localhost" };
+		uint32_t	mPort{ PORT_NUMBER };
+		uint32_t	mConnections{ LOAD_CONNECTIONS };
+		uint32_t	mRate{ LOAD_RATE };
+		uint32_t	mSeconds{ LOAD_SECONDS };
+		uint32_t	mRampSeconds{ LOAD_RAMP_SECONDS };
+		uint32_t	mJitter{ LOAD_JITTER };
+	};
+
+	class Connection : public socketchat::SocketChatCallback
+	{
+	public:
+		virtual ~Connection(void)
+		{
+			delete mSocketChat;
+		}
+
+		virtual void receiveMessage(const char *message) override final
+		{
+			mGenerator->received(mIndex, message);
+		}
+
+		LoadGenerator			*mGenerator{ nullptr };
+		socketchat::SocketChat	*mSocketChat{ nullptr };
+		uint32_t				mIndex{ 0 };
+	};
+
+	LoadGenerator(const Settings &settings) : mSettings(settings), mRandom(uint32_t(nowNanoseconds()))
+	{
+		mRunId = uint32_t(nowNanoseconds() % 1000000);
+	}
+
+	~LoadGenerator(void)
+	{
+		if (mReactor)
+		{
+			mReactor->release();
+		}
+		for (auto &i : mConnections)
+		{
+			delete i;
+		}
+	}
+
+	void run(void)
+	{
+		raiseFileLimit();
+		printf("Load test: %d connections to %s:%d, %d messages/sec, %d seconds after a %d second ramp up, %d%% jitter.\r\n",
+			int(mSettings.mConnections), mSettings.mHost, int(mSettings.mPort), int(mSettings.mRate),
+			int(mSettings.mSeconds), int(mSettings.mRampSeconds), int(mSettings.mJitter));
+		mReactor = socketchat::SocketChatReactor::create(nullptr, nullptr);
+		uint64_t start = nowNanoseconds();
+		uint64_t ramp = uint64_t(mSettings.mRampSeconds) * 1000000000;
+		mMeasureStart = start + ramp;
+		uint64_t stop = mMeasureStart + uint64_t(mSettings.mSeconds) * 1000000000;
+		uint64_t nextSend = start;
+		uint64_t nextReport = start + 1000000000;
+		uint64_t now = start;
+		while (now < stop)
+		{
+			// Open connections in step with the ramp
+			double progress = ramp ? double(now - start) / double(ramp) : 1.0;
+			if (progress > 1.0)
+			{
+				progress = 1.0;
+			}
+			uint32_t wanted = uint32_t(progress * mSettings.mConnections + 0.5);
+			while (mConnections.size() + mConnectFailures < wanted)
+			{
+				connect();
+			}
+			// Send everything which is due; if we are behind, the late ones keep their original stamps
+			while (nextSend <= now && !mConnections.empty())
+			{
+				send(nextSend, now);
+				nextSend += nextGap(progress);
+			}
+			mReactor->poll(nextSend > now + 1000000 ? 1 : 0);
+			now = nowNanoseconds();
+			if (now >= nextReport)
+			{
+				printf("%s %5.1fs connections %d sent %llu rtt p50 %0.1fms p99 %0.1fms\r\n",
+					now < mMeasureStart ? "ramp " : "load ", double(now - start) / 1e9, int(mConnections.size()),
+					(unsigned long long)mSent, double(mRoundTrip.getPercentile(50)) / 1e6, double(mRoundTrip.getPercentile(99)) / 1e6);
+				nextReport += 1000000000;
+			}
+		}
+		// Let the replies to the last messages arrive
+		while (now - stop < uint64_t(LOAD_DRAIN_SECONDS * 1e9) && mRoundTrip.getCount() < mSent)
+		{
+			mReactor->poll(1);
+			now = nowNanoseconds();
+		}
+		report();
+	}
+
+	// A message arrived on connection 'index'; ignores anything not stamped by this run
+	void received(uint32_t index, const char *message)
+	{
+		if (strncmp(message, LOAD_PREFIX, strlen(LOAD_PREFIX)) != 0)
+		{
+			return;
+		}
+		char *scan = (char *)message + strlen(LOAD_PREFIX);
+		uint32_t runId = uint32_t(strtoul(scan, &scan, 10));
+		uint32_t sender = uint32_t(strtoul(scan, &scan, 10));
+		uint64_t intended = strtoull(scan, &scan, 10);
+		uint64_t actual = strtoull(scan, &scan, 10);
+		if (runId != mRunId || intended < mMeasureStart)
+		{
+			return;
+		}
+		uint64_t now = nowNanoseconds();
+		if (sender == index)
+		{
+			mRoundTrip.record(now - intended);
+			mRoundTripUncorrected.record(now - actual);
+		}
+		else
+		{
+			mDelivery.record(now - intended);
+		}
+	}
+
+private:
+	// Connects in the background, so a slow handshake does not hold up the sends which are due;
+	// messages sent meanwhile go out once it opens
+	void connect(void)
+	{
+		socketchat::SocketChatOptions options;
+		options.mConnectAsync = true;
+		socketchat::SocketChat *sc = socketchat::SocketChat::create(mSettings.mHost, mSettings.mPort, options);
+		if (!sc)
+		{
+			mConnectFailures++;
+			return;
+		}
+		Connection *c = new Connection;
+		c->mGenerator = this;
+		c->mSocketChat = sc;
+		c->mIndex = uint32_t(mConnections.size());
+		mConnections.push_back(c);
+		mReactor->addConnection(sc, c);
+	}
+
+	// Sends the message due at 'intended' from the next connection in turn
+	void send(uint64_t intended, uint64_t now)
+	{
+		Connection *c = mConnections[mNextConnection++ % mConnections.size()];
+		char message[128];
+		snprintf(message, sizeof(message), LOAD_PREFIX "%u %u %llu %llu", mRunId, c->mIndex,
+			(unsigned long long)intended, (unsigned long long)now);
+		c->mSocketChat->sendText(message);
+		if (intended >= mMeasureStart)
+		{
+			mSent++;
+		}
+	}
+
+	// Nanoseconds until the next send, at the rate reached so far in the ramp
+	uint64_t nextGap(double progress)
+	{
+		double rate = double(mSettings.mRate) * progress;
+		if (rate < 1)
+		{
+			rate = 1;
+		}
+		double gap = 1e9 / rate;
+		double jitter = double(mSettings.mJitter) / 100.0;
+		std::uniform_real_distribution<double> spread(1.0 - jitter, 1.0 + jitter);
+		return uint64_t(gap * spread(mRandom));
+	}
+
+	void printLatency(const char *name, const histogram::Histogram &h)
+	{
+		printf("%-30s %10llu %10.2f %10.2f %10.2f %10.2f %10.2f\r\n", name, (unsigned long long)h.getCount(),
+			double(h.getPercentile(50)) / 1e6, double(h.getPercentile(90)) / 1e6, double(h.getPercentile(99)) / 1e6,
+			double(h.getPercentile(99.9)) / 1e6, double(h.getMax()) / 1e6);
+	}
+
+	void report(void)
+	{
+		printf("\r\n%d connections (%d failed to connect), %llu messages sent in %d seconds, %llu round trips lost\r\n",
+			int(mConnections.size()), int(mConnectFailures), (unsigned long long)mSent, int(mSettings.mSeconds),
+			(unsigned long long)(mSent > mRoundTrip.getCount() ? mSent - mRoundTrip.getCount() : 0));
+		printf("%-30s %10s %10s %10s %10s %10s %10s\r\n", "latency (ms)", "count", "p50", "p90", "p99", "p99.9", "max");
+		printLatency("round trip", mRoundTrip);
+		printLatency("round trip (uncorrected)", mRoundTripUncorrected);
+		printLatency("broadcast delivery", mDelivery);
+	}
+
+	Settings						mSettings;
+	std::mt19937					mRandom;
+	uint32_t						mRunId{ 0 };			// Tells this run's messages from anyone else's
+	socketchat::SocketChatReactor	*mReactor{ nullptr };
+	std::vector< Connection * >		mConnections;
+	uint32_t						mConnectFailures{ 0 };
+	uint32_t						mNextConnection{ 0 };
+	uint64_t						mMeasureStart{ 0 };		// Messages meant to be sent before this are not counted
+	uint64_t						mSent{ 0 };
+	histogram::Histogram			mRoundTrip;				// From when each message should have been sent
+	histogram::Histogram			mRoundTripUncorrected;	// From when it actually was
+	histogram::Histogram			mDelivery;				// To the other clients, from when it should have been sent
+};
+
 int main(int argc,const char **argv)
 {
     uint32_t portNumber = PORT_NUMBER;
 	const char *host = "localhost";
+	if (argc >= 2 && strcmp(argv[1], "load") == 0)
+	{
+		// Usage: TestClient load [connections] [messagesPerSecond] [seconds] [rampUpSeconds] [jitterPercent] [host]
+		LoadGenerator::Settings settings;
+		uint32_t *numbers[] = { &settings.mConnections, &settings.mRate, &settings.mSeconds, &settings.mRampSeconds, &settings.mJitter };
+		uint32_t numberCount = 0;
+		for (int i = 2; i < argc; i++)
+		{
+			if (argv[i][0] >= '0' && argv[i][0] <= '9' && numberCount < sizeof(numbers) / sizeof(numbers[0]))
+			{
+				*numbers[numberCount++] = uint32_t(atoi(argv[i]));
+			}
+			else
+			{
+				settings.mHost = argv[i];
+			}
+		}
+		if (settings.mJitter > 100)
+		{
+			settings.mJitter = 100;
+		}
+		socketchat::socketStartup();
+		{
+			LoadGenerator lg(settings);
+			lg.run();
+		}
+		socketchat::socketShutdown();
+		return 0;
+	}
 	if (argc == 2)
 	{
 		host = argv[1];
@@ -33,10 +375,16 @@ int main(int argc,const char **argv)
             host = "localhost";
             portNumber = 6379;
         }
+		else if (strcmp(host, "tap") == 0)
+		{
+			runTap(portNumber);
+			return 0;
+		}
 	}
 	{
 		socketchat::socketStartup();
-        socketchat::SocketChat *ws = socketchat::SocketChat::create(host,portNumber);
+        // The connection's own I/O thread does the socket work; this loop only handles the console
+        socketchat::SocketChat *ws = socketchat::SocketChat::createThreaded(host,portNumber);
 		if (ws)
 		{
 			printf("Type: 'bye' or 'quit' or 'exit' to close the client out.\r\n");
@@ -54,7 +402,7 @@ int main(int argc,const char **argv)
 					}
 					ws->sendText(data);
 				}
-				ws->poll(&rd, 1); // poll the socket connection
+				ws->poll(&rd, 1); // deliver what the I/O thread has received, waiting up to a millisecond for it
 			}
 			delete ws;
 		}
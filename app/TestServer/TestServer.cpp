@@ -4,25 +4,59 @@
 
 #include "socketchat.h"
 #include "wsocket.h"
+#include "WireLog.h"
+#include "socketchatreactor.h"
+#include "socketchatserver.h"
+#include "wplatform.h"
 #include "InputLine.h"
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <string>
+#include <unordered_map>
 #include <vector>
+#include <atomic>
 
 //#define PORT_NUMBER 6379    // Redis port number
 #define PORT_NUMBER 3009    // test port number
 
+// Where the server mirrors its broadcasts when run with 'tap' (follow it with 'TestClient tap')
+#ifdef _MSC_VER
+#define TAP_FILE "socketchat.tap.%d"
+#elif defined(__linux__)
+#define TAP_FILE "/dev/shm/socketchat.tap.%d"
+#else
+#define TAP_FILE "/tmp/socketchat.tap.%d"
+#endif
+#define TAP_RING_SIZE (1024*1024)
+
+// Where the simple server records its clients' traffic when run with 'capture'; replay it with 'SocketChatBench replay'
+#define CAPTURE_FILE "socketchat.capture"
+
+// Where the server logs its clients' traffic when run with 'log' (socketchat.0.wirelog, ...); render it with WireLogDump
+#define WIRE_LOG_FILE "socketchat"
+
+// Backlog allowed per client when run with a slow consumer policy ('disconnect', 'dropoldest' or 'conflate')
+#define SLOW_CONSUMER_HIGH_WATER (1024*1024)
+#define SLOW_CONSUMER_LOW_WATER (1024*256)
+
 using socketchat::SocketChat;
 
-class ClientConnection : public socketchat::SocketChatCallback
+// Common interface of the single threaded and multi-threaded servers
+class ChatServer
+{
+public:
+	// Echo a message back to all currently connected clients
+	virtual void broadcast(const char *message) = 0;
+};
+
+class ClientConnection : public socketchat::SocketChatCallback, public socketchat::SocketChatWatermarkCallback
 {
 public:
-	ClientConnection(wsocket::Wsocket *client,uint32_t id) : mId(id)
+	ClientConnection(ChatServer *server,socketchat::SocketChat *client,uint32_t id) : mServer(server), mClient(client), mId(id)
 	{
-		mClient = socketchat::SocketChat::create(client);
+		mClient->setWatermarkCallback(this);
 	}
 
 	virtual ~ClientConnection(void)
@@ -35,66 +69,113 @@ public:
 		return mId;
 	}
 
-	const char * getMessage(void)
+	void sendShared(socketchat::SharedMessage *message)
 	{
-		const char *ret = nullptr;
-
-		mHaveMessage = false;
 		if (mClient)
 		{
-			mClient->poll(this, 1);
-			if (mHaveMessage)
-			{
-				ret = mMessage.c_str();
-			}
+			mClient->sendShared(message);
 		}
-
-		return ret;
 	}
 
-	void sendText(const char *str)
-	{
-		if (mClient)
-		{
-			mClient->sendText(str);
-		}
-	}
+	// Invoked by the reactor whenever this client has sent us a complete message
+	virtual void receiveMessage(const char *message) override final;
 
-	virtual void receiveMessage(const char *message) override final
+	virtual void transmitHighWater(socketchat::SocketChat *sc, uint32_t pending) override final
 	{
-		mHaveMessage = true;
-        mMessage = std::string(message);
+		printf("Client %d is falling behind: %d bytes waiting%s.\r\n", mId, int(pending),
+			sc->getReadyState() == socketchat::SocketChat::CLOSED ? "; disconnected" : "");
 	}
 
-	bool isConnected(void)
+	virtual void transmitLowWater(socketchat::SocketChat *sc, uint32_t pending) override final
 	{
-		bool ret = false;
-
-		if (mClient && mClient->getReadyState() != socketchat::SocketChat::CLOSED)
-		{
-			ret = true;
-		}
-
-		return ret;
+		(void)sc;
+		printf("Client %d has caught up: %d bytes waiting.\r\n", mId, int(pending));
 	}
 
-	bool					mHaveMessage{ false };
-	std::string				mMessage;
+	ChatServer				*mServer{ nullptr };
 	socketchat::SocketChat	*mClient{ nullptr };
 	uint32_t				mId{ 0 };
 };
 
-typedef std::vector< ClientConnection * > ClientConnectionVector;
+typedef std::unordered_map< socketchat::SocketChat *, ClientConnection * > ClientConnectionMap;
+
+// Returns true if the user typed a command to stop the server
+static bool isExitCommand(const char *str)
+{
+	return strcmp(str, "bye") == 0 ||
+		strcmp(str, "quit") == 0 ||
+		strcmp(str, "exit") == 0;
+}
+
+// Prints the statistics gathered by 'getStats'
+static void printStats(const socketchat::SocketChatStats &stats)
+{
+	printf("Connections: %d\r\n", int(stats.mConnections));
+	printf("Sent: %llu messages, %llu bytes in %llu calls (%llu would block); transmit high water %d bytes\r\n",
+		(unsigned long long)stats.mMessagesSent, (unsigned long long)stats.mBytesSent,
+		(unsigned long long)stats.mSendCalls, (unsigned long long)stats.mSendWouldBlock, int(stats.mTransmitHighWater));
+	printf("Received: %llu messages, %llu bytes in %llu calls (%llu would block); receive high water %d bytes\r\n",
+		(unsigned long long)stats.mMessagesReceived, (unsigned long long)stats.mBytesReceived,
+		(unsigned long long)stats.mReceiveCalls, (unsigned long long)stats.mReceiveWouldBlock, int(stats.mReceiveHighWater));
+	if (stats.mHighWaterCount || stats.mMessagesDropped)
+	{
+		printf("Slow consumers: over the high water mark %llu times, %llu messages dropped\r\n",
+			(unsigned long long)stats.mHighWaterCount, (unsigned long long)stats.mMessagesDropped);
+	}
+	printf("Waiting to be sent: %llu bytes (%llu bytes in the whole process)\r\n",
+		(unsigned long long)stats.mTransmitPending, (unsigned long long)socketchat::getTransmitMemory());
+	if (stats.mLogDropped)
+	{
+		printf("Wire log: %llu records dropped\r\n", (unsigned long long)stats.mLogDropped);
+	}
+	const struct
+	{
+		const char					*mName;
+		const histogram::Histogram	*mHistogram;
+	} histograms[] =
+	{
+		{ "Send size (bytes)", &stats.mSendSize },
+		{ "Receive size (bytes)", &stats.mReceiveSize },
+		{ "Dispatch time (ns)", &stats.mDispatchTime },
+		{ "Queue time (ns)", &stats.mQueueTime },
+	};
+	for (auto &h : histograms)
+	{
+		printf("%-22s count %llu p50 %llu p99 %llu max %llu\r\n", h.mName,
+			(unsigned long long)h.mHistogram->getCount(),
+			(unsigned long long)h.mHistogram->getPercentile(50),
+			(unsigned long long)h.mHistogram->getPercentile(99),
+			(unsigned long long)h.mHistogram->getMax());
+	}
+}
 
-class SimpleServer
+class SimpleServer : public ChatServer, public socketchat::SocketChatReactorCallback
 {
 public:
-	SimpleServer(void)
+	SimpleServer(const char *serverType,bool capture,bool log,const socketchat::SocketChatOptions &connectionOptions) : mLog(log)
 	{
-		mServerSocket = wsocket::Wsocket::create(SOCKET_SERVER, PORT_NUMBER);
+		wsocket::WsocketOptions options;
+		if (capture)
+		{
+			options.mCaptureFile = CAPTURE_FILE;
+		}
+		mServerSocket = wsocket::Wsocket::create(serverType, PORT_NUMBER, options);
+		if (mServerSocket)
+		{
+			mReactor = socketchat::SocketChatReactor::create(mServerSocket, this, connectionOptions);
+		}
 		mInputLine = inputline::InputLine::create();
 		printf("Simple Websockets chat server started.\r\n");
+		if (capture)
+		{
+			printf("Recording the client connections to '%s'.\r\n", CAPTURE_FILE);
+		}
+		if (log)
+		{
+			printf("Logging the client connections to '%s.*%s'.\r\n", WIRE_LOG_FILE, WIRELOG_FILE_EXTENSION);
+		}
 		printf("Type 'bye', 'quit', or 'exit' to stop the server.\r\n");
+		printf("Type 'stats' to show the connection statistics.\r\n");
 		printf("Type anything else to send as a broadcast message to all current client connections.\r\n");
 	}
 
@@ -104,9 +185,13 @@ public:
 		{
 			mInputLine->release();
 		}
+		if (mReactor)
+		{
+			mReactor->release();
+		}
 		for (auto &i : mClients)
 		{
-			delete i;
+			delete i.second;
 		}
 		if (mServerSocket)
 		{
@@ -114,94 +199,293 @@ public:
 		}
 	}
 
+	virtual socketchat::SocketChatCallback *newConnection(socketchat::SocketChat *client) override final
+	{
+		uint32_t index = ++mConnectionCount;
+		if (mLog)
+		{
+			client->setLogFile(WIRE_LOG_FILE);
+		}
+		ClientConnection *cc = new ClientConnection(this, client, index);
+		printf("New client connection (%d) established.\r\n", index);
+		mClients[client] = cc;
+		return cc;
+	}
+
+	virtual void connectionClosed(socketchat::SocketChat *client) override final
+	{
+		ClientConnectionMap::iterator found = mClients.find(client);
+		if (found != mClients.end())
+		{
+			ClientConnection *cc = found->second;
+			printf("Lost connection to client: %d\r\n", cc->getId());
+			socketchat::SocketChatStats stats;
+			client->getStats(stats);
+			mClosedStats.merge(stats);
+			mClients.erase(found);
+			delete cc;
+		}
+	}
+
+	virtual void broadcast(const char *message) override final
+	{
+		// Every client references the same copy of the message
+		socketchat::SharedMessage *sm = socketchat::SharedMessage::create(message);
+		for (auto &i : mClients)
+		{
+			i.second->sendShared(sm);
+		}
+		sm->release();
+	}
+
+	// Every client so far, connected or not
+	void showStats(void)
+	{
+		socketchat::SocketChatStats total = mClosedStats;
+		socketchat::SocketChatStats stats;
+		for (auto &i : mClients)
+		{
+			i.first->getStats(stats);
+			total.merge(stats);
+		}
+		printStats(total);
+	}
+
 	void run(void)
 	{
 		bool exit = false;
 
 		while (!exit)
 		{
-			if (mServerSocket)
-			{
-				wsocket::Wsocket *clientSocket = mServerSocket->pollServer();
-				if (clientSocket)
-				{
-					uint32_t index = uint32_t(mClients.size()) + 1;
-					ClientConnection *cc = new ClientConnection(clientSocket, index);
-					printf("New client connection (%d) established.\r\n", index);
-					mClients.push_back(cc);
-				}
-			}
 			if (mInputLine)
 			{
 				const char *str = mInputLine->getInputLine();
 				if (str)
 				{
-					if (strcmp(str, "bye") == 0 ||
-						strcmp(str,"quit") == 0 ||
-						strcmp(str,"exit") == 0 )
+					if (isExitCommand(str))
 					{
 						exit = true;
 					}
+					else if (strcmp(str, "stats") == 0)
+					{
+						showStats();
+					}
 					else
 					{
-						for (auto &i : mClients)
-						{
-							i->sendText(str);
-						}
+						broadcast(str);
 					}
 				}
 			}
 
-			// See if any clients have dropped connection
-			bool killed = true;
-			while (killed)
+			// Accepts new clients, dispatches any messages received from clients that are ready,
+			// and flushes pending broadcasts; waiting at most 1ms for the whole set of connections.
+			if (mReactor)
 			{
-				killed = false;
-				for (ClientConnectionVector::iterator i = mClients.begin(); i != mClients.end(); ++i)
-				{
-					if (!(*i)->isConnected() )
-					{
-						killed = true;
-						ClientConnection *cc = (*i);
-						printf("Lost connection to client: %d\r\n", cc->getId());
-						delete cc;
-						mClients.erase(i);
-						break;
-					}
-				}
+				mReactor->poll(1);
+			}
+			else
+			{
+				wplatform::sleepNano(1000000);
+			}
+		}
+	}
+
+	wsocket::Wsocket				*mServerSocket{ nullptr };
+	socketchat::SocketChatReactor	*mReactor{ nullptr };
+	inputline::InputLine			*mInputLine{ nullptr };
+	uint32_t						mConnectionCount{ 0 };
+	ClientConnectionMap				mClients;
+	socketchat::SocketChatStats		mClosedStats;	// Clients which have disconnected
+	bool							mLog{ false };
+};
+
+// Runs the connections on several worker threads, each with its own listen socket and reactor.
+// The callbacks arrive on the worker which owns the connection, so each worker has its own client map.
+class ThreadedServer : public ChatServer, public socketchat::SocketChatServerCallback
+{
+public:
+	ThreadedServer(const char *serverType,uint32_t workerCount,bool tap,bool log,const socketchat::SocketChatOptions &connectionOptions) : mLog(log)
+	{
+		mClients.resize(workerCount);
+		mServer = socketchat::SocketChatServer::create(serverType, PORT_NUMBER, workerCount, this, true, connectionOptions);
+		if (mServer && tap)
+		{
+			// Overwrite, so a stalled reader can never hold up the chat
+			char fileName[512];
+			wplatform::stringFormat(fileName, sizeof(fileName), TAP_FILE, PORT_NUMBER);
+			if (mServer->mirrorBroadcasts(fileName, TAP_RING_SIZE, spmc::POLICY_OVERWRITE))
+			{
+				printf("Mirroring broadcasts to '%s'.\r\n", fileName);
 			}
+		}
+		if (log)
+		{
+			printf("Logging the client connections to '%s.*%s'.\r\n", WIRE_LOG_FILE, WIRELOG_FILE_EXTENSION);
+		}
+		mInputLine = inputline::InputLine::create();
+		printf("Simple Websockets chat server started with %d worker threads.\r\n", workerCount);
+		printf("Type 'bye', 'quit', or 'exit' to stop the server.\r\n");
+		printf("Type 'stats' to show the connection statistics.\r\n");
+		printf("Type anything else to send as a broadcast message to all current client connections.\r\n");
+	}
+
+	~ThreadedServer(void)
+	{
+		if (mInputLine)
+		{
+			mInputLine->release();
+		}
+		// Stops the workers; any remaining clients are reported through 'connectionClosed'
+		if (mServer)
+		{
+			mServer->release();
+		}
+	}
+
+	virtual socketchat::SocketChatCallback *newConnection(uint32_t worker,socketchat::SocketChat *client) override final
+	{
+		uint32_t index = ++mConnectionCount;
+		if (mLog)
+		{
+			client->setLogFile(WIRE_LOG_FILE);
+		}
+		ClientConnection *cc = new ClientConnection(this, client, index);
+		printf("New client connection (%d) established on worker %d.\r\n", index, worker);
+		mClients[worker][client] = cc;
+		return cc;
+	}
+
+	virtual void connectionClosed(uint32_t worker,socketchat::SocketChat *client) override final
+	{
+		ClientConnectionMap &clients = mClients[worker];
+		ClientConnectionMap::iterator found = clients.find(client);
+		if (found != clients.end())
+		{
+			ClientConnection *cc = found->second;
+			printf("Lost connection to client: %d\r\n", cc->getId());
+			clients.erase(found);
+			delete cc;
+		}
+	}
+
+	virtual void broadcast(const char *message) override final
+	{
+		if (mServer)
+		{
+			mServer->broadcast(message);
+		}
+	}
+
+	void run(void)
+	{
+		bool exit = false;
 
-			// For each active client connection..
-			// we see if that client has received a new message
-			// If we have received a message from a client, then we echo that message back to
-			// all currently connected clients
-			for (auto &i : mClients)
+		while (!exit)
+		{
+			const char *str = mInputLine ? mInputLine->getInputLine() : nullptr;
+			if (str)
 			{
-				const char *newMessage = i->getMessage();
-				if (newMessage)
+				if (isExitCommand(str))
 				{
-					printf("Client[%d] : %s\r\n", i->getId(), newMessage);
-					for (auto &j : mClients)
+					exit = true;
+				}
+				else if (strcmp(str, "stats") == 0)
+				{
+					if (mServer)
 					{
-						j->sendText(newMessage);
+						socketchat::SocketChatStats stats;
+						mServer->getStats(stats);
+						printStats(stats);
 					}
 				}
+				else
+				{
+					broadcast(str);
+				}
+			}
+			else
+			{
+				// The workers do all of the socket work; this thread only reads the console
+				wplatform::sleepNano(1000000);
 			}
 		}
 	}
 
-	wsocket::Wsocket		*mServerSocket{ nullptr };
-	inputline::InputLine	*mInputLine{ nullptr };
-	ClientConnectionVector	mClients;
+	socketchat::SocketChatServer		*mServer{ nullptr };
+	inputline::InputLine				*mInputLine{ nullptr };
+	std::atomic<uint32_t>				mConnectionCount{ 0 };
+	std::vector< ClientConnectionMap >	mClients;	// One map per worker thread
+	bool								mLog{ false };
 };
 
+void ClientConnection::receiveMessage(const char *message)
+{
+	printf("Client[%d] : %s\r\n", mId, message);
+	mServer->broadcast(message);
+}
 
-int main()
+
+int main(int argc,const char **argv)
 {
+	// Usage: TestServer [uring|shared] [tap] [capture] [log] [disconnect|dropoldest|conflate] [threadCount]
+	// Pass 'uring' to drive the client connections through io_uring (when available).
+	// Pass 'shared' to accept clients on this machine over shared memory (run TestClient with 'sharedclient').
+	// Pass 'tap' to mirror every broadcast into shared memory for local readers (run TestClient with 'tap').
+	// Pass 'capture' to record every client connection's traffic to a capture file (simple server, plain sockets only).
+	// Pass 'log' to log every client connection's traffic to the wire log (render it with WireLogDump).
+	// Pass 'disconnect', 'dropoldest' or 'conflate' to bound each client's backlog with that slow consumer policy.
+	// Pass a thread count to run the connections on that many worker threads.
+	const char *serverType = SOCKET_SERVER;
+	uint32_t threadCount = 0;
+	bool tap = false;
+	bool capture = false;
+	bool log = false;
+	socketchat::SocketChatOptions connectionOptions;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "uring") == 0)
+		{
+			serverType = URING_SERVER;
+		}
+		else if (strcmp(argv[i], "shared") == 0)
+		{
+			serverType = SHARED_SERVER;
+		}
+		else if (strcmp(argv[i], "tap") == 0)
+		{
+			tap = true;
+		}
+		else if (strcmp(argv[i], "capture") == 0)
+		{
+			capture = true;
+		}
+		else if (strcmp(argv[i], "log") == 0)
+		{
+			log = true;
+		}
+		else if (strcmp(argv[i], "disconnect") == 0 || strcmp(argv[i], "dropoldest") == 0 || strcmp(argv[i], "conflate") == 0)
+		{
+			connectionOptions.mHighWaterMark = SLOW_CONSUMER_HIGH_WATER;
+			connectionOptions.mLowWaterMark = SLOW_CONSUMER_LOW_WATER;
+			connectionOptions.mSlowConsumerPolicy = strcmp(argv[i], "disconnect") == 0 ? socketchat::SLOW_CONSUMER_DISCONNECT :
+				strcmp(argv[i], "dropoldest") == 0 ? socketchat::SLOW_CONSUMER_DROP_OLDEST : socketchat::SLOW_CONSUMER_CONFLATE;
+		}
+		else
+		{
+			threadCount = uint32_t(atoi(argv[i]));
+		}
+	}
 	socketchat::socketStartup();
-	// Run the simple server
+	if (threadCount || tap)
+	{
+		// The tap is provided by the threaded server
+		ThreadedServer ts(serverType, threadCount ? threadCount : 1, tap, log, connectionOptions);
+		ts.run();
+	}
+	else
 	{
-		SimpleServer ss;
+		// Run the simple server
+		SimpleServer ss(serverType, capture, log, connectionOptions);
 		ss.run();
 	}
 
@@ -0,0 +1,207 @@
+#ifdef _MSC_VER
+#endif
+
+#include "Capture.h"
+#include "WireLog.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+#include <unordered_map>
+
+#ifdef _MSC_VER
+#pragma warning(disable:4996)
+#endif
+
+#define DUMP_MAX_MISSING 4096			// Numbered files looked for before deciding a base name has none
+
+// Renders wire logs (see WireLog.h) as text, in the format SocketChat::setLogFile used to write directly:
+// each send and receive with its printable bytes as they are and the rest as $XX.
+// Capture files can be rendered too; they are the same format.
+//
+// Usage: WireLogDump <file or base name>... [connection]
+//
+//   A base name, such as 'socketchat', renders every rotated file still on disk (socketchat.N.wirelog) in order.
+//   A connection number renders only that connection's records.
+
+// How many sends and receives each connection has made so far
+struct StreamCounts
+{
+	uint32_t	mSendCount{ 0 };
+	uint32_t	mReceiveCount{ 0 };
+};
+
+class WireLogDump
+{
+public:
+	WireLogDump(uint32_t stream) : mStream(stream)
+	{
+	}
+
+	// Returns false if 'fileName' is not a capture file
+	bool dumpFile(const char *fileName)
+	{
+		capture::CaptureReader *reader = capture::CaptureReader::create(fileName);
+		if (!reader)
+		{
+			return false;
+		}
+		const uint8_t *data;
+		while (const capture::CaptureRecordHeader *record = reader->next(data))
+		{
+			if (mStream == CAPTURE_ANY_STREAM || record->mStream == mStream)
+			{
+				dumpRecord(*record, data);
+			}
+		}
+		reader->release();
+		return true;
+	}
+
+	// Renders 'baseName.0.wirelog', 'baseName.1.wirelog' and so on; the oldest may have been deleted
+	// by rotation, so the numbering need not start at zero. Returns the number of files rendered.
+	uint32_t dumpRotated(const char *baseName)
+	{
+		uint32_t ret = 0;
+		uint32_t missing = 0;
+		for (uint32_t i = 0; missing < DUMP_MAX_MISSING; i++)
+		{
+			char fileName[512];
+			snprintf(fileName, sizeof(fileName), "%s.%d%s", baseName, int(i), WIRELOG_FILE_EXTENSION);
+			if (dumpFile(fileName))
+			{
+				ret++;
+				missing = 0;
+			}
+			else if (ret)
+			{
+				break;
+			}
+			else
+			{
+				missing++;
+			}
+		}
+		return ret;
+	}
+
+private:
+	void dumpRecord(const capture::CaptureRecordHeader &record, const uint8_t *data)
+	{
+		std::unordered_map< uint32_t, StreamCounts >::iterator found = mCounts.find(record.mStream);
+		if (found == mCounts.end())
+		{
+			found = mCounts.insert(std::make_pair(record.mStream, StreamCounts())).first;
+			printf("======================================================================\r\n");
+			printf("**** NEW SocketChat INSTANCE[%d] ****\r\n", int(record.mStream));
+			printf("======================================================================\r\n");
+		}
+		StreamCounts &counts = found->second;
+		double seconds = double(record.mTime) / 1e9;
+		switch (record.mDirection)
+		{
+			case CAPTURE_RECEIVE:
+			case CAPTURE_SEND:
+				printf("===================================================================\r\n");
+				printf("%s[%d] : %d bytes (connection %d, %0.6f seconds)\r\n",
+					record.mDirection == CAPTURE_RECEIVE ? "RECEIVE" : "SEND",
+					int(record.mDirection == CAPTURE_RECEIVE ? ++counts.mReceiveCount : ++counts.mSendCount),
+					int(record.mLength), int(record.mStream), seconds);
+				printf("===================================================================\r\n");
+				dumpData(data, record.mLength);
+				printf("\r\n");
+				printf("===================================================================\r\n");
+				printf("\r\n");
+				break;
+			case CAPTURE_CLOSE:
+				printf("**** CLOSED connection %d (%0.6f seconds) ****\r\n", int(record.mStream), seconds);
+				printf("\r\n");
+				break;
+			case CAPTURE_DROPPED:
+				{
+					uint64_t dropped = 0;
+					if (record.mLength >= sizeof(dropped))
+					{
+						memcpy(&dropped, data, sizeof(dropped));
+					}
+					printf("**** DROPPED %llu records from connection %d (%0.6f seconds) ****\r\n",
+						(unsigned long long)dropped, int(record.mStream), seconds);
+					printf("\r\n");
+				}
+				break;
+		}
+	}
+
+	// Printable characters as they are, anything else as $XX; formatted a record at a time, not a byte
+	void dumpData(const uint8_t *data, uint32_t dataLen)
+	{
+		static const char hex[] = "0123456789ABCDEF";
+		mLine.clear();
+		for (uint32_t i = 0; i < dataLen; i++)
+		{
+			uint8_t c = data[i];
+			if (c >= 32 && c < 128)
+			{
+				mLine.push_back(char(c));
+			}
+			else
+			{
+				mLine.push_back('$');
+				mLine.push_back(hex[c >> 4]);
+				mLine.push_back(hex[c & 15]);
+			}
+		}
+		fwrite(mLine.c_str(), mLine.size(), 1, stdout);
+	}
+
+	uint32_t										mStream{ CAPTURE_ANY_STREAM };
+	std::unordered_map< uint32_t, StreamCounts >	mCounts;
+	std::string										mLine;
+};
+
+static bool isNumber(const char *str)
+{
+	if (!*str)
+	{
+		return false;
+	}
+	for (; *str; str++)
+	{
+		if (*str < '0' || *str > '9')
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, const char **argv)
+{
+	uint32_t stream = CAPTURE_ANY_STREAM;
+	for (int i = 1; i < argc; i++)
+	{
+		if (isNumber(argv[i]))
+		{
+			stream = uint32_t(atoi(argv[i]));
+		}
+	}
+	WireLogDump dump(stream);
+	bool any = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if (isNumber(argv[i]))
+		{
+			continue;
+		}
+		any = true;
+		if (!dump.dumpFile(argv[i]) && !dump.dumpRotated(argv[i]))
+		{
+			fprintf(stderr, "'%s' is not a wire log or capture file, nor the base name of one.\n", argv[i]);
+		}
+	}
+	if (!any)
+	{
+		printf("Usage: WireLogDump <file or base name>... [connection]\n");
+	}
+	return 0;
+}
@@ -0,0 +1,301 @@
+#include "Capture.h"
+#include "MemoryMap.h"
+#include "wsocket.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define CAPTURE_BATCH_SIZE (1024*256)			// Bytes which make it worth waking the writer thread early
+#define CAPTURE_MAX_PENDING (1024*1024*64)		// Bytes recorded but not yet written before callers wait
+#define CAPTURE_FLUSH_INTERVAL 100				// Longest a record waits in memory, in milliseconds
+#define CAPTURE_ALIGN 8							// Records are padded to a multiple of this
+
+namespace capture
+{
+
+static uint32_t paddedLength(uint32_t len)
+{
+	return (len + CAPTURE_ALIGN - 1) & ~uint32_t(CAPTURE_ALIGN - 1);
+}
+
+class CaptureWriterImpl : public CaptureWriter
+{
+public:
+	CaptureWriterImpl(const char *fileName)
+	{
+		mFile = fopen(fileName, "wb");
+		if (!mFile)
+		{
+			return;
+		}
+		mStart = std::chrono::steady_clock::now();
+		CaptureFileHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.mMagic, CAPTURE_MAGIC, sizeof(header.mMagic));
+		header.mVersion = CAPTURE_VERSION;
+		header.mHeaderSize = uint32_t(sizeof(header));
+		header.mStartTime = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+		fwrite(&header, sizeof(header), 1, mFile);
+		mThread = new std::thread([this]()
+		{
+			run();
+		});
+	}
+
+	virtual ~CaptureWriterImpl(void)
+	{
+		if (mThread)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+				mQuit = true;
+			}
+			mWake.notify_one();
+			mThread->join();
+			delete mThread;
+		}
+		if (mFile)
+		{
+			fclose(mFile);
+		}
+	}
+
+	bool isValid(void) const
+	{
+		return mFile != nullptr;
+	}
+
+	virtual uint32_t newStream(void) override final
+	{
+		return mNextStream++;
+	}
+
+	virtual void record(uint32_t stream, uint32_t direction, const void *data, uint32_t dataLen) override final
+	{
+		wsocket::WsocketIovec iov;
+		iov.mData = data;
+		iov.mLength = dataLen;
+		recordv(stream, direction, &iov, 1, dataLen);
+	}
+
+	virtual void recordv(uint32_t stream, uint32_t direction, const wsocket::WsocketIovec *iov, uint32_t iovCount, uint32_t dataLen) override final
+	{
+		CaptureRecordHeader header;
+		memset(&header, 0, sizeof(header));
+		header.mTime = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - mStart).count());
+		header.mStream = stream;
+		header.mLength = dataLen;
+		header.mDirection = uint8_t(direction);
+		std::unique_lock<std::mutex> lock(mMutex);
+		mDrained.wait(lock, [this]()
+		{
+			return mFill.size() < CAPTURE_MAX_PENDING || mQuit;
+		});
+		size_t offset = mFill.size();
+		mFill.resize(offset + sizeof(header) + paddedLength(dataLen));
+		uint8_t *dest = &mFill[offset];
+		memcpy(dest, &header, sizeof(header));
+		dest += sizeof(header);
+		uint32_t remaining = dataLen;
+		for (uint32_t i = 0; i < iovCount && remaining; i++)
+		{
+			uint32_t len = iov[i].mLength < remaining ? iov[i].mLength : remaining;
+			memcpy(dest, iov[i].mData, len);
+			dest += len;
+			remaining -= len;
+		}
+		memset(dest, 0, paddedLength(dataLen) - dataLen);
+		if (mFill.size() >= CAPTURE_BATCH_SIZE)
+		{
+			mWake.notify_one();
+		}
+	}
+
+	virtual void flush(void) override final
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		uint64_t target = mRecorded + mFill.size();
+		mFlushRequested = true;
+		mWake.notify_one();
+		mDrained.wait(lock, [this, target]()
+		{
+			return mWritten >= target || !mThread;
+		});
+	}
+
+	virtual void addRef(void) override final
+	{
+		mRefCount++;
+	}
+
+	virtual void release(void) override final
+	{
+		if (--mRefCount == 0)
+		{
+			delete this;
+		}
+	}
+
+private:
+	// Writes whatever has been recorded, in one call per batch
+	void run(void)
+	{
+		std::vector< uint8_t > batch;
+		std::unique_lock<std::mutex> lock(mMutex);
+		for (;;)
+		{
+			mWake.wait_for(lock, std::chrono::milliseconds(CAPTURE_FLUSH_INTERVAL), [this]()
+			{
+				return mQuit || mFlushRequested || mFill.size() >= CAPTURE_BATCH_SIZE;
+			});
+			bool quit = mQuit;
+			mFlushRequested = false;
+			batch.swap(mFill);
+			mRecorded += batch.size();
+			mDrained.notify_all(); // there is room again
+			lock.unlock();
+			if (!batch.empty())
+			{
+				fwrite(&batch[0], batch.size(), 1, mFile);
+				fflush(mFile);
+			}
+			lock.lock();
+			mWritten += batch.size();
+			batch.clear();
+			mDrained.notify_all();
+			if (quit)
+			{
+				break;
+			}
+		}
+	}
+
+	FILE									*mFile{ nullptr };
+	std::thread								*mThread{ nullptr };
+	std::chrono::steady_clock::time_point	mStart;
+	std::atomic<uint32_t>					mRefCount{ 1 };
+	std::atomic<uint32_t>					mNextStream{ 0 };
+	std::mutex								mMutex;				// guards everything below
+	std::condition_variable					mWake;				// wakes the writer thread
+	std::condition_variable					mDrained;			// wakes callers waiting for room, or for a flush
+	std::vector< uint8_t >					mFill;				// records waiting to be written
+	uint64_t								mRecorded{ 0 };		// bytes handed to the writer thread so far
+	uint64_t								mWritten{ 0 };		// bytes it has written so far
+	bool									mFlushRequested{ false };
+	bool									mQuit{ false };
+};
+
+class CaptureReaderImpl : public CaptureReader
+{
+public:
+	CaptureReaderImpl(const char *fileName)
+	{
+		uint64_t size = 0;
+		mMap = memorymap::MemoryMap::createMemoryMap(fileName, size, false, true);
+		if (!mMap)
+		{
+			return;
+		}
+		mData = (const uint8_t *)mMap->getBaseAddress();
+		mSize = mMap->getFileSize();
+		if (mSize >= sizeof(CaptureFileHeader))
+		{
+			const CaptureFileHeader *header = (const CaptureFileHeader *)mData;
+			if (memcmp(header->mMagic, CAPTURE_MAGIC, sizeof(header->mMagic)) == 0 &&
+				header->mVersion == CAPTURE_VERSION &&
+				header->mHeaderSize >= sizeof(CaptureFileHeader) &&
+				header->mHeaderSize <= mSize)
+			{
+				mStartTime = header->mStartTime;
+				mFirst = header->mHeaderSize;
+				mOffset = mFirst;
+				mValid = true;
+			}
+		}
+	}
+
+	virtual ~CaptureReaderImpl(void)
+	{
+		if (mMap)
+		{
+			mMap->release();
+		}
+	}
+
+	bool isValid(void) const
+	{
+		return mValid;
+	}
+
+	virtual uint64_t getStartTime(void) const override final
+	{
+		return mStartTime;
+	}
+
+	virtual const CaptureRecordHeader *next(const uint8_t *&data) override final
+	{
+		data = nullptr;
+		if (mOffset + sizeof(CaptureRecordHeader) > mSize)
+		{
+			return nullptr;
+		}
+		const CaptureRecordHeader *header = (const CaptureRecordHeader *)(mData + mOffset);
+		uint64_t end = mOffset + sizeof(CaptureRecordHeader) + paddedLength(header->mLength);
+		if (end > mSize)
+		{
+			return nullptr;
+		}
+		data = mData + mOffset + sizeof(CaptureRecordHeader);
+		mOffset = end;
+		return header;
+	}
+
+	virtual void rewind(void) override final
+	{
+		mOffset = mFirst;
+	}
+
+	virtual void release(void) override final
+	{
+		delete this;
+	}
+
+private:
+	memorymap::MemoryMap	*mMap{ nullptr };
+	const uint8_t			*mData{ nullptr };
+	uint64_t				mSize{ 0 };
+	uint64_t				mFirst{ 0 };
+	uint64_t				mOffset{ 0 };
+	uint64_t				mStartTime{ 0 };
+	bool					mValid{ false };
+};
+
+CaptureWriter *CaptureWriter::create(const char *fileName)
+{
+	auto ret = new CaptureWriterImpl(fileName);
+	if (!ret->isValid())
+	{
+		ret->release();
+		ret = nullptr;
+	}
+	return static_cast<CaptureWriter *>(ret);
+}
+
+CaptureReader *CaptureReader::create(const char *fileName)
+{
+	auto ret = new CaptureReaderImpl(fileName);
+	if (!ret->isValid())
+	{
+		ret->release();
+		ret = nullptr;
+	}
+	return static_cast<CaptureReader *>(ret);
+}
+
+} // namespace capture
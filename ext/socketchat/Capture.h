@@ -0,0 +1,101 @@
+#pragma once
+
+// Records what connections send and receive to a file, and reads it back for replay.
+//
+// A capture file is a CaptureFileHeader followed by records, each a CaptureRecordHeader and then
+// 'mLength' bytes of data, padded to a multiple of 8 bytes so every header is aligned in a mapped file.
+// Any number of connections can share one file; each writes its own stream of records.
+// Wsocket::create(playbackFile) replays one stream's receives into a SocketChat connection.
+#include <stdint.h>
+
+namespace wsocket
+{
+struct WsocketIovec;
+}
+
+namespace capture
+{
+
+#define CAPTURE_MAGIC "SCCAPTUR"		// First 8 bytes of every capture file
+#define CAPTURE_VERSION 1
+
+// What a record holds
+#define CAPTURE_RECEIVE 1				// Bytes one receive call returned
+#define CAPTURE_SEND 2					// Bytes the transport accepted from one send call
+#define CAPTURE_CLOSE 3					// The connection closed; no data
+#define CAPTURE_DROPPED 4				// Records were lost here (see WireLog.h); data is the uint64_t count
+
+#define CAPTURE_ANY_STREAM 0xFFFFFFFF	// Replay whichever stream comes first in the file
+
+struct CaptureFileHeader
+{
+	char		mMagic[8];
+	uint32_t	mVersion;
+	uint32_t	mHeaderSize;			// Bytes from the start of the file to the first record
+	uint64_t	mStartTime;				// Wall clock time of time zero, in nanoseconds since 1970
+};
+
+struct CaptureRecordHeader
+{
+	uint64_t	mTime;					// Nanoseconds since the capture started
+	uint32_t	mStream;				// Which connection
+	uint32_t	mLength;				// Bytes of data which follow
+	uint8_t		mDirection;				// CAPTURE_RECEIVE, CAPTURE_SEND or CAPTURE_CLOSE
+	uint8_t		mPad[7];
+};
+
+// Appends records from any number of threads. The caller only copies the record into memory; a
+// background thread writes them out in large batches. Nothing is ever dropped: a caller which gets
+// too far ahead of the disk waits for it.
+class CaptureWriter
+{
+public:
+	// Returns null if the file could not be created
+	static CaptureWriter *create(const char *fileName);
+
+	// Hands out the id of a new stream (one per connection)
+	virtual uint32_t newStream(void) = 0;
+
+	virtual void record(uint32_t stream, uint32_t direction, const void *data, uint32_t dataLen) = 0;
+
+	// One record gathered from several pieces, such as a 'sendv' call which sent 'dataLen' bytes of them
+	virtual void recordv(uint32_t stream, uint32_t direction, const wsocket::WsocketIovec *iov, uint32_t iovCount, uint32_t dataLen) = 0;
+
+	// Waits until everything recorded so far is in the file
+	virtual void flush(void) = 0;
+
+	// Writers are shared by reference; the last release finishes writing and closes the file
+	virtual void addRef(void) = 0;
+	virtual void release(void) = 0;
+
+protected:
+	virtual ~CaptureWriter(void)
+	{
+	}
+};
+
+// Walks the records of a capture file, mapped into memory read only, without copying any of them
+class CaptureReader
+{
+public:
+	// Returns null if the file cannot be opened or is not a capture file
+	static CaptureReader *create(const char *fileName);
+
+	virtual uint64_t getStartTime(void) const = 0;
+
+	// Returns the next record, with 'data' pointing at its bytes, or null at the end of the file.
+	// A record cut short (the writer did not finish) counts as the end.
+	virtual const CaptureRecordHeader *next(const uint8_t *&data) = 0;
+
+	// Back to the first record
+	virtual void rewind(void) = 0;
+
+	virtual void release(void) = 0;
+
+protected:
+	virtual ~CaptureReader(void)
+	{
+	}
+};
+
+} // namespace capture
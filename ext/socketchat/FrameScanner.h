@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// Incremental scanner for CR/LF terminated frames.
+// It remembers how far into the receive buffer it has already looked, so a large message which
+// arrives in many small reads is only scanned once in total instead of once per read.
+// The search runs 32 bytes at a time with AVX2, 16 bytes at a time with SSE2, and falls back
+// to memchr elsewhere. Each position is tested for a LF preceded by a CR, so a pair split across
+// a vector boundary (or across two reads) is found like any other.
+#if defined(__AVX2__)
+#define FRAME_SCANNER_AVX2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FRAME_SCANNER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace framescanner
+{
+
+const uint32_t cNotFound = 0xFFFFFFFF;
+
+// Index of the lowest set bit; 'mask' must be non-zero
+inline uint32_t lowestBit(uint32_t mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return uint32_t(index);
+#else
+	return uint32_t(__builtin_ctz(mask));
+#endif
+}
+
+// Returns the index of the CR of the first CR/LF pair whose LF is at or after 'start', or cNotFound
+inline uint32_t findCRLF(const uint8_t *data, uint32_t start, uint32_t dataLen)
+{
+	uint32_t i = start ? start : 1; // the LF can never be the first byte
+#if FRAME_SCANNER_AVX2
+	const __m256i cr = _mm256_set1_epi8(13);
+	const __m256i lf = _mm256_set1_epi8(10);
+	// Compare each byte against LF and the byte before it against CR
+	for (; i + 32 <= dataLen; i += 32)
+	{
+		__m256i cur = _mm256_loadu_si256((const __m256i *)(data + i));
+		__m256i prev = _mm256_loadu_si256((const __m256i *)(data + i - 1));
+		uint32_t mask = uint32_t(_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(cur, lf), _mm256_cmpeq_epi8(prev, cr))));
+		if (mask)
+		{
+			return i + lowestBit(mask) - 1;
+		}
+	}
+#endif
+#if FRAME_SCANNER_AVX2 || FRAME_SCANNER_SSE2
+	const __m128i cr16 = _mm_set1_epi8(13);
+	const __m128i lf16 = _mm_set1_epi8(10);
+	for (; i + 16 <= dataLen; i += 16)
+	{
+		__m128i cur = _mm_loadu_si128((const __m128i *)(data + i));
+		__m128i prev = _mm_loadu_si128((const __m128i *)(data + i - 1));
+		uint32_t mask = uint32_t(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(cur, lf16), _mm_cmpeq_epi8(prev, cr16))));
+		if (mask)
+		{
+			return i + lowestBit(mask) - 1;
+		}
+	}
+	for (; i < dataLen; i++)
+	{
+		if (data[i] == 10 && data[i - 1] == 13)
+		{
+			return i - 1;
+		}
+	}
+#else
+	while (i < dataLen)
+	{
+		const uint8_t *lf = (const uint8_t *)memchr(data + i, 10, dataLen - i);
+		if (!lf)
+		{
+			break;
+		}
+		i = uint32_t(lf - data);
+		if (data[i - 1] == 13)
+		{
+			return i - 1;
+		}
+		i++;
+	}
+#endif
+	return cNotFound;
+}
+
+class FrameScanner
+{
+public:
+	// Looks for the end of the next frame in 'data', which must start with the same bytes as the
+	// last call (less anything since consumed). Returns the index of the terminating CR, or cNotFound.
+	uint32_t scan(const uint8_t *data, uint32_t dataLen)
+	{
+		uint32_t ret = findCRLF(data, mScanned, dataLen);
+		// Every LF before dataLen has been checked; resume from there when more data arrives
+		mScanned = ret == cNotFound ? dataLen : ret + 1;
+		return ret;
+	}
+
+	// The first 'len' bytes of the buffer were removed
+	void consume(uint32_t len)
+	{
+		mScanned = mScanned > len ? mScanned - len : 0;
+	}
+
+	void reset(void)
+	{
+		mScanned = 0;
+	}
+
+private:
+	uint32_t	mScanned{ 0 };	// Offset of the next byte which could be the LF of a terminator
+};
+
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// A fixed size log-linear histogram (in the manner of HdrHistogram).
+// Each power of two range of values is split into HISTOGRAM_SUB_BUCKETS equal buckets, so any value is
+// recorded to within 1/HISTOGRAM_SUB_BUCKETS of itself whatever its magnitude. Recording is a bit scan
+// and an increment; there are no allocations, so histograms can be kept per connection and merged.
+namespace histogram
+{
+
+#define HISTOGRAM_SUB_BUCKET_BITS 3									// 8 buckets per power of two; about 12% precision
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_MAX_BITS 40											// Values of 2^40 and above share the last bucket
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+class Histogram
+{
+public:
+	void record(uint64_t value, uint32_t count = 1)
+	{
+		if (!count)
+		{
+			return;
+		}
+		mBuckets[getBucket(value)] += count;
+		mCount += count;
+		mSum += value * count;
+		if (value < mMin)
+		{
+			mMin = value;
+		}
+		if (value > mMax)
+		{
+			mMax = value;
+		}
+	}
+
+	void merge(const Histogram &other)
+	{
+		if (!other.mCount)
+		{
+			return;
+		}
+		for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+		{
+			mBuckets[i] += other.mBuckets[i];
+		}
+		mCount += other.mCount;
+		mSum += other.mSum;
+		if (other.mMin < mMin)
+		{
+			mMin = other.mMin;
+		}
+		if (other.mMax > mMax)
+		{
+			mMax = other.mMax;
+		}
+	}
+
+	void reset(void)
+	{
+		memset(mBuckets, 0, sizeof(mBuckets));
+		mCount = 0;
+		mSum = 0;
+		mMin = UINT64_MAX;
+		mMax = 0;
+	}
+
+	uint64_t getCount(void) const
+	{
+		return mCount;
+	}
+
+	uint64_t getMin(void) const
+	{
+		return mCount ? mMin : 0;
+	}
+
+	uint64_t getMax(void) const
+	{
+		return mMax;
+	}
+
+	double getMean(void) const
+	{
+		return mCount ? double(mSum) / double(mCount) : 0;
+	}
+
+	// The value below which 'percentile' percent of the recorded values fall, to the precision of a
+	// bucket (the top of the bucket it lands in, never more than the largest value recorded)
+	uint64_t getPercentile(double percentile) const
+	{
+		if (!mCount)
+		{
+			return 0;
+		}
+		uint64_t target = uint64_t(percentile / 100.0 * double(mCount) + 0.5);
+		if (target < 1)
+		{
+			target = 1;
+		}
+		uint64_t seen = 0;
+		for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+		{
+			seen += mBuckets[i];
+			if (seen >= target)
+			{
+				uint64_t ret = getBucketHigh(i);
+				return ret < mMin ? mMin : (ret > mMax ? mMax : ret);
+			}
+		}
+		return mMax;
+	}
+
+	// Bucket a value is recorded in
+	static uint32_t getBucket(uint64_t value)
+	{
+		if (value < HISTOGRAM_SUB_BUCKETS)
+		{
+			return uint32_t(value);
+		}
+		uint32_t msb = highestBit(value);
+		if (msb >= HISTOGRAM_MAX_BITS)
+		{
+			return HISTOGRAM_BUCKETS - 1;
+		}
+		uint32_t shift = msb - HISTOGRAM_SUB_BUCKET_BITS;
+		return (shift + 1) * HISTOGRAM_SUB_BUCKETS + uint32_t(value >> shift) - HISTOGRAM_SUB_BUCKETS;
+	}
+
+	// Smallest value recorded in a bucket
+	static uint64_t getBucketLow(uint32_t bucket)
+	{
+		uint32_t group = bucket / HISTOGRAM_SUB_BUCKETS;
+		uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+		return group ? (HISTOGRAM_SUB_BUCKETS + sub) << (group - 1) : sub;
+	}
+
+	// Largest value recorded in a bucket (the last one also takes everything too large for the rest)
+	static uint64_t getBucketHigh(uint32_t bucket)
+	{
+		if (bucket == HISTOGRAM_BUCKETS - 1)
+		{
+			return UINT64_MAX;
+		}
+		return getBucketLow(bucket + 1) - 1;
+	}
+
+private:
+	static uint32_t highestBit(uint64_t value)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanReverse64(&index, value);
+		return uint32_t(index);
+#else
+		return uint32_t(63 - __builtin_clzll(value));
+#endif
+	}
+
+	uint64_t	mCount{ 0 };
+	uint64_t	mSum{ 0 };
+	uint64_t	mMin{ UINT64_MAX };
+	uint64_t	mMax{ 0 };
+	uint32_t	mBuckets[HISTOGRAM_BUCKETS]{};
+};
+
+} // namespace histogram
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+// Implements a bounded multiple producer single consumer queue between threads of one process.
+// Any number of threads may push at once without taking a lock; a push never waits, it fails when
+// the queue is full so the caller can apply backpressure. One thread pops.
+// Each cell carries a sequence number which says whose turn it is (after Dmitry Vyukov's bounded queue):
+// producers claim a cell by advancing the shared tail with a compare and swap, fill it in and then
+// publish it by bumping the cell's sequence, so the consumer never sees a half written entry.
+namespace mpsc
+{
+
+#define MPSC_CACHE_LINE_SIZE 64
+#define MPSC_MIN_CAPACITY 2
+
+template <typename T>
+class MPSCQueue
+{
+public:
+	// 'capacity' is rounded up to a power of two
+	explicit MPSCQueue(uint32_t capacity)
+	{
+		mCapacity = MPSC_MIN_CAPACITY;
+		while (mCapacity < capacity)
+		{
+			mCapacity *= 2;
+		}
+		mMask = mCapacity - 1;
+		mCells = new Cell[mCapacity];
+		for (uint32_t i = 0; i < mCapacity; i++)
+		{
+			mCells[i].mSequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	~MPSCQueue(void)
+	{
+		delete[]mCells;
+	}
+
+	MPSCQueue(const MPSCQueue &) = delete;
+	MPSCQueue &operator=(const MPSCQueue &) = delete;
+
+	// Any thread. Returns false, leaving the queue untouched, if it is full.
+	bool push(const T &value)
+	{
+		uint64_t position = mTail.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			Cell &cell = mCells[position & mMask];
+			uint64_t sequence = cell.mSequence.load(std::memory_order_acquire);
+			int64_t difference = int64_t(sequence) - int64_t(position);
+			if (difference == 0)
+			{
+				// The cell is free; claim it unless another producer got there first
+				if (mTail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					cell.mValue = value;
+					cell.mSequence.store(position + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (difference < 0)
+			{
+				return false; // the consumer has not emptied this cell since the last lap
+			}
+			else
+			{
+				position = mTail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Consumer thread only. Returns false if nothing has been published yet.
+	bool pop(T &value)
+	{
+		Cell &cell = mCells[mHead & mMask];
+		uint64_t sequence = cell.mSequence.load(std::memory_order_acquire);
+		if (sequence != mHead + 1)
+		{
+			return false;
+		}
+		value = cell.mValue;
+		// Hand the cell back to the producers for the next lap
+		cell.mSequence.store(mHead + mCapacity, std::memory_order_release);
+		mHead++;
+		mHeadShared.store(mHead, std::memory_order_relaxed);
+		return true;
+	}
+
+	// Approximate number of entries; exact only when no producer is pushing
+	uint32_t size(void) const
+	{
+		uint64_t tail = mTail.load(std::memory_order_relaxed);
+		uint64_t head = mHeadShared.load(std::memory_order_relaxed);
+		return tail > head ? uint32_t(tail - head) : 0;
+	}
+
+	uint32_t getCapacity(void) const
+	{
+		return mCapacity;
+	}
+
+private:
+	struct Cell
+	{
+		std::atomic<uint64_t>	mSequence{ 0 };
+		T						mValue{};
+	};
+
+	Cell					*mCells{ nullptr };
+	uint32_t				mCapacity{ 0 };
+	uint32_t				mMask{ 0 };
+	// The producers' tail and the consumer's head sit on separate cache lines
+	uint8_t					mPad0[MPSC_CACHE_LINE_SIZE];
+	std::atomic<uint64_t>	mTail{ 0 };
+	uint8_t					mPad1[MPSC_CACHE_LINE_SIZE - sizeof(std::atomic<uint64_t>)];
+	uint64_t				mHead{ 0 };				// Next cell to pop
+	std::atomic<uint64_t>	mHeadShared{ 0 };		// Copy of mHead for 'size'
+};
+
+} // namespace mpsc
@@ -143,6 +143,11 @@ namespace memorymap
 			return mMapSize;
 		}
 
+		virtual int64_t getHandle(void) override final
+		{
+			return -1;
+		}
+
 		uint64_t getFileSize(HANDLE h)
 		{
 			DWORD highSize = 0;
@@ -166,21 +171,30 @@ namespace memorymap
 	public:
 		MemoryMapImpl(const char *mappingObject, uint64_t &size, bool createOk, bool readOnly)
 		{
-			mFileNumber = 0;
-			mData = nullptr;
-			mMapLength = 0;
-			mFileNumber = open(mappingObject, O_RDONLY);
+			int flags = readOnly ? O_RDONLY : O_RDWR;
+			if (createOk)
+			{
+				flags |= O_CREAT;
+			}
+			mFileNumber = open(mappingObject, flags, 0666);
 			if (mFileNumber != -1)
 			{
+				// Like CREATE_ALWAYS on Windows; the file starts out zero filled at the requested size
+				if (createOk && (ftruncate(mFileNumber, 0) != 0 || ftruncate(mFileNumber, off_t(size)) != 0))
+				{
+					close(mFileNumber);
+					mFileNumber = -1;
+					return;
+				}
 				mMapLength = lseek(mFileNumber, 0L, SEEK_END);
 				if (mMapLength)
 				{
-					mData = mmap(0, mMapLength, PROT_READ, MAP_SHARED, mFileNumber, 0);
+					mData = mmap(0, mMapLength, readOnly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, mFileNumber, 0);
 				}
-				if (mData == MAP_FAILED)
+				if (mData == MAP_FAILED || mData == nullptr)
 				{
 					close(mFileNumber);
-					mFileNumber = 0;
+					mFileNumber = -1;
 					mMapLength = 0;
 					mData = nullptr;
 				}
@@ -191,9 +205,43 @@ namespace memorymap
 			}
 		}
 
+		// Maps an anonymous region; takes ownership of 'fileNumber'
+		MemoryMapImpl(int32_t fileNumber, uint64_t size, uint32_t flags) : mFileNumber(fileNumber), mAnonymous(true)
+		{
+			int mapFlags = MAP_SHARED;
+#ifdef MAP_POPULATE
+			if (flags & MEMORYMAP_POPULATE)
+			{
+				mapFlags |= MAP_POPULATE;
+			}
+#endif
+			void *data = size ? mmap(nullptr, size_t(size), PROT_READ | PROT_WRITE, mapFlags, fileNumber, 0) : MAP_FAILED;
+			if (data == MAP_FAILED)
+			{
+				return;
+			}
+			mData = data;
+			mMapLength = size_t(size);
+#ifdef MADV_HUGEPAGE
+			if (flags & MEMORYMAP_HUGE_PAGES)
+			{
+				// Transparent huge pages, for when the region could not come from the huge page pool
+				madvise(mData, mMapLength, MADV_HUGEPAGE);
+			}
+#endif
+			if (flags & MEMORYMAP_LOCK)
+			{
+				mlock(mData, mMapLength);
+			}
+		}
+
 		virtual ~MemoryMapImpl(void)
 		{
-			if (mFileNumber)
+			if (mData)
+			{
+				munmap(mData, mMapLength);
+			}
+			if (mFileNumber != -1)
 			{
 				close(mFileNumber);
 			}
@@ -209,14 +257,20 @@ namespace memorymap
 			return mData;
 		}
 
+		virtual int64_t getHandle(void) override final
+		{
+			return mAnonymous ? mFileNumber : -1;
+		}
+
 		virtual void release(void) final
 		{
 			delete this;
 		}
 
-		int32_t     mFileNumber;
-		size_t      mMapLength;
-		void        *mData;
+		int32_t     mFileNumber{ -1 };
+		bool        mAnonymous{ false };
+		size_t      mMapLength{ 0 };
+		void        *mData{ nullptr };
 	};
 #endif
 
@@ -233,4 +287,98 @@ MemoryMap * MemoryMap::createMemoryMap(const char *fileName, uint64_t &size, boo
 	return static_cast<MemoryMap *>(m);
 }
 
+MemoryMap * MemoryMap::createSharedMemory(uint64_t size, uint32_t flags)
+{
+#ifdef _MSC_VER
+	(void)size;
+	(void)flags;
+	return nullptr;
+#else
+	int fd = -1;
+#if defined(__linux__)
+#ifdef MFD_HUGETLB
+	if (flags & MEMORYMAP_HUGE_PAGES)
+	{
+		// Needs pages reserved in the huge page pool; the mapping fails without them, so fall back to ordinary pages below
+		#define HUGE_PAGE_SIZE (1024*1024*2)
+		uint64_t hugeSize = (size + HUGE_PAGE_SIZE - 1) & ~uint64_t(HUGE_PAGE_SIZE - 1);
+		fd = memfd_create("memorymap", MFD_CLOEXEC | MFD_HUGETLB);
+		if (fd != -1)
+		{
+			if (ftruncate(fd, off_t(hugeSize)) == 0)
+			{
+				MemoryMap *ret = openSharedMemory(fd, hugeSize, flags);
+				if (ret)
+				{
+					return ret;
+				}
+			}
+			else
+			{
+				close(fd);
+			}
+			fd = -1;
+		}
+	}
+#endif
+	if (fd == -1)
+	{
+		fd = memfd_create("memorymap", MFD_CLOEXEC);
+		if (fd != -1 && ftruncate(fd, off_t(size)) != 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+#else
+	char name[64];
+	snprintf(name, sizeof(name), "/memorymap.%d.%p", int(getpid()), (void *)&fd);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd != -1)
+	{
+		shm_unlink(name);
+		if (ftruncate(fd, off_t(size)) != 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+#endif
+	if (fd == -1)
+	{
+		return nullptr;
+	}
+	uint64_t mappedSize = size;
+	return openSharedMemory(fd, mappedSize, flags);
+#endif
+}
+
+MemoryMap * MemoryMap::openSharedMemory(int64_t handle, uint64_t &size, uint32_t flags)
+{
+#ifdef _MSC_VER
+	(void)handle;
+	(void)size;
+	(void)flags;
+	return nullptr;
+#else
+	struct stat info;
+	if (handle < 0 || fstat(int(handle), &info) != 0)
+	{
+		if (handle >= 0)
+		{
+			close(int(handle));
+		}
+		return nullptr;
+	}
+	size = uint64_t(info.st_size);
+	MemoryMapImpl *m = new MemoryMapImpl(int32_t(handle), size, flags);
+	if (m->getBaseAddress() == nullptr)
+	{
+		m->release();
+		m = nullptr;
+	}
+	return static_cast<MemoryMap *>(m);
+#endif
+}
+
 }
@@ -2,14 +2,32 @@
 
 #include <stdint.h>
 
+// Options for anonymous shared memory regions
+#define MEMORYMAP_POPULATE 1		// Fault every page in when mapping (MAP_POPULATE) instead of on first touch
+#define MEMORYMAP_LOCK 2			// Keep the region resident (mlock); skipped if RLIMIT_MEMLOCK does not allow it
+#define MEMORYMAP_HUGE_PAGES 4		// Back the region with huge pages where the system has them to give
+
 namespace memorymap
 {
     class MemoryMap
     {
     public:
     	static MemoryMap * createMemoryMap(const char *fileName, uint64_t &size, bool createOk,bool readOnly);
+
+        // Creates an anonymous shared memory region with no name in the file system (a memfd on Linux,
+        // an shm_open object which is unlinked straight away elsewhere); 'flags' are MEMORYMAP_ flags.
+        // Other processes map it through the descriptor from 'getHandle', passed to them over a Unix
+        // domain socket. Returns null where this is not supported (Windows).
+        static MemoryMap * createSharedMemory(uint64_t size, uint32_t flags);
+
+        // Maps a region created by 'createSharedMemory' in another process, from the descriptor it passed
+        // us. Takes ownership of the descriptor, even on failure. Returns the size of the region in 'size'.
+        static MemoryMap * openSharedMemory(int64_t handle, uint64_t &size, uint32_t flags);
+
         virtual uint64_t getFileSize(void) = 0;
         virtual void *getBaseAddress(void) = 0;
+        // Descriptor of an anonymous region, to pass to another process; -1 for a mapped file
+        virtual int64_t getHandle(void) = 0;
         virtual void release(void) = 0;
     protected:
         virtual ~MemoryMap(void)
@@ -0,0 +1,513 @@
+#pragma once
+
+#include "SPSC.h"
+#include "wplatform.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+
+// Implements a single producer multiple consumer broadcast ring in shared memory.
+// One writer publishes each message once; any number of readers, in any number of processes, follow
+// the same stream with a cursor each (like a disruptor). Messages are records which never wrap,
+// as in spsc::SPSC's record mode, so a reader can look at each one in place.
+// What happens when the writer catches up with the slowest reader is set by the ring's Policy.
+namespace spmc
+{
+
+const uint32_t cBroadcastVersion = 2;
+
+#define SPMC_MAX_READERS 64					// Readers which may follow one ring at a time
+#define SPMC_RECORD_ALIGN 16				// Records start on this boundary; a record header's size, so any gap left at the end of the ring holds a filler
+#define SPMC_RECORD_PADDING 0x80000000		// Record flag reserved for the filler which skips to the start of the ring
+#define SPMC_READER_CHECK_INTERVAL 100		// Milliseconds between checks, while short of room, for readers whose process has gone
+
+// What the writer does when a message does not fit behind the slowest reader
+enum Policy
+{
+	POLICY_BLOCK,		// Wait for the reader; nothing is ever lost, but one stalled reader stalls the writer
+	POLICY_OVERWRITE,	// Never wait; a reader which falls a whole ring behind skips ahead to the oldest message left
+	POLICY_DROP,		// Never wait; the message is dropped for every reader and counted
+};
+
+class BroadcastRing
+{
+public:
+	// The writer's fields and the fields every reader writes sit on separate cache lines
+	struct SharedMemoryHeader
+	{
+		std::atomic<uint32_t>	mVersionNumber{ cBroadcastVersion };
+		std::atomic<uint32_t>	mBufferSize{ 0 };			// Size of the shared memory buffer (including headers)
+		std::atomic<uint32_t>	mPolicy{ POLICY_BLOCK };
+		uint8_t					mPad0[SPSC_CACHE_LINE_SIZE - 3 * sizeof(uint32_t)];
+		std::atomic<uint64_t>	mWritePosition{ 0 };		// End of the published messages, in bytes since the ring was created
+		std::atomic<uint64_t>	mTailPosition{ 0 };			// Start of the oldest message still in the ring
+		std::atomic<uint64_t>	mDropped{ 0 };				// Messages dropped under POLICY_DROP
+		std::atomic<uint32_t>	mPublished{ 0 };			// Bumped on every publish; readers sleep on it
+		std::atomic<uint32_t>	mReadersWaiting{ 0 };		// Readers asleep on mPublished
+		uint8_t					mPad1[SPSC_CACHE_LINE_SIZE - 3 * sizeof(uint64_t) - 2 * sizeof(uint32_t)];
+		std::atomic<uint32_t>	mConsumed{ 0 };				// Bumped by readers while the writer waits for room; the writer sleeps on it
+		std::atomic<uint32_t>	mWriterWaiting{ 0 };		// Non-zero while the writer sleeps on mConsumed
+		uint8_t					mPad2[SPSC_CACHE_LINE_SIZE - 2 * sizeof(uint32_t)];
+	};
+
+	// One reader's cursor; each sits on its own cache line
+	struct ReaderSlot
+	{
+		std::atomic<uint32_t>	mProcess;		// Process id of the reader; zero when free
+		uint32_t				mPad0;
+		std::atomic<uint64_t>	mCursor;		// Everything before this position has been read; cNoCursor while joining
+		uint8_t					mPad1[SPSC_CACHE_LINE_SIZE - 2 * sizeof(uint32_t) - sizeof(uint64_t)];
+	};
+
+	struct RecordHeader
+	{
+		uint32_t	mLength;	// Bytes of payload
+		uint32_t	mFlags;		// Free for the caller, except SPMC_RECORD_PADDING
+		uint64_t	mPosition;	// Where the record starts in the stream; tells a reader whether it has been lapped
+	};
+
+	static_assert(sizeof(RecordHeader) == SPMC_RECORD_ALIGN, "The filler at the end of the ring needs room for a whole record header");
+	static_assert(sizeof(SharedMemoryHeader) == SPSC_CACHE_LINE_SIZE * 3, "Each group of header fields should fill one cache line");
+	static_assert(sizeof(ReaderSlot) == SPSC_CACHE_LINE_SIZE, "ReaderSlot should fill one cache line");
+
+	// Bytes of shared memory a ring with this much room for messages needs
+	static uint32_t getRequiredSize(uint32_t capacity)
+	{
+		return uint32_t(sizeof(SharedMemoryHeader) + sizeof(ReaderSlot) * SPMC_MAX_READERS) + capacity;
+	}
+
+	~BroadcastRing(void)
+	{
+		detach();
+	}
+
+	// The writer initializes the ring ('isServer') and chooses its policy; readers check the header and
+	// take a free reader slot, starting with the next message published. Returns false if the memory is
+	// too small, does not hold a ring, or every reader slot is taken.
+	bool init(void *sharedMemory, uint32_t maxLen, bool isWriter, bool isServer, Policy policy = POLICY_BLOCK)
+	{
+		detach();
+		mIsWriter = isWriter;
+		if (maxLen <= getRequiredSize(SPSC_CACHE_LINE_SIZE))
+		{
+			return false;
+		}
+		SharedMemoryHeader *header = (SharedMemoryHeader *)sharedMemory;
+		mSlots = (ReaderSlot *)(header + 1);
+		mBaseMemory = (uint8_t *)(mSlots + SPMC_MAX_READERS);
+		mCapacity = (maxLen - getRequiredSize(0)) & ~uint32_t(SPMC_RECORD_ALIGN - 1);
+		if (isServer)
+		{
+			for (uint32_t i = 0; i < SPMC_MAX_READERS; i++)
+			{
+				mSlots[i].mCursor.store(cNoCursor, std::memory_order_relaxed);
+				mSlots[i].mProcess.store(0, std::memory_order_relaxed);
+			}
+			header->mBufferSize.store(maxLen, std::memory_order_relaxed);
+			header->mPolicy.store(uint32_t(policy), std::memory_order_relaxed);
+			header->mWritePosition.store(0, std::memory_order_relaxed);
+			header->mTailPosition.store(0, std::memory_order_relaxed);
+			header->mDropped.store(0, std::memory_order_relaxed);
+			header->mPublished.store(0, std::memory_order_relaxed);
+			header->mReadersWaiting.store(0, std::memory_order_relaxed);
+			header->mConsumed.store(0, std::memory_order_relaxed);
+			header->mWriterWaiting.store(0, std::memory_order_relaxed);
+			header->mVersionNumber.store(cBroadcastVersion, std::memory_order_release);
+		}
+		else if (header->mVersionNumber.load(std::memory_order_acquire) != cBroadcastVersion || header->mBufferSize != maxLen)
+		{
+			return false;
+		}
+		mHeader = header;
+		mPolicy = Policy(mHeader->mPolicy.load(std::memory_order_relaxed));
+		mPosition = mHeader->mWritePosition.load(std::memory_order_acquire);
+		mTail = mHeader->mTailPosition.load(std::memory_order_relaxed);
+		mCachedSlowest = mPosition;
+		if (!isWriter && !attach())
+		{
+			mHeader = nullptr;
+			return false;
+		}
+		return true;
+	}
+
+	// Reader only. Gives up the reader slot; the writer stops waiting for this reader
+	void detach(void)
+	{
+		if (mSlot)
+		{
+			mSlot->mCursor.store(cNoCursor, std::memory_order_relaxed);
+			mSlot->mProcess.store(0, std::memory_order_release);
+			mSlot = nullptr;
+			wakeWriter();
+		}
+	}
+
+	// The largest message the ring accepts
+	uint32_t getMaxMessageSize(void) const
+	{
+		return mCapacity / 2 - uint32_t(sizeof(RecordHeader));
+	}
+
+	Policy getPolicy(void) const
+	{
+		return mPolicy;
+	}
+
+	// Messages dropped so far under POLICY_DROP
+	uint64_t getDroppedCount(void) const
+	{
+		return mHeader ? mHeader->mDropped.load(std::memory_order_relaxed) : 0;
+	}
+
+	// Reader only. Times this reader fell a whole ring behind under POLICY_OVERWRITE and had to skip ahead
+	uint64_t getOverrunCount(void) const
+	{
+		return mOverruns;
+	}
+
+	// Writer only. Copies one message into the ring and publishes it. Returns false if it was dropped
+	// (POLICY_DROP) or is larger than 'getMaxMessageSize'.
+	bool publish(const void *data, uint32_t len, uint32_t flags = 0)
+	{
+		uint8_t *dest = reserve(len);
+		if (!dest)
+		{
+			return false;
+		}
+		memcpy(dest, data, len);
+		commit(len, flags);
+		return true;
+	}
+
+	// Writer only. Returns where a message of 'len' bytes may be written in place, making room for it as
+	// the policy says (which may mean waiting under POLICY_BLOCK). Returns null if it has to be dropped.
+	// Nothing is visible to readers until 'commit'.
+	uint8_t *reserve(uint32_t len)
+	{
+		if (!mIsWriter || !mHeader || len > getMaxMessageSize())
+		{
+			return nullptr;
+		}
+		uint32_t need = recordSize(len);
+		uint32_t offset = uint32_t(mPosition % mCapacity);
+		// A record never wraps; if it does not fit before the end of the ring, a filler takes the rest
+		mPadding = mCapacity - offset < need ? mCapacity - offset : 0;
+		uint64_t end = mPosition + mPadding + need;
+		if (!makeRoom(end))
+		{
+			return nullptr;
+		}
+		return &mBaseMemory[(mPadding ? 0 : offset) + sizeof(RecordHeader)];
+	}
+
+	// Writer only. Publishes the reserved message with 'len' bytes of payload (no more than was reserved)
+	void commit(uint32_t len, uint32_t flags)
+	{
+		if (mPadding)
+		{
+			writeHeader(mPosition, mPadding - uint32_t(sizeof(RecordHeader)), SPMC_RECORD_PADDING);
+			mPosition += mPadding;
+			mPadding = 0;
+		}
+		writeHeader(mPosition, len, flags);
+		mPosition += recordSize(len);
+		mHeader->mWritePosition.store(mPosition, std::memory_order_release);
+		mHeader->mPublished.store(mHeader->mPublished.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (mHeader->mReadersWaiting.load(std::memory_order_relaxed))
+		{
+			spsc::futexWake(mHeader->mPublished);
+		}
+	}
+
+	// Reader only. Returns the next message in place, or null if there is none yet; it stays put until
+	// 'release'. Under POLICY_OVERWRITE the writer may reuse the memory while it is being looked at:
+	// copy out what is needed and only trust the copy if 'release' returns true.
+	const uint8_t *peek(uint32_t &len, uint32_t &flags)
+	{
+		if (!mSlot)
+		{
+			return nullptr;
+		}
+		for (;;)
+		{
+			// After skipping ahead the cursor may be past a stale view of the write position
+			if (mCursor >= mCachedWritePosition)
+			{
+				mCachedWritePosition = mHeader->mWritePosition.load(std::memory_order_acquire);
+				if (mCursor >= mCachedWritePosition)
+				{
+					return nullptr;
+				}
+			}
+			const RecordHeader *header = (const RecordHeader *)&mBaseMemory[mCursor % mCapacity];
+			uint64_t position = header->mPosition;
+			len = header->mLength;
+			flags = header->mFlags;
+			if (position != mCursor || overwritten(mCursor))
+			{
+				skipAhead();
+				continue;
+			}
+			if (flags & SPMC_RECORD_PADDING)
+			{
+				mCursor += recordSize(len);
+				continue;
+			}
+			mPeekLength = len;
+			return (const uint8_t *)(header + 1);
+		}
+	}
+
+	// Reader only. Moves past the message returned by 'peek'. Returns false if the writer overwrote it
+	// in the meantime (POLICY_OVERWRITE only), in which case the reader has skipped ahead.
+	bool release(void)
+	{
+		if (!mSlot)
+		{
+			return false;
+		}
+		bool ret = true;
+		if (overwritten(mCursor))
+		{
+			skipAhead();
+			ret = false;
+		}
+		else
+		{
+			mCursor += recordSize(mPeekLength);
+		}
+		mSlot->mCursor.store(mCursor, std::memory_order_release);
+		wakeWriter();
+		return ret;
+	}
+
+	// Reader only. Copies the next message into 'dest', truncated to 'maxLen' bytes; 'len' receives its
+	// full size. Returns false if there is none. Messages overwritten while being copied are skipped.
+	bool read(void *dest, uint32_t maxLen, uint32_t &len, uint32_t &flags)
+	{
+		for (;;)
+		{
+			const uint8_t *data = peek(len, flags);
+			if (!data)
+			{
+				return false;
+			}
+			memcpy(dest, data, len < maxLen ? len : maxLen);
+			if (release())
+			{
+				return true;
+			}
+		}
+	}
+
+	// Reader only. Waits until a message is published, for at most 'timeOut' milliseconds
+	// (zero only checks, negative waits until one arrives). Returns true if there is one.
+	bool waitForData(int32_t timeOut)
+	{
+		if (!mSlot)
+		{
+			return false;
+		}
+		if (hasData() || timeOut == 0)
+		{
+			return hasData();
+		}
+		uint32_t observed = mHeader->mPublished.load(std::memory_order_acquire);
+		mHeader->mReadersWaiting.fetch_add(1);
+		if (!hasData())
+		{
+			spsc::futexWait(mHeader->mPublished, observed, timeOut);
+		}
+		mHeader->mReadersWaiting.fetch_sub(1);
+		return hasData();
+	}
+
+private:
+	static const uint64_t cNoCursor = ~uint64_t(0);
+
+	static uint32_t recordSize(uint32_t len)
+	{
+		return (uint32_t(sizeof(RecordHeader)) + len + SPMC_RECORD_ALIGN - 1) & ~uint32_t(SPMC_RECORD_ALIGN - 1);
+	}
+
+	bool attach(void)
+	{
+		uint32_t me = wplatform::getProcessId();
+		for (uint32_t i = 0; i < SPMC_MAX_READERS; i++)
+		{
+			uint32_t expected = 0;
+			if (mSlots[i].mProcess.compare_exchange_strong(expected, me))
+			{
+				mSlot = &mSlots[i];
+				mCursor = mHeader->mWritePosition.load(std::memory_order_acquire);
+				mCachedWritePosition = mCursor;
+				mOverruns = 0;
+				mSlot->mCursor.store(mCursor, std::memory_order_seq_cst);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void writeHeader(uint64_t position, uint32_t len, uint32_t flags)
+	{
+		RecordHeader *header = (RecordHeader *)&mBaseMemory[position % mCapacity];
+		header->mLength = len;
+		header->mFlags = flags;
+		header->mPosition = position;
+	}
+
+	bool hasData(void) const
+	{
+		return mHeader->mWritePosition.load(std::memory_order_acquire) != mCursor;
+	}
+
+	// True if the writer has moved the tail past 'position', so the record there may be gone.
+	// The fence pairs with the one in 'moveTail': anything read before it which the writer had already
+	// started overwriting shows up here as a tail past 'position'.
+	bool overwritten(uint64_t position) const
+	{
+		if (mPolicy != POLICY_OVERWRITE)
+		{
+			return false;
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return mHeader->mTailPosition.load(std::memory_order_relaxed) > position;
+	}
+
+	// The writer lapped us; carry on from the oldest message still in the ring. The cursor only ever
+	// moves forward, so nothing is delivered twice.
+	void skipAhead(void)
+	{
+		uint64_t tail = mHeader->mTailPosition.load(std::memory_order_acquire);
+		if (tail > mCursor)
+		{
+			mCursor = tail;
+			mOverruns++;
+		}
+	}
+
+	// Tells a writer waiting for room under POLICY_BLOCK that a reader moved on
+	void wakeWriter(void)
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (mHeader->mWriterWaiting.load(std::memory_order_relaxed))
+		{
+			mHeader->mConsumed.fetch_add(1);
+			spsc::futexWake(mHeader->mConsumed);
+		}
+	}
+
+	// Makes sure the stream up to 'end' fits in the ring, as the policy says
+	bool makeRoom(uint64_t end)
+	{
+		if (mPolicy != POLICY_OVERWRITE && end - mCachedSlowest > mCapacity)
+		{
+			mCachedSlowest = findSlowest();
+			while (end - mCachedSlowest > mCapacity)
+			{
+				pruneReaders();
+				if (mPolicy == POLICY_DROP)
+				{
+					mCachedSlowest = findSlowest();
+					if (end - mCachedSlowest > mCapacity)
+					{
+						mHeader->mDropped.fetch_add(1, std::memory_order_relaxed);
+						return false;
+					}
+					break;
+				}
+				// Sleep until a reader moves on; the fence pairs with the one in 'wakeWriter'
+				uint32_t observed = mHeader->mConsumed.load(std::memory_order_acquire);
+				mHeader->mWriterWaiting.store(1, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				mCachedSlowest = findSlowest();
+				if (end - mCachedSlowest > mCapacity)
+				{
+					spsc::futexWait(mHeader->mConsumed, observed, SPMC_READER_CHECK_INTERVAL);
+					mCachedSlowest = findSlowest();
+				}
+				mHeader->mWriterWaiting.store(0, std::memory_order_relaxed);
+			}
+		}
+		moveTail(end);
+		return true;
+	}
+
+	// Oldest position any reader still needs
+	uint64_t findSlowest(void) const
+	{
+		uint64_t ret = mPosition;
+		for (uint32_t i = 0; i < SPMC_MAX_READERS; i++)
+		{
+			uint64_t cursor = mSlots[i].mCursor.load(std::memory_order_acquire);
+			if (cursor < ret)
+			{
+				ret = cursor;
+			}
+		}
+		return ret;
+	}
+
+	// Every so often, while short of room, frees the slots of readers whose process has gone
+	void pruneReaders(void)
+	{
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (now < mNextReaderCheck)
+		{
+			return;
+		}
+		mNextReaderCheck = now + std::chrono::milliseconds(SPMC_READER_CHECK_INTERVAL);
+		for (uint32_t i = 0; i < SPMC_MAX_READERS; i++)
+		{
+			uint32_t process = mSlots[i].mProcess.load(std::memory_order_acquire);
+			if (process && !wplatform::isProcessAlive(process))
+			{
+				mSlots[i].mCursor.store(cNoCursor, std::memory_order_relaxed);
+				mSlots[i].mProcess.store(0, std::memory_order_release);
+			}
+		}
+	}
+
+	// Retires the oldest records until the stream up to 'end' fits. Readers must see the new tail before
+	// any of the overwritten bytes, hence the fence between the two.
+	void moveTail(uint64_t end)
+	{
+		if (end - mTail <= mCapacity)
+		{
+			return;
+		}
+		while (end - mTail > mCapacity)
+		{
+			const RecordHeader *header = (const RecordHeader *)&mBaseMemory[mTail % mCapacity];
+			mTail += recordSize(header->mLength);
+		}
+		mHeader->mTailPosition.store(mTail, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	SharedMemoryHeader	*mHeader{ nullptr };
+	ReaderSlot			*mSlots{ nullptr };
+	uint8_t				*mBaseMemory{ nullptr };	// Start of the records
+	uint32_t			mCapacity{ 0 };
+	bool				mIsWriter{ false };
+	Policy				mPolicy{ POLICY_BLOCK };
+	// Writer
+	uint64_t			mPosition{ 0 };				// Where the next record goes
+	uint64_t			mTail{ 0 };					// Oldest record still in the ring
+	uint64_t			mCachedSlowest{ 0 };		// Last view of the slowest reader's cursor
+	uint32_t			mPadding{ 0 };				// Filler the reserved record needs before it
+	std::chrono::steady_clock::time_point	mNextReaderCheck;
+	// Reader
+	ReaderSlot			*mSlot{ nullptr };
+	uint64_t			mCursor{ 0 };				// Next record to read
+	uint64_t			mCachedWritePosition{ 0 };	// Last view of the write position
+	uint32_t			mPeekLength{ 0 };			// Payload size of the record returned by 'peek'
+	uint64_t			mOverruns{ 0 };
+};
+
+}
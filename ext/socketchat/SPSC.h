@@ -5,6 +5,19 @@
 #include <string.h>
 #include <stdlib.h>
 #include <atomic>
+#include <chrono>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 // Implements a single producer single consumer data transfer class
 // Lock-free thread safe communications between two threads and/or processes using shared memory
@@ -13,22 +26,76 @@
 namespace spsc
 {
 
-const uint32_t cSharedMemoryVersion=100;
+const uint32_t cSharedMemoryVersion=102;
+
+#define SPSC_CACHE_LINE_SIZE 64
+#define SPSC_RECORD_ALIGN 8				// Records start on this boundary
+#define SPSC_RECORD_PADDING 0x80000000	// Record flag reserved for the filler which skips to the start of the ring
+
+#define SPSC_MIN_SPIN 64			// Fewest polls a waiter makes before it sleeps (on machines with more than one CPU)
+#define SPSC_MAX_SPIN (1024*16)		// Most polls a waiter makes before it sleeps
+
+// Tells the CPU we are in a spin loop
+inline void cpuRelax(void)
+{
+#if defined(_MSC_VER)
+	_mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+// Sleeps while 'word' still holds 'expected', for at most 'timeOut' milliseconds (negative waits until woken).
+// The words live in memory shared between processes, so the process-private futex operations cannot be used.
+// Platforms without a cross process wait primitive just sleep for a millisecond and let the caller check again.
+inline void futexWait(std::atomic<uint32_t> &word, uint32_t expected, int32_t timeOut)
+{
+#ifdef __linux__
+	timespec ts;
+	ts.tv_sec = timeOut / 1000;
+	ts.tv_nsec = long(timeOut % 1000) * 1000000;
+	syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, expected, timeOut >= 0 ? &ts : nullptr, nullptr, 0);
+#else
+	(void)word;
+	(void)expected;
+	(void)timeOut;
+	std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+}
+
+// Wakes everything sleeping in 'futexWait' on this word
+inline void futexWake(std::atomic<uint32_t> &word)
+{
+#ifdef __linux__
+	syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+#else
+	(void)word;
+#endif
+}
 
 class SPSC
 {
 public:
+	// The producer and the consumer each write to their own cache line, so neither invalidates the
+	// other's on every operation. Each line also holds the other side's sleep flag, since that is
+	// checked every time the index on the same line is published.
 	struct SharedMemoryHeader
 	{
 		std::atomic<uint32_t>	mVersionNumber{cSharedMemoryVersion};		// Version number
 		std::atomic<uint32_t>	mBufferSize{0};								// Size of the shared memory buffer (including header)
-		std::atomic<uint32_t>	mReadIndex{0};								// Current read index
-		std::atomic<uint32_t>	mWriteIndex{0};								// Current write index
 		std::atomic<uint32_t>	mSequenceNumber{ 0 };						// a sequence number that can be used for general purposes
-		std::atomic<uint32_t>	mUnused1{ 0 };
-		std::atomic<uint32_t>	mUnused2{ 0 };
-		std::atomic<uint32_t>	mUnused3{ 0 };
+		uint8_t					mPad0[SPSC_CACHE_LINE_SIZE - 3 * sizeof(uint32_t)];
+		std::atomic<uint32_t>	mWriteIndex{0};								// Current write index; written by the producer
+		std::atomic<uint32_t>	mReaderWaiting{ 0 };						// Non-zero while the reader sleeps on mWriteIndex
+		uint8_t					mPad1[SPSC_CACHE_LINE_SIZE - 2 * sizeof(uint32_t)];
+		std::atomic<uint32_t>	mReadIndex{0};								// Current read index; written by the consumer
+		std::atomic<uint32_t>	mWriterWaiting{ 0 };						// Non-zero while the writer sleeps on mReadIndex
+		uint8_t					mPad2[SPSC_CACHE_LINE_SIZE - 2 * sizeof(uint32_t)];
 	};
+	static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "The indices are used directly as futex words");
+	static_assert(sizeof(SharedMemoryHeader) == SPSC_CACHE_LINE_SIZE * 3, "Each group of header fields should fill one cache line");
 
 	bool init(void *sharedMemory,uint32_t maxLen,bool isWriter,bool isServer)
 	{
@@ -39,7 +106,7 @@ public:
 			mSharedMemory = (uint8_t *)sharedMemory;
 			mBaseMemory = mSharedMemory + sizeof(SharedMemoryHeader);
 			mHeader = (SharedMemoryHeader *)mSharedMemory;
-			mCapacity = maxLen - sizeof(SharedMemoryHeader);
+			mCapacity = (maxLen - uint32_t(sizeof(SharedMemoryHeader))) & ~uint32_t(SPSC_RECORD_ALIGN - 1);
 
 			if (isServer)
 			{
@@ -48,6 +115,8 @@ public:
 				mHeader->mWriteIndex.store(0, std::memory_order_relaxed);
 				mHeader->mReadIndex.store(0, std::memory_order_relaxed);
 				mHeader->mSequenceNumber.store(0, std::memory_order_relaxed);
+				mHeader->mReaderWaiting.store(0, std::memory_order_relaxed);
+				mHeader->mWriterWaiting.store(0, std::memory_order_relaxed);
 			}
 			else
 			{
@@ -59,6 +128,11 @@ public:
 					ret = false;
 				}
 			}
+			if (mHeader)
+			{
+				mCachedReadIndex = mHeader->mReadIndex.load(std::memory_order_acquire);
+				mCachedWriteIndex = mHeader->mWriteIndex.load(std::memory_order_acquire);
+			}
 		}
 		else
 		{
@@ -67,88 +141,252 @@ public:
 		return ret;
 	}
 
+	// Reader only. Copies up to 'maxLen' bytes out of the ring; returns the number of bytes read
 	uint32_t read(void *dest, uint32_t maxLen)
 	{
 		if (mIsWriter) return 0; // writers cannot read!
-		uint32_t len = size();
-		if (len > maxLen)
+		uint32_t len = maxLen;
+		const uint8_t *data = peek(len);
+		if (!data)
 		{
-			len = maxLen;
+			return 0;
 		}
-		if (len == 0)
+		memcpy(dest, data, len);
+		uint32_t remainder = maxLen - len;
+		if (remainder && mHeader->mReadIndex.load(std::memory_order_relaxed) + len == mCapacity)
 		{
-			return 0;
+			// The data wraps around the end of the ring; pick up the rest from the start
+			const uint8_t *more = peekFrom(0, remainder);
+			if (more)
+			{
+				memcpy((uint8_t *)dest + len, more, remainder);
+				len += remainder;
+			}
 		}
-		uint32_t readIndex = mHeader->mReadIndex.load(std::memory_order_acquire);
-		uint32_t availTop = mCapacity - readIndex;
-		if (availTop >= len)
+		release(len);
+		return len; // return number of bytes read
+	}
+
+	// Writer only. Copies as much of 'data' into the ring as fits; returns the number of bytes written
+	uint32_t write(const void *data, uint32_t dataLen)
+	{
+		if (!mIsWriter) return 0; // can't write if we are not a writer!
+		uint32_t len = dataLen;
+		uint8_t *dest = reserve(len);
+		if (!dest)
 		{
-			memcpy(dest, &mBaseMemory[readIndex], len);
-			mHeader->mReadIndex.store(readIndex + len, std::memory_order_relaxed);
+			return 0;
 		}
-		else
+		memcpy(dest, data, len);
+		uint32_t remainder = dataLen - len;
+		if (remainder && mHeader->mWriteIndex.load(std::memory_order_relaxed) + len == mCapacity)
 		{
-			uint32_t remainder = len - availTop;
-			uint8_t *cdest = (uint8_t *)dest;
-			if (availTop)
+			// Out of room at the end of the ring; the rest goes at the start
+			uint8_t *more = reserveFrom(0, remainder);
+			if (more)
 			{
-				memcpy(cdest, &mBaseMemory[readIndex], availTop);
-				cdest += availTop;
+				memcpy(more, (const uint8_t *)data + len, remainder);
+				len += remainder;
 			}
-			if (remainder)
-			{
-				memcpy(cdest, mBaseMemory, remainder);
-			}
-			mHeader->mReadIndex.store(remainder, std::memory_order_relaxed);
 		}
-		return len; // return number of bytes read
+		commit(len);
+		return len;
 	}
 
+	// Writer only. Returns a pointer straight into the ring where up to 'len' bytes may be written in place,
+	// or null if the ring is full. On return 'len' holds how many contiguous bytes are available, which may be
+	// fewer than asked for when the free space wraps around the end of the ring; reserve again after the commit.
+	// Nothing is visible to the reader until 'commit'.
+	uint8_t *reserve(uint32_t &len)
+	{
+		if (!mIsWriter || !mHeader)
+		{
+			len = 0;
+			return nullptr;
+		}
+		return reserveFrom(mHeader->mWriteIndex.load(std::memory_order_relaxed), len);
+	}
 
-	// Returns number of bytes written
-	uint32_t write(const void *data, uint32_t dataLen)
+	// Writer only. Publishes the first 'len' bytes of the last reservation (wrapping included) to the reader
+	void commit(uint32_t len)
 	{
-		if (!mIsWriter) return 0; // can't write if we are not a writer!
-		// Find out how much room is available left to write to
-		uint32_t avail = capacity();
-		if (avail == 0 )
+		if (!len) return;
+		uint32_t writeIndex = mHeader->mWriteIndex.load(std::memory_order_relaxed) + len;
+		if (writeIndex >= mCapacity)
 		{
-			return 0; // if the buffer is completely full return
+			writeIndex -= mCapacity;
 		}
-		avail--; // don't write the last byte!!
+		mHeader->mWriteIndex.store(writeIndex, std::memory_order_release);
+		wakePeer(mHeader->mWriteIndex, mHeader->mReaderWaiting);
+	}
 
-		if (avail < dataLen)	// if there is less room available than bytes we want to send
+	// Reader only. Returns a pointer straight into the ring at the oldest unread byte, or null if it is empty.
+	// On entry 'len' is the most the caller wants; on return it holds how many contiguous bytes may be read,
+	// which may be fewer than are in the ring when the data wraps around the end.
+	// The bytes stay valid until they are handed back with 'release'.
+	const uint8_t *peek(uint32_t &len)
+	{
+		if (mIsWriter || !mHeader)
 		{
-			dataLen = avail;	// We only copy as much data as we have room available
+			len = 0;
+			return nullptr;
 		}
-		// Find out how much is available at the top of the write buffer
-		// The total capacity minus the current write index
-		uint32_t writeIndex = mHeader->mWriteIndex.load(std::memory_order_acquire);
-		uint32_t availTop = mCapacity - writeIndex;
-		if (dataLen <= availTop)	// If there is enough room; we can just do a single contiguous copy
+		return peekFrom(mHeader->mReadIndex.load(std::memory_order_relaxed), len);
+	}
+
+	// Reader only. Hands 'len' bytes back to the writer
+	void release(uint32_t len)
+	{
+		if (!len) return;
+		uint32_t readIndex = mHeader->mReadIndex.load(std::memory_order_relaxed) + len;
+		if (readIndex >= mCapacity)
 		{
-			memcpy(&mBaseMemory[writeIndex], data, dataLen);	// Copy the data
-			mHeader->mWriteIndex.store(writeIndex + dataLen, std::memory_order_relaxed); // advance the write pointer
+			readIndex -= mCapacity;
 		}
-		else
+		mHeader->mReadIndex.store(readIndex, std::memory_order_release);
+		wakePeer(mHeader->mReadIndex, mHeader->mWriterWaiting);
+	}
+
+	// Record mode. Instead of a byte stream the ring carries whole records, each with a small header and
+	// padded to SPSC_RECORD_ALIGN. A record never wraps: if it does not fit before the end of the ring, a
+	// filler record is left there and it starts over at the beginning, so the reader always gets it in one
+	// piece, in place. A ring must be used either for records or for bytes ('read'/'write'), never both.
+	struct RecordHeader
+	{
+		uint32_t	mLength;	// Bytes of payload
+		uint32_t	mFlags;		// Free for the caller, except SPSC_RECORD_PADDING
+	};
+
+	// The largest record payload which is guaranteed to fit once the reader catches up
+	uint32_t getMaxRecordSize(void) const
+	{
+		return mCapacity / 2 - SPSC_RECORD_ALIGN - uint32_t(sizeof(RecordHeader));
+	}
+
+	// Writer only. Reserves a record and returns where its payload goes, or null if there is no room at all.
+	// On entry 'len' is the payload size wanted; on return it is how much fits, which may be less.
+	// The record is not visible to the reader until 'commitRecord'; a reservation may simply be abandoned.
+	uint8_t *reserveRecord(uint32_t &len)
+	{
+		if (!mIsWriter || !mHeader)
+		{
+			len = 0;
+			return nullptr;
+		}
+		uint32_t writeIndex = mHeader->mWriteIndex.load(std::memory_order_relaxed);
+		uint32_t need = recordSize(len);
+		uint32_t top = mCapacity - writeIndex;
+		uint32_t room = 0;
+		bool wrap = false;
+		for (uint32_t pass = 0; pass < 2; pass++)
 		{
-			// Compute how many bytes will be left to copy after we copy the top portion
-			uint32_t remainder = dataLen - availTop;
-			const uint8_t *scan = (const uint8_t *)data;
-			if (availTop)
+			// Only look at the reader's index again if our last view of it leaves too little room
+			if (pass)
+			{
+				mCachedReadIndex = mHeader->mReadIndex.load(std::memory_order_acquire);
+			}
+			uint32_t avail = mCapacity - SPSC_RECORD_ALIGN - calcSize(mCachedReadIndex, writeIndex);
+			// Room up to the end of the ring, or, after leaving a filler there, from the start
+			uint32_t here = avail < top ? avail : top;
+			uint32_t wrapped = avail > top ? avail - top : 0;
+			wrap = here < need && wrapped > here;
+			room = wrap ? wrapped : here;
+			if (room >= need)
 			{
-				// Copy up to the top of the buffer
-				memcpy(&mBaseMemory[writeIndex], scan, availTop);
-				scan += availTop;
+				break;
 			}
-			if (remainder)
+		}
+		if (room < need && room <= sizeof(RecordHeader))
+		{
+			len = 0;
+			return nullptr;
+		}
+		if (len > room - sizeof(RecordHeader))
+		{
+			len = room - uint32_t(sizeof(RecordHeader));
+		}
+		mRecordIndex = wrap ? 0 : writeIndex;
+		mRecordPadding = wrap ? top : 0;
+		return &mBaseMemory[mRecordIndex + sizeof(RecordHeader)];
+	}
+
+	// Writer only. Publishes the reserved record with 'len' bytes of payload (no more than was reserved)
+	void commitRecord(uint32_t len, uint32_t flags)
+	{
+		if (mRecordPadding)
+		{
+			RecordHeader *filler = (RecordHeader *)&mBaseMemory[mCapacity - mRecordPadding];
+			filler->mLength = mRecordPadding - uint32_t(sizeof(RecordHeader));
+			filler->mFlags = SPSC_RECORD_PADDING;
+		}
+		RecordHeader *header = (RecordHeader *)&mBaseMemory[mRecordIndex];
+		header->mLength = len;
+		header->mFlags = flags;
+		uint32_t writeIndex = mRecordIndex + recordSize(len);
+		if (writeIndex == mCapacity)
+		{
+			writeIndex = 0;
+		}
+		mRecordPadding = 0;
+		mHeader->mWriteIndex.store(writeIndex, std::memory_order_release);
+		wakePeer(mHeader->mWriteIndex, mHeader->mReaderWaiting);
+	}
+
+	// Writer only. Copies one whole record into the ring; returns false if it does not fit right now
+	bool writeRecord(const void *data, uint32_t len, uint32_t flags)
+	{
+		uint32_t room = len;
+		uint8_t *dest = reserveRecord(room);
+		if (!dest || room < len)
+		{
+			return false;
+		}
+		memcpy(dest, data, len);
+		commitRecord(len, flags);
+		return true;
+	}
+
+	// Reader only. Returns the payload of the oldest record in place, or null if there is none.
+	// It stays valid until 'releaseRecord'; peeking again without releasing returns the same record.
+	const uint8_t *peekRecord(uint32_t &len, uint32_t &flags)
+	{
+		if (mIsWriter || !mHeader)
+		{
+			return nullptr;
+		}
+		uint32_t readIndex = mHeader->mReadIndex.load(std::memory_order_relaxed);
+		if (readIndex == mCachedWriteIndex)
+		{
+			mCachedWriteIndex = mHeader->mWriteIndex.load(std::memory_order_acquire);
+			if (readIndex == mCachedWriteIndex)
 			{
-				memcpy(mBaseMemory, scan, remainder);
+				return nullptr;
 			}
-			// Now that the data has been written, write the new write pointer
-			mHeader->mWriteIndex.store(remainder,std::memory_order_relaxed);
 		}
-		return dataLen;
+		const RecordHeader *header = (const RecordHeader *)&mBaseMemory[readIndex];
+		if (header->mFlags & SPSC_RECORD_PADDING)
+		{
+			// The filler was published together with the record at the start of the ring
+			readIndex = 0;
+			header = (const RecordHeader *)mBaseMemory;
+		}
+		mRecordIndex = readIndex;
+		len = header->mLength;
+		flags = header->mFlags;
+		return &mBaseMemory[readIndex + sizeof(RecordHeader)];
+	}
+
+	// Reader only. Hands the record returned by 'peekRecord' back to the writer
+	void releaseRecord(void)
+	{
+		const RecordHeader *header = (const RecordHeader *)&mBaseMemory[mRecordIndex];
+		uint32_t readIndex = mRecordIndex + recordSize(header->mLength);
+		if (readIndex == mCapacity)
+		{
+			readIndex = 0;
+		}
+		mHeader->mReadIndex.store(readIndex, std::memory_order_release);
+		wakePeer(mHeader->mReadIndex, mHeader->mWriterWaiting);
 	}
 
 	// Size of write buffer
@@ -162,7 +400,7 @@ public:
 	inline uint32_t size(void) const
 	{
 		uint32_t writeIndex = mHeader->mWriteIndex.load(std::memory_order_acquire);
-		uint32_t readIndex = mHeader->mReadIndex.load(std::memory_order_relaxed);
+		uint32_t readIndex = mHeader->mReadIndex.load(std::memory_order_acquire);
 		return calcSize(readIndex, writeIndex);
 	}
 
@@ -197,12 +435,225 @@ public:
 		return ret;
 	}
 
+	// Reader only. Waits until there is something to read, for at most 'timeOut' milliseconds
+	// (zero only checks, negative waits until data arrives). Returns true if there is data; may
+	// return false early if 'wakeAll' was called.
+	bool waitForData(int32_t timeOut)
+	{
+		if (mIsWriter || !mHeader) return false;
+		return wait(mHeader->mWriteIndex, mHeader->mReaderWaiting, timeOut, [this]() { return size() != 0; });
+	}
+
+	// Writer only. Waits until there is room to write, with the same time out rules as 'waitForData'.
+	bool waitForSpace(int32_t timeOut)
+	{
+		if (!mIsWriter || !mHeader) return false;
+		return wait(mHeader->mReadIndex, mHeader->mWriterWaiting, timeOut, [this]() { return capacity() != 0; });
+	}
+
+	// Wakes anything sleeping on this ring from either side, so it can notice it is being shut down
+	void wakeAll(void)
+	{
+		if (mHeader)
+		{
+			futexWake(mHeader->mWriteIndex);
+			futexWake(mHeader->mReadIndex);
+		}
+	}
+
 private:
+	// Bytes a record with this much payload occupies in the ring
+	static uint32_t recordSize(uint32_t len)
+	{
+		return (uint32_t(sizeof(RecordHeader)) + len + SPSC_RECORD_ALIGN - 1) & ~uint32_t(SPSC_RECORD_ALIGN - 1);
+	}
+
+	// Contiguous free space starting at 'writeIndex'. The reader's index is only fetched from its cache line
+	// when our last view of it does not leave enough room.
+	uint8_t *reserveFrom(uint32_t writeIndex, uint32_t &len)
+	{
+		uint32_t avail = mCapacity - 1 - calcSize(mCachedReadIndex, writeIndex);
+		if (avail < len)
+		{
+			mCachedReadIndex = mHeader->mReadIndex.load(std::memory_order_acquire);
+			avail = mCapacity - 1 - calcSize(mCachedReadIndex, writeIndex);
+		}
+		uint32_t top = mCapacity - writeIndex;
+		if (avail > top)
+		{
+			avail = top;
+		}
+		if (len > avail)
+		{
+			len = avail;
+		}
+		return len ? &mBaseMemory[writeIndex] : nullptr;
+	}
+
+	// Contiguous unread data starting at 'readIndex'. The writer's index is only fetched from its cache line
+	// when our last view of it does not show enough data.
+	const uint8_t *peekFrom(uint32_t readIndex, uint32_t &len)
+	{
+		uint32_t avail = calcSize(readIndex, mCachedWriteIndex);
+		if (avail < len)
+		{
+			mCachedWriteIndex = mHeader->mWriteIndex.load(std::memory_order_acquire);
+			avail = calcSize(readIndex, mCachedWriteIndex);
+		}
+		uint32_t top = mCapacity - readIndex;
+		if (avail > top)
+		{
+			avail = top;
+		}
+		if (len > avail)
+		{
+			len = avail;
+		}
+		return len ? &mBaseMemory[readIndex] : nullptr;
+	}
+
+	// Called after publishing a new index; only pays for the system call when the other side is asleep.
+	// The fence pairs with the one in 'wait': either the waiter sees the new index, or we see its flag.
+	void wakePeer(std::atomic<uint32_t> &index, std::atomic<uint32_t> &waiting)
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiting.load(std::memory_order_relaxed))
+		{
+			futexWake(index);
+		}
+	}
+
+	// Spins for a while, then sleeps on the index the other side advances.
+	// The spin budget adapts: it doubles whenever spinning paid off and halves whenever we had to sleep
+	// anyway, so a busy peer is caught without a system call and an idle one costs no CPU.
+	// Only one thread on each side of the ring may wait at a time.
+	template< typename Ready >
+	bool wait(std::atomic<uint32_t> &index, std::atomic<uint32_t> &waiting, int32_t timeOut, Ready ready)
+	{
+		if (ready())
+		{
+			return true;
+		}
+		if (timeOut == 0)
+		{
+			return false;
+		}
+		for (uint32_t i = 0; i < mSpinLimit; i++)
+		{
+			cpuRelax();
+			if (ready())
+			{
+				mSpinLimit = mSpinLimit * 2 < SPSC_MAX_SPIN ? mSpinLimit * 2 : SPSC_MAX_SPIN;
+				return true;
+			}
+		}
+		if (mSpinLimit)
+		{
+			mSpinLimit = mSpinLimit / 2 > SPSC_MIN_SPIN ? mSpinLimit / 2 : SPSC_MIN_SPIN;
+		}
+		// Read the index before the last check so a change made after it makes the futex return at once
+		uint32_t observed = index.load(std::memory_order_acquire);
+		waiting.store(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!ready())
+		{
+			futexWait(index, observed, timeOut);
+		}
+		waiting.store(0, std::memory_order_relaxed);
+		return ready();
+	}
+
 	SharedMemoryHeader	*mHeader{nullptr};      		// points to the head of the shared memory;
 	uint8_t				*mSharedMemory{nullptr};		// Address of shared memory between processes (includes header)
 	uint8_t				*mBaseMemory{nullptr};			// Base address of the read/write circular buffer (mSharedMemory+header)
 	uint32_t			mCapacity{ 0 };					// The total capacity of the read/write buffer
 	bool				mIsWriter{ true };				// Whether or not we are a writer instance (can only do writes)
+	uint32_t			mCachedReadIndex{ 0 };			// Writer's last view of the read index
+	uint32_t			mCachedWriteIndex{ 0 };			// Reader's last view of the write index
+	uint32_t			mRecordIndex{ 0 };				// Where the record being reserved or peeked starts
+	uint32_t			mRecordPadding{ 0 };			// Size of the filler the reserved record needs before it
+	uint32_t			mSpinLimit{ std::thread::hardware_concurrency() > 1 ? uint32_t(SPSC_MIN_SPIN) : 0u };	// Spinning is pointless when the peer cannot run at the same time
+};
+
+// A fixed capacity single producer single consumer queue of values, for passing items between
+// two threads of the same process. One thread may only push and the other may only pop.
+// The read and write indices sit on separate cache lines so the two threads do not contend.
+
+template< typename T >
+class SPSCQueue
+{
+public:
+	// 'capacity' is rounded up to a power of two
+	SPSCQueue(uint32_t capacity)
+	{
+		mCapacity = 2;
+		while (mCapacity < capacity)
+		{
+			mCapacity *= 2;
+		}
+		mMask = mCapacity - 1;
+		mItems = new T[mCapacity];
+	}
+
+	~SPSCQueue(void)
+	{
+		delete[]mItems;
+	}
+
+	// Producer only. Returns false if the queue is full
+	bool push(const T &item)
+	{
+		uint32_t writeIndex = mWriteIndex.load(std::memory_order_relaxed);
+		if (writeIndex - mCachedReadIndex == mCapacity)
+		{
+			mCachedReadIndex = mReadIndex.load(std::memory_order_acquire);
+			if (writeIndex - mCachedReadIndex == mCapacity)
+			{
+				return false;
+			}
+		}
+		mItems[writeIndex & mMask] = item;
+		mWriteIndex.store(writeIndex + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer only. Returns false if the queue is empty
+	bool pop(T &item)
+	{
+		uint32_t readIndex = mReadIndex.load(std::memory_order_relaxed);
+		if (readIndex == mCachedWriteIndex)
+		{
+			mCachedWriteIndex = mWriteIndex.load(std::memory_order_acquire);
+			if (readIndex == mCachedWriteIndex)
+			{
+				return false;
+			}
+		}
+		item = mItems[readIndex & mMask];
+		mReadIndex.store(readIndex + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Either thread; only a snapshot
+	bool empty(void) const
+	{
+		return mReadIndex.load(std::memory_order_acquire) == mWriteIndex.load(std::memory_order_acquire);
+	}
+
+private:
+	SPSCQueue(const SPSCQueue &) = delete;
+	SPSCQueue &operator=(const SPSCQueue &) = delete;
+
+	T						*mItems{ nullptr };
+	uint32_t				mCapacity{ 0 };
+	uint32_t				mMask{ 0 };
+	uint8_t					mPad0[SPSC_CACHE_LINE_SIZE];
+	std::atomic<uint32_t>	mWriteIndex{ 0 };			// Written by the producer
+	uint32_t				mCachedReadIndex{ 0 };		// Producer's last view of the read index
+	uint8_t					mPad1[SPSC_CACHE_LINE_SIZE];
+	std::atomic<uint32_t>	mReadIndex{ 0 };			// Written by the consumer
+	uint32_t				mCachedWriteIndex{ 0 };		// Consumer's last view of the write index
+	uint8_t					mPad2[SPSC_CACHE_LINE_SIZE];
 };
 
 }
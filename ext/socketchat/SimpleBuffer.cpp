@@ -3,6 +3,14 @@
 #include <string.h>
 #include <assert.h>
 
+#ifdef __linux__
+#define USE_MIRRORED_BUFFER 1
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define USE_MIRRORED_BUFFER 0
+#endif
+
 namespace simplebuffer
 {
 
@@ -105,7 +113,7 @@ namespace simplebuffer
                 uint32_t keepSize = getSize();
                 if (keepSize)
                 {
-                    memcpy(mBuffer, &mBuffer[mStartLoc], keepSize);
+                    memmove(mBuffer, &mBuffer[mStartLoc], keepSize);
                 }
                 mStartLoc = 0;              // Reset the current read location to zero
                 mEndLoc = keepSize;         // The current end location is the active buffer size
@@ -198,6 +206,8 @@ namespace simplebuffer
             {
                 memcpy(newBuffer, &mBuffer[mStartLoc], currentSize);
             }
+            free(mBuffer);
+            mBuffer = newBuffer;
             mStartLoc = 0;
             mEndLoc = currentSize;
             mMaxLen = newSize;  // New buffer size
@@ -218,12 +228,283 @@ namespace simplebuffer
         uint32_t    mDefaultSize{ 1024 };
 	};
 
+#if USE_MIRRORED_BUFFER
+
+	// A ring buffer backed by a memfd which is mapped twice, back to back. Any run of up to 'capacity'
+	// bytes starting inside the first mapping is contiguous in memory, so the live data can always be
+	// read in place and new data written in place, and consuming from the front never moves anything.
+	class MirroredBufferImpl : public SimpleBuffer
+	{
+	public:
+		MirroredBufferImpl(uint32_t defaultLen,uint32_t maxGrowSize)
+		{
+			mPageSize = uint32_t(sysconf(_SC_PAGESIZE));
+			mMaxGrowSize = roundUp(maxGrowSize > defaultLen ? maxGrowSize : defaultLen);
+			reset(defaultLen);
+		}
+
+		virtual ~MirroredBufferImpl(void)
+		{
+			unmap();
+		}
+
+		bool isValid(void) const
+		{
+			return mBase != nullptr;
+		}
+
+		virtual uint8_t *getData(uint32_t &dataLen) const override final
+		{
+			dataLen = mSize;
+			return mBase + mStartLoc;
+		}
+
+		virtual void clear(void) override final
+		{
+			mStartLoc = 0;
+			mSize = 0;
+		}
+
+		virtual bool addBuffer(const void *data, uint32_t dataLen) override final
+		{
+			uint8_t *dest = confirmCapacity(dataLen);
+			if (!dest)
+			{
+				return false;
+			}
+			if (data)
+			{
+				memcpy(dest, data, dataLen);
+			}
+			mSize += dataLen;
+			return true;
+		}
+
+		virtual void reset(uint32_t defaultSize) override final
+		{
+			unmap();
+			mStartLoc = 0;
+			mSize = 0;
+			mDefaultSize = roundUp(defaultSize ? defaultSize : 1);
+			map(mDefaultSize);
+		}
+
+		virtual void release(void) override final
+		{
+			delete this;
+		}
+
+		virtual uint32_t getSize(void) const override final
+		{
+			return mSize;
+		}
+
+		virtual void consume(uint32_t removeLen) override final
+		{
+			assert(removeLen <= mSize);
+			if (removeLen > mSize)
+			{
+				removeLen = mSize;
+			}
+			mSize -= removeLen;
+			mStartLoc = mSize ? (mStartLoc + removeLen) % mCapacity : 0;
+		}
+
+		virtual uint8_t *confirmCapacity(uint32_t capacity) override final
+		{
+			if (!mBase)
+			{
+				return nullptr;
+			}
+			if (capacity > mCapacity - mSize)
+			{
+				uint32_t newCapacity = mCapacity * 2;
+				if (newCapacity < mSize + capacity)
+				{
+					newCapacity = roundUp(mSize + capacity);
+				}
+				if (newCapacity > mMaxGrowSize || !grow(newCapacity))
+				{
+					return nullptr;
+				}
+			}
+			return mBase + (mStartLoc + mSize) % mCapacity;
+		}
+
+		virtual uint32_t getMaxBufferSize(void) const override final
+		{
+			return mCapacity;
+		}
+
+		// Replaces an oversized ring with a fresh one of the default size (or the current data size)
+		virtual uint32_t shrinkBuffer(void) override final
+		{
+			uint32_t newSize = roundUp(mSize > mDefaultSize ? mSize : mDefaultSize);
+			if (newSize >= mCapacity)
+			{
+				return mCapacity;
+			}
+			MirroredBufferImpl smaller(newSize, mMaxGrowSize);
+			if (!smaller.isValid())
+			{
+				return mCapacity;
+			}
+			if (mSize)
+			{
+				smaller.addBuffer(mBase + mStartLoc, mSize);
+			}
+			unmap();
+			mFd = smaller.mFd;
+			mBase = smaller.mBase;
+			mCapacity = smaller.mCapacity;
+			mStartLoc = smaller.mStartLoc;
+			smaller.mFd = -1;
+			smaller.mBase = nullptr;
+			return mCapacity;
+		}
+
+		virtual uint32_t getMaxGrowSize(void) const override final
+		{
+			return mMaxGrowSize;
+		}
+
+	private:
+		uint32_t roundUp(uint32_t size) const
+		{
+			return (size + mPageSize - 1) / mPageSize * mPageSize;
+		}
+
+		// Creates the memfd and maps it twice into one reserved address range
+		bool map(uint32_t capacity)
+		{
+			mFd = memfd_create("simplebuffer", MFD_CLOEXEC);
+			if (mFd < 0)
+			{
+				return false;
+			}
+			if (ftruncate(mFd, capacity) != 0)
+			{
+				unmap();
+				return false;
+			}
+			uint8_t *region = mapMirrored(capacity);
+			if (!region)
+			{
+				unmap();
+				return false;
+			}
+			void *primary = mmap(region, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, mFd, 0);
+			if (primary == MAP_FAILED)
+			{
+				munmap(region, size_t(capacity) * 2);
+				unmap();
+				return false;
+			}
+			mBase = region;
+			mCapacity = capacity;
+			return true;
+		}
+
+		// Reserves twice 'capacity' of address space and maps the file into the upper half
+		uint8_t *mapMirrored(uint32_t capacity)
+		{
+			void *region = mmap(nullptr, size_t(capacity) * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (region == MAP_FAILED)
+			{
+				return nullptr;
+			}
+			void *mirror = mmap((uint8_t *)region + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, mFd, 0);
+			if (mirror == MAP_FAILED)
+			{
+				munmap(region, size_t(capacity) * 2);
+				return nullptr;
+			}
+			return (uint8_t *)region;
+		}
+
+		// Extends the file, moves the existing primary mapping to a new range with mremap (extending it
+		// over the new part of the file) and maps a new mirror after it. The data itself stays in the
+		// page cache; only the part which had wrapped around to the front of the ring is copied.
+		bool grow(uint32_t newCapacity)
+		{
+			if (ftruncate(mFd, newCapacity) != 0)
+			{
+				return false;
+			}
+			uint8_t *region = mapMirrored(newCapacity);
+			if (!region)
+			{
+				return false;
+			}
+			void *primary = mremap(mBase, mCapacity, newCapacity, MREMAP_MAYMOVE | MREMAP_FIXED, region);
+			if (primary == MAP_FAILED)
+			{
+				munmap(region, size_t(newCapacity) * 2);
+				return false;
+			}
+			munmap(mBase + mCapacity, mCapacity); // the old mirror
+			uint32_t end = mStartLoc + mSize;
+			if (end > mCapacity)
+			{
+				// The data used to wrap at the old capacity; move the wrapped part up to follow the rest
+				memcpy(region + mCapacity, region, end - mCapacity);
+			}
+			mBase = region;
+			mCapacity = newCapacity;
+			return true;
+		}
+
+		void unmap(void)
+		{
+			if (mBase)
+			{
+				munmap(mBase, size_t(mCapacity) * 2);
+				mBase = nullptr;
+			}
+			if (mFd >= 0)
+			{
+				::close(mFd);
+				mFd = -1;
+			}
+			mCapacity = 0;
+		}
+
+		uint8_t		*mBase{ nullptr };		// Start of the first of the two mappings
+		int			mFd{ -1 };				// memfd holding the ring's memory
+		uint32_t	mCapacity{ 0 };			// Size of one mapping
+		uint32_t	mStartLoc{ 0 };			// Offset of the first byte of data; always less than mCapacity
+		uint32_t	mSize{ 0 };				// Bytes of data in the ring
+		uint32_t	mPageSize{ 4096 };
+		uint32_t	mMaxGrowSize{ 0 };
+		uint32_t	mDefaultSize{ 0 };
+	};
+
+#endif
+
 SimpleBuffer *SimpleBuffer::create(uint32_t defaultSize,uint32_t maxGrowSize)
 {
 	auto ret = new SimpleBufferImpl(defaultSize,maxGrowSize);
 	return static_cast<SimpleBuffer *>(ret);
 }
 
+SimpleBuffer *SimpleBuffer::create(uint32_t defaultSize,uint32_t maxGrowSize,BufferType type)
+{
+#if USE_MIRRORED_BUFFER
+	if (type == BUFFER_MIRRORED)
+	{
+		auto ret = new MirroredBufferImpl(defaultSize, maxGrowSize);
+		if (ret->isValid())
+		{
+			return static_cast<SimpleBuffer *>(ret);
+		}
+		delete ret; // out of descriptors or mappings; use a regular buffer instead
+	}
+#else
+	(void)type;
+#endif
+	return create(defaultSize, maxGrowSize);
+}
+
 
 }
 
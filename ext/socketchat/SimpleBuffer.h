@@ -5,11 +5,20 @@
 namespace simplebuffer
 {
 
+enum BufferType
+{
+	BUFFER_HEAP,		// A malloc'd block; consumed space at the front is reclaimed by moving the data down
+	BUFFER_MIRRORED,	// A ring buffer whose memory is mapped twice back to back, so the data and the free space
+						// are always contiguous and nothing is ever moved. Grows with mremap.
+						// Linux only (falls back to BUFFER_HEAP elsewhere); costs a file descriptor and two mappings.
+};
+
 class SimpleBuffer
 {
 public:
 
 	static SimpleBuffer *create(uint32_t defaultSize,uint32_t maxGrowSize);
+	static SimpleBuffer *create(uint32_t defaultSize,uint32_t maxGrowSize,BufferType type);
 
 	// Conume this many bytes of the current buffer; retaining whatever is left
 	virtual void consume(uint32_t removeLen) = 0;
@@ -37,7 +46,7 @@ public:
 	// Add this data to the current buffer.  If 'data' is null, it doesn't copy any data
 	virtual bool 		addBuffer(const void *data,uint32_t dataLen) = 0;
 
-	// Make sure the buffer is large enough for this capacity; return the *current* read location in the buffer
+	// Make sure the buffer is large enough for this capacity; return the *current* write location in the buffer
 	virtual	uint8_t	*confirmCapacity(uint32_t capacity) = 0;
 
 	// Note, the reset command does not retain the previous data buffer!
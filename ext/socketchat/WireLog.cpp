@@ -0,0 +1,442 @@
+#include "WireLog.h"
+#include "SPSC.h"
+#include "wsocket.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _MSC_VER
+#pragma warning(disable:4996)
+#endif
+
+#define WIRELOG_ALIGN 8							// Records in the file are padded to a multiple of this
+
+namespace wirelog
+{
+
+static uint32_t paddedLength(uint32_t len)
+{
+	return (len + WIRELOG_ALIGN - 1) & ~uint32_t(WIRELOG_ALIGN - 1);
+}
+
+class WireLogStreamImpl : public WireLogStream
+{
+public:
+	WireLogStreamImpl(WireLog *log, uint32_t stream, std::chrono::steady_clock::time_point start) : mLog(log), mStream(stream), mStart(start)
+	{
+		mRingMemory = new uint8_t[WIRELOG_RING_SIZE];
+		mWriter.init(mRingMemory, WIRELOG_RING_SIZE, true, true);
+		mReader.init(mRingMemory, WIRELOG_RING_SIZE, false, false);
+		mMaxPayload = mWriter.getMaxRecordSize() - uint32_t(sizeof(capture::CaptureRecordHeader));
+	}
+
+	virtual ~WireLogStreamImpl(void)
+	{
+		delete[]mRingMemory;
+	}
+
+	virtual void record(uint32_t direction, const void *data, uint32_t dataLen) override final
+	{
+		wsocket::WsocketIovec iov;
+		iov.mData = data;
+		iov.mLength = dataLen;
+		recordv(direction, &iov, 1, dataLen);
+	}
+
+	// Records too large for the ring go in as several records of the same direction, which is the same
+	// bytes as far as the stream is concerned
+	virtual void recordv(uint32_t direction, const wsocket::WsocketIovec *iov, uint32_t iovCount, uint32_t dataLen) override final
+	{
+		uint64_t time = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - mStart).count());
+		uint32_t index = 0;
+		uint32_t offset = 0;
+		do
+		{
+			if (mUnreported && !reportDrops(time))
+			{
+				drop();
+				return;
+			}
+			uint32_t len = dataLen < mMaxPayload ? dataLen : mMaxPayload;
+			uint8_t *dest = reserve(time, direction, len);
+			if (!dest)
+			{
+				drop();
+				return;
+			}
+			// Gather 'len' bytes, carrying on from where the last piece stopped
+			uint32_t remaining = len;
+			while (remaining && index < iovCount)
+			{
+				uint32_t available = iov[index].mLength - offset;
+				uint32_t copy = available < remaining ? available : remaining;
+				memcpy(dest, (const uint8_t *)iov[index].mData + offset, copy);
+				dest += copy;
+				remaining -= copy;
+				offset += copy;
+				if (offset == iov[index].mLength)
+				{
+					index++;
+					offset = 0;
+				}
+			}
+			mWriter.commitRecord(uint32_t(sizeof(capture::CaptureRecordHeader)) + len, 0);
+			dataLen -= len;
+		} while (dataLen);
+	}
+
+	virtual uint32_t getStream(void) const override final
+	{
+		return mStream;
+	}
+
+	virtual uint64_t getDropCount(void) const override final
+	{
+		return mDrops.load(std::memory_order_relaxed);
+	}
+
+	virtual void release(void) override final
+	{
+		record(CAPTURE_CLOSE, nullptr, 0);
+		// The writer thread drains the ring and deletes the stream once it sees this, so nothing
+		// of the stream may be touched afterwards
+		WireLog *log = mLog;
+		mReleased.store(true, std::memory_order_release);
+		log->release();
+	}
+
+	bool isReleased(void) const
+	{
+		return mReleased.load(std::memory_order_acquire);
+	}
+
+	// Writer thread. Appends every record in the ring to 'batch', padded as in the file.
+	void drain(std::vector< uint8_t > &batch)
+	{
+		uint32_t len;
+		uint32_t flags;
+		const uint8_t *data;
+		while ((data = mReader.peekRecord(len, flags)) != nullptr)
+		{
+			size_t offset = batch.size();
+			batch.resize(offset + paddedLength(len));
+			memcpy(&batch[offset], data, len);
+			memset(&batch[offset + len], 0, paddedLength(len) - len);
+			mReader.releaseRecord();
+		}
+	}
+
+private:
+	// Reserves a record with its header filled in; returns where its 'len' bytes of data go, or null if
+	// they do not fit
+	uint8_t *reserve(uint64_t time, uint32_t direction, uint32_t len)
+	{
+		uint32_t need = uint32_t(sizeof(capture::CaptureRecordHeader)) + len;
+		uint32_t room = need;
+		uint8_t *dest = mWriter.reserveRecord(room);
+		if (!dest || room < need)
+		{
+			return nullptr;
+		}
+		capture::CaptureRecordHeader header;
+		memset(&header, 0, sizeof(header));
+		header.mTime = time;
+		header.mStream = mStream;
+		header.mLength = len;
+		header.mDirection = uint8_t(direction);
+		memcpy(dest, &header, sizeof(header));
+		return dest + sizeof(header);
+	}
+
+	// Puts a CAPTURE_DROPPED record in the stream where records went missing
+	bool reportDrops(uint64_t time)
+	{
+		uint8_t *dest = reserve(time, CAPTURE_DROPPED, uint32_t(sizeof(mUnreported)));
+		if (!dest)
+		{
+			return false;
+		}
+		memcpy(dest, &mUnreported, sizeof(mUnreported));
+		mWriter.commitRecord(uint32_t(sizeof(capture::CaptureRecordHeader) + sizeof(mUnreported)), 0);
+		mUnreported = 0;
+		return true;
+	}
+
+	void drop(void)
+	{
+		mUnreported++;
+		mDrops.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	WireLog									*mLog{ nullptr };
+	uint32_t								mStream{ 0 };
+	std::chrono::steady_clock::time_point	mStart;
+	uint8_t									*mRingMemory{ nullptr };
+	spsc::SPSC								mWriter;			// the connection's side of the ring
+	spsc::SPSC								mReader;			// the writer thread's side
+	uint32_t								mMaxPayload{ 0 };	// most data bytes one record can hold
+	uint64_t								mUnreported{ 0 };	// drops not yet recorded in the stream
+	std::atomic<uint64_t>					mDrops{ 0 };
+	std::atomic<bool>						mReleased{ false };
+};
+
+class WireLogImpl;
+
+// Logs open in this process, by name, so connections logging to the same name share one set of files
+static std::mutex gLogsMutex;
+static std::vector< WireLogImpl * > gLogs;
+
+class WireLogImpl : public WireLog
+{
+public:
+	WireLogImpl(const char *baseName) : mBaseName(baseName)
+	{
+		mStart = std::chrono::steady_clock::now();
+		mStartTime = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+		if (!openFile(0))
+		{
+			return;
+		}
+		mThread = new std::thread([this]()
+		{
+			run();
+		});
+	}
+
+	virtual ~WireLogImpl(void)
+	{
+		if (mThread)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+				mQuit = true;
+			}
+			mWake.notify_one();
+			mThread->join();
+			delete mThread;
+		}
+		for (auto &i : mStreams)
+		{
+			delete i;
+		}
+		if (mFile)
+		{
+			fclose(mFile);
+		}
+	}
+
+	bool isValid(void) const
+	{
+		return mFile != nullptr;
+	}
+
+	const std::string &getBaseName(void) const
+	{
+		return mBaseName;
+	}
+
+	virtual WireLogStream *openStream(void) override final
+	{
+		addRef(); // each stream holds the log open until it is released
+		WireLogStreamImpl *ret = new WireLogStreamImpl(this, mNextStream++, mStart);
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStreams.push_back(ret);
+		return static_cast<WireLogStream *>(ret);
+	}
+
+	virtual uint64_t getDropCount(void) const override final
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		uint64_t ret = mRetiredDrops;
+		for (auto &i : mStreams)
+		{
+			ret += i->getDropCount();
+		}
+		return ret;
+	}
+
+	virtual void flush(void) override final
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		// Sweeps drain the rings while holding the lock, so the next one to start sees everything recorded so far
+		uint64_t target = mSweepsStarted + 1;
+		mFlushRequested = true;
+		mWake.notify_one();
+		mSwept.wait(lock, [this, target]()
+		{
+			return mSweepsDone >= target;
+		});
+	}
+
+	virtual void addRef(void) override final
+	{
+		mRefCount++;
+	}
+
+	virtual void release(void) override final
+	{
+		{
+			std::lock_guard<std::mutex> lock(gLogsMutex);
+			if (--mRefCount)
+			{
+				return;
+			}
+			for (size_t i = 0; i < gLogs.size(); i++)
+			{
+				if (gLogs[i] == this)
+				{
+					gLogs.erase(gLogs.begin() + i);
+					break;
+				}
+			}
+		}
+		delete this;
+	}
+
+private:
+	// Collects whatever the streams have recorded and writes it in one call per sweep
+	void run(void)
+	{
+		std::vector< uint8_t > batch;
+		std::unique_lock<std::mutex> lock(mMutex);
+		for (;;)
+		{
+			mWake.wait_for(lock, std::chrono::milliseconds(WIRELOG_FLUSH_INTERVAL), [this]()
+			{
+				return mQuit || mFlushRequested;
+			});
+			bool quit = mQuit;
+			mFlushRequested = false;
+			mSweepsStarted++;
+			for (size_t i = 0; i < mStreams.size();)
+			{
+				WireLogStreamImpl *s = mStreams[i];
+				// Released before the drain means nothing more can arrive after it
+				bool released = s->isReleased();
+				s->drain(batch);
+				if (released)
+				{
+					mRetiredDrops += s->getDropCount();
+					delete s;
+					mStreams[i] = mStreams.back();
+					mStreams.pop_back();
+				}
+				else
+				{
+					i++;
+				}
+			}
+			lock.unlock();
+			if (!batch.empty())
+			{
+				write(batch);
+				batch.clear();
+			}
+			lock.lock();
+			mSweepsDone++;
+			mSwept.notify_all();
+			if (quit)
+			{
+				break;
+			}
+		}
+	}
+
+	void write(const std::vector< uint8_t > &batch)
+	{
+		if (mFileSize + batch.size() > WIRELOG_FILE_SIZE && mFileSize > sizeof(capture::CaptureFileHeader))
+		{
+			openFile(mFileIndex + 1);
+		}
+		fwrite(&batch[0], batch.size(), 1, mFile);
+		fflush(mFile);
+		mFileSize += batch.size();
+	}
+
+	void getFileName(uint32_t index, char *fileName, size_t fileNameSize) const
+	{
+		snprintf(fileName, fileNameSize, "%s.%d%s", mBaseName.c_str(), int(index), WIRELOG_FILE_EXTENSION);
+	}
+
+	// Starts file 'index', deleting the oldest one kept if there are now too many.
+	// If it cannot be created the current file carries on growing.
+	bool openFile(uint32_t index)
+	{
+		char fileName[512];
+		getFileName(index, fileName, sizeof(fileName));
+		FILE *fph = fopen(fileName, "wb");
+		if (!fph)
+		{
+			return false;
+		}
+		if (mFile)
+		{
+			fclose(mFile);
+		}
+		mFile = fph;
+		mFileIndex = index;
+		capture::CaptureFileHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.mMagic, CAPTURE_MAGIC, sizeof(header.mMagic));
+		header.mVersion = CAPTURE_VERSION;
+		header.mHeaderSize = uint32_t(sizeof(header));
+		header.mStartTime = mStartTime; // every file counts from the same time zero
+		fwrite(&header, sizeof(header), 1, mFile);
+		mFileSize = sizeof(header);
+		if (index >= WIRELOG_MAX_FILES)
+		{
+			getFileName(index - WIRELOG_MAX_FILES, fileName, sizeof(fileName));
+			remove(fileName);
+		}
+		return true;
+	}
+
+	std::string								mBaseName;
+	FILE									*mFile{ nullptr };
+	uint32_t								mFileIndex{ 0 };
+	uint64_t								mFileSize{ 0 };
+	std::thread								*mThread{ nullptr };
+	std::chrono::steady_clock::time_point	mStart;
+	uint64_t								mStartTime{ 0 };
+	std::atomic<uint32_t>					mRefCount{ 1 };
+	std::atomic<uint32_t>					mNextStream{ 0 };
+	mutable std::mutex						mMutex;				// guards everything below
+	std::condition_variable					mWake;				// wakes the writer thread
+	std::condition_variable					mSwept;				// wakes callers waiting for a flush
+	std::vector< WireLogStreamImpl * >		mStreams;
+	uint64_t								mRetiredDrops{ 0 };	// drops of streams already deleted
+	uint64_t								mSweepsStarted{ 0 };
+	uint64_t								mSweepsDone{ 0 };
+	bool									mFlushRequested{ false };
+	bool									mQuit{ false };
+};
+
+WireLog *WireLog::create(const char *baseName)
+{
+	std::lock_guard<std::mutex> lock(gLogsMutex);
+	for (auto &i : gLogs)
+	{
+		if (i->getBaseName() == baseName)
+		{
+			i->addRef();
+			return static_cast<WireLog *>(i);
+		}
+	}
+	auto ret = new WireLogImpl(baseName);
+	if (!ret->isValid())
+	{
+		delete ret;
+		return nullptr;
+	}
+	gLogs.push_back(ret);
+	return static_cast<WireLog *>(ret);
+}
+
+} // namespace wirelog
@@ -0,0 +1,76 @@
+#pragma once
+
+// Logs every byte connections send and receive without slowing them down.
+//
+// Each connection records into a lock-free ring of its own (spsc::SPSC, in private memory). Recording
+// is a copy into the ring; if the ring is full the record is dropped and counted, so the network path
+// never waits on the disk. A background thread sweeps the rings and writes their records in large
+// batches to a set of rotating files: 'baseName.0.wirelog', 'baseName.1.wirelog', and so on.
+//
+// The files use the capture file format (Capture.h), one stream per connection, so they can also be
+// replayed; WireLogDump renders them as text. Where records were dropped the stream holds a
+// CAPTURE_DROPPED record saying how many.
+#include <stdint.h>
+
+#include "Capture.h"
+
+namespace wirelog
+{
+
+#define WIRELOG_RING_SIZE (1024*256)			// Bytes of ring per connection; records larger than half of it are split
+#define WIRELOG_FILE_SIZE (1024*1024*64)		// A file is closed and the next one started once it grows past this
+#define WIRELOG_MAX_FILES 8						// Older files are deleted so no more than this many are kept
+#define WIRELOG_FLUSH_INTERVAL 10				// Milliseconds between sweeps of the rings
+#define WIRELOG_FILE_EXTENSION ".wirelog"
+
+// One connection's records. Only one thread at a time may record into a stream.
+class WireLogStream
+{
+public:
+	virtual void record(uint32_t direction, const void *data, uint32_t dataLen) = 0;
+
+	// One record gathered from several pieces, such as a 'sendv' call which sent 'dataLen' bytes of them
+	virtual void recordv(uint32_t direction, const wsocket::WsocketIovec *iov, uint32_t iovCount, uint32_t dataLen) = 0;
+
+	// The stream id the records carry in the file
+	virtual uint32_t getStream(void) const = 0;
+
+	// Records dropped because the ring was full
+	virtual uint64_t getDropCount(void) const = 0;
+
+	// Records a CAPTURE_CLOSE; whatever is still in the ring is written before the stream goes away
+	virtual void release(void) = 0;
+
+protected:
+	virtual ~WireLogStream(void)
+	{
+	}
+};
+
+class WireLog
+{
+public:
+	// Starts a log writing to 'baseName.N.wirelog', or shares the one already open under that name
+	// in this process. Returns null if the first file could not be created.
+	static WireLog *create(const char *baseName);
+
+	// Hands out a stream (one per connection)
+	virtual WireLogStream *openStream(void) = 0;
+
+	// Records dropped by every stream so far
+	virtual uint64_t getDropCount(void) const = 0;
+
+	// Waits until everything recorded so far is in the file
+	virtual void flush(void) = 0;
+
+	// Logs are shared by reference; the last release writes out the remaining records and closes the file
+	virtual void addRef(void) = 0;
+	virtual void release(void) = 0;
+
+protected:
+	virtual ~WireLog(void)
+	{
+	}
+};
+
+} // namespace wirelog
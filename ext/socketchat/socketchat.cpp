@@ -2,12 +2,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <new>
 
 #include "socketchat.h"
 #include "wplatform.h"
 #include "wsocket.h"
 #include "SimpleBuffer.h"
+#include "FrameScanner.h"
+#include "MPSC.h"
 #include "Timer.h"
+#include "WireLog.h"
 
 
 #ifdef _MSC_VER
@@ -20,6 +27,9 @@
 #define DEFAULT_MAXIMUM_BUFFER_SIZE (1024*1024)*512  // Don't ever cache more than 64 mb of data (for the moment...)
 
 #define CONNECTION_TIME_OUT 60	// wait no more than this number of seconds for connection to complete
+#define MAX_VARINT_SIZE 5		// Longest varint length prefix (a 32 bit length, 7 bits per byte)
+#define SEND_QUEUE_COPY_SIZE 1024	// Messages from the send queue up to this size are copied into the transmit buffer
+#define TRANSMIT_MEMORY_GRANULARITY (1024*16)	// Smallest change in a connection's backlog reported to getTransmitMemory
 
 
 #define USE_LOGGING 1
@@ -27,37 +37,206 @@
 namespace socketchat
 { // private module-only namespace
 
+	// Writes 'value' as a little endian base 128 varint; returns the number of bytes written
+	static uint32_t writeVarint(uint8_t *dest, uint32_t value)
+	{
+		uint32_t ret = 0;
+		while (value >= 0x80)
+		{
+			dest[ret++] = uint8_t(value | 0x80);
+			value >>= 7;
+		}
+		dest[ret++] = uint8_t(value);
+		return ret;
+	}
+
+	// Reads a varint from the front of 'data'. Returns the number of bytes used, 0 if more data is
+	// needed, or -1 if the prefix is malformed
+	static int32_t readVarint(const uint8_t *data, uint32_t dataLen, uint32_t &value)
+	{
+		value = 0;
+		for (uint32_t i = 0; i < MAX_VARINT_SIZE; i++)
+		{
+			if (i == dataLen)
+			{
+				return 0;
+			}
+			uint8_t c = data[i];
+			if (i == MAX_VARINT_SIZE - 1 && c > 0x0F)
+			{
+				return -1; // more than 32 bits
+			}
+			value |= uint32_t(c & 0x7F) << (7 * i);
+			if (!(c & 0x80))
+			{
+				return int32_t(i + 1);
+			}
+		}
+		return -1;
+	}
+
+	// Writes a framed message to 'dest', which must have room for 'len' plus maxFramingSize bytes;
+	// returns the size on the wire
+	static uint32_t frameMessage(uint8_t *dest, const void *data, uint32_t len, FramingMode framing)
+	{
+		uint32_t ret = 0;
+		if (framing == FRAMING_BINARY)
+		{
+			ret = writeVarint(dest, len);
+		}
+		if (len)
+		{
+			memcpy(dest + ret, data, len);
+		}
+		ret += len;
+		if (framing == FRAMING_TEXT)
+		{
+			dest[ret++] = '\r';
+			dest[ret++] = '\n';
+		}
+		return ret;
+	}
+
+	// Backlog of every connection in the process (see getTransmitMemory)
+	static std::atomic<uint64_t> gTransmitMemory{ 0 };
+
+	// Clock used for the statistics
+	static inline uint64_t nowNanoseconds(void)
+	{
+		return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	// Most bytes the framing adds to a message
+	static uint32_t maxFramingSize(FramingMode framing)
+	{
+		return framing == FRAMING_BINARY ? MAX_VARINT_SIZE : 2;
+	}
+
+	// The framed message is stored directly after the object, so a message is a single allocation
+	class SharedMessageImpl : public socketchat::SharedMessage
+	{
+	public:
+		SharedMessageImpl(FramingMode framing) : mFraming(framing)
+		{
+		}
+
+		static SharedMessageImpl *create(const void *data, uint32_t len, FramingMode framing)
+		{
+			void *mem = malloc(sizeof(SharedMessageImpl) + len + maxFramingSize(framing));
+			SharedMessageImpl *ret = new (mem) SharedMessageImpl(framing);
+			uint8_t *dest = (uint8_t *)(ret + 1);
+			ret->mLength = frameMessage(dest, data, len, framing);
+			ret->mPayloadLength = len;
+			ret->mPayloadOffset = framing == FRAMING_BINARY ? ret->mLength - len : 0;
+			return ret;
+		}
+
+		virtual void addRef(void) override final
+		{
+			mRefCount.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		virtual void release(void) override final
+		{
+			if (mRefCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				this->~SharedMessageImpl();
+				free(this);
+			}
+		}
+
+		virtual const uint8_t *getData(uint32_t &dataLen) const override final
+		{
+			dataLen = mLength;
+			return (const uint8_t *)(this + 1);
+		}
+
+		virtual const uint8_t *getPayload(uint32_t &dataLen) const override final
+		{
+			dataLen = mPayloadLength;
+			return (const uint8_t *)(this + 1) + mPayloadOffset;
+		}
+
+		virtual FramingMode getFraming(void) const override final
+		{
+			return mFraming;
+		}
+
+		std::atomic<uint32_t>	mRefCount{ 1 };
+		FramingMode				mFraming{ FRAMING_TEXT };
+		uint32_t				mLength{ 0 };			// Bytes on the wire, including the framing
+		uint32_t				mPayloadOffset{ 0 };	// Where the payload starts within the wire data
+		uint32_t				mPayloadLength{ 0 };
+	};
+
+	// A run of queued transmit data. Either a shared message, or (when 'mMessage' is null)
+	// the next 'mLength' bytes of the connection's own transmit buffer.
+	struct TransmitSegment
+	{
+		SharedMessage	*mMessage{ nullptr };
+		uint32_t		mLength{ 0 };
+		uint32_t		mMessages{ 0 };		// Messages in the segment
+		uint64_t		mQueuedAt{ 0 };		// When the first of them was queued, for the queue time histogram
+	};
+
 	class SocketChatImpl : public socketchat::SocketChat
 	{
 	public:
-		SocketChatImpl(wsocket::Wsocket *clientSocket)
+		SocketChatImpl(wsocket::Wsocket *clientSocket, const SocketChatOptions &options) : mFraming(options.mFraming)
 		{
+			setWatermarks(options);
             mReadyState = ReadyStateValues::OPEN;
 			mIsServerClient = true;	// we are a server connection to a client
 			mSocket = clientSocket;
-			mTransmitBuffer = simplebuffer::SimpleBuffer::create(DEFAULT_TRANSMIT_BUFFER_SIZE, DEFAULT_MAXIMUM_BUFFER_SIZE);
-			mReceiveBuffer = simplebuffer::SimpleBuffer::create(DEFAULT_RECEIVE_BUFFER_SIZE, DEFAULT_MAXIMUM_BUFFER_SIZE);
+			mMessageTransport = mSocket && mSocket->supportsMessages();
+			createBuffers(options);
 		}
 
-		SocketChatImpl(const char *host,uint32_t port) : mReadyState(OPEN)
+		SocketChatImpl(const char *host,uint32_t port, const SocketChatOptions &options) : mReadyState(OPEN), mFraming(options.mFraming)
 		{
+			setWatermarks(options);
             {
-                mTransmitBuffer = simplebuffer::SimpleBuffer::create(DEFAULT_TRANSMIT_BUFFER_SIZE, DEFAULT_MAXIMUM_BUFFER_SIZE);
-                mReceiveBuffer = simplebuffer::SimpleBuffer::create(DEFAULT_RECEIVE_BUFFER_SIZE, DEFAULT_MAXIMUM_BUFFER_SIZE);
+                createBuffers(options);
                 fprintf(stderr, "socketchat: connecting: host=%s port=%d\n", host, port);
-                mSocket = wsocket::Wsocket::create(host, port);
+                wsocket::WsocketOptions socketOptions;
+                socketOptions.mCaptureFile = options.mCaptureFile;
+                socketOptions.mConnectAsync = options.mConnectAsync;
+                socketOptions.mConnectTimeout = options.mConnectTimeout ? options.mConnectTimeout : CONNECTION_TIME_OUT * 1000;
+                mSocket = wsocket::Wsocket::create(host, port, socketOptions);
                 if (mSocket == nullptr)
                 {
                     fprintf(stderr, "Unable to connect to %s:%d\n", host, port);
                 }
 				else
 				{
-                    mReadyState = ReadyStateValues::OPEN;
+                    mReadyState = mSocket->pollConnect(0) == wsocket::CONNECT_PENDING ? ReadyStateValues::CONNECTING : ReadyStateValues::OPEN;
+                    mMessageTransport = mSocket->supportsMessages();
                     mSocket->disableNaglesAlgorithm();
 				}
             }
 		}
 
+		void setWatermarks(const SocketChatOptions &options)
+		{
+			mHighWaterMark = options.mHighWaterMark;
+			mLowWaterMark = options.mLowWaterMark < options.mHighWaterMark ? options.mLowWaterMark : options.mHighWaterMark;
+			mSlowConsumerPolicy = options.mSlowConsumerPolicy;
+			// Only whole messages queued by reference can be dropped from the middle of the queue
+			mQueueByReference = mHighWaterMark &&
+				(mSlowConsumerPolicy == SLOW_CONSUMER_DROP_OLDEST || mSlowConsumerPolicy == SLOW_CONSUMER_CONFLATE);
+		}
+
+		void createBuffers(const SocketChatOptions &options)
+		{
+			simplebuffer::BufferType type = options.mMirroredBuffers ? simplebuffer::BUFFER_MIRRORED : simplebuffer::BUFFER_HEAP;
+			mTransmitBuffer = simplebuffer::SimpleBuffer::create(DEFAULT_TRANSMIT_BUFFER_SIZE, DEFAULT_MAXIMUM_BUFFER_SIZE, type);
+			mReceiveBuffer = simplebuffer::SimpleBuffer::create(DEFAULT_RECEIVE_BUFFER_SIZE, DEFAULT_MAXIMUM_BUFFER_SIZE, type);
+			if (options.mSendQueueSize)
+			{
+				mSendQueue = new mpsc::MPSCQueue< SharedMessage * >(options.mSendQueueSize);
+			}
+		}
+
 		virtual ~SocketChatImpl(void)
 		{
 			close();
@@ -66,7 +245,7 @@ namespace socketchat
 			while (mReadyState != CLOSED)
 			{
 				poll(nullptr, 1);
-				if (t.getElapsedSeconds() >= CLOSE_TIMEOUT)
+				if (t.peekElapsedSeconds() >= CLOSE_TIMEOUT)
 				{
 					break;
 				}
@@ -75,6 +254,23 @@ namespace socketchat
 			{
 				mSocket->release();
 			}
+			if (mSendQueue)
+			{
+				SharedMessage *message;
+				while (mSendQueue->pop(message))
+				{
+					message->release();
+				}
+				delete mSendQueue;
+			}
+			for (auto &i : mTransmitQueue)
+			{
+				if (i.mMessage)
+				{
+					i.mMessage->release();
+				}
+			}
+			gTransmitMemory.fetch_sub(mReportedPending, std::memory_order_relaxed);
 			if (mReceiveBuffer)
 			{
 				mReceiveBuffer->release();
@@ -84,9 +280,9 @@ namespace socketchat
 				mTransmitBuffer->release();
 			}
 #if USE_LOGGING
-            if (mLogFile)
+            if (mLogStream)
             {
-                fclose(mLogFile);
+                mLogStream->release();
             }
 #endif
 		}
@@ -107,8 +303,14 @@ namespace socketchat
             }
             return;
         }
+        if (mReadyState == CONNECTING && !advanceConnect(timeout))
+        {
+            return;
+        }
         while (true)
         {
+            // A message transport hands over whole messages, which are dispatched where they lie
+            uint32_t dispatched = (mMessageTransport && callback) ? _dispatchMessages(callback) : 0;
             // Get the current read buffer address, and make sure we have room for this many bytes
             uint8_t *rbuffer = mReceiveBuffer->confirmCapacity(DEFAULT_MAX_READ_SIZE);
             if (!rbuffer)
@@ -117,9 +319,15 @@ namespace socketchat
             }
             // Read from the socket
             int32_t ret = mSocket->receive(rbuffer, DEFAULT_MAX_READ_SIZE);
+            mStats.mReceiveCalls++;
             // If we got no data but the transmission is still valid, just exit
             if (ret < 0 && (mSocket->wouldBlock() || mSocket->inProgress()))
             {
+                mStats.mReceiveWouldBlock++;
+                if (dispatched)
+                {
+                    continue; // stream data stopped at a message; look again
+                }
                 break;
             }
             else if (ret <= 0) // If the socket is in a bad state and we got no data, close the connection
@@ -133,19 +341,211 @@ namespace socketchat
             {
                 // Advance the buffer pointer by the number of bytes read
                 mReceiveBuffer->addBuffer(nullptr, ret);
+                mStats.mBytesReceived += uint32_t(ret);
+#if USE_LOGGING
+                logReceive(rbuffer, uint32_t(ret));
+#endif
+                if (mReceiveBuffer->getSize() > mStats.mReceiveHighWater)
+                {
+                    mStats.mReceiveHighWater = mReceiveBuffer->getSize();
+                }
             }
         }
         if (mReadyState == CLOSED)
         {
             return;
         }
-        while (mTransmitBuffer->getSize())
+        drainSendQueue();
+        transmitData();
+        if (mReadyState == SocketChat::CLOSED)
         {
-            uint32_t dataLen;
-            const uint8_t *buffer = mTransmitBuffer->getData(dataLen);
-            int32_t ret = mSocket->send(buffer, dataLen);
+            return;
+        }
+        if (callback)
+        {
+            if (mFraming == FRAMING_BINARY)
+            {
+                _dispatchFrames(callback);
+            }
+            else
+            {
+                _dispatchBinary(callback);
+            }
+        }
+    }
+
+    virtual uint32_t tryReceive(SocketChatCallback *callback, uint32_t maxMessages) override final
+    {
+        (void)callback;
+        (void)maxMessages;
+        return 0;
+    }
+
+    virtual void flush(void) override final
+    {
+        if (!mSocket || mReadyState == CLOSED)
+        {
+            return;
+        }
+        if (mReadyState == CONNECTING && !advanceConnect(0))
+        {
+            return;
+        }
+        drainSendQueue();
+        transmitData();
+    }
+
+    // Moves an asynchronous connect along, waiting up to 'timeout' milliseconds. Returns true once it is open.
+    bool advanceConnect(int32_t timeout)
+    {
+        switch (mSocket->pollConnect(timeout))
+        {
+            case wsocket::CONNECT_DONE:
+                mReadyState = OPEN;
+                return true;
+            case wsocket::CONNECT_FAILED:
+                mSocket->close();
+                mReadyState = CLOSED;
+                fputs("Unable to connect!\n", stderr);
+                return false;
+            default:
+                return false;
+        }
+    }
+
+    // Moves what other threads have sent since the last call into the transmit queue. Takes no more
+    // than one queue's worth, so producers which never stop cannot keep the polling thread here.
+    void drainSendQueue(void)
+    {
+        if (!mSendQueue)
+        {
+            return;
+        }
+        // Sends from here on notify the event loop again
+        mSendQueued.store(false);
+        SharedMessage *message;
+        uint32_t i = mSendQueue->getCapacity();
+        for (; i && mSendQueue->pop(message); i--)
+        {
+            // Small messages are copied so that consecutive ones share a segment of the transmit buffer
+            uint32_t payloadLen;
+            const uint8_t *payload = message->getPayload(payloadLen);
+            bool queued;
+            if (payloadLen <= SEND_QUEUE_COPY_SIZE && !mQueueByReference)
+            {
+                queued = queueFrame(payload, payloadLen);
+            }
+            else
+            {
+                queued = queueShared(message);
+            }
+            if (!queued)
+            {
+                sendQueueDropped();
+            }
+            message->release();
+        }
+        // A whole queue's worth was taken, so there may be more; come back for it
+        if (i == 0)
+        {
+            notifySendQueued();
+        }
+    }
+
+    // Any thread. Tells the event loop, once until it next drains the queue, that there is something in it
+    void notifySendQueued(void)
+    {
+        if (mSendQueued.exchange(true))
+        {
+            return;
+        }
+        SocketChatTransmitNotify *notify = mSendQueueNotify.load(std::memory_order_acquire);
+        if (notify)
+        {
+            notify->transmitQueued(this);
+        }
+    }
+
+    // The sender was told this message had gone, but the transmit buffer could not take it after all.
+    // Counts it and, unless the connection is gone anyway, tells the watermark callback it is falling behind.
+    void sendQueueDropped(void)
+    {
+        mStats.mMessagesDropped++;
+        if (mDisconnected || mOverHighWater)
+        {
+            return;
+        }
+        mOverHighWater = true;
+        mStats.mHighWaterCount++;
+        if (mWatermarkCallback)
+        {
+            mWatermarkCallback->transmitHighWater(this, getTransmitBufferSize());
+        }
+    }
+
+    // Send as much of the transmit queue as the socket will accept
+    void transmitData(void)
+    {
+        if (mMessageTransport)
+        {
+            transmitMessages();
+        }
+        else
+        {
+            transmitStream();
+        }
+        if (mReadyState == SocketChat::CLOSED)
+        {
+            return;
+        }
+        if (mTransmitQueue.empty() && mReadyState == CLOSING)
+        {
+            mSocket->close();
+            mReadyState = CLOSED;
+        }
+    }
+
+    // Gathers the queued segments into as few socket calls as possible
+    void transmitStream(void)
+    {
+        while (!mTransmitQueue.empty())
+        {
+            // Gather the queued segments; buffered segments follow each other in the transmit buffer
+            wsocket::WsocketIovec iov[WSOCKET_MAX_IOV];
+            uint32_t iovCount = 0;
+            uint32_t total = 0;
+            uint32_t bufferLen;
+            const uint8_t *buffer = mTransmitBuffer->getData(bufferLen);
+            for (auto &i : mTransmitQueue)
+            {
+                if (iovCount == WSOCKET_MAX_IOV)
+                {
+                    break;
+                }
+                if (i.mMessage)
+                {
+                    uint32_t dataLen;
+                    const uint8_t *data = i.mMessage->getData(dataLen);
+                    uint32_t offset = iovCount ? 0 : mTransmitOffset;
+                    iov[iovCount].mData = data + offset;
+                    iov[iovCount].mLength = dataLen - offset;
+                }
+                else
+                {
+                    iov[iovCount].mData = buffer;
+                    iov[iovCount].mLength = i.mLength;
+                    buffer += i.mLength;
+                }
+                total += iov[iovCount].mLength;
+                iovCount++;
+            }
+            // If the queue holds more than one call's worth, keep the packet open for the next call
+            bool moreToCome = iovCount < mTransmitQueue.size();
+            int32_t ret = (iovCount == 1 && !moreToCome) ? mSocket->send(iov[0].mData, iov[0].mLength) : mSocket->sendv(iov, iovCount, moreToCome);
+            mStats.mSendCalls++;
             if (ret < 0 && (mSocket->wouldBlock() || mSocket->inProgress()))
             {
+                mStats.mSendWouldBlock++;
                 break;
             }
             else if (ret <= 0)
@@ -155,29 +555,193 @@ namespace socketchat
                 fputs(ret < 0 ? "Connection error!\n" : "Connection closed!\n", stderr);
                 break;
             }
+            mStats.mBytesSent += uint32_t(ret);
+#if USE_LOGGING
+            logSendv(iov, iovCount, uint32_t(ret));
+#endif
+            consumeTransmit(uint32_t(ret));
+            if (uint32_t(ret) < total)
+            {
+                break; // the socket is full; wait until it is writable again
+            }
+        }
+    }
+
+    // Hands each queued message to the transport as a message of its own, without framing
+    void transmitMessages(void)
+    {
+        while (!mTransmitQueue.empty())
+        {
+            TransmitSegment &s = mTransmitQueue.front();
+            const uint8_t *data;
+            uint32_t dataLen;
+            uint32_t queued;
+            if (s.mMessage)
+            {
+                data = s.mMessage->getPayload(dataLen);
+                s.mMessage->getData(queued);
+            }
             else
             {
-                mTransmitBuffer->consume(ret); // shrink the transmit buffer by the number of bytes we managed to send..
+                // Messages wait in the transmit buffer behind a length prefix (see queueFrame)
+                uint32_t bufferLen;
+                const uint8_t *buffer = mTransmitBuffer->getData(bufferLen);
+                int32_t prefix = readVarint(buffer, bufferLen, dataLen);
+                data = buffer + prefix;
+                queued = uint32_t(prefix) + dataLen;
             }
+            mStats.mSendCalls++;
+            if (!mSocket->sendMessage(data, dataLen))
+            {
+                mStats.mSendWouldBlock++;
+                break; // the transport is full; it signals when there is room again
+            }
+            mStats.mBytesSent += dataLen;
+#if USE_LOGGING
+            logSend(data, dataLen);
+#endif
+            consumeTransmit(queued);
         }
-        if (mReadyState == SocketChat::CLOSED)
+    }
+
+    // Drops 'len' sent bytes from the front of the transmit queue
+    void consumeTransmit(uint32_t len)
+    {
+        uint64_t now = 0;
+        while (len && !mTransmitQueue.empty())
         {
-            return;
+            TransmitSegment &s = mTransmitQueue.front();
+            if (s.mMessage)
+            {
+                uint32_t dataLen;
+                s.mMessage->getData(dataLen);
+                uint32_t remaining = dataLen - mTransmitOffset;
+                if (len < remaining)
+                {
+                    mTransmitOffset += len;
+                    mSharedBytes -= len;
+                    break;
+                }
+                len -= remaining;
+                mSharedBytes -= remaining;
+                mTransmitOffset = 0;
+                recordQueueTime(s, now);
+                s.mMessage->release();
+                mTransmitQueue.pop_front();
+            }
+            else
+            {
+                uint32_t sent = len < s.mLength ? len : s.mLength;
+                mTransmitBuffer->consume(sent); // shrink the transmit buffer by the number of bytes we managed to send..
+                s.mLength -= sent;
+                len -= sent;
+                if (s.mLength == 0)
+                {
+                    recordQueueTime(s, now);
+                    mTransmitQueue.pop_front();
+                }
+            }
         }
-        if (!mTransmitBuffer->getSize() && mReadyState == CLOSING)
+        transmitShrank();
+    }
+
+    // A segment has been sent in full. Its messages are all timed from when the first of them was queued.
+    // 'now' is read once per call of consumeTransmit.
+    void recordQueueTime(const TransmitSegment &s, uint64_t &now)
+    {
+        if (!now)
         {
-            mSocket->close();
-            mReadyState = CLOSED;
+            now = nowNanoseconds();
         }
-        if (callback)
+        mStats.mQueueTime.record(now - s.mQueuedAt, s.mMessages);
+    }
+
+    // Counts a message delivered to the callback. 'start' is when its dispatch began (0 if not yet read),
+    // and becomes when the next one's did, so each message costs one clock read.
+    void recordDispatch(uint32_t len, uint64_t &start)
+    {
+        uint64_t now = nowNanoseconds();
+        mStats.mMessagesReceived++;
+        mStats.mReceiveSize.record(len);
+        mStats.mDispatchTime.record(now - start);
+        start = now;
+    }
+
+    // Split length prefixed messages out of the receive buffer; each one costs the same regardless of its size
+    void _dispatchFrames(SocketChatCallback *callback)
+    {
+        uint64_t start = 0;
+        while (mReadyState != CLOSED)
+        {
+            uint32_t dataLen;
+            uint8_t *data = mReceiveBuffer->getData(dataLen);
+            uint32_t messageLen;
+            int32_t prefix = readVarint(data, dataLen, messageLen);
+            if (prefix == 0)
+            {
+                break;
+            }
+            if (prefix < 0 || messageLen > mReceiveBuffer->getMaxGrowSize() - MAX_VARINT_SIZE)
+            {
+                mSocket->close();
+                mReadyState = CLOSED;
+                fputs("Invalid message frame!\n", stderr);
+                break;
+            }
+            uint32_t frameLen = uint32_t(prefix) + messageLen;
+            if (dataLen < frameLen)
+            {
+                // Make room for the rest of the message up front rather than growing a read at a time
+                mReceiveBuffer->confirmCapacity(frameLen - dataLen);
+                break;
+            }
+            if (!start)
+            {
+                start = nowNanoseconds();
+            }
+            callback->receiveBinary(data + prefix, messageLen);
+            mReceiveBuffer->consume(frameLen);
+            recordDispatch(messageLen, start);
+        }
+    }
+
+    // Delivers the messages the transport has ready, in place: no terminator to scan for and no copy
+    // into the receive buffer. Returns how many were delivered.
+    uint32_t _dispatchMessages(SocketChatCallback *callback)
+    {
+        uint32_t ret = 0;
+        uint32_t dataLen;
+        const void *data;
+        uint64_t start = 0;
+        while ((data = mSocket->receiveMessage(dataLen)) != nullptr)
         {
-            _dispatchBinary(callback);
+            if (!start)
+            {
+                start = nowNanoseconds();
+            }
+            mStats.mBytesReceived += dataLen;
+#if USE_LOGGING
+            logReceive(data, dataLen);
+#endif
+            if (mFraming == FRAMING_BINARY)
+            {
+                callback->receiveBinary(data, dataLen);
+            }
+            else
+            {
+                callback->receiveMessage((const char *)data);
+            }
+            mSocket->releaseMessage();
+            recordDispatch(dataLen, start);
+            ret++;
         }
+        return ret;
     }
 
     // Look for messages in the input receive buffer
     virtual void _dispatchBinary(SocketChatCallback *callback)
     {
+        uint64_t start = 0;
         while (true)
         {
             uint32_t dataLen;
@@ -186,80 +750,323 @@ namespace socketchat
             {
                 break;
             }
-            bool haveMessage = false;
-            uint32_t messageEnd = 0;
-            for (uint32_t i = 0; i < (dataLen - 1); i++)
-            {
-                if (data[i] == 13 &&
-                    data[i+1] == 10)
-                {
-                    haveMessage = true;
-                    messageEnd = i;
-                    break;
-                }
-            }
-            if (!haveMessage)
+            // Only looks at bytes which arrived since the last scan
+            uint32_t messageEnd = mFrameScanner.scan(data, dataLen);
+            if (messageEnd == framescanner::cNotFound)
             {
                 break;
             }
             data[messageEnd] = 0;
+            if (!start)
+            {
+                start = nowNanoseconds();
+            }
             callback->receiveMessage((const char *)data);
             mReceiveBuffer->consume(messageEnd + 2);
+            mFrameScanner.consume(messageEnd + 2);
+            recordDispatch(messageEnd, start);
         }
     }
 
-		virtual void sendText(const char *str) override final
+		virtual bool sendText(const char *str) override final
 		{
             size_t len = str ? strlen(str) : 0;
-            mTransmitBuffer->addBuffer(str, uint32_t(len));
-            mTransmitBuffer->addBuffer("\r\n", 2);
+            if (mSendQueue)
+            {
+                return pushSendQueue(SharedMessageImpl::create(str, uint32_t(len), mFraming));
+            }
+            return queueFrame(str, uint32_t(len));
 		}
 
-#if USE_LOGGING
-        void logReceive(const void *messageData, uint32_t message_size)
-        {
-            if (mLogFile)
+		virtual bool sendBinary(const void *data, uint32_t dataLen) override final
+		{
+            if (mSendQueue)
             {
-                fprintf(mLogFile, "===================================================================\r\n");
-                fprintf(mLogFile, "RECEIVE[%d] : %d bytes\r\n", ++mReceiveCount, message_size);
-                fprintf(mLogFile, "===================================================================\r\n");
-                logData(messageData, message_size);
-                fprintf(mLogFile, "\r\n");
-                fprintf(mLogFile, "===================================================================\r\n");
-                fprintf(mLogFile, "\r\n");
-                fflush(mLogFile);
+                return pushSendQueue(SharedMessageImpl::create(data, dataLen, mFraming));
             }
-        }
+            return queueFrame(data, dataLen);
+		}
 
-        void logData(const void *messageData, uint32_t message_size)
-        {
-            const uint8_t *scan = (const uint8_t *)messageData;
-            for (uint32_t i = 0; i < message_size; i++)
+		// Any thread. Hands a message, and the reference the caller holds on it, to the polling thread.
+		bool pushSendQueue(SharedMessage *message)
+		{
+            if (mSendQueue->push(message))
+            {
+                notifySendQueued();
+                return true;
+            }
+            message->release();
+            return false;
+		}
+
+		// Copies one message into the transmit buffer along with its framing.
+		// A message transport with nothing queued takes the message straight away instead.
+		// Returns false if the transmit buffer could not grow to hold it.
+		bool queueFrame(const void *data, uint32_t len)
+		{
+            if (mDisconnected)
+            {
+                return false;
+            }
+            bool wasEmpty = mTransmitQueue.empty();
+            if (mMessageTransport && wasEmpty && mReadyState == OPEN)
             {
-                uint8_t c = scan[i];
-                if (c >= 32 && c < 128)
+                mStats.mSendCalls++;
+                if (mSocket->sendMessage(data, len))
                 {
-                    fprintf(mLogFile, "%c", c);
+                    mStats.mMessagesSent++;
+                    mStats.mSendSize.record(len);
+                    mStats.mBytesSent += len;
+                    mStats.mQueueTime.record(0);
+#if USE_LOGGING
+                    logSend(data, len);
+#endif
+                    return true;
+                }
+                mStats.mSendWouldBlock++;
+            }
+            if (mQueueByReference)
+            {
+                SharedMessageImpl *message = SharedMessageImpl::create(data, len, mFraming);
+                mStats.mMessagesSent++;
+                mStats.mSendSize.record(len);
+                appendShared(message);
+                message->release();
+                return true;
+            }
+            // Messages queued for a message transport only need their length, whatever the framing mode
+            FramingMode framing = mMessageTransport ? FRAMING_BINARY : mFraming;
+            uint32_t added = 0;
+            uint8_t *dest = mTransmitBuffer->confirmCapacity(len + maxFramingSize(framing));
+            if (dest)
+            {
+                added = frameMessage(dest, data, len, framing);
+                mTransmitBuffer->addBuffer(nullptr, added);
+            }
+            if (added)
+            {
+                mStats.mMessagesSent++;
+                mStats.mSendSize.record(len);
+                // Consecutive text messages share one segment of the transmit buffer
+                if (!mTransmitQueue.empty() && mTransmitQueue.back().mMessage == nullptr)
+                {
+                    mTransmitQueue.back().mLength += added;
+                    mTransmitQueue.back().mMessages++;
                 }
                 else
                 {
-                    fprintf(mLogFile, "$%02X", uint32_t(c));
+                    TransmitSegment s;
+                    s.mLength = added;
+                    s.mMessages = 1;
+                    s.mQueuedAt = nowNanoseconds();
+                    mTransmitQueue.push_back(s);
                 }
             }
+            if (wasEmpty && added && mTransmitNotify)
+            {
+                mTransmitNotify->transmitPending(this);
+            }
+            if (added)
+            {
+                transmitGrew();
+            }
+            return added != 0;
+		}
+
+		virtual bool sendShared(SharedMessage *message) override final
+		{
+            if (!message)
+            {
+                return false;
+            }
+            if (mSendQueue)
+            {
+                message->addRef();
+                return pushSendQueue(message);
+            }
+            return queueShared(message);
+		}
+
+		// Adds a reference to the message to the transmit queue
+		bool queueShared(SharedMessage *message)
+		{
+            if (message->getFraming() != mFraming)
+            {
+                uint32_t payloadLen;
+                const uint8_t *payload = message->getPayload(payloadLen);
+                return queueFrame(payload, payloadLen);
+            }
+            if (mDisconnected)
+            {
+                return false;
+            }
+            uint32_t payloadLen;
+            message->getPayload(payloadLen);
+            mStats.mMessagesSent++;
+            mStats.mSendSize.record(payloadLen);
+            appendShared(message);
+            return true;
+		}
+
+		// Queues a reference to the message as a segment of its own
+		void appendShared(SharedMessage *message)
+		{
+            bool wasEmpty = mTransmitQueue.empty();
+            uint32_t dataLen;
+            message->getData(dataLen);
+            message->addRef();
+            TransmitSegment s;
+            s.mMessage = message;
+            s.mMessages = 1;
+            s.mQueuedAt = nowNanoseconds();
+            mTransmitQueue.push_back(s);
+            mSharedBytes += dataLen;
+            if (wasEmpty && mTransmitNotify)
+            {
+                mTransmitNotify->transmitPending(this);
+            }
+            transmitGrew();
+		}
+
+		// The backlog grew; applies the slow consumer policy if it is now over the high water mark
+		void transmitGrew(void)
+		{
+            updateTransmitHighWater();
+            reportTransmitMemory();
+            if (!mHighWaterMark || getTransmitBufferSize() <= mHighWaterMark)
+            {
+                return;
+            }
+            switch (mSlowConsumerPolicy)
+            {
+                case SLOW_CONSUMER_NOTIFY:
+                    break;
+                case SLOW_CONSUMER_DISCONNECT:
+                    disconnectSlowConsumer();
+                    break;
+                case SLOW_CONSUMER_DROP_OLDEST:
+                    dropQueued(false);
+                    break;
+                case SLOW_CONSUMER_CONFLATE:
+                    dropQueued(true);
+                    break;
+            }
+            if (!mOverHighWater)
+            {
+                mOverHighWater = true;
+                mStats.mHighWaterCount++;
+                if (mWatermarkCallback)
+                {
+                    mWatermarkCallback->transmitHighWater(this, getTransmitBufferSize());
+                }
+            }
+		}
+
+		// The backlog shrank; tells the watermark callback once it has drained to the low water mark
+		void transmitShrank(void)
+		{
+            reportTransmitMemory();
+            if (mOverHighWater && getTransmitBufferSize() <= mLowWaterMark)
+            {
+                mOverHighWater = false;
+                if (mWatermarkCallback)
+                {
+                    mWatermarkCallback->transmitLowWater(this, getTransmitBufferSize());
+                }
+            }
+		}
+
+		// Drops whole messages which have not started to go out, oldest first: until the backlog is back
+		// under the high water mark or, when conflating, all but the newest
+		void dropQueued(bool conflate)
+		{
+            // The message at the front may be partly sent already
+            size_t first = mTransmitOffset ? 1 : 0;
+            size_t last = mTransmitQueue.size() - (conflate ? 1 : 0);
+            size_t end = first;
+            uint32_t pending = getTransmitBufferSize();
+            while (end < last && (conflate || pending > mHighWaterMark))
+            {
+                TransmitSegment &s = mTransmitQueue[end];
+                if (!s.mMessage)
+                {
+                    break; // bytes in the transmit buffer cannot be taken out of the middle of it
+                }
+                uint32_t dataLen;
+                s.mMessage->getData(dataLen);
+                pending -= dataLen;
+                mSharedBytes -= dataLen;
+                mStats.mMessagesDropped += s.mMessages;
+                s.mMessage->release();
+                end++;
+            }
+            mTransmitQueue.erase(mTransmitQueue.begin() + first, mTransmitQueue.begin() + end);
+            reportTransmitMemory();
+		}
+
+		// Closes the connection at once and throws away everything waiting to be sent
+		void disconnectSlowConsumer(void)
+		{
+            fputs("Slow consumer disconnected!\n", stderr);
+            mSocket->close();
+            mReadyState = CLOSED;
+            mDisconnected = true;
+            for (auto &i : mTransmitQueue)
+            {
+                if (i.mMessage)
+                {
+                    i.mMessage->release();
+                }
+                mStats.mMessagesDropped += i.mMessages;
+            }
+            mTransmitQueue.clear();
+            mTransmitBuffer->consume(mTransmitBuffer->getSize());
+            mSharedBytes = 0;
+            mTransmitOffset = 0;
+            reportTransmitMemory();
+            // An event loop only looks at a connection it has news of
+            if (mTransmitNotify)
+            {
+                mTransmitNotify->transmitPending(this);
+            }
+		}
+
+		// Passes on changes in the backlog to the process wide total, in steps of at least
+		// TRANSMIT_MEMORY_GRANULARITY so busy connections do not all contend for it on every message
+		void reportTransmitMemory(void)
+		{
+            uint64_t pending = getTransmitBufferSize();
+            uint64_t change = pending > mReportedPending ? pending - mReportedPending : mReportedPending - pending;
+            if (change >= TRANSMIT_MEMORY_GRANULARITY || (pending == 0 && mReportedPending))
+            {
+                gTransmitMemory.fetch_add(pending - mReportedPending, std::memory_order_relaxed); // wraps around for a decrease
+                mReportedPending = pending;
+            }
+		}
+
+#if USE_LOGGING
+        // The I/O path only copies the bytes into the log's ring; WireLogDump renders them
+        void logReceive(const void *messageData, uint32_t message_size)
+        {
+            if (mLogStream)
+            {
+                mLogStream->record(CAPTURE_RECEIVE, messageData, message_size);
+            }
         }
 
         void logSend(const void *messageData, uint32_t message_size)
         {
-            if (mLogFile)
+            if (mLogStream)
             {
-                fprintf(mLogFile, "===================================================================\r\n");
-                fprintf(mLogFile, "SEND[%d] : %d bytes\r\n", ++mSendCount, message_size);
-                fprintf(mLogFile, "===================================================================\r\n");
-                logData(messageData, message_size);
-                fprintf(mLogFile, "\r\n");
-                fprintf(mLogFile, "===================================================================\r\n");
-                fprintf(mLogFile, "\r\n");
-                fflush(mLogFile);
+                mLogStream->record(CAPTURE_SEND, messageData, message_size);
+            }
+        }
+
+        void logSendv(const wsocket::WsocketIovec *iov, uint32_t iovCount, uint32_t message_size)
+        {
+            if (mLogStream)
+            {
+                mLogStream->recordv(CAPTURE_SEND, iov, iovCount, message_size);
             }
         }
 #endif
@@ -272,6 +1079,13 @@ namespace socketchat
                 {
                     return;
                 }
+                // Nothing has been sent yet, so there is nothing to finish sending
+                if (mReadyState == CONNECTING)
+                {
+                    mSocket->close();
+                    mReadyState = CLOSED;
+                    return;
+                }
                 // add the 'close frame' command to the transmit buffer and set the closing state on
                 mReadyState = CLOSING;
             }
@@ -297,7 +1111,7 @@ namespace socketchat
 		// Return the amount of memory being consumed by the pending transmit buffer
 		virtual uint32_t getTransmitBufferSize(void) const override final
 		{
-            return mTransmitBuffer ? mTransmitBuffer->getSize() : 0;
+            return (mTransmitBuffer ? mTransmitBuffer->getSize() : 0) + mSharedBytes;
 		}
 
 		// Maximum size of the buffer
@@ -306,46 +1120,123 @@ namespace socketchat
             return mTransmitBuffer ? mTransmitBuffer->getMaxBufferSize() : 0;
 		}
 
+		virtual void getStats(SocketChatStats &stats) const override final
+		{
+            stats = mStats;
+            stats.mConnections = 1;
+            stats.mTransmitPending = getTransmitBufferSize();
+#if USE_LOGGING
+            stats.mLogDropped = mLogStream ? mLogStream->getDropCount() : 0;
+#endif
+		}
+
+		void updateTransmitHighWater(void)
+		{
+            uint32_t size = getTransmitBufferSize();
+            if (size > mStats.mTransmitHighWater)
+            {
+                mStats.mTransmitHighWater = size;
+            }
+		}
+
         // Log all sends
         virtual bool setLogFile(const char *fileName) override final
         {
 #if USE_LOGGING
-            if (mLogFile == nullptr)
+            if (mLogStream == nullptr)
             {
-                char scratch[512];
-                static uint32_t gSaveCount = 0;
-                snprintf(scratch, 512, "%s%d.txt", fileName, ++gSaveCount);
-                mLogFile = fopen(scratch, "wb");
-                fprintf(mLogFile, "======================================================================\r\n");
-                fprintf(mLogFile, "**** NEW SocketChat INSTANCE[%d] ****\r\n", gSaveCount);
-                fprintf(mLogFile, "======================================================================\r\n");
-                fflush(mLogFile);
+                wirelog::WireLog *log = wirelog::WireLog::create(fileName);
+                if (log)
+                {
+                    mLogStream = log->openStream();
+                    log->release(); // the stream keeps it open
+                }
             }
 
-            return mLogFile ? true : false;
+            return mLogStream ? true : false;
 #else
 			(fileName);
 			return false;
 #endif
         }
 
+		virtual int64_t getSocketHandle(void) const override final
+		{
+			return mSocket ? mSocket->getSocketHandle() : -1;
+		}
+
+		virtual wsocket::Wsocket *getSocket(void) const override final
+		{
+			return mSocket;
+		}
+
+		virtual void setTransmitNotify(SocketChatTransmitNotify *notify) override final
+		{
+			mTransmitNotify = notify;
+			mSendQueueNotify.store(notify, std::memory_order_release);
+		}
+
+		virtual void setWatermarkCallback(SocketChatWatermarkCallback *callback) override final
+		{
+			mWatermarkCallback = callback;
+		}
+
+		virtual FramingMode getFraming(void) const override final
+		{
+			return mFraming;
+		}
+
 	private:
         SocketChatCallback           *mCallback{ nullptr };
+        SocketChatTransmitNotify     *mTransmitNotify{ nullptr };
+        SocketChatWatermarkCallback  *mWatermarkCallback{ nullptr };
 		simplebuffer::SimpleBuffer	*mReceiveBuffer{ nullptr };		// receive buffer
 		simplebuffer::SimpleBuffer	*mTransmitBuffer{ nullptr };	// transmit buffer
+		std::deque< TransmitSegment >	mTransmitQueue;				// what to send next, in order
+		mpsc::MPSCQueue< SharedMessage * >	*mSendQueue{ nullptr };	// messages sent from other threads, waiting for 'poll'
+		std::atomic<SocketChatTransmitNotify *>	mSendQueueNotify{ nullptr };	// mTransmitNotify, as the sending threads see it
+		std::atomic<bool>					mSendQueued{ false };	// The event loop has been told about the send queue since it last drained it
+		uint32_t					mTransmitOffset{ 0 };			// bytes of the shared message at the front already sent
+		uint32_t					mSharedBytes{ 0 };				// unsent bytes of queued shared messages
+		framescanner::FrameScanner	mFrameScanner;					// how far the receive buffer has been searched for a message terminator
 		wsocket::Wsocket			*mSocket{ nullptr };
 		ReadyStateValues			mReadyState{ CLOSED };
+		FramingMode					mFraming{ FRAMING_TEXT };
+		bool						mMessageTransport{ false };	// the socket keeps message boundaries itself, so nothing is framed
 		bool						mIsServerClient{ false }; // We are a server and this is a connection to a remote client
-        uint32_t                    mSendCount{ 0 };
-        uint32_t                    mReceiveCount{ 0 };
+        SocketChatStats             mStats;
+        uint32_t                    mHighWaterMark{ 0 };		// zero when the water marks are off
+        uint32_t                    mLowWaterMark{ 0 };
+        SlowConsumerPolicy          mSlowConsumerPolicy{ SLOW_CONSUMER_NOTIFY };
+        bool                        mQueueByReference{ false };	// every message is a segment of its own, so it can be dropped
+        bool                        mOverHighWater{ false };	// went over the high water mark and has not drained to the low one yet
+        bool                        mDisconnected{ false };		// closed by SLOW_CONSUMER_DISCONNECT; sends fail
+        uint64_t                    mReportedPending{ 0 };		// backlog included in gTransmitMemory
 #if USE_LOGGING
-        FILE                        *mLogFile{ nullptr };
+        wirelog::WireLogStream      *mLogStream{ nullptr };
 #endif
 };
 
+SharedMessage *SharedMessage::create(const char *str)
+{
+	size_t len = str ? strlen(str) : 0;
+	return static_cast<SharedMessage *>(SharedMessageImpl::create(str, uint32_t(len), FRAMING_TEXT));
+}
+
+SharedMessage *SharedMessage::createBinary(const void *data, uint32_t dataLen)
+{
+	return static_cast<SharedMessage *>(SharedMessageImpl::create(data, dataLen, FRAMING_BINARY));
+}
+
 SocketChat *SocketChat::create(const char *host,uint32_t port)
 {
-    auto ret = new SocketChatImpl(host, port);
+	SocketChatOptions options;
+	return create(host, port, options);
+}
+
+SocketChat *SocketChat::create(const char *host, uint32_t port, const SocketChatOptions &options)
+{
+    auto ret = new SocketChatImpl(host, port, options);
 	if (!ret->isValid())
 	{
 		delete ret;
@@ -357,7 +1248,13 @@ SocketChat *SocketChat::create(const char *host,uint32_t port)
 // Create call for the server when a new client connection is established
 SocketChat *SocketChat::create(wsocket::Wsocket *clientSocket)
 {
-	auto ret = new SocketChatImpl(clientSocket);
+	SocketChatOptions options;
+	return create(clientSocket, options);
+}
+
+SocketChat *SocketChat::create(wsocket::Wsocket *clientSocket, const SocketChatOptions &options)
+{
+	auto ret = new SocketChatImpl(clientSocket, options);
 	if (!ret->isValid())
 	{
 		delete ret;
@@ -377,4 +1274,9 @@ void socketShutdown(void)
 	wsocket::Wsocket::shutdownSockets();
 }
 
+uint64_t getTransmitMemory(void)
+{
+	return gTransmitMemory.load(std::memory_order_relaxed);
+}
+
 } // namespace socketchat
@@ -5,6 +5,8 @@
 //
 #include <stdint.h>
 
+#include "Histogram.h"
+
 namespace wsocket
 {
 	class Wsocket;
@@ -13,11 +15,180 @@ namespace wsocket
 namespace socketchat 
 {
 
+// How messages are delimited on the wire. Both ends of a connection must use the same mode.
+enum FramingMode
+{
+	FRAMING_TEXT,		// ASCIIZ text terminated by CR/LF; the default
+	FRAMING_BINARY,		// Arbitrary bytes preceded by a varint length prefix
+};
+
+// What a connection does when more than its high water mark is waiting to be sent (see SocketChatOptions)
+enum SlowConsumerPolicy
+{
+	SLOW_CONSUMER_NOTIFY,		// Only tell the watermark callback; the sender decides what to do
+	SLOW_CONSUMER_DISCONNECT,	// Close the connection at once, discarding whatever is waiting
+	SLOW_CONSUMER_DROP_OLDEST,	// Drop the oldest messages not yet started until it is back under the high water mark
+	SLOW_CONSUMER_CONFLATE,		// Drop every message not yet started except the newest
+};
+
+// Optional settings used when creating a connection
+struct SocketChatOptions
+{
+	FramingMode	mFraming{ FRAMING_TEXT };
+	// Use mirrored ring buffers (see SimpleBuffer.h) for transmit and receive, so buffered data is
+	// never compacted. Each connection then uses two extra file descriptors and four memory mappings.
+	bool		mMirroredBuffers{ false };
+	// When non-zero, sendText, sendBinary and sendShared may be called from any number of threads at once.
+	// Messages then go through a lock-free queue with room for this many, which the thread calling
+	// 'poll' (or 'flush') drains into the transmit buffer; a send fails rather than waits when it is full.
+	// A queued message which then finds the transmit buffer full is dropped, counted in mMessagesDropped
+	// and reported through SocketChatWatermarkCallback::transmitHighWater. A connection driven by a
+	// SocketChatReactor (or SocketChatServer) wakes it to flush the queue; stop sending from other
+	// threads before the connection is removed from the reactor.
+	uint32_t	mSendQueueSize{ 0 };
+	// Client connections only. Records everything the connection sends and receives to this capture
+	// file (see Capture.h), to be replayed later through Wsocket::create(playbackFile).
+	const char	*mCaptureFile{ nullptr };
+	// Client connections only. Return from 'create' at once, in the CONNECTING state, and connect in the
+	// background (see WsocketOptions::mConnectAsync); 'poll' and 'flush' move it on, to OPEN or, if no
+	// address answers, to CLOSED. Messages sent meanwhile wait in the transmit queue.
+	bool		mConnectAsync{ false };
+	// Client connections only. Milliseconds to keep trying to connect, or 0 for the default of a minute
+	uint32_t	mConnectTimeout{ 0 };
+	// Bytes waiting to be sent (see getTransmitBufferSize) above which the connection applies
+	// 'mSlowConsumerPolicy' and calls its watermark callback; zero turns the water marks off, leaving only
+	// the transmit buffer's own maximum size. Once over, the connection calls back again when the backlog
+	// has drained to 'mLowWaterMark'. Under SLOW_CONSUMER_DROP_OLDEST and SLOW_CONSUMER_CONFLATE every
+	// message is queued as a message of its own, so it can be dropped without disturbing the others.
+	uint32_t	mHighWaterMark{ 0 };
+	uint32_t	mLowWaterMark{ 0 };
+	SlowConsumerPolicy	mSlowConsumerPolicy{ SLOW_CONSUMER_NOTIFY };
+};
+
+// Counters every connection keeps as it runs (see SocketChat::getStats). They cost a few increments per
+// call and a clock read per message, so they are always on. The same structure holds the totals of
+// many connections (see SocketChatServer::getStats).
+struct SocketChatStats
+{
+	uint64_t	mBytesSent{ 0 };			// Bytes the transport accepted, framing included
+	uint64_t	mBytesReceived{ 0 };		// Bytes read from the transport, framing included
+	uint64_t	mMessagesSent{ 0 };			// Messages queued with the send methods
+	uint64_t	mMessagesReceived{ 0 };		// Messages delivered to the callback
+	uint64_t	mSendCalls{ 0 };			// Calls into the transport to send (system calls, for sockets)
+	uint64_t	mReceiveCalls{ 0 };			// Calls into the transport to receive
+	uint64_t	mSendWouldBlock{ 0 };		// Sends which found the transport full (EAGAIN)
+	uint64_t	mReceiveWouldBlock{ 0 };	// Receives which found nothing to read (EAGAIN)
+	uint32_t	mTransmitHighWater{ 0 };	// Most bytes ever waiting to be sent
+	uint32_t	mReceiveHighWater{ 0 };		// Most bytes ever buffered waiting to be dispatched
+	uint32_t	mConnections{ 0 };			// How many connections these figures cover
+	uint64_t	mLogDropped{ 0 };			// Wire log records dropped because the log could not keep up (see setLogFile)
+	uint64_t	mMessagesDropped{ 0 };		// Messages dropped unsent by the slow consumer policy, or by a full transmit buffer
+	uint64_t	mHighWaterCount{ 0 };		// Times the backlog went over the high water mark
+	uint64_t	mTransmitPending{ 0 };		// Bytes waiting to be sent when the figures were taken
+	histogram::Histogram	mSendSize;		// Bytes per message sent, without framing
+	histogram::Histogram	mReceiveSize;	// Bytes per message received, without framing
+	histogram::Histogram	mDispatchTime;	// Nanoseconds to dispatch each received message, callback included
+	histogram::Histogram	mQueueTime;		// Nanoseconds from queueing a message until the transport took all of it
+
+	// Adds another set of figures to these; high water marks take the larger of the two
+	void merge(const SocketChatStats &other)
+	{
+		mBytesSent += other.mBytesSent;
+		mBytesReceived += other.mBytesReceived;
+		mMessagesSent += other.mMessagesSent;
+		mMessagesReceived += other.mMessagesReceived;
+		mSendCalls += other.mSendCalls;
+		mReceiveCalls += other.mReceiveCalls;
+		mSendWouldBlock += other.mSendWouldBlock;
+		mReceiveWouldBlock += other.mReceiveWouldBlock;
+		mTransmitHighWater = other.mTransmitHighWater > mTransmitHighWater ? other.mTransmitHighWater : mTransmitHighWater;
+		mReceiveHighWater = other.mReceiveHighWater > mReceiveHighWater ? other.mReceiveHighWater : mReceiveHighWater;
+		mConnections += other.mConnections;
+		mLogDropped += other.mLogDropped;
+		mMessagesDropped += other.mMessagesDropped;
+		mHighWaterCount += other.mHighWaterCount;
+		mTransmitPending += other.mTransmitPending;
+		mSendSize.merge(other.mSendSize);
+		mReceiveSize.merge(other.mReceiveSize);
+		mDispatchTime.merge(other.mDispatchTime);
+		mQueueTime.merge(other.mQueueTime);
+	}
+};
+
 // Pure virtual callback interface to receive messages from the server.
 class SocketChatCallback
 {
 public:
+	// Receives each message on a FRAMING_TEXT connection
 	virtual void receiveMessage(const char *data) = 0;
+
+	// Receives each message on a FRAMING_BINARY connection. The data is only valid for the
+	// duration of the call.
+	virtual void receiveBinary(const void *data, uint32_t dataLen)
+	{
+		(void)data;
+		(void)dataLen;
+	}
+};
+
+class SocketChat;
+
+// An immutable, reference counted text message which can be queued on any number of connections
+// without being copied; each connection holds a reference until the message has been sent.
+// The reference count is atomic, so a message may be shared between connections on different threads.
+class SharedMessage
+{
+public:
+	// Creates a message holding 'str' plus the message terminator, with one reference owned by the caller
+	static SharedMessage *create(const char *str);
+
+	// Creates a message holding 'dataLen' bytes of binary data framed for FRAMING_BINARY connections
+	static SharedMessage *createBinary(const void *data, uint32_t dataLen);
+
+	virtual void addRef(void) = 0;
+
+	// Drops a reference; the message is freed when the last one goes
+	virtual void release(void) = 0;
+
+	// Returns the bytes which go on the wire, including the terminator or length prefix
+	virtual const uint8_t *getData(uint32_t &dataLen) const = 0;
+
+	// Returns the message contents without any framing
+	virtual const uint8_t *getPayload(uint32_t &dataLen) const = 0;
+
+	// Returns the framing the wire data was built for
+	virtual FramingMode getFraming(void) const = 0;
+
+protected:
+	virtual ~SharedMessage(void)
+	{
+	}
+};
+
+// Notification interface used by an external event loop (such as SocketChatReactor).
+// It is invoked when a connection's transmit buffer goes from empty to non-empty, so that
+// the event loop knows this connection needs to be flushed without having to scan every connection.
+class SocketChatTransmitNotify
+{
+public:
+	virtual void transmitPending(SocketChat *sc) = 0;
+
+	// Any thread. Another thread sent on a connection with a send queue (SocketChatOptions::mSendQueueSize)
+	// which had nothing waiting; the event loop should flush the connection from its own thread.
+	virtual void transmitQueued(SocketChat *sc) = 0;
+};
+
+// Notification interface for a connection's backlog crossing its water marks (see SocketChatOptions::mHighWaterMark).
+// It is invoked from whichever call changed the backlog: a send, or the poll or flush which sent it.
+class SocketChatWatermarkCallback
+{
+public:
+	// More than the high water mark is waiting to be sent. The slow consumer policy has already been
+	// applied, so under SLOW_CONSUMER_DISCONNECT the connection is closed by now.
+	virtual void transmitHighWater(SocketChat *sc, uint32_t pending) = 0;
+
+	// The backlog has drained to the low water mark since the last 'transmitHighWater'
+	virtual void transmitLowWater(SocketChat *sc, uint32_t pending) = 0;
 };
 
 class SocketChat 
@@ -32,9 +203,19 @@ public:
 	};
 
     static SocketChat *create(const char *host, uint32_t port);
+	static SocketChat *create(const char *host, uint32_t port, const SocketChatOptions &options);
+
+	// Creates a client connection which owns an I/O thread. The thread does all the socket work (reads,
+	// sends, waiting on the socket), so I/O no longer depends on how often the application calls 'poll'.
+	// Received messages wait in a lock-free queue until the application takes them with 'poll' or
+	// 'tryReceive', from any one thread; sends may come from any thread (see mSendQueueSize, which
+	// defaults to a small queue here). Such a connection cannot be added to a SocketChatReactor.
+	static SocketChat *createThreaded(const char *host, uint32_t port);
+	static SocketChat *createThreaded(const char *host, uint32_t port, const SocketChatOptions &options);
 
 	// Create call for the server when a new client connection is established
 	static SocketChat *create(wsocket::Wsocket *clientSocket);
+	static SocketChat *create(wsocket::Wsocket *clientSocket, const SocketChatOptions &options);
 
 	virtual ~SocketChat(void)
 	{
@@ -42,16 +223,43 @@ public:
 
 
 	// This client is polled from a single thread.  These methods are *not* thread safe.
-	// If you call them from different threads, you will need to create your own mutex.
+	// If you call them from different threads, you will need to create your own mutex; the exception is
+	// the send methods on a connection created with SocketChatOptions::mSendQueueSize.
 	// While this 'poll' call is non-blocking, you can still run the whole socket connection in it's own
 	// thread.  This is recommended for maximum performance
 	// Calling the 'poll' routine will process all sends and receives
 	// If any new messages have been received from the sever and you have provided a valid 'callback' pointer, then
 	// it will send incoming messages back through that interface
+	// On a connection created with 'createThreaded' it only delivers what the I/O thread has received,
+	// waiting up to 'timeout' for the first message if there are none yet.
 	virtual void poll(SocketChatCallback *callback,int32_t timeout = 0) = 0; // timeout in milliseconds
 
+	// Connections created with 'createThreaded' only. Delivers up to 'maxMessages' of the messages the
+	// I/O thread has already received, without waiting, and returns how many. Other connections
+	// deliver their messages from 'poll' and return 0 here.
+	virtual uint32_t tryReceive(SocketChatCallback *callback, uint32_t maxMessages = 0xFFFFFFFF) = 0;
+
+	// Sends as much pending transmit data as the socket will accept without reading anything.
+	// Used by event loops when the socket reports it is writable again.
+	virtual void flush(void) = 0;
+
 	// Send a text message to the server.  Assumed zero byte terminated ASCIIZ string
-	virtual void sendText(const char *str) = 0;
+	// Returns false if the message could not be queued: the transmit buffer is at its maximum size, or
+	// the send queue is full (see SocketChatOptions::mSendQueueSize), in which case try again later.
+	virtual bool sendText(const char *str) = 0;
+
+	// Send a block of binary data. On a FRAMING_TEXT connection it must not contain CR/LF.
+	// Returns false if it could not be queued, as for sendText.
+	virtual bool sendBinary(const void *data, uint32_t dataLen) = 0;
+
+	// Queue a shared message for transmit. The connection takes its own reference rather than
+	// copying the data, so sending one message to many connections costs a single allocation.
+	// A message built for the other framing mode is copied and reframed instead.
+	// Returns false if it could not be queued, as for sendText; the caller's reference is untouched either way.
+	virtual bool sendShared(SharedMessage *message) = 0;
+
+	// Returns how messages are delimited on this connection
+	virtual FramingMode getFraming(void) const = 0;
 
 	// Close the connection
 	virtual void close() = 0;
@@ -62,15 +270,34 @@ public:
 	// Returns the total memory used by the transmit and receive buffers
 	virtual uint32_t getMemoryUsage(void) const = 0;
 
-	// Return the amount of memory being used by pending transmit frames
+	// Return the number of bytes waiting to be sent, including queued shared messages
 	virtual uint32_t getTransmitBufferSize(void) const = 0;
 
 	// Maximum size of the buffer
 	virtual uint32_t getTransmitBufferMaxSize(void) const = 0;
 
-    // Log all sends and receives
+	// Copies this connection's counters and histograms (a few KB), so it is cheap to call now and then
+	// but not on every message. On a connection created with 'createThreaded' it may be called from any
+	// thread, and waits briefly for the I/O thread to take the snapshot.
+	virtual void getStats(SocketChatStats &stats) const = 0;
+
+    // Log all sends and receives to the wire log 'fileName' (WireLog.h), which every connection logging
+    // under the same name shares. Call it before any traffic; render the files with WireLogDump.
     virtual bool setLogFile(const char *fileName) = 0;
 
+	// Returns the operating system handle of the underlying socket, or -1 if it has none
+	virtual int64_t getSocketHandle(void) const = 0;
+
+	// Returns the underlying transport socket
+	virtual wsocket::Wsocket *getSocket(void) const = 0;
+
+	// Register an interface to be notified when this connection has new data queued for transmit
+	virtual void setTransmitNotify(SocketChatTransmitNotify *notify) = 0;
+
+	// Register an interface to be told when the backlog crosses the water marks. On a connection created
+	// with 'createThreaded' it is called from the I/O thread; set it before sending anything.
+	virtual void setWatermarkCallback(SocketChatWatermarkCallback *callback) = 0;
+
 
 };
 
@@ -80,6 +307,11 @@ void socketStartup(void);
 // Shutdown sockets on exit from your app
 void socketShutdown(void);
 
+// Bytes waiting to be sent on every connection in the process, a broadcast message counting once per
+// connection it is queued on. Each connection reports changes of 16KB or more
+// (and every time it empties), so the figure may be that far out per busy connection.
+uint64_t getTransmitMemory(void);
+
 } // namespace socketchat
 
 
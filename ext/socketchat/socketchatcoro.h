@@ -0,0 +1,638 @@
+#pragma once
+
+// C++20 coroutine front end for SocketChat.
+// Instead of a SocketChatCallback plus a poll loop, each connection can be served by a coroutine
+// which reads like blocking code:
+//
+//		socketchat::coro::Task echo(socketchat::coro::Connection *c)
+//		{
+//			while (socketchat::coro::Message m = co_await c->receiveMessage())
+//			{
+//				c->sendText(m.text());
+//				co_await c->flush(ECHO_HIGH_WATERMARK);
+//			}
+//			c->release();
+//		}
+//
+// A Loop runs a SocketChatReactor and resumes coroutines as their connections become ready, so
+// thousands of them can share one thread. Apart from the coroutine frame itself, which is allocated
+// once when the coroutine starts, suspending and resuming allocates nothing: messages are handed to
+// a waiting coroutine where the connection received them.
+// Only compiled by a compiler with coroutine support (C++20); the rest of the library stays C++11.
+
+#ifdef __cpp_impl_coroutine
+
+#include "socketchat.h"
+#include "socketchatreactor.h"
+#include "wsocket.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <coroutine>
+#include <exception>
+#include <unordered_map>
+#include <vector>
+
+namespace socketchat
+{
+namespace coro
+{
+
+class Loop;
+
+// A coroutine which starts running straight away and frees itself when it finishes; nothing waits
+// on it. Use it for the coroutine serving a connection.
+struct Task
+{
+	struct promise_type
+	{
+		Task get_return_object(void) noexcept
+		{
+			return Task();
+		}
+
+		std::suspend_never initial_suspend(void) noexcept
+		{
+			return std::suspend_never();
+		}
+
+		std::suspend_never final_suspend(void) noexcept
+		{
+			return std::suspend_never();
+		}
+
+		void return_void(void) noexcept
+		{
+		}
+
+		void unhandled_exception(void) noexcept
+		{
+			std::terminate();
+		}
+	};
+};
+
+// One received message, or the end of the connection (which tests false).
+// The data is only valid until the coroutine which received it next suspends.
+struct Message
+{
+	const void	*mData{ nullptr };
+	uint32_t	mLength{ 0 };
+	bool		mText{ false };		// FRAMING_TEXT message; zero terminated
+	bool		mClosed{ false };	// The connection has closed; there is no message
+
+	explicit operator bool(void) const
+	{
+		return !mClosed;
+	}
+
+	const char *text(void) const
+	{
+		return (const char *)mData;
+	}
+};
+
+// A connection served by a coroutine. Created by Loop::connect, Loop::accept or Loop::adopt and
+// freed with 'release' once the coroutine is done with it.
+class Connection
+{
+public:
+	struct ReceiveAwaiter
+	{
+		bool await_ready(void) noexcept
+		{
+			return mConnection->takeBacklog(mMessage) || mConnection->mClosed;
+		}
+
+		void await_suspend(std::coroutine_handle<> handle) noexcept
+		{
+			mConnection->mReceiveHandle = handle;
+			mConnection->mReceiveTarget = &mMessage;
+		}
+
+		Message await_resume(void) noexcept
+		{
+			if (!mMessage.mData && mConnection->mClosed)
+			{
+				mMessage.mClosed = true;
+			}
+			return mMessage;
+		}
+
+		Connection	*mConnection;
+		Message		mMessage;
+	};
+
+	struct FlushAwaiter
+	{
+		bool await_ready(void) noexcept
+		{
+			return mConnection->flushed(mWatermark);
+		}
+
+		void await_suspend(std::coroutine_handle<> handle) noexcept;
+
+		// False if the connection closed before its transmit buffer drained
+		bool await_resume(void) noexcept
+		{
+			return !mConnection->mClosed;
+		}
+
+		Connection	*mConnection;
+		uint32_t	mWatermark;
+	};
+
+	// co_await resumes with the next message, or a Message which tests false once the connection closes
+	ReceiveAwaiter receiveMessage(void)
+	{
+		return ReceiveAwaiter{ this, Message() };
+	}
+
+	// co_await resumes once no more than 'watermark' bytes are waiting to be sent
+	FlushAwaiter flush(uint32_t watermark = 0)
+	{
+		return FlushAwaiter{ this, watermark };
+	}
+
+	bool sendText(const char *str)
+	{
+		return mSocketChat->sendText(str);
+	}
+
+	bool sendBinary(const void *data, uint32_t dataLen)
+	{
+		return mSocketChat->sendBinary(data, dataLen);
+	}
+
+	bool sendShared(SharedMessage *message)
+	{
+		return mSocketChat->sendShared(message);
+	}
+
+	uint32_t getTransmitBufferSize(void) const
+	{
+		return mSocketChat->getTransmitBufferSize();
+	}
+
+	bool isOpen(void) const
+	{
+		return !mClosed;
+	}
+
+	// The underlying connection, for anything not wrapped here
+	SocketChat *getSocketChat(void) const
+	{
+		return mSocketChat;
+	}
+
+	// Closes the connection once its queued data is sent. It is freed when the current loop pass ends,
+	// so this may be called from anywhere in the coroutine, including while a message is being handled.
+	void release(void);
+
+private:
+	friend class Loop;
+
+	// Passes what the connection receives to the waiting coroutine, or into the backlog if there is none
+	class Receiver : public SocketChatCallback
+	{
+	public:
+		virtual void receiveMessage(const char *data) override final
+		{
+			mConnection->received(data, uint32_t(strlen(data)), true);
+		}
+
+		virtual void receiveBinary(const void *data, uint32_t dataLen) override final
+		{
+			mConnection->received(data, dataLen, false);
+		}
+
+		Connection	*mConnection{ nullptr };
+	};
+
+	// Each backlog entry is this header followed by the message (plus a zero byte for text)
+	struct BacklogHeader
+	{
+		uint32_t	mLength;
+		uint32_t	mText;
+	};
+
+	Connection(Loop *loop, SocketChat *sc) : mLoop(loop), mSocketChat(sc)
+	{
+		mReceiver.mConnection = this;
+	}
+
+	// Called from inside the reactor's dispatch; a waiting coroutine runs right here
+	void received(const void *data, uint32_t len, bool text)
+	{
+		if (mReceiveHandle)
+		{
+			std::coroutine_handle<> handle = mReceiveHandle;
+			mReceiveHandle = nullptr;
+			mReceiveTarget->mData = data;
+			mReceiveTarget->mLength = len;
+			mReceiveTarget->mText = text;
+			handle.resume();
+			return;
+		}
+		// The coroutine is busy elsewhere; keep a copy until it asks. The backlog's memory is reused.
+		BacklogHeader header{ len, text ? 1u : 0u };
+		size_t offset = mBacklog.size();
+		mBacklog.resize(offset + sizeof(header) + len + 1);
+		memcpy(&mBacklog[offset], &header, sizeof(header));
+		if (len)
+		{
+			memcpy(&mBacklog[offset + sizeof(header)], data, len);
+		}
+		mBacklog[offset + sizeof(header) + len] = 0;
+	}
+
+	bool takeBacklog(Message &message)
+	{
+		if (mBacklogRead == mBacklog.size())
+		{
+			mBacklog.clear();
+			mBacklogRead = 0;
+			return false;
+		}
+		BacklogHeader header;
+		memcpy(&header, &mBacklog[mBacklogRead], sizeof(header));
+		message.mData = &mBacklog[mBacklogRead + sizeof(header)];
+		message.mLength = header.mLength;
+		message.mText = header.mText != 0;
+		mBacklogRead += sizeof(header) + header.mLength + 1;
+		return true;
+	}
+
+	bool flushed(uint32_t watermark)
+	{
+		if (mClosed)
+		{
+			return true;
+		}
+		mSocketChat->flush();
+		return mSocketChat->getTransmitBufferSize() <= watermark;
+	}
+
+	// The connection went away: a coroutine waiting on it learns so straight away
+	void closed(void)
+	{
+		mClosed = true;
+		if (mReceiveHandle)
+		{
+			std::coroutine_handle<> handle = mReceiveHandle;
+			mReceiveHandle = nullptr;
+			handle.resume();
+		}
+	}
+
+	Loop					*mLoop{ nullptr };
+	SocketChat				*mSocketChat{ nullptr };
+	Receiver				mReceiver;
+	bool					mClosed{ false };
+	bool					mReleased{ false };
+	bool					mRegistered{ false };		// Still in the reactor; it drops connections which close
+	std::coroutine_handle<>	mReceiveHandle;				// Coroutine waiting in receiveMessage
+	Message					*mReceiveTarget{ nullptr };	// Where its message goes
+	std::coroutine_handle<>	mFlushHandle;				// Coroutine waiting in flush
+	uint32_t				mFlushWatermark{ 0 };
+	Connection				*mNextFlush{ nullptr };		// Next in the loop's list of connections waiting to drain
+	std::coroutine_handle<>	mConnectHandle;				// Coroutine waiting in Loop::connect
+	Connection				*mNextConnect{ nullptr };	// Next in the loop's list of connections still connecting
+	std::vector<uint8_t>	mBacklog;					// Messages which arrived while the coroutine was busy
+	size_t					mBacklogRead{ 0 };
+};
+
+// Runs the reactor which all of its connections are registered with, and resumes their coroutines.
+// Everything happens on the thread calling 'poll' or 'run'.
+class Loop : public SocketChatReactorCallback
+{
+public:
+	struct ConnectAwaiter
+	{
+		// Starts connecting in the background (see SocketChatOptions::mConnectAsync); the coroutine
+		// only suspends if the connection does not open straight away
+		bool await_ready(void)
+		{
+			SocketChatOptions options = mLoop->mOptions;
+			options.mConnectAsync = true;
+			SocketChat *sc = SocketChat::create(mHost, mPort, options);
+			if (!sc)
+			{
+				return true;
+			}
+			mConnection = mLoop->adopt(sc);
+			if (!mConnection)
+			{
+				delete sc;
+				return true;
+			}
+			return sc->getReadyState() != SocketChat::CONNECTING;
+		}
+
+		void await_suspend(std::coroutine_handle<> handle) noexcept
+		{
+			mConnection->mConnectHandle = handle;
+			mLoop->waitForConnect(mConnection);
+		}
+
+		// Null if the connection failed
+		Connection *await_resume(void)
+		{
+			if (mConnection && mConnection->mSocketChat->getReadyState() != SocketChat::OPEN)
+			{
+				mConnection->release();
+				mConnection = nullptr;
+			}
+			return mConnection;
+		}
+
+		Loop		*mLoop;
+		const char	*mHost;
+		uint32_t	mPort;
+		Connection	*mConnection;
+	};
+
+	struct AcceptAwaiter
+	{
+		bool await_ready(void) noexcept
+		{
+			return mLoop->takeAccepted(mConnection) || mLoop->mStopping;
+		}
+
+		void await_suspend(std::coroutine_handle<> handle) noexcept
+		{
+			mLoop->mAcceptHandle = handle;
+			mLoop->mAcceptTarget = &mConnection;
+		}
+
+		// Null once the loop is shutting down
+		Connection *await_resume(void) noexcept
+		{
+			return mConnection;
+		}
+
+		Loop		*mLoop;
+		Connection	*mConnection;
+	};
+
+	// If 'listenSocket' is not null, connections accepted on it are handed out by 'accept'.
+	// The loop does not take ownership of the listen socket.
+	Loop(wsocket::Wsocket *listenSocket = nullptr, const SocketChatOptions &options = SocketChatOptions()) : mOptions(options)
+	{
+		mReactor = SocketChatReactor::create(listenSocket, this, options);
+	}
+
+	// Coroutines still waiting on a connection are resumed as if it had closed, then every
+	// connection is freed, whether or not it was released
+	virtual ~Loop(void)
+	{
+		mStopping = true;
+		if (mAcceptHandle)
+		{
+			std::coroutine_handle<> handle = mAcceptHandle;
+			mAcceptHandle = nullptr;
+			handle.resume();
+		}
+		std::vector<Connection *> connections;
+		for (auto &i : mConnections)
+		{
+			connections.push_back(i.second);
+		}
+		for (auto &i : connections)
+		{
+			i->closed();
+		}
+		resumeConnected();
+		resumeFlushed();
+		freeReleased();
+		for (auto &i : mConnections)
+		{
+			destroy(i.second);
+		}
+		if (mReactor)
+		{
+			mReactor->release();
+		}
+	}
+
+	bool isValid(void) const
+	{
+		return mReactor != nullptr;
+	}
+
+	// co_await resumes with a new client connection, or null if it could not connect
+	ConnectAwaiter connect(const char *host, uint32_t port)
+	{
+		return ConnectAwaiter{ this, host, port, nullptr };
+	}
+
+	// co_await resumes with the next connection accepted on the listen socket. Only one coroutine may
+	// wait in 'accept' at a time.
+	AcceptAwaiter accept(void)
+	{
+		return AcceptAwaiter{ this, nullptr };
+	}
+
+	// Takes over an existing connection, which must not be registered with any other reactor
+	Connection *adopt(SocketChat *sc)
+	{
+		Connection *c = new Connection(this, sc);
+		if (!mReactor->addConnection(sc, &c->mReceiver))
+		{
+			delete c;
+			return nullptr;
+		}
+		c->mRegistered = true;
+		mConnections[sc] = c;
+		return c;
+	}
+
+	// One pass: waits up to 'timeout' milliseconds for activity, then resumes every coroutine whose
+	// connection is ready. Returns the number of connections serviced.
+	uint32_t poll(int32_t timeout)
+	{
+		uint32_t ret = mReactor->poll(hasWork() ? 0 : timeout);
+		while (mAcceptHandle && !mAccepted.empty())
+		{
+			std::coroutine_handle<> handle = mAcceptHandle;
+			mAcceptHandle = nullptr;
+			takeAccepted(*mAcceptTarget);
+			handle.resume();
+		}
+		resumeConnected();
+		resumeFlushed();
+		freeReleased();
+		return ret;
+	}
+
+	// Polls until 'stop' is called
+	void run(int32_t timeout = 100)
+	{
+		while (!mStopping)
+		{
+			poll(timeout);
+		}
+	}
+
+	void stop(void)
+	{
+		mStopping = true;
+		mReactor->wakeup();
+	}
+
+	SocketChatReactor *getReactor(void) const
+	{
+		return mReactor;
+	}
+
+private:
+	friend class Connection;
+
+	virtual SocketChatCallback *newConnection(SocketChat *client) override final
+	{
+		// Handed out after the reactor pass, once the connection is fully registered
+		Connection *c = new Connection(this, client);
+		c->mRegistered = true;
+		mConnections[client] = c;
+		mAccepted.push_back(c);
+		return &c->mReceiver;
+	}
+
+	virtual void connectionClosed(SocketChat *client) override final
+	{
+		auto found = mConnections.find(client);
+		if (found != mConnections.end())
+		{
+			found->second->mRegistered = false;
+			found->second->closed();
+		}
+	}
+
+	bool takeAccepted(Connection *&c)
+	{
+		if (mAccepted.empty())
+		{
+			return false;
+		}
+		c = mAccepted.front();
+		mAccepted.erase(mAccepted.begin());
+		return true;
+	}
+
+	void waitForFlush(Connection *c)
+	{
+		c->mNextFlush = mFlushWaiters;
+		mFlushWaiters = c;
+	}
+
+	void waitForConnect(Connection *c)
+	{
+		c->mNextConnect = mConnectWaiters;
+		mConnectWaiters = c;
+	}
+
+	// Resumes the coroutines whose connections have opened, or failed to, since they started waiting.
+	// Once the loop is stopping they all are.
+	void resumeConnected(void)
+	{
+		Connection **link = &mConnectWaiters;
+		while (*link)
+		{
+			Connection *c = *link;
+			if (mStopping || c->mSocketChat->getReadyState() != SocketChat::CONNECTING)
+			{
+				*link = c->mNextConnect;
+				c->mNextConnect = nullptr;
+				std::coroutine_handle<> handle = c->mConnectHandle;
+				c->mConnectHandle = nullptr;
+				handle.resume();
+			}
+			else
+			{
+				link = &c->mNextConnect;
+			}
+		}
+	}
+
+	// Resumes the coroutines whose connections have drained (or closed) since they started waiting
+	void resumeFlushed(void)
+	{
+		Connection **link = &mFlushWaiters;
+		while (*link)
+		{
+			Connection *c = *link;
+			if (c->flushed(c->mFlushWatermark))
+			{
+				*link = c->mNextFlush;
+				c->mNextFlush = nullptr;
+				std::coroutine_handle<> handle = c->mFlushHandle;
+				c->mFlushHandle = nullptr;
+				handle.resume(); // may wait again, which puts it back at the head of the list
+			}
+			else
+			{
+				link = &c->mNextFlush;
+			}
+		}
+	}
+
+	// Connections accepted but not yet handed out keep the reactor from waiting
+	bool hasWork(void) const
+	{
+		return (mAcceptHandle && !mAccepted.empty()) || !mReleased.empty();
+	}
+
+	void freeReleased(void)
+	{
+		for (auto &i : mReleased)
+		{
+			mConnections.erase(i->mSocketChat);
+			destroy(i);
+		}
+		mReleased.clear();
+	}
+
+	void destroy(Connection *c)
+	{
+		if (c->mRegistered)
+		{
+			mReactor->removeConnection(c->mSocketChat);
+		}
+		delete c->mSocketChat;
+		delete c;
+	}
+
+	SocketChatOptions			mOptions;
+	SocketChatReactor			*mReactor{ nullptr };
+	std::unordered_map<SocketChat *, Connection *>	mConnections;
+	std::vector<Connection *>	mAccepted;					// Accepted, waiting for a coroutine to 'accept' them
+	std::vector<Connection *>	mReleased;					// Freed at the end of the current pass
+	std::coroutine_handle<>		mAcceptHandle;				// Coroutine waiting in 'accept'
+	Connection					**mAcceptTarget{ nullptr };
+	Connection					*mFlushWaiters{ nullptr };	// Connections whose coroutine waits in 'flush'
+	Connection					*mConnectWaiters{ nullptr };	// Connections whose coroutine waits in 'connect'
+	bool						mStopping{ false };
+};
+
+inline void Connection::FlushAwaiter::await_suspend(std::coroutine_handle<> handle) noexcept
+{
+	mConnection->mFlushHandle = handle;
+	mConnection->mFlushWatermark = mWatermark;
+	mConnection->mLoop->waitForFlush(mConnection);
+}
+
+inline void Connection::release(void)
+{
+	if (mReleased)
+	{
+		return;
+	}
+	mReleased = true;
+	mSocketChat->close();
+	mLoop->mReleased.push_back(this);
+}
+
+} // namespace coro
+} // namespace socketchat
+
+#endif
@@ -0,0 +1,573 @@
+#include "socketchatreactor.h"
+#include "socketchat.h"
+#include "wsocket.h"
+
+#include <stdio.h>
+#include <assert.h>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+#ifdef __linux__
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#else
+#define USE_EPOLL 0
+#endif
+
+#define MAX_REACTOR_EVENTS 1024		// Maximum number of ready events harvested per wait call
+#define POLLED_CONNECTION_TIMEOUT 1	// Longest we will block when there are connections with no pollable handle
+#define MAX_READY_SOCKETS 256		// Maximum number of ready sockets fetched from the listen socket's transport at once
+#define ACCEPT_BUDGET 256			// Most connections accepted per pass, so a connect storm cannot starve the open ones
+
+namespace socketchat
+{
+
+class SocketChatReactorImpl : public SocketChatReactor, public SocketChatTransmitNotify
+{
+public:
+	// Per connection bookkeeping; the epoll user data points at one of these
+	class Connection
+	{
+	public:
+		SocketChat			*mSocketChat{ nullptr };
+		SocketChatCallback	*mCallback{ nullptr };
+		wsocket::Wsocket	*mSocket{ nullptr };	// Only set when readiness comes from the listen socket's transport
+		int64_t				mHandle{ -1 };
+		bool				mPendingFlush{ false };	// Already in the pending flush list
+		bool				mDead{ false };			// Removed; freed at the end of the current poll
+	};
+
+	typedef std::unordered_map< SocketChat *, Connection * > ConnectionMap;
+	typedef std::vector< Connection * > ConnectionVector;
+	typedef std::unordered_map< wsocket::Wsocket *, Connection * > ReadyMap;
+
+	SocketChatReactorImpl(wsocket::Wsocket *listenSocket, SocketChatReactorCallback *callback, const SocketChatOptions &options)
+		: mListenSocket(listenSocket)
+		, mCallback(callback)
+		, mOptions(options)
+	{
+#if USE_EPOLL
+		mEpoll = epoll_create1(EPOLL_CLOEXEC);
+		mWakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (mEpoll >= 0 && mWakeup >= 0)
+		{
+			epoll_event ev;
+			ev.events = EPOLLIN | EPOLLET;
+			ev.data.ptr = &mWakeupRecord;
+			epoll_ctl(mEpoll, EPOLL_CTL_ADD, mWakeup, &ev);
+		}
+		if (mEpoll >= 0 && mListenSocket)
+		{
+			int64_t handle = mListenSocket->getSocketHandle();
+			if (handle >= 0)
+			{
+				epoll_event ev;
+				ev.events = EPOLLIN | EPOLLET;
+				ev.data.ptr = &mListenRecord;
+				epoll_ctl(mEpoll, EPOLL_CTL_ADD, int(handle), &ev);
+			}
+			else
+			{
+				mPollListenSocket = true;
+			}
+		}
+#else
+		mPollListenSocket = mListenSocket != nullptr;
+#endif
+		// A transport without descriptors (io_uring) may still be able to tell us which of its
+		// connections had activity, which saves polling every one of them each pass
+		mListenTracksReady = mPollListenSocket && mListenSocket->pollReady(nullptr, 0) >= 0;
+	}
+
+	virtual ~SocketChatReactorImpl(void)
+	{
+		for (auto &i : mConnections)
+		{
+			i.second->mSocketChat->setTransmitNotify(nullptr);
+			delete i.second;
+		}
+		for (auto &c : mDeadConnections)
+		{
+			delete c;
+		}
+#if USE_EPOLL
+		if (mEpoll >= 0)
+		{
+			::close(mEpoll);
+		}
+		if (mWakeup >= 0)
+		{
+			::close(mWakeup);
+		}
+#endif
+	}
+
+	bool isValid(void) const
+	{
+#if USE_EPOLL
+		return mEpoll >= 0 && mWakeup >= 0;
+#else
+		return true;
+#endif
+	}
+
+	virtual bool addConnection(SocketChat *sc, SocketChatCallback *callback) override final
+	{
+		if (!sc || mConnections.find(sc) != mConnections.end())
+		{
+			return false;
+		}
+		Connection *c = new Connection;
+		c->mSocketChat = sc;
+		c->mCallback = callback;
+		c->mHandle = sc->getSocketHandle();
+#if USE_EPOLL
+		if (c->mHandle >= 0)
+		{
+			epoll_event ev;
+			ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+			ev.data.ptr = c;
+			if (epoll_ctl(mEpoll, EPOLL_CTL_ADD, int(c->mHandle), &ev) != 0)
+			{
+				delete c;
+				return false;
+			}
+			mEpollCount++;
+		}
+		else if (!trackReady(c))
+		{
+			mPolledConnections.push_back(c);
+		}
+#else
+		if (!trackReady(c))
+		{
+			mPolledConnections.push_back(c);
+		}
+#endif
+		mConnections[sc] = c;
+		sc->setTransmitNotify(this);
+		// Anything queued before registration still needs to go out
+		if (sc->getTransmitBufferSize())
+		{
+			transmitPending(sc);
+		}
+		return true;
+	}
+
+	virtual void removeConnection(SocketChat *sc) override final
+	{
+		ConnectionMap::iterator found = mConnections.find(sc);
+		if (found == mConnections.end())
+		{
+			return;
+		}
+		Connection *c = found->second;
+		mConnections.erase(found);
+		if (c->mSocket)
+		{
+			mReadyConnections.erase(c->mSocket);
+		}
+#if USE_EPOLL
+		// A closed socket has already been dropped from the epoll set by the kernel, and its
+		// descriptor number may have been reused, so only unregister sockets which are still open
+		if (c->mHandle >= 0 && sc->getReadyState() != SocketChat::CLOSED)
+		{
+			epoll_ctl(mEpoll, EPOLL_CTL_DEL, int(c->mHandle), nullptr);
+		}
+		if (c->mHandle >= 0)
+		{
+			mEpollCount--;
+		}
+#endif
+		sc->setTransmitNotify(nullptr);
+		c->mDead = true;
+		c->mSocketChat = nullptr;
+		c->mCallback = nullptr;
+		mDeadConnections.push_back(c);
+	}
+
+	// Called by a connection when its transmit buffer goes from empty to non-empty
+	virtual void transmitPending(SocketChat *sc) override final
+	{
+		ConnectionMap::iterator found = mConnections.find(sc);
+		if (found != mConnections.end() && !found->second->mPendingFlush)
+		{
+			found->second->mPendingFlush = true;
+			mPendingFlush.push_back(found->second);
+		}
+	}
+
+	// Any thread. The connection's send queue has messages for it; flushed on the next pass
+	virtual void transmitQueued(SocketChat *sc) override final
+	{
+		{
+			std::lock_guard<std::mutex> lock(mQueuedMutex);
+			mQueuedSends.push_back(sc);
+			mHaveQueuedSends.store(true);
+		}
+		wakeup();
+	}
+
+	// Moves the connections other threads have sent on into the pending flush list. A connection
+	// removed meanwhile is simply not found.
+	void takeQueuedSends(void)
+	{
+		if (!mHaveQueuedSends.load())
+		{
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mQueuedMutex);
+			mQueuedScratch.swap(mQueuedSends);
+			mHaveQueuedSends.store(false);
+		}
+		for (auto &sc : mQueuedScratch)
+		{
+			transmitPending(sc);
+		}
+		mQueuedScratch.clear();
+	}
+
+	virtual uint32_t poll(int32_t timeout) override final
+	{
+		uint32_t ret = 0;
+
+		// Send anything which was queued since the last pass before we go to sleep
+		takeQueuedSends();
+		ret += flushPending();
+		if (mAcceptBacklog)
+		{
+			timeout = 0;
+		}
+		// Retry a stalled accept (out of descriptors) soon, but without spinning
+		if (!mPolledConnections.empty() || mPollListenSocket || mAcceptStalled)
+		{
+			if (timeout > POLLED_CONNECTION_TIMEOUT)
+			{
+				timeout = POLLED_CONNECTION_TIMEOUT;
+			}
+		}
+
+#if USE_EPOLL
+		int count = 0;
+		if (mPollListenSocket && mEpollCount == 0)
+		{
+			// Nothing is registered with epoll; let the listen socket's own transport do the waiting
+			mListenSocket->select(timeout, 0);
+		}
+		else
+		{
+			count = epoll_wait(mEpoll, mEvents, MAX_REACTOR_EVENTS, timeout);
+		}
+		for (int i = 0; i < count; i++)
+		{
+			const epoll_event &ev = mEvents[i];
+			if (ev.data.ptr == &mListenRecord)
+			{
+				acceptConnections();
+				continue;
+			}
+			if (ev.data.ptr == &mWakeupRecord)
+			{
+				uint64_t value;
+				while (::read(mWakeup, &value, sizeof(value)) > 0)
+				{
+				}
+				continue;
+			}
+			Connection *c = (Connection *)ev.data.ptr;
+			if (c->mDead)
+			{
+				continue;
+			}
+			if (ev.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			{
+				// Reads until the socket would block, flushes, and dispatches messages
+				c->mSocketChat->poll(c->mCallback, 0);
+			}
+			else if (ev.events & EPOLLOUT)
+			{
+				c->mSocketChat->flush();
+			}
+			ret++;
+			checkClosed(c);
+		}
+#else
+		if (mPolledConnections.empty() && mListenSocket && timeout > 0)
+		{
+			mListenSocket->select(timeout, 0);
+		}
+#endif
+		if (mPollListenSocket || mAcceptBacklog || mAcceptStalled)
+		{
+			acceptConnections();
+		}
+		if (mListenTracksReady)
+		{
+			ret += pollReadyConnections();
+		}
+		// Connections with no pollable handle are serviced every pass
+		for (size_t i = 0; i < mPolledConnections.size(); i++)
+		{
+			Connection *c = mPolledConnections[i];
+			if (c->mDead)
+			{
+				continue;
+			}
+			c->mSocketChat->poll(c->mCallback, 0);
+			ret++;
+			checkClosed(c);
+#if USE_EPOLL
+			// A connection which was still connecting has a handle once it connects
+			if (!c->mDead && promoteConnection(c))
+			{
+				mPolledConnections[i--] = mPolledConnections.back();
+				mPolledConnections.pop_back();
+			}
+#endif
+		}
+		// Messages queued while dispatching go out in the same pass
+		ret += flushPending();
+		freeDeadConnections();
+
+		return ret;
+	}
+
+#if USE_EPOLL
+	// Registers a polled connection with epoll if it has got a handle since it was added
+	bool promoteConnection(Connection *c)
+	{
+		int64_t handle = c->mSocketChat->getSocketHandle();
+		if (handle < 0)
+		{
+			return false;
+		}
+		epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = c;
+		if (epoll_ctl(mEpoll, EPOLL_CTL_ADD, int(handle), &ev) != 0)
+		{
+			return false;
+		}
+		c->mHandle = handle;
+		mEpollCount++;
+		return true;
+	}
+#endif
+
+	virtual void wakeup(void) override final
+	{
+#if USE_EPOLL
+		uint64_t value = 1;
+		ssize_t result = ::write(mWakeup, &value, sizeof(value));
+		(void)result; // Only fails if the counter is already saturated, in which case the poll wakes anyway
+#endif
+		// Without epoll, 'poll' never waits longer than POLLED_CONNECTION_TIMEOUT, so there is nothing to interrupt
+	}
+
+	virtual uint32_t getConnectionCount(void) const override final
+	{
+		return uint32_t(mConnections.size());
+	}
+
+	virtual void release(void) override final
+	{
+		delete this;
+	}
+
+private:
+	void acceptConnections(void)
+	{
+		if (!mListenSocket)
+		{
+			return;
+		}
+		// Edge triggered; keep accepting until the backlog is empty, or the budget for this pass is spent,
+		// in which case the rest are taken on the next pass without waiting for another edge
+		uint32_t budget = ACCEPT_BUDGET;
+		wsocket::Wsocket *clientSocket;
+		while (budget && (clientSocket = mListenSocket->pollServer()) != nullptr)
+		{
+			budget--;
+			clientSocket->disableNaglesAlgorithm(); // regular sockets come back from pollServer with this done
+			SocketChat *sc = SocketChat::create(clientSocket, mOptions);
+			if (!sc)
+			{
+				continue;
+			}
+			mAccepting = true;
+			bool added = addConnection(sc, nullptr);
+			mAccepting = false;
+			if (!added)
+			{
+				delete sc;
+				continue;
+			}
+			SocketChatCallback *callback = mCallback ? mCallback->newConnection(sc) : nullptr;
+			ConnectionMap::iterator found = mConnections.find(sc);
+			if (found != mConnections.end())
+			{
+				found->second->mCallback = callback;
+			}
+		}
+		mAcceptBacklog = budget == 0;
+		mAcceptStalled = budget != 0 && mListenSocket->acceptStalled();
+	}
+
+	// Connections accepted from a listen socket which tracks readiness are only serviced once it reports them
+	bool trackReady(Connection *c)
+	{
+		if (!mAccepting || !mListenTracksReady)
+		{
+			return false;
+		}
+		c->mSocket = c->mSocketChat->getSocket();
+		mReadyConnections[c->mSocket] = c;
+		return true;
+	}
+
+	uint32_t pollReadyConnections(void)
+	{
+		uint32_t ret = 0;
+		for (;;)
+		{
+			int32_t count = mListenSocket->pollReady(mReadySockets, MAX_READY_SOCKETS);
+			for (int32_t i = 0; i < count; i++)
+			{
+				ReadyMap::iterator found = mReadyConnections.find(mReadySockets[i]);
+				if (found == mReadyConnections.end() || found->second->mDead)
+				{
+					continue;
+				}
+				Connection *c = found->second;
+				c->mSocketChat->poll(c->mCallback, 0);
+				ret++;
+				checkClosed(c);
+			}
+			if (count < MAX_READY_SOCKETS)
+			{
+				break;
+			}
+		}
+		return ret;
+	}
+
+	uint32_t flushPending(void)
+	{
+		uint32_t ret = 0;
+		if (mPendingFlush.empty())
+		{
+			return ret;
+		}
+		mFlushScratch.swap(mPendingFlush);
+		for (auto &c : mFlushScratch)
+		{
+			c->mPendingFlush = false;
+			if (c->mDead)
+			{
+				continue;
+			}
+			c->mSocketChat->flush();
+			ret++;
+			checkClosed(c);
+		}
+		mFlushScratch.clear();
+		return ret;
+	}
+
+	void checkClosed(Connection *c)
+	{
+		if (c->mDead || c->mSocketChat->getReadyState() != SocketChat::CLOSED)
+		{
+			return;
+		}
+		SocketChat *sc = c->mSocketChat;
+		removeConnection(sc);
+		if (mCallback)
+		{
+			mCallback->connectionClosed(sc);
+		}
+	}
+
+	void freeDeadConnections(void)
+	{
+		if (mDeadConnections.empty())
+		{
+			return;
+		}
+		for (size_t i = 0; i < mPolledConnections.size();)
+		{
+			if (mPolledConnections[i]->mDead)
+			{
+				mPolledConnections[i] = mPolledConnections.back();
+				mPolledConnections.pop_back();
+			}
+			else
+			{
+				i++;
+			}
+		}
+		for (auto &c : mDeadConnections)
+		{
+			if (c->mPendingFlush)
+			{
+				mPendingFlush.erase(std::remove(mPendingFlush.begin(), mPendingFlush.end(), c), mPendingFlush.end());
+			}
+			delete c;
+		}
+		mDeadConnections.clear();
+	}
+
+	wsocket::Wsocket			*mListenSocket{ nullptr };
+	SocketChatReactorCallback	*mCallback{ nullptr };
+	SocketChatOptions			mOptions;				// Used to create accepted connections
+	bool						mPollListenSocket{ false };
+	bool						mListenTracksReady{ false };	// The listen socket reports which connections are ready
+	bool						mAccepting{ false };
+	bool						mAcceptBacklog{ false };	// The last pass left connections waiting to be accepted
+	bool						mAcceptStalled{ false };	// The listen socket ran out of descriptors; retry every pass
+	Connection					mListenRecord;			// Sentinel whose address identifies the listen socket
+	Connection					mWakeupRecord;			// Sentinel whose address identifies the wakeup event
+	ConnectionMap				mConnections;
+	ConnectionVector			mPolledConnections;		// Connections with no pollable handle
+	ConnectionVector			mPendingFlush;			// Connections with newly queued transmit data
+	ConnectionVector			mFlushScratch;
+	ConnectionVector			mDeadConnections;
+	std::mutex					mQueuedMutex;			// Guards the two below, which other threads add to
+	std::vector< SocketChat * >	mQueuedSends;			// Connections whose send queue has new messages
+	std::atomic<bool>			mHaveQueuedSends{ false };
+	std::vector< SocketChat * >	mQueuedScratch;
+	ReadyMap					mReadyConnections;		// Connections serviced through the listen socket's ready list
+	wsocket::Wsocket			*mReadySockets[MAX_READY_SOCKETS];
+#if USE_EPOLL
+	int							mEpoll{ -1 };
+	int							mWakeup{ -1 };			// eventfd used by 'wakeup'
+	uint32_t					mEpollCount{ 0 };		// Connections registered with epoll
+	epoll_event					mEvents[MAX_REACTOR_EVENTS];
+#endif
+};
+
+SocketChatReactor *SocketChatReactor::create(wsocket::Wsocket *listenSocket, SocketChatReactorCallback *callback)
+{
+	SocketChatOptions options;
+	return create(listenSocket, callback, options);
+}
+
+SocketChatReactor *SocketChatReactor::create(wsocket::Wsocket *listenSocket, SocketChatReactorCallback *callback, const SocketChatOptions &options)
+{
+	auto ret = new SocketChatReactorImpl(listenSocket, callback, options);
+	if (!ret->isValid())
+	{
+		delete ret;
+		ret = nullptr;
+	}
+	return static_cast<SocketChatReactor *>(ret);
+}
+
+} // namespace socketchat
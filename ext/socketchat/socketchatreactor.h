@@ -0,0 +1,76 @@
+#pragma once
+
+// Services many SocketChat connections from a single event loop.
+// On Linux the listen socket and every connection are registered with an edge-triggered
+// epoll instance, so each call to 'poll' only touches the connections which are actually
+// ready (readable, writable, or with newly queued transmit data) and takes a single timeout
+// for the whole set. Connections accepted from a transport without descriptors (io_uring) are
+// serviced from the listen socket's own ready list instead.
+// On other platforms it falls back to polling every connection each pass.
+#include <stdint.h>
+
+namespace wsocket
+{
+	class Wsocket;
+}
+
+namespace socketchat
+{
+
+class SocketChat;
+class SocketChatCallback;
+struct SocketChatOptions;
+
+// Notification interface for connections accepted by, or dropped from, the reactor
+class SocketChatReactorCallback
+{
+public:
+	// A new client connection was accepted on the listen socket and registered with the reactor.
+	// Return the callback which should receive messages for this connection.
+	// The application owns the SocketChat instance and must delete it once 'connectionClosed' is called.
+	virtual SocketChatCallback *newConnection(SocketChat *client) = 0;
+
+	// The connection has closed, either remotely or due to an error.
+	// It has already been removed from the reactor, so it is safe to delete it here.
+	virtual void connectionClosed(SocketChat *client) = 0;
+};
+
+class SocketChatReactor
+{
+public:
+	// Create a reactor. If 'listenSocket' is not null, new connections are accepted from it
+	// and reported through 'callback'. The reactor does not take ownership of the listen socket.
+	static SocketChatReactor *create(wsocket::Wsocket *listenSocket, SocketChatReactorCallback *callback);
+
+	// As above; accepted connections are created with 'options' (for example to use binary framing)
+	static SocketChatReactor *create(wsocket::Wsocket *listenSocket, SocketChatReactorCallback *callback, const SocketChatOptions &options);
+
+	// Register an existing connection (for example a client connection) with the reactor.
+	// Incoming messages for this connection are delivered to 'callback'
+	virtual bool addConnection(SocketChat *sc, SocketChatCallback *callback) = 0;
+
+	// Remove a connection from the reactor without closing it
+	virtual void removeConnection(SocketChat *sc) = 0;
+
+	// Waits up to 'timeout' milliseconds for activity on any registered socket, then accepts
+	// new connections, reads and dispatches incoming messages, and flushes pending transmit data.
+	// Returns the number of connections which were serviced.
+	virtual uint32_t poll(int32_t timeout) = 0;
+
+	// Makes a 'poll' call which is waiting for activity return early.
+	// This is the only method which may be called from a thread other than the one polling the reactor
+	// (apart from the sends on a connection with a send queue, which wake it through this).
+	virtual void wakeup(void) = 0;
+
+	// Returns the number of connections currently registered
+	virtual uint32_t getConnectionCount(void) const = 0;
+
+	virtual void release(void) = 0;
+
+protected:
+	virtual ~SocketChatReactor(void)
+	{
+	}
+};
+
+} // namespace socketchat
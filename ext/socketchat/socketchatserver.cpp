@@ -0,0 +1,693 @@
+#include "socketchatserver.h"
+#include "socketchatreactor.h"
+#include "socketchat.h"
+#include "wsocket.h"
+#include "MemoryMap.h"
+#include "SPSC.h"
+#include "SPMC.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unordered_set>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+
+#define BROADCAST_QUEUE_SIZE 4096	// Messages which may be in flight between any one pair of threads
+#define WORKER_POLL_TIMEOUT 10		// Longest a worker sleeps in its reactor; broadcasts wake it early
+#define WORKER_OVERFLOW_TIMEOUT 1	// Longest it sleeps while it has messages which did not fit in another's queue
+#define WORKER_STATS_WAIT 1000		// Longest getStats waits for a worker to take its snapshot
+
+namespace socketchat
+{
+
+// Each queued message carries one reference, which the receiving worker drops once it has
+// queued the message on all of its connections (or the mirror thread once it has published it)
+typedef spsc::SPSCQueue< SharedMessage * > BroadcastQueue;
+
+class SocketChatServerImpl;
+
+// One worker thread, with its own listen socket, reactor and connections
+class ServerWorker : public SocketChatReactorCallback
+{
+public:
+	ServerWorker(SocketChatServerImpl *server, uint32_t index, uint32_t workerCount) : mServer(server), mIndex(index)
+	{
+		mOverflow.resize(workerCount);
+	}
+
+	virtual ~ServerWorker(void)
+	{
+		for (auto &i : mOverflow)
+		{
+			for (auto &m : i)
+			{
+				m->release();
+			}
+		}
+		for (auto &m : mMirrorOverflow)
+		{
+			m->release();
+		}
+	}
+
+	bool init(const char *serverType, int32_t port, const SocketChatOptions &connectionOptions)
+	{
+		wsocket::WsocketOptions options;
+		options.mReusePort = true;
+		mListenSocket = wsocket::Wsocket::create(serverType, port, options);
+		if (mListenSocket)
+		{
+			mReactor = SocketChatReactor::create(mListenSocket, this, connectionOptions);
+		}
+		return mReactor != nullptr;
+	}
+
+	void start(bool pinThread)
+	{
+		mThread = new std::thread([this, pinThread]()
+		{
+			if (pinThread)
+			{
+				pinToCpu();
+			}
+			run();
+		});
+	}
+
+	void join(void)
+	{
+		if (mThread)
+		{
+			mThread->join();
+			delete mThread;
+			mThread = nullptr;
+		}
+	}
+
+	void release(void)
+	{
+		if (mReactor)
+		{
+			mReactor->release();
+		}
+		if (mListenSocket)
+		{
+			mListenSocket->release();
+		}
+	}
+
+	virtual SocketChatCallback *newConnection(SocketChat *client) override final;
+	virtual void connectionClosed(SocketChat *client) override final;
+
+	void run(void);
+	void pinToCpu(void);
+
+	// Queues the message on every connection owned by this worker
+	void deliver(SharedMessage *message)
+	{
+		for (auto &i : mConnections)
+		{
+			i->sendShared(message);
+		}
+	}
+
+	// Hands a message to another worker
+	void send(uint32_t consumer, SharedMessage *message);
+
+	// Any thread, after queueing something for this worker. The worker sets mSleeping and then looks at
+	// its queues, and a producer does the reverse, so a message is either seen before the worker sleeps
+	// or finds the flag set and wakes it.
+	void wake(void)
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (mSleeping.load())
+		{
+			mReactor->wakeup();
+		}
+	}
+
+	// Any thread, after taking messages out of this worker's queues. Lets it retry its overflow at once.
+	void wakeIfOverflowing(void)
+	{
+		if (mHasOverflow.load())
+		{
+			mReactor->wakeup();
+		}
+	}
+
+	// Worker thread. Answers a getStats call, if there is one waiting.
+	void publishStats(void)
+	{
+		if (!mStatsRequested.exchange(false))
+		{
+			return;
+		}
+		std::lock_guard<std::mutex> lock(mStatsMutex);
+		mStatsSnapshot = mClosedStats;
+		SocketChatStats stats;
+		for (auto &i : mConnections)
+		{
+			i->getStats(stats);
+			mStatsSnapshot.merge(stats);
+		}
+		mStatsGeneration++;
+		mStatsReady.notify_all();
+	}
+
+	SocketChatServerImpl						*mServer{ nullptr };
+	uint32_t									mIndex{ 0 };
+	wsocket::Wsocket							*mListenSocket{ nullptr };
+	SocketChatReactor							*mReactor{ nullptr };
+	std::thread									*mThread{ nullptr };
+	std::unordered_set< SocketChat * >			mConnections;
+	std::vector< std::vector< SharedMessage * > >	mOverflow;	// Per destination worker; messages which did not fit in its queue
+	std::vector< SharedMessage * >				mMirrorOverflow;	// Messages which did not fit in the queue to the mirror thread
+	std::atomic<bool>							mHasOverflow{ false };	// Either of the above holds anything
+	std::atomic<bool>							mSleeping{ false };		// In, or about to go into, the reactor's wait
+	SocketChatStats								mClosedStats;	// Connections this worker has already closed
+	std::atomic<bool>							mStatsRequested{ false };
+	std::mutex									mStatsMutex;	// guards the three below
+	std::condition_variable						mStatsReady;
+	uint32_t									mStatsGeneration{ 0 };
+	SocketChatStats								mStatsSnapshot;
+};
+
+// The worker running on the current thread, if any
+static thread_local ServerWorker *gCurrentWorker = nullptr;
+
+class SocketChatServerImpl : public SocketChatServer
+{
+public:
+	SocketChatServerImpl(SocketChatServerCallback *callback, uint32_t workerCount)
+		: mCallback(callback)
+		, mWorkerCount(workerCount)
+	{
+		// One queue for every (producer,consumer) pair; the extra producer is the thread which created the server
+		for (uint32_t i = 0; i < (workerCount + 1)*workerCount; i++)
+		{
+			mQueues.push_back(new BroadcastQueue(BROADCAST_QUEUE_SIZE));
+		}
+		for (uint32_t i = 0; i < workerCount; i++)
+		{
+			mWorkers.push_back(new ServerWorker(this, i, workerCount));
+		}
+	}
+
+	virtual ~SocketChatServerImpl(void)
+	{
+		mExit = true;
+		for (auto &w : mWorkers)
+		{
+			if (w->mReactor)
+			{
+				w->mReactor->wakeup();
+			}
+		}
+		for (auto &w : mWorkers)
+		{
+			w->join();
+		}
+		if (mMirrorThread)
+		{
+			wakeMirror(true);
+			mMirrorThread->join();
+			delete mMirrorThread;
+		}
+		for (auto &w : mWorkers)
+		{
+			w->release();
+			delete w;
+		}
+		SharedMessage *message;
+		for (auto &q : mQueues)
+		{
+			while (q->pop(message))
+			{
+				message->release();
+			}
+			delete q;
+		}
+		for (auto &q : mMirrorQueues)
+		{
+			while (q->pop(message))
+			{
+				message->release();
+			}
+			delete q;
+		}
+		if (mMirrorMap)
+		{
+			mMirrorMap->release();
+#ifndef _MSC_VER
+			unlink(mMirrorFile.c_str());
+#endif
+		}
+	}
+
+	bool init(const char *serverType, int32_t port, bool pinThreads, const SocketChatOptions &options)
+	{
+		for (auto &w : mWorkers)
+		{
+			if (!w->init(serverType, port, options))
+			{
+				return false;
+			}
+		}
+		for (auto &w : mWorkers)
+		{
+			w->start(pinThreads);
+		}
+		return true;
+	}
+
+	BroadcastQueue &getQueue(uint32_t producer, uint32_t consumer)
+	{
+		return *mQueues[producer*mWorkerCount + consumer];
+	}
+
+	virtual void broadcast(const char *message) override final
+	{
+		// One allocation for the whole fan-out; every connection on every worker references the same message
+		SharedMessage *bm = SharedMessage::create(message);
+		ServerWorker *worker = gCurrentWorker;
+		if (worker && worker->mServer != this)
+		{
+			worker = nullptr;
+		}
+		if (mMirroring)
+		{
+			bm->addRef();
+			mirror(worker, bm);
+		}
+		if (worker)
+		{
+			worker->deliver(bm);
+			for (uint32_t i = 0; i < mWorkerCount; i++)
+			{
+				if (i != worker->mIndex)
+				{
+					bm->addRef();
+					worker->send(i, bm);
+				}
+			}
+		}
+		else
+		{
+			// The external thread is not servicing any connections, so it can simply wait for room
+			for (uint32_t i = 0; i < mWorkerCount; i++)
+			{
+				BroadcastQueue &queue = getQueue(mWorkerCount, i);
+				bm->addRef();
+				while (!queue.push(bm))
+				{
+					mWorkers[i]->mReactor->wakeup();
+					std::this_thread::yield();
+				}
+				mWorkers[i]->wake();
+			}
+		}
+		bm->release();
+	}
+
+	virtual bool mirrorBroadcasts(const char *fileName, uint32_t ringSize, spmc::Policy policy) override final
+	{
+		// The workers must never wait for a reader, not even by way of the mirror thread
+		if (mMirrorMap || !fileName || policy == spmc::POLICY_BLOCK)
+		{
+			return false;
+		}
+		uint64_t size = spmc::BroadcastRing::getRequiredSize(ringSize);
+		mMirrorMap = memorymap::MemoryMap::createMemoryMap(fileName, size, true, false);
+		if (!mMirrorMap)
+		{
+			return false;
+		}
+		if (!mMirror.init(mMirrorMap->getBaseAddress(), uint32_t(size), true, true, policy))
+		{
+			mMirrorMap->release();
+			mMirrorMap = nullptr;
+			return false;
+		}
+		mMirrorFile = fileName;
+		// One queue per worker, plus one for the thread which created the server
+		for (uint32_t i = 0; i <= mWorkerCount; i++)
+		{
+			mMirrorQueues.push_back(new BroadcastQueue(BROADCAST_QUEUE_SIZE));
+		}
+		mMirrorThread = new std::thread([this]()
+		{
+			runMirror();
+		});
+		mMirroring = true;
+		return true;
+	}
+
+	// The ring has a single writer, so every broadcasting thread hands its messages to the mirror
+	// thread through a queue of its own. Takes over the caller's reference on 'message'.
+	void mirror(ServerWorker *worker, SharedMessage *message)
+	{
+		BroadcastQueue &queue = *mMirrorQueues[worker ? worker->mIndex : mWorkerCount];
+		if (worker)
+		{
+			// Keep messages in order; the worker retries its overflow on its next pass
+			if (!worker->mMirrorOverflow.empty() || !queue.push(message))
+			{
+				worker->mMirrorOverflow.push_back(message);
+				worker->mHasOverflow.store(true);
+			}
+		}
+		else
+		{
+			while (!queue.push(message))
+			{
+				wakeMirror(true);
+				std::this_thread::yield();
+			}
+		}
+		wakeMirror(false);
+	}
+
+	// The mirror thread sets mMirrorSleeping and then looks at the queues, and a producer does the
+	// reverse, so a message is either seen before the mirror thread sleeps or finds the flag set
+	void wakeMirror(bool always)
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (always || mMirrorSleeping.load())
+		{
+			std::lock_guard<std::mutex> lock(mMirrorMutex);
+			mMirrorWake.notify_one();
+		}
+	}
+
+	bool mirrorQueuesEmpty(void)
+	{
+		for (auto &q : mMirrorQueues)
+		{
+			if (!q->empty())
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Mirror thread. Publishes every queued broadcast, with its terminating zero, into the ring.
+	void runMirror(void)
+	{
+		SharedMessage *message;
+		while (!mExit)
+		{
+			bool published = false;
+			for (uint32_t i = 0; i <= mWorkerCount; i++)
+			{
+				BroadcastQueue *q = mMirrorQueues[i];
+				if (q->empty())
+				{
+					continue;
+				}
+				while (q->pop(message))
+				{
+					uint32_t len;
+					const uint8_t *payload = message->getPayload(len);
+					uint8_t *dest = mMirror.reserve(len + 1);
+					if (dest)
+					{
+						memcpy(dest, payload, len);
+						dest[len] = 0;
+						mMirror.commit(len + 1, 0);
+					}
+					message->release();
+					published = true;
+				}
+				if (i < mWorkerCount)
+				{
+					mWorkers[i]->wakeIfOverflowing();
+				}
+			}
+			if (published)
+			{
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(mMirrorMutex);
+			mMirrorSleeping.store(true);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (mirrorQueuesEmpty() && !mExit)
+			{
+				mMirrorWake.wait_for(lock, std::chrono::milliseconds(WORKER_POLL_TIMEOUT));
+			}
+			mMirrorSleeping.store(false);
+		}
+	}
+
+	// Delivers every message other threads have queued for this worker
+	void receiveBroadcasts(ServerWorker *worker)
+	{
+		SharedMessage *message;
+		for (uint32_t producer = 0; producer <= mWorkerCount; producer++)
+		{
+			if (producer == worker->mIndex)
+			{
+				continue;
+			}
+			BroadcastQueue &queue = getQueue(producer, worker->mIndex);
+			if (queue.empty())
+			{
+				continue;
+			}
+			while (queue.pop(message))
+			{
+				worker->deliver(message);
+				message->release();
+			}
+			// There is room now for whatever the producer could not fit in
+			if (producer < mWorkerCount)
+			{
+				mWorkers[producer]->wakeIfOverflowing();
+			}
+		}
+	}
+
+	// True if another thread has queued anything for this worker
+	bool broadcastsWaiting(ServerWorker *worker)
+	{
+		for (uint32_t producer = 0; producer <= mWorkerCount; producer++)
+		{
+			if (producer != worker->mIndex && !getQueue(producer, worker->mIndex).empty())
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	virtual uint32_t getWorkerCount(void) const override final
+	{
+		return mWorkerCount;
+	}
+
+	virtual uint32_t getConnectionCount(void) const override final
+	{
+		return mConnectionCount;
+	}
+
+	// Asks every worker for a snapshot at once, then waits for each in turn
+	virtual void getStats(SocketChatStats &stats) override final
+	{
+		std::vector< uint32_t > generations;
+		for (auto &w : mWorkers)
+		{
+			std::lock_guard<std::mutex> lock(w->mStatsMutex);
+			generations.push_back(w->mStatsGeneration);
+			w->mStatsRequested.store(true);
+			w->mReactor->wakeup();
+		}
+		stats = SocketChatStats();
+		for (uint32_t i = 0; i < mWorkerCount; i++)
+		{
+			ServerWorker *w = mWorkers[i];
+			uint32_t generation = generations[i];
+			std::unique_lock<std::mutex> lock(w->mStatsMutex);
+			w->mStatsReady.wait_for(lock, std::chrono::milliseconds(WORKER_STATS_WAIT), [w, generation]()
+			{
+				return w->mStatsGeneration != generation;
+			});
+			stats.merge(w->mStatsSnapshot);
+		}
+	}
+
+	virtual void release(void) override final
+	{
+		delete this;
+	}
+
+	SocketChatServerCallback			*mCallback{ nullptr };
+	uint32_t							mWorkerCount{ 0 };
+	std::atomic<bool>					mExit{ false };
+	std::atomic<uint32_t>				mConnectionCount{ 0 };
+	std::vector< ServerWorker * >		mWorkers;
+	std::vector< BroadcastQueue * >		mQueues;
+	std::atomic<bool>					mMirroring{ false };
+	std::vector< BroadcastQueue * >		mMirrorQueues;				// Per broadcasting thread, to the mirror thread
+	std::thread							*mMirrorThread{ nullptr };	// The one writer of mMirror
+	std::atomic<bool>					mMirrorSleeping{ false };
+	std::mutex							mMirrorMutex;				// Guards the mirror thread's sleep
+	std::condition_variable				mMirrorWake;
+	spmc::BroadcastRing					mMirror;					// Where broadcasts are mirrored for local readers
+	memorymap::MemoryMap				*mMirrorMap{ nullptr };
+	std::string							mMirrorFile;
+};
+
+SocketChatCallback *ServerWorker::newConnection(SocketChat *client)
+{
+	mConnections.insert(client);
+	mServer->mConnectionCount++;
+	return mServer->mCallback ? mServer->mCallback->newConnection(mIndex, client) : nullptr;
+}
+
+void ServerWorker::connectionClosed(SocketChat *client)
+{
+	SocketChatStats stats;
+	client->getStats(stats);
+	mClosedStats.merge(stats);
+	mConnections.erase(client);
+	mServer->mConnectionCount--;
+	if (mServer->mCallback)
+	{
+		mServer->mCallback->connectionClosed(mIndex, client);
+	}
+}
+
+void ServerWorker::send(uint32_t consumer, SharedMessage *message)
+{
+	// Keep messages in order; once anything has overflowed, everything after it waits behind it
+	BroadcastQueue &queue = mServer->getQueue(mIndex, consumer);
+	std::vector< SharedMessage * > &overflow = mOverflow[consumer];
+	if (!overflow.empty() || !queue.push(message))
+	{
+		overflow.push_back(message);
+		mHasOverflow.store(true);
+	}
+	mServer->mWorkers[consumer]->wake();
+}
+
+void ServerWorker::run(void)
+{
+	gCurrentWorker = this;
+	std::vector< SharedMessage * > pending;
+	while (!mServer->mExit)
+	{
+		// Retry anything which did not fit into another worker's queue on an earlier pass
+		for (uint32_t i = 0; i < mOverflow.size(); i++)
+		{
+			if (mOverflow[i].empty())
+			{
+				continue;
+			}
+			pending.swap(mOverflow[i]);
+			for (auto &m : pending)
+			{
+				send(i, m);
+			}
+			pending.clear();
+		}
+		if (!mMirrorOverflow.empty())
+		{
+			pending.swap(mMirrorOverflow);
+			for (auto &m : pending)
+			{
+				mServer->mirror(this, m);
+			}
+			pending.clear();
+		}
+		bool overflowing = !mMirrorOverflow.empty();
+		for (auto &i : mOverflow)
+		{
+			overflowing = overflowing || !i.empty();
+		}
+		mHasOverflow.store(overflowing);
+		mServer->receiveBroadcasts(this);
+		publishStats();
+		// Consumers wake us as they make room, but do not count on it while anything is held back
+		int32_t timeout = overflowing ? WORKER_OVERFLOW_TIMEOUT : WORKER_POLL_TIMEOUT;
+		mSleeping.store(true);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (mServer->broadcastsWaiting(this))
+		{
+			timeout = 0;
+		}
+		mReactor->poll(timeout);
+		mSleeping.store(false);
+	}
+	// Shut down every connection this worker still owns so the application can release it.
+	// The reactor itself stays alive until every worker has stopped, since the others may still wake it.
+	std::vector< SocketChat * > connections(mConnections.begin(), mConnections.end());
+	for (auto &sc : connections)
+	{
+		mReactor->removeConnection(sc);
+		sc->close();
+		connectionClosed(sc);
+	}
+	gCurrentWorker = nullptr;
+}
+
+void ServerWorker::pinToCpu(void)
+{
+#ifdef __linux__
+	uint32_t cpuCount = std::thread::hardware_concurrency();
+	if (cpuCount)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(mIndex % cpuCount, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+#endif
+}
+
+SocketChatServer *SocketChatServer::create(const char *serverType,
+										   int32_t port,
+										   uint32_t workerCount,
+										   SocketChatServerCallback *callback,
+										   bool pinThreads)
+{
+	SocketChatOptions options;
+	return create(serverType, port, workerCount, callback, pinThreads, options);
+}
+
+SocketChatServer *SocketChatServer::create(const char *serverType,
+										   int32_t port,
+										   uint32_t workerCount,
+										   SocketChatServerCallback *callback,
+										   bool pinThreads,
+										   const SocketChatOptions &options)
+{
+	if (workerCount == 0)
+	{
+		workerCount = 1;
+	}
+	auto ret = new SocketChatServerImpl(callback, workerCount);
+	if (!ret->init(serverType, port, pinThreads, options))
+	{
+		delete ret;
+		ret = nullptr;
+	}
+	return static_cast<SocketChatServer *>(ret);
+}
+
+} // namespace socketchat
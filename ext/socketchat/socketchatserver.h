@@ -0,0 +1,93 @@
+#pragma once
+
+// A shared-nothing multi-threaded server.
+// Each worker thread owns its own listen socket (all bound to the same port with SO_REUSEPORT, so the
+// kernel spreads new connections across them), its own SocketChatReactor and its own connections.
+// The only state shared between workers is the set of broadcast queues: every pair of threads has its
+// own lock-free single producer single consumer queue, so a broadcast never takes a global lock.
+#include "SPMC.h"
+
+#include <stdint.h>
+
+namespace socketchat
+{
+
+class SocketChat;
+class SocketChatCallback;
+struct SocketChatStats;
+struct SocketChatOptions;
+
+// Notification interface for the server. Every method is invoked on the worker thread which owns
+// the connection; 'worker' is that thread's index.
+class SocketChatServerCallback
+{
+public:
+	// A new client connection was accepted by one of the workers.
+	// Return the callback which should receive messages for this connection; it is only ever
+	// invoked from this same worker thread.
+	// The application owns the SocketChat instance and must delete it once 'connectionClosed' is called.
+	virtual SocketChatCallback *newConnection(uint32_t worker, SocketChat *client) = 0;
+
+	// The connection has closed, or the server is shutting down. It is safe to delete it here.
+	virtual void connectionClosed(uint32_t worker, SocketChat *client) = 0;
+};
+
+class SocketChatServer
+{
+public:
+	// Starts 'workerCount' threads which all accept connections on 'port'.
+	// 'serverType' is the host name used to create each listen socket (SOCKET_SERVER or URING_SERVER).
+	// If 'pinThreads' is true each worker is pinned to its own CPU, where the platform supports it.
+	// Returns null if any of the listen sockets could not be created.
+	static SocketChatServer *create(const char *serverType,
+									int32_t port,
+									uint32_t workerCount,
+									SocketChatServerCallback *callback,
+									bool pinThreads);
+
+	// As above; accepted connections are created with 'options', for example to give every connection
+	// water marks and a slow consumer policy so one stalled client cannot make a broadcast server grow
+	// without bound
+	static SocketChatServer *create(const char *serverType,
+									int32_t port,
+									uint32_t workerCount,
+									SocketChatServerCallback *callback,
+									bool pinThreads,
+									const SocketChatOptions &options);
+
+	// Sends a text message to every connection on every worker.
+	// When called from a worker thread (for example from inside 'receiveMessage') the connections on that
+	// worker receive it immediately and the other workers receive it on their next pass.
+	// It may also be called from the thread which created the server; only that one non-worker thread may do so.
+	virtual void broadcast(const char *message) = 0;
+
+	// Also publishes every broadcast, with its terminating zero, into a shared memory broadcast ring
+	// (spmc::BroadcastRing) created in 'fileName', so local consumers such as loggers and bots can follow
+	// the chat without a connection each. 'ringSize' is the room for messages; 'policy' decides what happens
+	// when a reader falls behind. A mirror thread of its own writes the ring, so broadcasting never waits on
+	// it; POLICY_BLOCK is refused, since a stalled reader would back every worker's broadcasts up behind it.
+	// Call it from the thread which created the server. Returns false if the ring could not be created.
+	virtual bool mirrorBroadcasts(const char *fileName, uint32_t ringSize, spmc::Policy policy) = 0;
+
+	// Returns the number of worker threads
+	virtual uint32_t getWorkerCount(void) const = 0;
+
+	// Returns the number of connections across all workers
+	virtual uint32_t getConnectionCount(void) const = 0;
+
+	// Adds up the statistics of every connection the server has had, open or since closed.
+	// Each worker takes a snapshot of its own connections on its next pass, so this waits for them.
+	// Call it from the thread which created the server.
+	virtual void getStats(SocketChatStats &stats) = 0;
+
+	// Stops and joins the worker threads. Connections which are still open are closed and reported
+	// through 'connectionClosed' before their worker exits.
+	virtual void release(void) = 0;
+
+protected:
+	virtual ~SocketChatServer(void)
+	{
+	}
+};
+
+} // namespace socketchat
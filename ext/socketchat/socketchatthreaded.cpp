@@ -0,0 +1,433 @@
+#include "socketchat.h"
+#include "wsocket.h"
+#include "SPSC.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#ifdef __linux__
+#define USE_EVENTFD 1
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#else
+#define USE_EVENTFD 0
+#endif
+
+#define IO_THREAD_RING_SIZE (1024*1024)	// Bytes of received messages which can wait for the application
+#define IO_THREAD_SEND_QUEUE_SIZE 1024		// Send queue entries, unless the options ask for a particular number
+#define IO_THREAD_IDLE_WAIT 100				// Longest the I/O thread sleeps on a socket with a handle; sends wake it early
+#define IO_THREAD_POLL_WAIT 1				// Longest it sleeps on a socket without a handle, which sends cannot interrupt
+#define IO_THREAD_FULL_WAIT 1				// Milliseconds between looks at a receive ring the application has let fill up
+#define IO_THREAD_STATS_WAIT 1000			// Longest getStats waits for the I/O thread to take a snapshot
+
+// Flags of the records in the receive ring
+#define RECEIVED_TEXT 1		// A FRAMING_TEXT message, stored with its zero terminator
+#define RECEIVED_BINARY 2	// A FRAMING_BINARY message
+#define RECEIVED_HEAP 4		// Too large for the ring; the record holds a HeapMessage instead
+
+namespace socketchat
+{
+
+// Wraps an ordinary connection and drives it from a thread of its own. Only the I/O thread touches
+// the wrapped connection, apart from its send methods, which go through its lock-free send queue.
+// Received messages travel to the application through an in-process SPSC record ring, so they are
+// delivered in place without an allocation each.
+class SocketChatThreaded : public SocketChat, public SocketChatCallback
+{
+public:
+	// A received message too large for the ring
+	struct HeapMessage
+	{
+		void		*mData;
+		uint32_t	mLength;
+	};
+
+	SocketChatThreaded(SocketChat *connection) : mConnection(connection)
+	{
+		mRingMemory = malloc(IO_THREAD_RING_SIZE);
+		mRingWriter.init(mRingMemory, IO_THREAD_RING_SIZE, true, true);
+		mRingReader.init(mRingMemory, IO_THREAD_RING_SIZE, false, false);
+		mFraming = mConnection->getFraming();
+		mSocket = mConnection->getSocket();
+		publishState();
+#if USE_EVENTFD
+		mWakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+		mThread = new std::thread([this]()
+		{
+			run();
+		});
+	}
+
+	virtual ~SocketChatThreaded(void)
+	{
+		mQuit.store(true);
+		wakeup();
+		mThread->join();
+		delete mThread;
+		// Whatever the application never took
+		while (tryReceive(nullptr, 0xFFFFFFFF))
+		{
+		}
+		free(mRingMemory);
+#if USE_EVENTFD
+		if (mWakeup >= 0)
+		{
+			::close(mWakeup);
+		}
+#endif
+	}
+
+	virtual void poll(SocketChatCallback *callback, int32_t timeout) override final
+	{
+		if (!callback)
+		{
+			return;
+		}
+		if (!tryReceive(callback, 0xFFFFFFFF) && timeout > 0 && mRingReader.waitForData(timeout))
+		{
+			tryReceive(callback, 0xFFFFFFFF);
+		}
+	}
+
+	// With a null callback the messages are discarded
+	virtual uint32_t tryReceive(SocketChatCallback *callback, uint32_t maxMessages) override final
+	{
+		uint32_t ret = 0;
+		while (ret < maxMessages)
+		{
+			uint32_t len;
+			uint32_t flags;
+			const uint8_t *data = mRingReader.peekRecord(len, flags);
+			if (!data)
+			{
+				break;
+			}
+			HeapMessage heap{ nullptr, 0 };
+			if (flags & RECEIVED_HEAP)
+			{
+				memcpy(&heap, data, sizeof(heap));
+				data = (const uint8_t *)heap.mData;
+				len = heap.mLength;
+			}
+			if (callback)
+			{
+				if (flags & RECEIVED_TEXT)
+				{
+					callback->receiveMessage((const char *)data);
+				}
+				else
+				{
+					callback->receiveBinary(data, len);
+				}
+			}
+			free(heap.mData);
+			mRingReader.releaseRecord();
+			ret++;
+		}
+		return ret;
+	}
+
+	// Has the I/O thread make a pass straight away
+	virtual void flush(void) override final
+	{
+		sent();
+	}
+
+	virtual bool sendText(const char *str) override final
+	{
+		return sent(mConnection->sendText(str));
+	}
+
+	virtual bool sendBinary(const void *data, uint32_t dataLen) override final
+	{
+		return sent(mConnection->sendBinary(data, dataLen));
+	}
+
+	virtual bool sendShared(SharedMessage *message) override final
+	{
+		return sent(mConnection->sendShared(message));
+	}
+
+	virtual FramingMode getFraming(void) const override final
+	{
+		return mFraming;
+	}
+
+	// The I/O thread closes the connection once what has already been sent is out
+	virtual void close() override final
+	{
+		mCloseRequested.store(true);
+		wakeup();
+	}
+
+	virtual ReadyStateValues getReadyState() const override final
+	{
+		return ReadyStateValues(mReadyState.load(std::memory_order_acquire));
+	}
+
+	virtual uint32_t getMemoryUsage(void) const override final
+	{
+		return mMemoryUsage.load(std::memory_order_relaxed) + IO_THREAD_RING_SIZE;
+	}
+
+	virtual uint32_t getTransmitBufferSize(void) const override final
+	{
+		return mTransmitBufferSize.load(std::memory_order_relaxed);
+	}
+
+	virtual uint32_t getTransmitBufferMaxSize(void) const override final
+	{
+		return mTransmitBufferMaxSize.load(std::memory_order_relaxed);
+	}
+
+	// The wrapped connection's statistics belong to the I/O thread, so this asks it for a copy
+	// and waits for the next pass to take one. Falls back to the last copy if the thread is stuck.
+	virtual void getStats(SocketChatStats &stats) const override final
+	{
+		std::unique_lock<std::mutex> lock(mStatsMutex);
+		uint32_t generation = mStatsGeneration;
+		mStatsRequested.store(true);
+		const_cast<SocketChatThreaded *>(this)->wakeup();
+		mStatsReady.wait_for(lock, std::chrono::milliseconds(IO_THREAD_STATS_WAIT), [this, generation]()
+		{
+			return mStatsGeneration != generation;
+		});
+		stats = mStatsSnapshot;
+	}
+
+	// Call before sending anything; the I/O thread may be logging already
+	virtual bool setLogFile(const char *fileName) override final
+	{
+		return mConnection->setLogFile(fileName);
+	}
+
+	virtual int64_t getSocketHandle(void) const override final
+	{
+		return mSocketHandle.load(std::memory_order_relaxed);
+	}
+
+	virtual wsocket::Wsocket *getSocket(void) const override final
+	{
+		return mSocket;
+	}
+
+	// Transmit notifications would come from the I/O thread, which no event loop expects
+	virtual void setTransmitNotify(SocketChatTransmitNotify *notify) override final
+	{
+		(void)notify;
+	}
+
+	// Call before sending anything; the callbacks come from the I/O thread, which sends
+	virtual void setWatermarkCallback(SocketChatWatermarkCallback *callback) override final
+	{
+		mConnection->setWatermarkCallback(callback);
+	}
+
+	// The I/O thread's callback from the wrapped connection; queues each message for the application
+	virtual void receiveMessage(const char *data) override final
+	{
+		queueReceived(data, uint32_t(strlen(data)) + 1, RECEIVED_TEXT);
+	}
+
+	virtual void receiveBinary(const void *data, uint32_t dataLen) override final
+	{
+		queueReceived(data, dataLen, RECEIVED_BINARY);
+	}
+
+private:
+	void run(void)
+	{
+		while (!mQuit.load())
+		{
+			if (mCloseRequested.exchange(false))
+			{
+				mConnection->close();
+			}
+			// Anything sent after this point is noticed before the thread goes to sleep
+			mSeenSendCount = mSendCount.load();
+			mConnection->poll(this, 0);
+			publishState();
+			publishStats();
+			wait();
+		}
+		publishStats();
+		delete mConnection; // finishes closing the connection
+		mConnection = nullptr;
+		mReadyState.store(CLOSED, std::memory_order_release);
+	}
+
+	// I/O thread. Answers a getStats call, if there is one waiting.
+	void publishStats(void)
+	{
+		if (mStatsRequested.exchange(false))
+		{
+			std::lock_guard<std::mutex> lock(mStatsMutex);
+			mConnection->getStats(mStatsSnapshot);
+			mStatsGeneration++;
+			mStatsReady.notify_all();
+		}
+	}
+
+	// Sleeps until the socket has something to do, the application sends, or the time out passes.
+	// The application bumps mSendCount and then checks mSleeping, and this does the reverse, so a
+	// send either shows up in the count here or finds the flag set and wakes us.
+	void wait(void)
+	{
+		bool closed = mReadyState.load(std::memory_order_relaxed) == CLOSED;
+		mSleeping.store(true);
+		if (mSendCount.load() == mSeenSendCount && !mQuit.load() && !mCloseRequested.load() && !mStatsRequested.load())
+		{
+#if USE_EVENTFD
+			int64_t handle = mSocketHandle.load(std::memory_order_relaxed);
+			if (handle >= 0 || closed)
+			{
+				pollfd fds[2];
+				nfds_t count = 0;
+				fds[count].fd = mWakeup;
+				fds[count].events = POLLIN;
+				count++;
+				if (!closed)
+				{
+					fds[count].fd = int(handle);
+					fds[count].events = short(POLLIN | (mConnection->getTransmitBufferSize() ? POLLOUT : 0));
+					count++;
+				}
+				::poll(fds, count, IO_THREAD_IDLE_WAIT);
+				uint64_t value;
+				while (::read(mWakeup, &value, sizeof(value)) > 0)
+				{
+				}
+			}
+			else
+#endif
+			if (closed)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(IO_THREAD_POLL_WAIT));
+			}
+			else
+			{
+				mSocket->select(IO_THREAD_POLL_WAIT, mConnection->getTransmitBufferSize());
+			}
+		}
+		mSleeping.store(false);
+	}
+
+	void wakeup(void)
+	{
+#if USE_EVENTFD
+		if (mWakeup >= 0)
+		{
+			uint64_t value = 1;
+			ssize_t result = ::write(mWakeup, &value, sizeof(value));
+			(void)result; // Only fails if the counter is already saturated, in which case the thread wakes anyway
+		}
+#endif
+	}
+
+	// Any thread. Tells the I/O thread there is something new to send.
+	bool sent(bool ret = true)
+	{
+		mSendCount.fetch_add(1);
+		if (mSleeping.load())
+		{
+			wakeup();
+		}
+		return ret;
+	}
+
+	// The application reads these without touching the wrapped connection
+	void publishState(void)
+	{
+		// A connection still connecting has no handle until it connects
+		if (mSocketHandle.load(std::memory_order_relaxed) < 0)
+		{
+			mSocketHandle.store(mConnection->getSocketHandle(), std::memory_order_relaxed);
+		}
+		mReadyState.store(mConnection->getReadyState(), std::memory_order_release);
+		mMemoryUsage.store(mConnection->getMemoryUsage(), std::memory_order_relaxed);
+		mTransmitBufferSize.store(mConnection->getTransmitBufferSize(), std::memory_order_relaxed);
+		mTransmitBufferMaxSize.store(mConnection->getTransmitBufferMaxSize(), std::memory_order_relaxed);
+	}
+
+	// I/O thread. Copies a received message into the ring; while the application leaves the ring full,
+	// nothing more is read from the socket, so the backlog stays in the kernel.
+	void queueReceived(const void *data, uint32_t len, uint32_t flags)
+	{
+		HeapMessage heap{ nullptr, 0 };
+		if (len > mRingWriter.getMaxRecordSize())
+		{
+			heap.mData = malloc(len);
+			heap.mLength = flags & RECEIVED_TEXT ? len - 1 : len;
+			memcpy(heap.mData, data, len);
+			data = &heap;
+			len = uint32_t(sizeof(heap));
+			flags |= RECEIVED_HEAP;
+		}
+		while (!mRingWriter.writeRecord(data, len, flags))
+		{
+			if (mQuit.load())
+			{
+				free(heap.mData);
+				return;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(IO_THREAD_FULL_WAIT));
+		}
+	}
+
+	SocketChat					*mConnection{ nullptr };	// the wrapped connection; I/O thread only
+	wsocket::Wsocket			*mSocket{ nullptr };
+	std::atomic<int64_t>		mSocketHandle{ -1 };
+	FramingMode					mFraming{ FRAMING_TEXT };
+	std::thread					*mThread{ nullptr };
+	void						*mRingMemory{ nullptr };
+	spsc::SPSC					mRingWriter;				// I/O thread's end of the receive ring
+	spsc::SPSC					mRingReader;				// application's end of the receive ring
+	std::atomic<bool>			mQuit{ false };
+	std::atomic<bool>			mCloseRequested{ false };
+	std::atomic<bool>			mSleeping{ false };
+	std::atomic<uint32_t>		mSendCount{ 0 };			// bumped by every send from the application
+	uint32_t					mSeenSendCount{ 0 };		// mSendCount when the I/O thread last polled
+	std::atomic<uint32_t>		mReadyState{ CLOSED };
+	std::atomic<uint32_t>		mMemoryUsage{ 0 };
+	std::atomic<uint32_t>		mTransmitBufferSize{ 0 };
+	std::atomic<uint32_t>		mTransmitBufferMaxSize{ 0 };
+	mutable std::atomic<bool>	mStatsRequested{ false };
+	mutable std::mutex			mStatsMutex;				// guards the three below
+	mutable std::condition_variable	mStatsReady;
+	uint32_t					mStatsGeneration{ 0 };		// bumped by each snapshot
+	SocketChatStats				mStatsSnapshot;
+#if USE_EVENTFD
+	int							mWakeup{ -1 };				// eventfd which interrupts the I/O thread's wait
+#endif
+};
+
+SocketChat *SocketChat::createThreaded(const char *host, uint32_t port)
+{
+	SocketChatOptions options;
+	return createThreaded(host, port, options);
+}
+
+SocketChat *SocketChat::createThreaded(const char *host, uint32_t port, const SocketChatOptions &options)
+{
+	SocketChatOptions connectionOptions = options;
+	if (!connectionOptions.mSendQueueSize)
+	{
+		connectionOptions.mSendQueueSize = IO_THREAD_SEND_QUEUE_SIZE;
+	}
+	SocketChat *connection = create(host, port, connectionOptions);
+	if (!connection)
+	{
+		return nullptr;
+	}
+	return static_cast<SocketChat *>(new SocketChatThreaded(connection));
+}
+
+} // namespace socketchat
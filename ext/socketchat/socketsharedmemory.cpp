@@ -4,127 +4,834 @@
 #include "wplatform.h"
 #include "SPSC.h"
 
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
 #ifdef _MSC_VER
 #pragma warning(disable:4100)
+#else
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <stddef.h>
+#define USE_EVENTFD_BRIDGE 1
+#define USE_DESCRIPTOR_HANDOFF 1		// The region is a memfd which clients receive over an abstract Unix domain socket
+#else
+#define USE_EVENTFD_BRIDGE 0
+#define USE_DESCRIPTOR_HANDOFF 0		// The region is a file which clients open by name
 #endif
 
-#define SHARED_BUFFER_SIZE (1024*16)
+#define SHARED_BUFFER_SIZE (1024*256)	// Default size of each ring (including its header); every client has one in each direction
+#define SHARED_MIN_RING_SIZE (1024*4)	// Smallest ring size accepted through WsocketOptions
+#define SHARED_MAX_CLIENTS 256			// Clients which may be connected to one shared memory server at a time
+#define PEER_CHECK_INTERVAL 100			// Milliseconds between checks that the process on the other side still exists
+#define BRIDGE_WAIT_TIMEOUT 100			// Longest the bridge thread sleeps before checking whether it should exit
+#define BRIDGE_SLICE_TIMEOUT 1			// Per ring wait while the bridge watches both rings at once
+#define HANDOFF_NAME "socketchat.shared.%d"	// Abstract socket the server hands out its region on, per port
+#define HANDOFF_TIMEOUT 1000			// Milliseconds a client waits for the server to hand over its region
+
+#ifdef _MSC_VER
+#define SHARED_SERVER_FILE "f:\\@sharedserver.%d.cache"
+#elif defined(__linux__)
+#define SHARED_SERVER_FILE "/dev/shm/sharedserver.%d.cache"
+#else
+#define SHARED_SERVER_FILE "/tmp/sharedserver.%d.cache"
+#endif
 
+// The server creates one rendezvous region per port:
+//
+//	RendezvousHeader
+//	RendezvousSlot[SHARED_MAX_CLIENTS]
+//	rings: client to server and server to client for slot 0, then slot 1, ...
+//
+// On Linux the region is an anonymous memfd. The server listens on an abstract Unix domain socket
+// named after the port, and a small thread passes the memfd (SCM_RIGHTS) to every process of the same
+// user which connects, so nothing touches the file system and nothing is left behind if the server
+// dies. Elsewhere the region is a file which clients open by name.
+//
+// A client claims a free slot by writing its process id into it, sets up the slot's two rings and
+// marks it as connecting; the server's 'pollServer' accepts it as a new Wsocket. Since the server
+// cannot sleep on hundreds of rings at once, clients ring a single doorbell in the header whenever a
+// slot needs attention, and the listen socket reports those slots through 'pollReady'.
 namespace wsocket
 {
 
-class WsocketSharedMemory : public Wsocket
+const uint32_t cRendezvousVersion = 2;
+const uint32_t cNoSlot = 0xFFFFFFFF;
+
+#define SHARED_SLOT_CLIENT 1	// 'mAttached' bit held by the client
+#define SHARED_SLOT_SERVER 2	// 'mAttached' bit held by the server
+
+// Both rings of a connection carry records (see spsc::SPSC) of these kinds
+#define RECORD_STREAM 1			// Bytes sent with 'send' or 'sendv'
+#define RECORD_MESSAGE 2		// A whole message, or the last piece of one, followed by a zero byte
+#define RECORD_FRAGMENT 4		// Part of a message too large for one record; more follows
+
+enum SlotState
+{
+	SLOT_IDLE,			// Free, or claimed by a client which is still setting it up
+	SLOT_CONNECTING,	// Waiting for the server to accept it
+	SLOT_CONNECTED,
+	SLOT_CLOSED,		// One side has closed the connection
+};
+
+struct RendezvousHeader
+{
+	std::atomic<uint32_t>	mVersionNumber;		// Written last, so clients never see a half initialized header
+	std::atomic<uint32_t>	mSlotCount;
+	std::atomic<uint32_t>	mRingSize;
+	std::atomic<uint32_t>	mServerProcess;		// Process id of the server
+	std::atomic<uint32_t>	mListening;			// Cleared once the listen socket is released
+	std::atomic<uint32_t>	mConnectSequence;	// Bumped every time a client marks a slot as connecting
+	std::atomic<uint32_t>	mDoorbell;			// Bumped whenever a slot needs the server's attention; the server sleeps on it
+	std::atomic<uint32_t>	mServerWaiting;		// Non-zero while the server sleeps on mDoorbell
+	uint8_t					mPad[SPSC_CACHE_LINE_SIZE - 8 * sizeof(uint32_t)];
+};
+
+// One client's claim on the server; each sits on its own cache line
+struct RendezvousSlot
+{
+	std::atomic<uint32_t>	mClientProcess;		// Process id of the client which owns the slot; zero when free
+	std::atomic<uint32_t>	mAttached;			// SHARED_SLOT_CLIENT and/or SHARED_SLOT_SERVER; the slot is freed when both let go
+	std::atomic<uint32_t>	mState;				// SlotState
+	std::atomic<uint32_t>	mServerNotify;		// Set by the client when the server should service this slot
+	std::atomic<uint32_t>	mServerWantsSpace;	// Set by the server when a send to the client came up short
+	uint8_t					mPad[SPSC_CACHE_LINE_SIZE - 5 * sizeof(uint32_t)];
+};
+
+static_assert(sizeof(RendezvousHeader) == SPSC_CACHE_LINE_SIZE, "RendezvousHeader should fill one cache line");
+static_assert(sizeof(RendezvousSlot) == SPSC_CACHE_LINE_SIZE, "RendezvousSlot should fill one cache line");
+
+class WsocketSharedMemory;
+
+// The mapped rendezvous file. Reference counted, since connections may outlive the listen socket.
+class SharedMemoryRegion
 {
 public:
-	WsocketSharedMemory(const char *hostName,int32_t port)
-	{
-		mIsServer = strcmp(hostName, SHARED_SERVER) == 0;
-		char scratch[512];
-		wplatform::stringFormat(scratch, 512, "f:\\@sharedserver.%d.cache", port);
-		uint64_t fsize = SHARED_BUFFER_SIZE;
-		mServerFile = memorymap::MemoryMap::createMemoryMap(scratch, fsize, mIsServer, false);
-		wplatform::stringFormat(scratch, 512, "f:\\@sharedclient.%d.cache", port);
-		fsize = SHARED_BUFFER_SIZE;
-		mClientFile = memorymap::MemoryMap::createMemoryMap(scratch, fsize, mIsServer, false);
-		if (mServerFile && mClientFile)
-		{
-			// If I'm the server, then I write to the server file and read from the client file
-			if (mIsServer)
+	SharedMemoryRegion(int32_t port, bool isServer, const WsocketOptions &options) : mIsServer(isServer), mPort(port)
+	{
+		wplatform::stringFormat(mFileName, sizeof(mFileName), SHARED_SERVER_FILE, port);
+		if (isServer)
+		{
+			createServer(options);
+		}
+		else
+		{
+			openClient();
+		}
+	}
+
+	~SharedMemoryRegion(void)
+	{
+		stopHandoff();
+		if (mMap)
+		{
+			mMap->release();
+		}
+	}
+
+	bool isValid(void) const
+	{
+		return mHeader != nullptr;
+	}
+
+	void addRef(void)
+	{
+		mRefCount++;
+	}
+
+	void release(void)
+	{
+		mRefCount--;
+		if (mRefCount == 0)
+		{
+			delete this;
+		}
+	}
+
+	RendezvousHeader *getHeader(void) const
+	{
+		return mHeader;
+	}
+
+	RendezvousSlot *getSlot(uint32_t index) const
+	{
+		return &mSlots[index];
+	}
+
+	uint32_t getSlotCount(void) const
+	{
+		return mSlotCount;
+	}
+
+	uint32_t getRingSize(void) const
+	{
+		return mRingSize;
+	}
+
+	uint8_t *getRing(uint32_t index, bool toServer) const
+	{
+		return mRings + (uint64_t(index) * 2 + (toServer ? 0 : 1)) * mRingSize;
+	}
+
+	// Client only. Claims a free slot for the calling process, or returns cNoSlot if the server is full
+	uint32_t claimSlot(void)
+	{
+		uint32_t me = wplatform::getProcessId();
+		for (uint32_t i = 0; i < mSlotCount; i++)
+		{
+			uint32_t expected = 0;
+			if (mSlots[i].mClientProcess.compare_exchange_strong(expected, me))
 			{
-				mWriter.init(mServerFile->getBaseAddress(), uint32_t(mServerFile->getFileSize()), true,true);
-				mReader.init(mClientFile->getBaseAddress(), uint32_t(mClientFile->getFileSize()), false,true);
+				mSlots[i].mState.store(SLOT_IDLE, std::memory_order_relaxed);
+				mSlots[i].mServerNotify.store(0, std::memory_order_relaxed);
+				mSlots[i].mServerWantsSpace.store(0, std::memory_order_relaxed);
+				mSlots[i].mAttached.store(SHARED_SLOT_CLIENT, std::memory_order_release);
+				return i;
 			}
-			else
+		}
+		return cNoSlot;
+	}
+
+	// Client only. The slot's rings are ready; hand it to the server
+	void publishSlot(uint32_t index)
+	{
+		mSlots[index].mState.store(SLOT_CONNECTING, std::memory_order_release);
+		mHeader->mConnectSequence.fetch_add(1);
+		ringDoorbell();
+	}
+
+	// Asks the server to look at this slot. Only the first request since the server last looked rings the doorbell.
+	void notifyServer(uint32_t index)
+	{
+		RendezvousSlot &slot = mSlots[index];
+		if (slot.mServerNotify.load(std::memory_order_relaxed) == 0 && slot.mServerNotify.exchange(1) == 0)
+		{
+			ringDoorbell();
+		}
+	}
+
+	// Drops the given attach bits; whoever lets go last returns the slot to the free list
+	void detachSlot(uint32_t index, uint32_t bits)
+	{
+		RendezvousSlot &slot = mSlots[index];
+		uint32_t previous = slot.mAttached.fetch_and(~bits);
+		if ((previous & bits) && (previous & ~bits) == 0)
+		{
+			freeSlot(index);
+		}
+	}
+
+	// Server only. Frees slots left behind by clients which died before the server ever attached to them
+	void sweepSlots(void)
+	{
+		for (uint32_t i = 0; i < mSlotCount; i++)
+		{
+			RendezvousSlot &slot = mSlots[i];
+			uint32_t process = slot.mClientProcess.load(std::memory_order_acquire);
+			if (process && !(slot.mAttached.load(std::memory_order_acquire) & SHARED_SLOT_SERVER) && !wplatform::isProcessAlive(process))
 			{
-				// If I am a client..then I write to the client file and read from the server file
-				mWriter.init(mClientFile->getBaseAddress(), uint32_t(mClientFile->getFileSize()), true,false);
-				mReader.init(mServerFile->getBaseAddress(), uint32_t(mServerFile->getFileSize()), false,false);
-				mWriter.incrementSequenceNumber();
+				freeSlot(i);
 			}
 		}
 	}
 
-	virtual ~WsocketSharedMemory(void)
+	// Server only. The listen socket is gone; new clients should not connect to this region any more
+	void stopListening(void)
 	{
-		if (mClientFile)
+		mHeader->mListening.store(0, std::memory_order_release);
+#if USE_DESCRIPTOR_HANDOFF
+		stopHandoff();
+#elif !defined(_MSC_VER)
+		unlink(mFileName);
+#endif
+	}
+
+	// Server side connections, indexed by slot, so the listen socket can report which are ready
+	std::vector< WsocketSharedMemory * >	mConnections;
+
+private:
+	void createServer(const WsocketOptions &options)
+	{
+		uint32_t ringSize = options.mSharedRingSize ? options.mSharedRingSize : SHARED_BUFFER_SIZE;
+		if (ringSize < SHARED_MIN_RING_SIZE)
 		{
-			mClientFile->release();
+			ringSize = SHARED_MIN_RING_SIZE;
 		}
-		if (mServerFile)
+		// Keep every ring on its own cache lines
+		ringSize = (ringSize + SPSC_CACHE_LINE_SIZE - 1) & ~uint32_t(SPSC_CACHE_LINE_SIZE - 1);
+		mMapFlags = (options.mSharedPopulate ? MEMORYMAP_POPULATE : 0) |
+			(options.mSharedLock ? MEMORYMAP_LOCK : 0) |
+			(options.mSharedHugePages ? MEMORYMAP_HUGE_PAGES : 0);
+		uint64_t size = regionSize(SHARED_MAX_CLIENTS, ringSize);
+#if USE_DESCRIPTOR_HANDOFF
+		// Binding the name fails while another server owns this port; the kernel drops it when that process exits
+		if (!bindHandoff())
 		{
-			mServerFile->release();
+			return;
 		}
+		mMap = memorymap::MemoryMap::createSharedMemory(size, mMapFlags);
+#else
+		// Refuse to take over a port whose server is still running
+		uint64_t existingSize = 0;
+		memorymap::MemoryMap *existing = memorymap::MemoryMap::createMemoryMap(mFileName, existingSize, false, true);
+		if (existing)
+		{
+			bool inUse = false;
+			if (existingSize >= sizeof(RendezvousHeader))
+			{
+				RendezvousHeader *h = (RendezvousHeader *)existing->getBaseAddress();
+				inUse = h->mVersionNumber == cRendezvousVersion && h->mListening && wplatform::isProcessAlive(h->mServerProcess);
+			}
+			existing->release();
+			if (inUse)
+			{
+				return;
+			}
+		}
+#ifndef _MSC_VER
+		// Clients of an earlier server may still have the old file mapped; give this server a fresh one rather than truncating theirs
+		unlink(mFileName);
+#endif
+		mMap = memorymap::MemoryMap::createMemoryMap(mFileName, size, true, false);
+#endif
+		if (!mMap)
+		{
+			return;
+		}
+		RendezvousHeader *h = (RendezvousHeader *)mMap->getBaseAddress();
+		h->mSlotCount.store(SHARED_MAX_CLIENTS, std::memory_order_relaxed);
+		h->mRingSize.store(ringSize, std::memory_order_relaxed);
+		h->mServerProcess.store(wplatform::getProcessId(), std::memory_order_relaxed);
+		h->mListening.store(1, std::memory_order_relaxed);
+		h->mConnectSequence.store(0, std::memory_order_relaxed);
+		h->mDoorbell.store(0, std::memory_order_relaxed);
+		h->mServerWaiting.store(0, std::memory_order_relaxed);
+		h->mVersionNumber.store(cRendezvousVersion, std::memory_order_release);
+		setLayout(h, SHARED_MAX_CLIENTS, ringSize);
+		mConnections.resize(mSlotCount, nullptr);
+#if USE_DESCRIPTOR_HANDOFF
+		mHandoffThread = new std::thread([this]()
+		{
+			runHandoff();
+		});
+#endif
 	}
 
-	// If we are a server, we poll for new connections.
-	// If a new connection is found, then we return an instance of a Wsocket with that connection.
-	// It is the caller's responsibility to release it when finished
-	virtual Wsocket *pollServer(void) override final
+	void openClient(void)
 	{
-		Wsocket *ret = nullptr;
+		uint64_t size = 0;
+#if USE_DESCRIPTOR_HANDOFF
+		uint32_t mapFlags = 0;
+		uint32_t handoffProcess = 0;
+		int fd = receiveHandoff(mapFlags, handoffProcess);
+		if (fd < 0)
+		{
+			return;
+		}
+		mMap = memorymap::MemoryMap::openSharedMemory(fd, size, mapFlags);
+#else
+		mMap = memorymap::MemoryMap::createMemoryMap(mFileName, size, false, false);
+#endif
+		if (!mMap)
+		{
+			return;
+		}
+		RendezvousHeader *h = (RendezvousHeader *)mMap->getBaseAddress();
+		if (size < sizeof(RendezvousHeader) ||
+			h->mVersionNumber.load(std::memory_order_acquire) != cRendezvousVersion ||
+			size < regionSize(h->mSlotCount, h->mRingSize) ||
+			!h->mListening ||
+			!wplatform::isProcessAlive(h->mServerProcess))
+		{
+			mMap->release();
+			mMap = nullptr;
+			return;
+		}
+#if USE_DESCRIPTOR_HANDOFF
+		// The region must belong to the process which handed it over
+		if (h->mServerProcess.load(std::memory_order_relaxed) != handoffProcess)
+		{
+			mMap->release();
+			mMap = nullptr;
+			return;
+		}
+#endif
+		setLayout(h, h->mSlotCount, h->mRingSize);
+	}
 
-		if (mIsServer)
+	void setLayout(RendezvousHeader *h, uint32_t slotCount, uint32_t ringSize)
+	{
+		mHeader = h;
+		mSlotCount = slotCount;
+		mRingSize = ringSize;
+		mSlots = (RendezvousSlot *)(h + 1);
+		mRings = (uint8_t *)(mSlots + slotCount);
+	}
+
+	static uint64_t regionSize(uint32_t slotCount, uint32_t ringSize)
+	{
+		return sizeof(RendezvousHeader) + uint64_t(slotCount) * (sizeof(RendezvousSlot) + uint64_t(ringSize) * 2);
+	}
+
+	void ringDoorbell(void)
+	{
+		mHeader->mDoorbell.fetch_add(1);
+		if (mHeader->mServerWaiting.load())
+		{
+			spsc::futexWake(mHeader->mDoorbell);
+		}
+	}
+
+#if USE_DESCRIPTOR_HANDOFF
+	socklen_t handoffAddress(sockaddr_un &address) const
+	{
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		// A leading zero byte puts the name in the abstract namespace rather than the file system
+		wplatform::stringFormat(address.sun_path + 1, sizeof(address.sun_path) - 1, HANDOFF_NAME, mPort);
+		return socklen_t(offsetof(sockaddr_un, sun_path) + 1 + strlen(address.sun_path + 1));
+	}
+
+	bool bindHandoff(void)
+	{
+		mHandoffSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (mHandoffSocket < 0)
+		{
+			return false;
+		}
+		sockaddr_un address;
+		socklen_t len = handoffAddress(address);
+		if (bind(mHandoffSocket, (sockaddr *)&address, len) != 0 || listen(mHandoffSocket, SOMAXCONN) != 0)
+		{
+			::close(mHandoffSocket);
+			mHandoffSocket = -1;
+			return false;
+		}
+		return true;
+	}
+
+	// Server thread. Passes the region's descriptor, along with the mapping flags, to each client which connects
+	void runHandoff(void)
+	{
+		uid_t me = getuid();
+		while (!mHandoffExit)
 		{
-			if (mReader.getSequenceNumber() != mSequenceNumber)
+			pollfd p;
+			p.fd = mHandoffSocket;
+			p.events = POLLIN;
+			p.revents = 0;
+			if (::poll(&p, 1, BRIDGE_WAIT_TIMEOUT) <= 0)
+			{
+				continue;
+			}
+			int client = accept4(mHandoffSocket, nullptr, nullptr, SOCK_CLOEXEC);
+			if (client < 0)
+			{
+				continue;
+			}
+			// Only processes running as the same user get the region
+			ucred credentials;
+			socklen_t credentialsLen = sizeof(credentials);
+			if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &credentials, &credentialsLen) == 0 && credentials.uid == me)
 			{
-				if (mFirst)
+				int fd = int(mMap->getHandle());
+				iovec iov;
+				iov.iov_base = &mMapFlags;
+				iov.iov_len = sizeof(mMapFlags);
+				char control[CMSG_SPACE(sizeof(int))];
+				memset(control, 0, sizeof(control));
+				msghdr msg;
+				memset(&msg, 0, sizeof(msg));
+				msg.msg_iov = &iov;
+				msg.msg_iovlen = 1;
+				msg.msg_control = control;
+				msg.msg_controllen = sizeof(control);
+				cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+				cmsg->cmsg_level = SOL_SOCKET;
+				cmsg->cmsg_type = SCM_RIGHTS;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+				memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+				ssize_t result = sendmsg(client, &msg, MSG_NOSIGNAL);
+				(void)result; // A client which gave up already simply never gets it
+			}
+			::close(client);
+		}
+	}
+
+	// Client only. Asks the server for its region; returns the descriptor, or -1.
+	// The name is abstract, with no permissions of its own, so whoever answers has to prove to be a process
+	// of the same user; 'serverProcess' is its process id, for the caller to match against the region.
+	int receiveHandoff(uint32_t &mapFlags, uint32_t &serverProcess)
+	{
+		int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (s < 0)
+		{
+			return -1;
+		}
+		timeval timeOut;
+		timeOut.tv_sec = HANDOFF_TIMEOUT / 1000;
+		timeOut.tv_usec = (HANDOFF_TIMEOUT % 1000) * 1000;
+		setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeOut, sizeof(timeOut));
+		sockaddr_un address;
+		socklen_t len = handoffAddress(address);
+		int fd = -1;
+		ucred credentials;
+		socklen_t credentialsLen = sizeof(credentials);
+		if (connect(s, (sockaddr *)&address, len) == 0 &&
+			getsockopt(s, SOL_SOCKET, SO_PEERCRED, &credentials, &credentialsLen) == 0 &&
+			credentials.uid == getuid())
+		{
+			serverProcess = uint32_t(credentials.pid);
+			iovec iov;
+			iov.iov_base = &mapFlags;
+			iov.iov_len = sizeof(mapFlags);
+			char control[CMSG_SPACE(sizeof(int))];
+			msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			if (recvmsg(s, &msg, MSG_CMSG_CLOEXEC) == ssize_t(sizeof(mapFlags)))
+			{
+				cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+				if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
 				{
-					mSequenceNumber = mReader.getSequenceNumber();
-					mFirst = false;
-					ret = this;
+					memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
 				}
 			}
 		}
+		::close(s);
+		return fd;
+	}
 
-		return ret;
+	void stopHandoff(void)
+	{
+		if (mHandoffThread)
+		{
+			mHandoffExit = true;
+			// Wakes the thread's poll straight away
+			shutdown(mHandoffSocket, SHUT_RDWR);
+			mHandoffThread->join();
+			delete mHandoffThread;
+			mHandoffThread = nullptr;
+		}
+		if (mHandoffSocket >= 0)
+		{
+			::close(mHandoffSocket);
+			mHandoffSocket = -1;
+		}
+	}
+#else
+	void stopHandoff(void)
+	{
+	}
+#endif
+
+	void freeSlot(uint32_t index)
+	{
+		RendezvousSlot &slot = mSlots[index];
+		slot.mState.store(SLOT_IDLE, std::memory_order_relaxed);
+		slot.mServerNotify.store(0, std::memory_order_relaxed);
+		slot.mServerWantsSpace.store(0, std::memory_order_relaxed);
+		slot.mAttached.store(0, std::memory_order_relaxed);
+		slot.mClientProcess.store(0, std::memory_order_release);
+	}
+
+	bool					mIsServer{ false };
+	int32_t					mPort{ 0 };
+	char					mFileName[512];
+	uint32_t				mRefCount{ 1 };
+	memorymap::MemoryMap	*mMap{ nullptr };
+	RendezvousHeader		*mHeader{ nullptr };
+	RendezvousSlot			*mSlots{ nullptr };
+	uint8_t					*mRings{ nullptr };
+	uint32_t				mSlotCount{ 0 };
+	uint32_t				mRingSize{ 0 };
+	uint32_t				mMapFlags{ 0 };				// MEMORYMAP_ flags the server created the region with
+#if USE_DESCRIPTOR_HANDOFF
+	int						mHandoffSocket{ -1 };		// Server only; where clients ask for the region
+	std::thread				*mHandoffThread{ nullptr };
+	std::atomic<bool>		mHandoffExit{ false };
+#endif
+};
+
+// One end of a connection; the client's end or one of the server's accepted connections
+class WsocketSharedMemory : public Wsocket
+{
+public:
+	WsocketSharedMemory(SharedMemoryRegion *region, uint32_t slot, bool isServer) : mRegion(region), mSlot(slot), mIsServer(isServer)
+	{
+		mRegion->addRef();
+		uint8_t *toServer = mRegion->getRing(slot, true);
+		uint8_t *toClient = mRegion->getRing(slot, false);
+		uint32_t ringSize = mRegion->getRingSize();
+		if (isServer)
+		{
+			// The client set up both rings before publishing the slot
+			mReader.init(toServer, ringSize, false, false);
+			mWriter.init(toClient, ringSize, true, false);
+			mPeerProcess = mRegion->getSlot(slot)->mClientProcess;
+			mRegion->mConnections[slot] = this;
+		}
+		else
+		{
+			mWriter.init(toServer, ringSize, true, true);
+			mReader.init(toClient, ringSize, false, true);
+			mPeerProcess = mRegion->getHeader()->mServerProcess;
+		}
+	}
+
+	virtual ~WsocketSharedMemory(void)
+	{
+		stopBridge();
+		close();
+		uint32_t bits = mIsServer ? SHARED_SLOT_SERVER : SHARED_SLOT_CLIENT;
+		if (mPeerDead)
+		{
+			bits |= mIsServer ? SHARED_SLOT_CLIENT : SHARED_SLOT_SERVER; // nobody is left to let go of the other side
+		}
+		if (mIsServer)
+		{
+			mRegion->mConnections[mSlot] = nullptr;
+		}
+		mRegion->detachSlot(mSlot, bits);
+		mRegion->release();
+	}
+
+	virtual Wsocket *pollServer(void) override final
+	{
+		return nullptr;
+	}
+
+	virtual bool acceptStalled(void) override final
+	{
+		return false;
+	}
+
+	virtual int32_t pollReady(Wsocket **ready, uint32_t maxReady) override final
+	{
+		return -1;
 	}
 
-	// performs the select operation on this socket
+	// Waits until the peer has written something, or, if we have data to send and our ring is full,
+	// until the peer has made room. Spins briefly and then sleeps on a futex, so an idle connection costs no CPU.
 	virtual void select(int32_t timeOut, size_t txBufSize) override final
 	{
-		// nothing to do here...
+		if (txBufSize && mWriter.capacity() == 0)
+		{
+			mWriter.waitForSpace(timeOut);
+		}
+		else if (!txBufSize || mReader.size() == 0)
+		{
+			mReader.waitForData(timeOut);
+		}
 	}
 
-	// Performs a general select on no specific socket 
+	// Performs a general select on no specific socket; returns early if the peer writes something
 	virtual void nullSelect(int32_t timeOut) override final
 	{
-		// nothing to do here
+		if (timeOut > 0)
+		{
+			mReader.waitForData(timeOut);
+		}
 	}
 
-	// Receive data from the socket connection.  
+	// Receive data from the socket connection.
 	// A return code of -1 means no data received.
-	// A return code >0 is number of bytes received.
+	// A return code of 0 means the peer closed the connection or its process has gone away.
+	// Stops short at a message, which has to be taken with 'receiveMessage' first.
 	virtual int32_t receive(void *dest, uint32_t maxLen) override final
 	{
-		int32_t ret = -1;
-
-		uint32_t rcount = mReader.read(dest, maxLen);
-		if (rcount > 0)
+		uint32_t rcount = readStream(dest, maxLen);
+		if (rcount == 0 && isPeerGone())
 		{
-			ret = int32_t(rcount);
+			// Anything written before the close is still delivered
+			rcount = readStream(dest, maxLen);
+			if (rcount == 0 && mReader.size() == 0)
+			{
+				return 0;
+			}
 		}
-
-		return ret;
+		if (rcount == 0)
+		{
+			armBridge(true, false);
+			return -1;
+		}
+		return int32_t(rcount);
 	}
 
 	// Send this much data to the socket
 	virtual int32_t send(const void *data, uint32_t dataLen) override final
 	{
-		int32_t ret = -1;
+		WsocketIovec iov;
+		iov.mData = data;
+		iov.mLength = dataLen;
+		return sendv(&iov, 1, false);
+	}
 
-		uint32_t scount = mWriter.write(data, dataLen);
-		if (scount > 0)
+	virtual int32_t sendv(const WsocketIovec *iov, uint32_t iovCount, bool moreToCome) override final
+	{
+		(void)moreToCome;
+		uint32_t remaining = 0;
+		for (uint32_t i = 0; i < iovCount; i++)
 		{
-			ret = int32_t(scount);
+			remaining += iov[i].mLength;
 		}
+		// Gather straight into the ring, one stream record per contiguous run rather than one per piece
+		uint32_t total = 0;
+		uint32_t piece = 0;
+		uint32_t offset = 0;
+		while (remaining)
+		{
+			uint32_t len = remaining < mWriter.getMaxRecordSize() ? remaining : mWriter.getMaxRecordSize();
+			uint8_t *dest = mWriter.reserveRecord(len);
+			if (!dest)
+			{
+				break;
+			}
+			uint32_t filled = 0;
+			while (filled < len)
+			{
+				uint32_t copy = iov[piece].mLength - offset;
+				if (copy > len - filled)
+				{
+					copy = len - filled;
+				}
+				memcpy(dest + filled, (const uint8_t *)iov[piece].mData + offset, copy);
+				filled += copy;
+				offset += copy;
+				if (offset == iov[piece].mLength)
+				{
+					piece++;
+					offset = 0;
+				}
+			}
+			mWriter.commitRecord(filled, RECORD_STREAM);
+			total += filled;
+			remaining -= filled;
+		}
+		return sent(total, remaining != 0);
+	}
 
-		return ret;
+	// Every message is one record, written straight into the ring, so the peer gets it in place with no
+	// framing to scan for. One too large for a record goes as a run of fragments the peer reassembles.
+	virtual bool supportsMessages(void) override final
+	{
+		return true;
+	}
+
+	virtual bool sendMessage(const void *data, uint32_t dataLen) override final
+	{
+		const uint8_t *source = (const uint8_t *)data;
+		uint32_t maxRecord = mWriter.getMaxRecordSize();
+		while (mMessageSent <= dataLen)
+		{
+			// The last record carries the rest of the message and the zero byte which follows it
+			uint32_t remaining = dataLen - mMessageSent;
+			uint32_t len = remaining < maxRecord ? remaining + 1 : maxRecord;
+			uint32_t wanted = len;
+			uint8_t *dest = mWriter.reserveRecord(len);
+			// Only split a message which could never fit in one record
+			if (!dest || (dataLen < maxRecord && len < wanted))
+			{
+				sent(0, true);
+				return false;
+			}
+			if (len > remaining)
+			{
+				memcpy(dest, source + mMessageSent, remaining);
+				dest[remaining] = 0;
+				mWriter.commitRecord(len, RECORD_MESSAGE);
+				mMessageSent = 0;
+				sent(len, false);
+				return true;
+			}
+			memcpy(dest, source + mMessageSent, len);
+			mWriter.commitRecord(len, RECORD_FRAGMENT);
+			mMessageSent += len;
+			sent(len, false);
+		}
+		return false;
+	}
+
+	virtual const void *receiveMessage(uint32_t &dataLen) override final
+	{
+		uint32_t len;
+		uint32_t flags;
+		const uint8_t *record;
+		while ((record = mReader.peekRecord(len, flags)) != nullptr && !(flags & RECORD_STREAM))
+		{
+			if (flags & RECORD_FRAGMENT)
+			{
+				mAssembly.insert(mAssembly.end(), record, record + len);
+				mReader.releaseRecord();
+				consumed();
+				continue;
+			}
+			if (mAssembly.empty())
+			{
+				dataLen = len - 1;
+				return record;
+			}
+			// The final piece of a fragmented message; it brings the zero byte with it
+			mAssembly.insert(mAssembly.end(), record, record + len);
+			mReader.releaseRecord();
+			mAssembled = true;
+			dataLen = uint32_t(mAssembly.size()) - 1;
+			return &mAssembly[0];
+		}
+		dataLen = 0;
+		return nullptr;
 	}
 
-	// Close the socket
+	virtual void releaseMessage(void) override final
+	{
+		if (mAssembled)
+		{
+			mAssembled = false;
+			mAssembly.clear();
+		}
+		else
+		{
+			mReader.releaseRecord();
+		}
+		consumed();
+	}
+
+	// The server's rings are mapped by the time 'create' returns
+	virtual ConnectState pollConnect(int32_t timeout) override final
+	{
+		(void)timeout;
+		return CONNECT_DONE;
+	}
+
+	// Tells the peer we are done; it sees the connection close once it has read everything we sent
 	virtual void	close(void) override final
 	{
-		// don't do anything in particular yet...
+		if (mClosed)
+		{
+			return;
+		}
+		mClosed = true;
+		mRegion->getSlot(mSlot)->mState.store(SLOT_CLOSED, std::memory_order_release);
+		if (mIsServer)
+		{
+			mWriter.wakeAll();
+		}
+		else
+		{
+			mRegion->notifyServer(mSlot);
+		}
 	}
 
 	// Returns true if the socket send 'would block'
@@ -149,41 +856,506 @@ public:
 		// nothing to do
 	}
 
+	// Shared memory has no descriptor of its own. The server's connections are reported through the listen
+	// socket's 'pollReady' instead. On a client, where eventfd is available, asking for the handle starts a
+	// bridge thread which sleeps on the rings' futexes and signals an eventfd whenever the server writes data,
+	// closes, or, after a send came up short, frees space; that descriptor can sit in an epoll set next to TCP sockets.
+	virtual int64_t getSocketHandle(void) override final
+	{
+#if USE_EVENTFD_BRIDGE
+		if (mIsServer)
+		{
+			return -1;
+		}
+		if (mEventFd < 0)
+		{
+			startBridge();
+		}
+		return mEventFd;
+#else
+		return -1;
+#endif
+	}
+
 	// Close the socket and release this class
 	virtual void release(void) override final
 	{
 		delete this;
 	}
 
-	bool isValid(void) const
+	// Server only. The listen socket found the client's process has gone
+	void setPeerDead(void)
 	{
-		bool ret = false;
-		if (mServerFile && mClientFile)
+		mPeerDead = true;
+	}
+
+private:
+	// Copies bytes out of the stream records at the front of the ring, stopping at a message
+	uint32_t readStream(void *dest, uint32_t maxLen)
+	{
+		uint32_t rcount = 0;
+		uint32_t len;
+		uint32_t flags;
+		const uint8_t *record;
+		while (rcount < maxLen && (record = mReader.peekRecord(len, flags)) != nullptr && (flags & RECORD_STREAM))
 		{
-			ret = true;
+			uint32_t copy = len - mStreamOffset;
+			if (copy > maxLen - rcount)
+			{
+				copy = maxLen - rcount;
+			}
+			memcpy((uint8_t *)dest + rcount, record + mStreamOffset, copy);
+			rcount += copy;
+			mStreamOffset += copy;
+			if (mStreamOffset == len)
+			{
+				mStreamOffset = 0;
+				mReader.releaseRecord();
+			}
+		}
+		if (rcount)
+		{
+			consumed();
+		}
+		return rcount;
+	}
+
+	// We freed space in the ring the server writes to; wake it if it was waiting for that
+	void consumed(void)
+	{
+		if (!mIsServer)
+		{
+			RendezvousSlot *slot = mRegion->getSlot(mSlot);
+			// Releasing a record has already fenced, so a server which set the flag after we freed space re-checks and sees it
+			if (slot->mServerWantsSpace.load(std::memory_order_relaxed) && slot->mServerWantsSpace.exchange(0))
+			{
+				mRegion->notifyServer(mSlot);
+			}
 		}
-		return ret;
 	}
 
-	bool					mFirst{ true };
-	uint32_t				mSequenceNumber{ 0 };
+	int32_t sent(uint32_t count, bool full)
+	{
+		if (count && !mIsServer)
+		{
+			mRegion->notifyServer(mSlot);
+		}
+		if (full)
+		{
+			if (count == 0 && isPeerGone())
+			{
+				return 0;
+			}
+			if (mIsServer)
+			{
+				// Ask the client to ring when it reads; if it already has, make sure we get looked at again anyway
+				RendezvousSlot *slot = mRegion->getSlot(mSlot);
+				slot->mServerWantsSpace.store(1);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (mWriter.capacity())
+				{
+					mRegion->notifyServer(mSlot);
+				}
+			}
+			else
+			{
+				armBridge(false, true);
+			}
+		}
+		return count ? int32_t(count) : -1;
+	}
+
+	// True once the peer has closed the connection or its process no longer exists
+	bool isPeerGone(void)
+	{
+		if (mRegion->getSlot(mSlot)->mState.load(std::memory_order_acquire) == SLOT_CLOSED)
+		{
+			return true;
+		}
+		if (!mPeerDead)
+		{
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			if (now >= mNextPeerCheck)
+			{
+				mNextPeerCheck = now + std::chrono::milliseconds(PEER_CHECK_INTERVAL);
+				mPeerDead = !wplatform::isProcessAlive(mPeerProcess);
+			}
+		}
+		return mPeerDead;
+	}
+
+#if USE_EVENTFD_BRIDGE
+	void startBridge(void)
+	{
+		mEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (mEventFd < 0)
+		{
+			return;
+		}
+		mWantData = true;
+		mBridgeThread = new std::thread([this]()
+		{
+			runBridge();
+		});
+	}
+
+	void stopBridge(void)
+	{
+		if (mBridgeThread)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mBridgeMutex);
+				mBridgeExit = true;
+			}
+			mBridgeWake.notify_one();
+			mReader.wakeAll();
+			mWriter.wakeAll();
+			mBridgeThread->join();
+			delete mBridgeThread;
+			mBridgeThread = nullptr;
+		}
+		if (mEventFd >= 0)
+		{
+			::close(mEventFd);
+			mEventFd = -1;
+		}
+	}
+
+	// Asks the bridge to signal the eventfd once data arrives and/or space frees up.
+	// Before watching for data again, the eventfd is drained; every caller goes on to try
+	// sending as well, so a space notification drained here is never lost.
+	void armBridge(bool wantData, bool wantSpace)
+	{
+		// Nothing to do if the bridge is already watching for this; keeps the polling path free of locks
+		if (!mBridgeThread || ((!wantData || mWantData) && (!wantSpace || mWantSpace)))
+		{
+			return;
+		}
+		if (wantData)
+		{
+			uint64_t value;
+			while (::read(mEventFd, &value, sizeof(value)) > 0)
+			{
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lock(mBridgeMutex);
+			if (wantData)
+			{
+				mWantData = true;
+			}
+			if (wantSpace)
+			{
+				mWantSpace = true;
+			}
+		}
+		mBridgeWake.notify_one();
+	}
+
+	void runBridge(void)
+	{
+		for (;;)
+		{
+			bool wantData;
+			bool wantSpace;
+			{
+				std::unique_lock<std::mutex> lock(mBridgeMutex);
+				mBridgeWake.wait(lock, [this]() { return mBridgeExit || mWantData || mWantSpace; });
+				if (mBridgeExit)
+				{
+					break;
+				}
+				wantData = mWantData;
+				wantSpace = mWantSpace;
+			}
+			// A thread can only sleep on one futex, so watching both rings means taking turns in short slices
+			int32_t timeOut = (wantData && wantSpace) ? BRIDGE_SLICE_TIMEOUT : BRIDGE_WAIT_TIMEOUT;
+			// A close by the server wakes the reader without writing anything; report it like data so it gets read
+			bool gotData = wantData && (mReader.waitForData(timeOut) ||
+				mRegion->getSlot(mSlot)->mState.load(std::memory_order_acquire) == SLOT_CLOSED ||
+				!wplatform::isProcessAlive(mPeerProcess));
+			bool gotSpace = wantSpace && mWriter.waitForSpace(timeOut);
+			if (gotData || gotSpace)
+			{
+				{
+					std::lock_guard<std::mutex> lock(mBridgeMutex);
+					if (gotData)
+					{
+						mWantData = false;
+					}
+					if (gotSpace)
+					{
+						mWantSpace = false;
+					}
+				}
+				uint64_t value = 1;
+				ssize_t result = ::write(mEventFd, &value, sizeof(value));
+				(void)result; // Only fails if the counter is saturated, in which case it is already readable
+			}
+		}
+	}
+
+	int						mEventFd{ -1 };
+	std::thread				*mBridgeThread{ nullptr };
+	std::mutex				mBridgeMutex;
+	std::condition_variable	mBridgeWake;
+	bool					mBridgeExit{ false };
+	std::atomic<bool>		mWantData{ false };		// The reader drained the ring; signal when the peer writes again
+	std::atomic<bool>		mWantSpace{ false };	// A send came up short; signal when the peer reads
+#else
+	void stopBridge(void)
+	{
+	}
+
+	void armBridge(bool wantData, bool wantSpace)
+	{
+		(void)wantData;
+		(void)wantSpace;
+	}
+#endif
+
+	SharedMemoryRegion		*mRegion{ nullptr };
+	uint32_t				mSlot{ 0 };
 	bool					mIsServer{ false };
+	bool					mClosed{ false };
+	bool					mPeerDead{ false };
+	uint32_t				mPeerProcess{ 0 };
+	std::chrono::steady_clock::time_point	mNextPeerCheck;
 	spsc::SPSC				mReader;
 	spsc::SPSC				mWriter;
-	bool					mOwnClientServerFiles{ true };
-	memorymap::MemoryMap	*mServerFile{ nullptr };
-	memorymap::MemoryMap	*mClientFile{ nullptr };
+	uint32_t				mStreamOffset{ 0 };		// Bytes already received from the stream record at the front of the ring
+	uint32_t				mMessageSent{ 0 };		// Bytes of a fragmented message already sent
+	std::vector< uint8_t >	mAssembly;				// Fragments of a message too large for one record
+	bool					mAssembled{ false };	// The message handed out lives in mAssembly
+};
+
+// The server's listen socket. Accepts clients which have claimed a slot, and reports which of the
+// accepted connections need servicing so hundreds of them do not all have to be polled every pass.
+class WsocketSharedMemoryServer : public Wsocket
+{
+public:
+	WsocketSharedMemoryServer(SharedMemoryRegion *region) : mRegion(region)
+	{
+		mRegion->addRef();
+	}
+
+	virtual ~WsocketSharedMemoryServer(void)
+	{
+		mRegion->stopListening();
+		mRegion->release();
+	}
+
+	// Returns the next client which has connected since the last call, or null
+	virtual Wsocket *pollServer(void) override final
+	{
+		checkPeers();
+		RendezvousHeader *header = mRegion->getHeader();
+		uint32_t sequence = header->mConnectSequence.load(std::memory_order_acquire);
+		if (sequence == mAcceptSequence)
+		{
+			return nullptr;
+		}
+		for (uint32_t i = 0; i < mRegion->getSlotCount(); i++)
+		{
+			RendezvousSlot *slot = mRegion->getSlot(i);
+			if (slot->mState.load(std::memory_order_acquire) != SLOT_CONNECTING)
+			{
+				continue;
+			}
+			// Attach before accepting, so a client which gives up in between cannot free the slot under us
+			slot->mAttached.fetch_or(SHARED_SLOT_SERVER);
+			uint32_t expected = SLOT_CONNECTING;
+			if (slot->mState.compare_exchange_strong(expected, SLOT_CONNECTED))
+			{
+				return new WsocketSharedMemory(mRegion, i, true);
+			}
+			mRegion->detachSlot(i, SHARED_SLOT_SERVER);
+		}
+		// Everything up to this sequence number has been accepted
+		mAcceptSequence = sequence;
+		return nullptr;
+	}
+
+	// New clients are found by scanning the rendezvous region on every call
+	virtual bool acceptStalled(void) override final
+	{
+		return false;
+	}
+
+	// Reports the accepted connections whose client has sent data, freed space we were waiting for,
+	// closed, or died since the last call
+	virtual int32_t pollReady(Wsocket **ready, uint32_t maxReady) override final
+	{
+		uint32_t count = 0;
+		if (!ready)
+		{
+			return 0;
+		}
+		// Anything which rings the doorbell from here on is picked up by this scan or wakes the next 'select'
+		mSeenDoorbell = mRegion->getHeader()->mDoorbell.load(std::memory_order_acquire);
+		for (uint32_t i = 0; i < mRegion->getSlotCount() && count < maxReady; i++)
+		{
+			WsocketSharedMemory *connection = mRegion->mConnections[i];
+			if (!connection)
+			{
+				continue;
+			}
+			RendezvousSlot *slot = mRegion->getSlot(i);
+			if (slot->mServerNotify.load(std::memory_order_relaxed) && slot->mServerNotify.exchange(0))
+			{
+				ready[count++] = connection;
+			}
+		}
+		return int32_t(count);
+	}
+
+	// Sleeps until a client connects or rings the doorbell, unless one already has since we last looked
+	virtual void select(int32_t timeOut, size_t txBufSize) override final
+	{
+		RendezvousHeader *header = mRegion->getHeader();
+		uint32_t observed = header->mDoorbell.load(std::memory_order_acquire);
+		if (observed == mSeenDoorbell && timeOut != 0)
+		{
+			header->mServerWaiting.store(1);
+			if (header->mDoorbell.load() == observed)
+			{
+				spsc::futexWait(header->mDoorbell, observed, timeOut);
+			}
+			header->mServerWaiting.store(0);
+		}
+		mSeenDoorbell = header->mDoorbell.load(std::memory_order_acquire);
+	}
+
+	virtual void nullSelect(int32_t timeOut) override final
+	{
+		select(timeOut, 0);
+	}
+
+	virtual int32_t receive(void *dest, uint32_t maxLen) override final
+	{
+		return -1;
+	}
+
+	virtual int32_t send(const void *data, uint32_t dataLen) override final
+	{
+		return -1;
+	}
+
+	virtual int32_t sendv(const WsocketIovec *iov, uint32_t iovCount, bool moreToCome) override final
+	{
+		return -1;
+	}
+
+	// The listen socket carries no data
+	virtual bool supportsMessages(void) override final
+	{
+		return false;
+	}
+
+	virtual bool sendMessage(const void *data, uint32_t dataLen) override final
+	{
+		(void)data;
+		(void)dataLen;
+		return false;
+	}
+
+	virtual const void *receiveMessage(uint32_t &dataLen) override final
+	{
+		dataLen = 0;
+		return nullptr;
+	}
+
+	virtual void releaseMessage(void) override final
+	{
+	}
+
+	virtual ConnectState pollConnect(int32_t timeout) override final
+	{
+		(void)timeout;
+		return CONNECT_DONE;
+	}
+
+	virtual void	close(void) override final
+	{
+	}
+
+	virtual bool	wouldBlock(void) override final
+	{
+		return true;
+	}
+
+	virtual bool	inProgress(void) override final
+	{
+		return false;
+	}
+
+	virtual void disableNaglesAlgorithm(void) override final
+	{
+	}
+
+	// The listen socket is serviced through 'select', 'pollServer' and 'pollReady'
+	virtual int64_t getSocketHandle(void) override final
+	{
+		return -1;
+	}
+
+	virtual void release(void) override final
+	{
+		delete this;
+	}
+
+private:
+	// Every so often, look for clients which died without closing
+	void checkPeers(void)
+	{
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (now < mNextPeerCheck)
+		{
+			return;
+		}
+		mNextPeerCheck = now + std::chrono::milliseconds(PEER_CHECK_INTERVAL);
+		mRegion->sweepSlots();
+		for (uint32_t i = 0; i < mRegion->getSlotCount(); i++)
+		{
+			WsocketSharedMemory *connection = mRegion->mConnections[i];
+			if (connection && !wplatform::isProcessAlive(mRegion->getSlot(i)->mClientProcess))
+			{
+				// Have it serviced, so its next 'receive' reports the connection as closed
+				connection->setPeerDead();
+				mRegion->notifyServer(i);
+			}
+		}
+	}
+
+	SharedMemoryRegion						*mRegion{ nullptr };
+	uint32_t								mAcceptSequence{ 0 };
+	uint32_t								mSeenDoorbell{ 0 };
+	std::chrono::steady_clock::time_point	mNextPeerCheck;
 };
 
-Wsocket *createSocketSharedMemory(const char *hostName,int32_t port)
+Wsocket *createSocketSharedMemory(const char *hostName,int32_t port, const WsocketOptions &options)
 {
-	auto ret = new WsocketSharedMemory(hostName, port);
-	if (!ret->isValid())
+	bool isServer = strcmp(hostName, SHARED_SERVER) == 0;
+	SharedMemoryRegion *region = new SharedMemoryRegion(port, isServer, options);
+	Wsocket *ret = nullptr;
+	if (region->isValid())
 	{
-		delete ret;
-		ret = nullptr;
+		if (isServer)
+		{
+			ret = new WsocketSharedMemoryServer(region);
+		}
+		else
+		{
+			uint32_t slot = region->claimSlot();
+			if (slot != cNoSlot)
+			{
+				ret = new WsocketSharedMemory(region, slot, false);
+				region->publishSlot(slot);
+			}
+		}
 	}
-	return static_cast<Wsocket *>(ret);
+	region->release(); // the sockets hold their own references
+	return ret;
 }
 
 }
@@ -0,0 +1,1205 @@
+#include "socketuring.h"
+#include "wsocket.h"
+#include "SimpleBuffer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// Multishot accept and multishot recv (which implies provided buffer rings) are required
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT)
+#define USE_IO_URING 1
+#else
+#define USE_IO_URING 0
+#endif
+
+#if USE_IO_URING
+
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define URING_QUEUE_DEPTH 4096				// Number of submission queue entries
+#define URING_COMPLETION_DEPTH (4096*4)		// Multishot operations can post many completions per submission
+#define URING_BUFFER_COUNT 4096				// Number of receive buffers in the provided buffer ring (power of two)
+#define URING_BUFFER_SIZE (1024*4)			// Size of each receive buffer; matches the SocketChat read size
+#define URING_BUFFER_GROUP 0				// Buffer group id used for the provided buffer ring
+#define URING_MAX_STAGED_SEND (1024*1024*4)	// Per connection limit of accepted but not yet sent data
+#define URING_SEND_BUFFER_SIZE (1024*16)	// Default size of the per connection send buffers
+#define URING_CLOSE_TIMEOUT 100				// Milliseconds a closing connection's queued sends get to drain before it is shut down
+
+namespace wsocket
+{
+
+class WsocketUring;
+
+// Operation types, stored in the low bits of the submission user data
+enum UringOp
+{
+	OP_ACCEPT = 1,
+	OP_RECV,
+	OP_SEND,
+	OP_CANCEL,
+};
+
+static int uringSetup(uint32_t entries, io_uring_params *p)
+{
+	return int(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int uringEnter(int fd, uint32_t toSubmit, uint32_t minComplete, uint32_t flags, const void *arg, size_t argSize)
+{
+	return int(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize));
+}
+
+static int uringRegister(int fd, uint32_t opcode, const void *arg, uint32_t argCount)
+{
+	return int(syscall(__NR_io_uring_register, fd, opcode, arg, argCount));
+}
+
+// One io_uring instance shared by a listen socket and every connection it accepts.
+// Completions are harvested from user space without a system call; pending submissions
+// from all connections go to the kernel together whenever the server polls or waits.
+class UringLoop
+{
+public:
+	struct Slot
+	{
+		WsocketUring	*mSocket{ nullptr };
+		uint32_t		mGeneration{ 0 };
+	};
+
+	~UringLoop(void)
+	{
+		if (mBufferRing)
+		{
+			io_uring_buf_reg reg;
+			memset(&reg, 0, sizeof(reg));
+			reg.bgid = URING_BUFFER_GROUP;
+			uringRegister(mRingFd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+			munmap(mBufferRing, mBufferRingSize);
+		}
+		if (mBuffers)
+		{
+			munmap(mBuffers, size_t(URING_BUFFER_COUNT) * URING_BUFFER_SIZE);
+		}
+		if (mSqes)
+		{
+			munmap(mSqes, mSqesSize);
+		}
+		if (mCqRingPtr && mCqRingPtr != mSqRingPtr)
+		{
+			munmap(mCqRingPtr, mCqRingSize);
+		}
+		if (mSqRingPtr)
+		{
+			munmap(mSqRingPtr, mSqRingSize);
+		}
+		if (mRingFd >= 0)
+		{
+			::close(mRingFd);
+		}
+	}
+
+	bool init(void)
+	{
+		io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = URING_COMPLETION_DEPTH;
+		mRingFd = uringSetup(URING_QUEUE_DEPTH, &p);
+		if (mRingFd < 0)
+		{
+			return false;
+		}
+		// We rely on single mmap, no dropped completions, and timeouts on the wait call
+		const uint32_t required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+		if ((p.features & required) != required)
+		{
+			return false;
+		}
+		mSqRingSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+		mCqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		if (mCqRingSize > mSqRingSize)
+		{
+			mSqRingSize = mCqRingSize;
+		}
+		mCqRingSize = mSqRingSize;
+		mSqRingPtr = mmap(nullptr, mSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQ_RING);
+		if (mSqRingPtr == MAP_FAILED)
+		{
+			mSqRingPtr = nullptr;
+			return false;
+		}
+		mCqRingPtr = mSqRingPtr;
+		mSqesSize = p.sq_entries * sizeof(io_uring_sqe);
+		mSqes = (io_uring_sqe *)mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQES);
+		if (mSqes == MAP_FAILED)
+		{
+			mSqes = nullptr;
+			return false;
+		}
+		uint8_t *sq = (uint8_t *)mSqRingPtr;
+		mSqHead = (uint32_t *)(sq + p.sq_off.head);
+		mSqTail = (uint32_t *)(sq + p.sq_off.tail);
+		mSqMask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+		mSqEntries = *(uint32_t *)(sq + p.sq_off.ring_entries);
+		mSqFlags = (uint32_t *)(sq + p.sq_off.flags);
+		mSqArray = (uint32_t *)(sq + p.sq_off.array);
+		uint8_t *cq = (uint8_t *)mCqRingPtr;
+		mCqHead = (uint32_t *)(cq + p.cq_off.head);
+		mCqTail = (uint32_t *)(cq + p.cq_off.tail);
+		mCqMask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+		mCqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+		mLocalSqTail = *mSqTail;
+
+		// Provided buffer ring; the kernel picks a buffer from here for every multishot receive completion
+		mBufferRingSize = URING_BUFFER_COUNT * sizeof(io_uring_buf);
+		void *ring = mmap(nullptr, mBufferRingSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if (ring == MAP_FAILED)
+		{
+			return false;
+		}
+		void *buffers = mmap(nullptr, size_t(URING_BUFFER_COUNT) * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if (buffers == MAP_FAILED)
+		{
+			munmap(ring, mBufferRingSize);
+			return false;
+		}
+		io_uring_buf_reg reg;
+		memset(&reg, 0, sizeof(reg));
+		reg.ring_addr = uint64_t(uintptr_t(ring));
+		reg.ring_entries = URING_BUFFER_COUNT;
+		reg.bgid = URING_BUFFER_GROUP;
+		if (uringRegister(mRingFd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+		{
+			munmap(ring, mBufferRingSize);
+			munmap(buffers, size_t(URING_BUFFER_COUNT) * URING_BUFFER_SIZE);
+			return false;
+		}
+		mBufferRing = (io_uring_buf_ring *)ring;
+		mBuffers = (uint8_t *)buffers;
+		mBufferTail = 0;
+		for (uint32_t i = 0; i < URING_BUFFER_COUNT; i++)
+		{
+			addBuffer(uint16_t(i));
+		}
+		publishBuffers();
+		return true;
+	}
+
+	void addRef(void)
+	{
+		mRefCount++;
+	}
+
+	void release(void)
+	{
+		assert(mRefCount);
+		mRefCount--;
+		if (mRefCount == 0)
+		{
+			delete this;
+		}
+	}
+
+	// Returns the next free submission entry, flushing the queue to the kernel if it is full
+	io_uring_sqe *getSqe(void)
+	{
+		uint32_t head = __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE);
+		if (mLocalSqTail - head >= mSqEntries)
+		{
+			submit(0, 0);
+			head = __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE);
+			if (mLocalSqTail - head >= mSqEntries)
+			{
+				return nullptr;
+			}
+		}
+		uint32_t index = mLocalSqTail & mSqMask;
+		io_uring_sqe *sqe = &mSqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		mSqArray[index] = index;
+		mLocalSqTail++;
+		mPendingSubmit++;
+		return sqe;
+	}
+
+	// Hands every queued submission to the kernel in one call, optionally waiting up to
+	// 'timeout' milliseconds for at least 'waitCount' completions
+	void submit(uint32_t waitCount, int32_t timeout)
+	{
+		bool overflow = (__atomic_load_n(mSqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) != 0;
+		if (mPendingSubmit == 0 && waitCount == 0 && !overflow)
+		{
+			return;
+		}
+		__atomic_store_n(mSqTail, mLocalSqTail, __ATOMIC_RELEASE);
+		uint32_t flags = 0;
+		io_uring_getevents_arg arg;
+		__kernel_timespec ts;
+		const void *argp = nullptr;
+		size_t argSize = 0;
+		if (waitCount || overflow)
+		{
+			flags |= IORING_ENTER_GETEVENTS;
+		}
+		if (waitCount)
+		{
+			memset(&arg, 0, sizeof(arg));
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000LL;
+			arg.sigmask = 0;
+			arg.sigmask_sz = _NSIG / 8;
+			arg.ts = uint64_t(uintptr_t(&ts));
+			flags |= IORING_ENTER_EXT_ARG;
+			argp = &arg;
+			argSize = sizeof(arg);
+		}
+		uringEnter(mRingFd, mPendingSubmit, waitCount, flags, argp, argSize);
+		// A timed out wait still consumes the submissions; the kernel head says how many
+		mPendingSubmit = mLocalSqTail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE);
+	}
+
+	// Process every completion currently in the ring; no system call is made
+	void reap(void);
+
+	// Wait up to 'timeout' milliseconds for activity, submitting anything pending
+	void wait(int32_t timeout)
+	{
+		reap();
+		if (timeout > 0 && !haveCompletions())
+		{
+			submit(1, timeout);
+		}
+		else
+		{
+			submit(0, 0);
+		}
+		reap();
+	}
+
+	bool haveCompletions(void) const
+	{
+		return *mCqHead != __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+	}
+
+	const uint8_t *getBuffer(uint16_t bid) const
+	{
+		return &mBuffers[size_t(bid) * URING_BUFFER_SIZE];
+	}
+
+	// Return a consumed receive buffer to the kernel
+	void recycleBuffer(uint16_t bid)
+	{
+		addBuffer(bid);
+		publishBuffers();
+		if (!mStarved.empty())
+		{
+			rearmStarved();
+		}
+	}
+
+	uint32_t addSocket(WsocketUring *s, uint32_t &generation)
+	{
+		uint32_t slot;
+		if (!mFreeSlots.empty())
+		{
+			slot = mFreeSlots.back();
+			mFreeSlots.pop_back();
+		}
+		else
+		{
+			slot = uint32_t(mSlots.size());
+			mSlots.push_back(Slot());
+		}
+		mSlots[slot].mSocket = s;
+		mSlots[slot].mGeneration++;
+		generation = mSlots[slot].mGeneration;
+		return slot;
+	}
+
+	void removeSocket(uint32_t slot)
+	{
+		mSlots[slot].mSocket = nullptr;
+		mSlots[slot].mGeneration++;
+		mFreeSlots.push_back(slot);
+		for (size_t i = 0; i < mStarved.size(); i++)
+		{
+			if (mStarved[i] == slot)
+			{
+				mStarved[i] = mStarved.back();
+				mStarved.pop_back();
+				break;
+			}
+		}
+	}
+
+	// A connection's multishot receive stopped because the buffer ring ran dry
+	void addStarved(uint32_t slot)
+	{
+		mStarved.push_back(slot);
+	}
+
+	// A connection received data, hit end of file, or finished a send
+	void addReady(uint32_t slot, uint32_t generation)
+	{
+		mReady.push_back(makeUserData(slot, generation, UringOp(0)));
+	}
+
+	// Hands out the connections which have had activity since the last call
+	uint32_t pollReady(Wsocket **ready, uint32_t maxReady);
+
+	// A connection is closing; the loop moves it along as its operations complete (see WsocketUring::close)
+	void addClosing(WsocketUring *s)
+	{
+		mClosing.push_back(s);
+	}
+
+	bool haveClosing(void) const
+	{
+		return !mClosing.empty();
+	}
+
+	// Shuts down closing connections whose sends have drained (or run out of time), and frees those
+	// released whose last operation has completed
+	void advanceClosing(void);
+
+	static uint64_t makeUserData(uint32_t slot, uint32_t generation, UringOp op)
+	{
+		return (uint64_t(generation) << 32) | (uint64_t(slot) << 4) | uint64_t(op);
+	}
+
+	bool			mMultishotRecv{ true };		// Cleared if the kernel rejects multishot receive
+	bool			mListening{ true };			// Cleared once the listen socket is gone, and with it the polling
+	int				mRingFd{ -1 };
+
+private:
+	void addBuffer(uint16_t bid)
+	{
+		// Index the ring as a plain array; in C++ the empty struct in the header's flexible array
+		// declaration has a non-zero size, which would shift 'bufs' away from the kernel's layout
+		io_uring_buf *buf = (io_uring_buf *)mBufferRing + (mBufferTail & (URING_BUFFER_COUNT - 1));
+		buf->addr = uint64_t(uintptr_t(getBuffer(bid)));
+		buf->len = URING_BUFFER_SIZE;
+		buf->bid = bid;
+		mBufferTail++;
+	}
+
+	void publishBuffers(void)
+	{
+		__atomic_store_n(&mBufferRing->tail, mBufferTail, __ATOMIC_RELEASE);
+	}
+
+	void rearmStarved(void);
+
+	uint32_t				mRefCount{ 1 };
+	void					*mSqRingPtr{ nullptr };
+	void					*mCqRingPtr{ nullptr };
+	size_t					mSqRingSize{ 0 };
+	size_t					mCqRingSize{ 0 };
+	io_uring_sqe			*mSqes{ nullptr };
+	size_t					mSqesSize{ 0 };
+	uint32_t				*mSqHead{ nullptr };
+	uint32_t				*mSqTail{ nullptr };
+	uint32_t				*mSqFlags{ nullptr };
+	uint32_t				*mSqArray{ nullptr };
+	uint32_t				mSqMask{ 0 };
+	uint32_t				mSqEntries{ 0 };
+	uint32_t				mLocalSqTail{ 0 };
+	uint32_t				mPendingSubmit{ 0 };
+	uint32_t				*mCqHead{ nullptr };
+	uint32_t				*mCqTail{ nullptr };
+	uint32_t				mCqMask{ 0 };
+	io_uring_cqe			*mCqes{ nullptr };
+	io_uring_buf_ring		*mBufferRing{ nullptr };
+	size_t					mBufferRingSize{ 0 };
+	uint8_t					*mBuffers{ nullptr };
+	uint16_t				mBufferTail{ 0 };
+	std::vector< Slot >		mSlots;
+	std::vector< uint32_t >	mFreeSlots;
+	std::vector< uint32_t >	mStarved;
+	std::vector< uint64_t >	mReady;			// Slot and generation of connections with new activity
+	size_t					mReadyIndex{ 0 };
+	std::vector< WsocketUring * >	mClosing;		// Closed connections with operations still in flight
+	bool					mAdvancingClosing{ false };
+};
+
+class WsocketUring : public Wsocket
+{
+public:
+	// A chunk of received data still sitting in one of the provided buffers
+	struct ReceiveChunk
+	{
+		uint16_t	mBufferId{ 0 };
+		uint32_t	mLength{ 0 };
+		uint32_t	mOffset{ 0 };
+	};
+
+	// Create the listen socket along with a new io_uring instance
+	WsocketUring(int32_t port, const WsocketOptions &options)
+	{
+		mIsServer = true;
+		mLoop = new UringLoop;
+		if (!mLoop->init())
+		{
+			return;
+		}
+		mFd = listenSocket(port, options);
+		if (mFd < 0)
+		{
+			return;
+		}
+		mSlot = mLoop->addSocket(this, mGeneration);
+		armAccept();
+		mLoop->submit(0, 0);
+	}
+
+	// A connection accepted on a listen socket which shares 'loop'
+	WsocketUring(UringLoop *loop, int fd) : mLoop(loop), mFd(fd)
+	{
+		mLoop->addRef();
+		mSlot = mLoop->addSocket(this, mGeneration);
+		mSendInFlight = simplebuffer::SimpleBuffer::create(URING_SEND_BUFFER_SIZE, URING_MAX_STAGED_SEND);
+		mSendStaging = simplebuffer::SimpleBuffer::create(URING_SEND_BUFFER_SIZE, URING_MAX_STAGED_SEND);
+		armReceive();
+	}
+
+	// Only reached once nothing is in flight any more (see release)
+	virtual ~WsocketUring(void)
+	{
+		if (mLoop)
+		{
+			if (mFd >= 0)
+			{
+				::close(mFd);
+			}
+			if (mGeneration)
+			{
+				mLoop->removeSocket(mSlot);
+			}
+			for (auto &i : mReceived)
+			{
+				mLoop->recycleBuffer(i.mBufferId);
+			}
+			for (auto &i : mAccepted)
+			{
+				::close(i);
+			}
+			mLoop->release();
+		}
+		if (mSendInFlight)
+		{
+			mSendInFlight->release();
+		}
+		if (mSendStaging)
+		{
+			mSendStaging->release();
+		}
+	}
+
+	bool isValid(void) const
+	{
+		return mFd >= 0;
+	}
+
+	// Accepted connections are handed out one at a time; this is also the point where the
+	// queued sends of every connection on this ring are submitted to the kernel together
+	virtual Wsocket *pollServer(void) override final
+	{
+		Wsocket *ret = nullptr;
+
+		if (mIsServer && mFd >= 0)
+		{
+			mLoop->wait(0);
+			if (!mAccepted.empty())
+			{
+				int fd = mAccepted.front();
+				mAccepted.pop_front();
+				ret = static_cast<Wsocket *>(new WsocketUring(mLoop, fd));
+			}
+		}
+
+		return ret;
+	}
+
+	// The multishot accept is re-armed by the kernel completion itself, so it never waits on an edge
+	virtual bool acceptStalled(void) override final
+	{
+		return false;
+	}
+
+	// The listen socket reports which of its connections have had completions since the last call,
+	// so an event loop only has to service those
+	virtual int32_t pollReady(Wsocket **ready, uint32_t maxReady) override final
+	{
+		if (!mIsServer)
+		{
+			return -1;
+		}
+		mLoop->reap();
+		return int32_t(mLoop->pollReady(ready, maxReady));
+	}
+
+	// Submits pending operations and waits for any completion on the shared ring
+	virtual void select(int32_t timeOut, size_t txBufSize) override final
+	{
+		(void)txBufSize;
+		mLoop->wait(timeOut);
+	}
+
+	virtual void nullSelect(int32_t timeOut) override final
+	{
+		mLoop->wait(timeOut);
+	}
+
+	virtual int32_t receive(void *dest, uint32_t maxLen) override final
+	{
+		mWouldBlock = false;
+		if (mIsServer)
+		{
+			return -1;
+		}
+		mLoop->reap();
+		uint32_t copied = 0;
+		uint8_t *cdest = (uint8_t *)dest;
+		while (copied < maxLen && !mReceived.empty())
+		{
+			ReceiveChunk &chunk = mReceived.front();
+			uint32_t len = chunk.mLength - chunk.mOffset;
+			if (len > (maxLen - copied))
+			{
+				len = maxLen - copied;
+			}
+			memcpy(&cdest[copied], mLoop->getBuffer(chunk.mBufferId) + chunk.mOffset, len);
+			copied += len;
+			chunk.mOffset += len;
+			if (chunk.mOffset == chunk.mLength)
+			{
+				uint16_t bid = chunk.mBufferId;
+				mReceived.pop_front();
+				mLoop->recycleBuffer(bid);
+			}
+		}
+		if (copied)
+		{
+			return int32_t(copied);
+		}
+		if (mEndOfFile || mError)
+		{
+			return mEndOfFile ? 0 : -1;
+		}
+		mWouldBlock = true;
+		return -1;
+	}
+
+	// The data is copied into the connection's staging buffer and a send is queued on the ring.
+	// It reaches the kernel with the next batch submission.
+	virtual int32_t send(const void *data, uint32_t dataLen) override final
+	{
+		mWouldBlock = false;
+		if (mIsServer || mFd < 0 || mError || mClosing)
+		{
+			return -1;
+		}
+		if (mSendStaging->getSize() + mSendInFlight->getSize() + dataLen > URING_MAX_STAGED_SEND)
+		{
+			mLoop->reap();
+			if (mSendStaging->getSize() + mSendInFlight->getSize() + dataLen > URING_MAX_STAGED_SEND)
+			{
+				mWouldBlock = true;
+				return -1;
+			}
+		}
+		if (!mSendStaging->addBuffer(data, dataLen))
+		{
+			mWouldBlock = true;
+			return -1;
+		}
+		if (!mSendBusy)
+		{
+			startSend();
+		}
+		return int32_t(dataLen);
+	}
+
+	// Copies as much as fits into the staging buffer; it all goes out with the next batch of submissions
+	virtual int32_t sendv(const WsocketIovec *iov, uint32_t iovCount, bool moreToCome) override final
+	{
+		(void)moreToCome; // every send is held until the next batch of submissions anyway
+		mWouldBlock = false;
+		if (mIsServer || mFd < 0 || mError || mClosing)
+		{
+			return -1;
+		}
+		if (mSendStaging->getSize() + mSendInFlight->getSize() >= URING_MAX_STAGED_SEND)
+		{
+			mLoop->reap();
+		}
+		uint32_t total = 0;
+		for (uint32_t i = 0; i < iovCount; i++)
+		{
+			uint32_t staged = mSendStaging->getSize() + mSendInFlight->getSize();
+			uint32_t room = staged < URING_MAX_STAGED_SEND ? URING_MAX_STAGED_SEND - staged : 0;
+			uint32_t len = iov[i].mLength < room ? iov[i].mLength : room;
+			if (len == 0 || !mSendStaging->addBuffer(iov[i].mData, len))
+			{
+				break;
+			}
+			total += len;
+			if (len < iov[i].mLength)
+			{
+				break;
+			}
+		}
+		if (total == 0)
+		{
+			mWouldBlock = true;
+			return -1;
+		}
+		if (!mSendBusy)
+		{
+			startSend();
+		}
+		return int32_t(total);
+	}
+
+	// A byte stream; messages are framed by the layer above
+	virtual bool supportsMessages(void) override final
+	{
+		return false;
+	}
+
+	virtual bool sendMessage(const void *data, uint32_t dataLen) override final
+	{
+		(void)data;
+		(void)dataLen;
+		return false;
+	}
+
+	virtual const void *receiveMessage(uint32_t &dataLen) override final
+	{
+		dataLen = 0;
+		return nullptr;
+	}
+
+	virtual void releaseMessage(void) override final
+	{
+	}
+
+	// Only accepted connections are driven through io_uring
+	virtual ConnectState pollConnect(int32_t timeout) override final
+	{
+		(void)timeout;
+		return CONNECT_DONE;
+	}
+
+	// Never waits. Queued sends get up to URING_CLOSE_TIMEOUT milliseconds to drain, then the connection
+	// is shut down, which ends its outstanding operations; the descriptor is closed once the last of them
+	// has completed, since until then the kernel may still be reading the send buffers.
+	virtual void close(void) override final
+	{
+		if (mFd < 0 || mClosing)
+		{
+			return;
+		}
+		mClosing = true;
+		if (mIsServer)
+		{
+			cancelAccept();
+		}
+		else
+		{
+			mCloseDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(URING_CLOSE_TIMEOUT);
+			startSend();
+		}
+		if (!advanceClose())
+		{
+			mLoop->addClosing(this);
+		}
+	}
+
+	// Loop only. Returns true once the connection is completely closed.
+	bool advanceClose(void)
+	{
+		if (!mShutdown)
+		{
+			bool drained = mIsServer || (!mSendBusy && mSendStaging->getSize() == 0 && mSendInFlight->getSize() == 0);
+			if (drained || mError || std::chrono::steady_clock::now() >= mCloseDeadline)
+			{
+				if (!mIsServer)
+				{
+					::shutdown(mFd, SHUT_RDWR);
+				}
+				mShutdown = true;
+			}
+		}
+		if (mShutdown && mInflight == 0 && mFd >= 0)
+		{
+			::close(mFd);
+			mFd = -1;
+		}
+		return mFd < 0;
+	}
+
+	bool isReleased(void) const
+	{
+		return mReleased;
+	}
+
+	virtual bool wouldBlock(void) override final
+	{
+		return mWouldBlock;
+	}
+
+	virtual bool inProgress(void) override final
+	{
+		return false;
+	}
+
+	virtual void disableNaglesAlgorithm(void) override final
+	{
+		if (mFd >= 0)
+		{
+			int flag = 1;
+			setsockopt(mFd, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag));
+		}
+	}
+
+	// Readiness is tracked through the shared ring rather than a descriptor, so these
+	// sockets are polled; each poll only inspects user space queues.
+	virtual int64_t getSocketHandle(void) override final
+	{
+		return -1;
+	}
+
+	// A connection with operations still in flight is freed by the loop once they have completed
+	virtual void release(void) override final
+	{
+		if (!mLoop)
+		{
+			delete this;
+			return;
+		}
+		close();
+		if (mIsServer)
+		{
+			// Nothing polls the loop once the listen socket is gone, so its connections are seen out here
+			mLoop->mListening = false;
+			waitClosed(true);
+			if (mFd >= 0)
+			{
+				return; // the kernel never finished with it; leak it (and the loop) rather than free it
+			}
+		}
+		else if (!mLoop->mListening)
+		{
+			waitClosed(false);
+		}
+		if (mFd < 0)
+		{
+			delete this;
+			return;
+		}
+		mReleased = true; // the loop frees it
+	}
+
+	// Called by the loop when it hands this socket out from its ready list
+	void clearReadyQueued(void)
+	{
+		mReadyQueued = false;
+	}
+
+	// Called by the loop for every completion which belongs to this socket
+	void complete(UringOp op, int32_t res, uint32_t flags)
+	{
+		bool more = (flags & IORING_CQE_F_MORE) != 0;
+		if ((op == OP_RECV || op == OP_SEND) && !mReadyQueued && !mClosing)
+		{
+			mReadyQueued = true;
+			mLoop->addReady(mSlot, mGeneration);
+		}
+		switch (op)
+		{
+			case OP_ACCEPT:
+				if (res >= 0)
+				{
+					mAccepted.push_back(res);
+				}
+				if (!more)
+				{
+					mInflight--;
+					mAcceptArmed = false;
+					if (mFd >= 0 && !mClosing && res != -ECANCELED)
+					{
+						armAccept();
+					}
+				}
+				break;
+			case OP_RECV:
+				if (res > 0 && (flags & IORING_CQE_F_BUFFER))
+				{
+					ReceiveChunk chunk;
+					chunk.mBufferId = uint16_t(flags >> IORING_CQE_BUFFER_SHIFT);
+					chunk.mLength = uint32_t(res);
+					mReceived.push_back(chunk);
+				}
+				else if (res == 0)
+				{
+					mEndOfFile = true;
+				}
+				else if (res == -EINVAL && mLoop->mMultishotRecv)
+				{
+					mLoop->mMultishotRecv = false; // older kernel; fall back to single shot buffer selected receives
+				}
+				else if (res < 0 && res != -ENOBUFS)
+				{
+					mError = -res;
+				}
+				if (!more)
+				{
+					mInflight--;
+					mRecvArmed = false;
+					if (res == -ENOBUFS)
+					{
+						mLoop->addStarved(mSlot);
+					}
+					else if (!mEndOfFile && !mError && mFd >= 0 && !mShutdown)
+					{
+						armReceive();
+					}
+				}
+				break;
+			case OP_SEND:
+				mInflight--;
+				mSendBusy = false;
+				if (res < 0)
+				{
+					mError = -res;
+					mSendInFlight->clear();
+					mSendStaging->clear();
+				}
+				else
+				{
+					mSendInFlight->consume(uint32_t(res));
+					if (mFd >= 0 && !mShutdown)
+					{
+						startSend();
+					}
+				}
+				break;
+			case OP_CANCEL:
+				mInflight--;
+				break;
+		}
+	}
+
+	void armReceive(void)
+	{
+		if (mRecvArmed || mFd < 0 || mShutdown)
+		{
+			return;
+		}
+		io_uring_sqe *sqe = mLoop->getSqe();
+		if (!sqe)
+		{
+			mLoop->addStarved(mSlot);
+			return;
+		}
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = mFd;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BUFFER_GROUP;
+		if (mLoop->mMultishotRecv)
+		{
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+		}
+		sqe->user_data = UringLoop::makeUserData(mSlot, mGeneration, OP_RECV);
+		mRecvArmed = true;
+		mInflight++;
+	}
+
+private:
+	void armAccept(void)
+	{
+		io_uring_sqe *sqe = mLoop->getSqe();
+		if (!sqe)
+		{
+			return;
+		}
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = mFd;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		sqe->user_data = UringLoop::makeUserData(mSlot, mGeneration, OP_ACCEPT);
+		mAcceptArmed = true;
+		mInflight++;
+	}
+
+	// Send whatever is in flight (after a short send), otherwise promote the staging buffer
+	void startSend(void)
+	{
+		if (mSendBusy)
+		{
+			return;
+		}
+		if (mSendInFlight->getSize() == 0)
+		{
+			if (mSendStaging->getSize() == 0)
+			{
+				return;
+			}
+			simplebuffer::SimpleBuffer *swap = mSendInFlight;
+			mSendInFlight = mSendStaging;
+			mSendStaging = swap;
+		}
+		io_uring_sqe *sqe = mLoop->getSqe();
+		if (!sqe)
+		{
+			return;
+		}
+		uint32_t dataLen;
+		const uint8_t *data = mSendInFlight->getData(dataLen);
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = mFd;
+		sqe->addr = uint64_t(uintptr_t(data));
+		sqe->len = dataLen;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->user_data = UringLoop::makeUserData(mSlot, mGeneration, OP_SEND);
+		mSendBusy = true;
+		mInflight++;
+	}
+
+	// Drives the loop itself, for when nothing else polls it any more
+	void waitClosed(bool allConnections)
+	{
+		int32_t waited = 0;
+		while ((mFd >= 0 || (allConnections && mLoop->haveClosing())) && waited < URING_CLOSE_TIMEOUT * 2)
+		{
+			mLoop->wait(1);
+			waited++;
+		}
+	}
+
+	// Stops the multishot accept; its final completion arrives once the cancel has gone through
+	void cancelAccept(void)
+	{
+		if (!mAcceptArmed)
+		{
+			return;
+		}
+		io_uring_sqe *sqe = mLoop->getSqe();
+		if (sqe)
+		{
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = mFd;
+			sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+			sqe->user_data = UringLoop::makeUserData(mSlot, mGeneration, OP_CANCEL);
+			mInflight++;
+		}
+	}
+
+	int listenSocket(int32_t port, const WsocketOptions &options)
+	{
+		int fd = ::socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+		if (fd < 0)
+		{
+			return -1;
+		}
+		int flag = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char*)&flag, sizeof(flag));
+		if (options.mReusePort)
+		{
+			setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char*)&flag, sizeof(flag));
+		}
+		sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(uint16_t(port));
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		if (::bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(fd, SOMAXCONN) != 0)
+		{
+			::close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	UringLoop						*mLoop{ nullptr };
+	int								mFd{ -1 };
+	bool							mIsServer{ false };
+	uint32_t						mSlot{ 0 };
+	uint32_t						mGeneration{ 0 };
+	uint32_t						mInflight{ 0 };		// Operations submitted whose final completion has not arrived
+	bool							mAcceptArmed{ false };
+	bool							mRecvArmed{ false };
+	bool							mSendBusy{ false };
+	bool							mEndOfFile{ false };
+	bool							mReadyQueued{ false };	// Already in the loop's ready list
+	bool							mWouldBlock{ false };
+	bool							mClosing{ false };		// 'close' was called
+	bool							mShutdown{ false };		// and the connection has been shut down
+	bool							mReleased{ false };		// The loop frees it once it is closed
+	std::chrono::steady_clock::time_point	mCloseDeadline;	// When queued sends stop being waited for
+	int32_t							mError{ 0 };
+	std::deque< ReceiveChunk >		mReceived;
+	std::deque< int >				mAccepted;
+	simplebuffer::SimpleBuffer		*mSendInFlight{ nullptr };	// Referenced by the kernel while a send is in flight
+	simplebuffer::SimpleBuffer		*mSendStaging{ nullptr };	// New data accumulates here meanwhile
+};
+
+void UringLoop::reap(void)
+{
+	uint32_t head = *mCqHead;
+	uint32_t tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+	while (head != tail)
+	{
+		const io_uring_cqe &cqe = mCqes[head & mCqMask];
+		uint64_t userData = cqe.user_data;
+		int32_t res = cqe.res;
+		uint32_t flags = cqe.flags;
+		head++;
+		// Release the entry before dispatching; completing may queue new work
+		__atomic_store_n(mCqHead, head, __ATOMIC_RELEASE);
+
+		UringOp op = UringOp(userData & 0xF);
+		uint32_t slot = uint32_t(userData >> 4) & 0x0FFFFFFF;
+		uint32_t generation = uint32_t(userData >> 32);
+		WsocketUring *s = nullptr;
+		if (slot < mSlots.size() && mSlots[slot].mGeneration == generation)
+		{
+			s = mSlots[slot].mSocket;
+		}
+		if (s)
+		{
+			s->complete(op, res, flags);
+		}
+		else
+		{
+			// The owner is gone; give back anything the completion carried
+			if (op == OP_RECV && res > 0 && (flags & IORING_CQE_F_BUFFER))
+			{
+				recycleBuffer(uint16_t(flags >> IORING_CQE_BUFFER_SHIFT));
+			}
+			else if (op == OP_ACCEPT && res >= 0)
+			{
+				::close(res);
+			}
+		}
+		tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+	}
+	if (!mClosing.empty())
+	{
+		advanceClosing();
+	}
+}
+
+void UringLoop::advanceClosing(void)
+{
+	if (mAdvancingClosing)
+	{
+		return;
+	}
+	mAdvancingClosing = true;
+	for (size_t i = 0; i < mClosing.size();)
+	{
+		WsocketUring *s = mClosing[i];
+		if (!s->advanceClose())
+		{
+			i++;
+			continue;
+		}
+		mClosing[i] = mClosing.back();
+		mClosing.pop_back();
+		// Whoever is driving the loop holds a reference on it, so this never frees the loop itself
+		if (s->isReleased())
+		{
+			delete s;
+		}
+	}
+	mAdvancingClosing = false;
+}
+
+uint32_t UringLoop::pollReady(Wsocket **ready, uint32_t maxReady)
+{
+	uint32_t ret = 0;
+	while (ret < maxReady && mReadyIndex < mReady.size())
+	{
+		uint64_t entry = mReady[mReadyIndex++];
+		uint32_t slot = uint32_t(entry >> 4) & 0x0FFFFFFF;
+		uint32_t generation = uint32_t(entry >> 32);
+		// A released connection stays in its slot until its last operation completes
+		if (mSlots[slot].mGeneration == generation && mSlots[slot].mSocket && !mSlots[slot].mSocket->isReleased())
+		{
+			WsocketUring *s = mSlots[slot].mSocket;
+			s->clearReadyQueued();
+			ready[ret++] = static_cast<Wsocket *>(s);
+		}
+	}
+	if (mReadyIndex == mReady.size())
+	{
+		mReady.clear();
+		mReadyIndex = 0;
+	}
+	return ret;
+}
+
+void UringLoop::rearmStarved(void)
+{
+	std::vector< uint32_t > starved;
+	starved.swap(mStarved);
+	for (auto &slot : starved)
+	{
+		if (mSlots[slot].mSocket)
+		{
+			mSlots[slot].mSocket->armReceive();
+		}
+	}
+}
+
+Wsocket *createSocketUring(const char *hostName, int32_t port, const WsocketOptions &options)
+{
+	(void)hostName;
+	auto ret = new WsocketUring(port, options);
+	if (!ret->isValid())
+	{
+		delete ret;
+		ret = nullptr;
+	}
+	return static_cast<Wsocket *>(ret);
+}
+
+}
+
+#else
+
+namespace wsocket
+{
+
+// io_uring is not available on this platform
+Wsocket *createSocketUring(const char *hostName, int32_t port, const WsocketOptions &options)
+{
+	(void)hostName;
+	(void)port;
+	(void)options;
+	return nullptr;
+}
+
+}
+
+#endif
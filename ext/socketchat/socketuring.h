@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace wsocket
+{
+
+class Wsocket;
+struct WsocketOptions;
+
+// Creates a server socket whose accepted connections are driven by a shared io_uring instance.
+// Accepts use multishot accept, receives use multishot recv into a provided buffer ring, and sends
+// from every connection are queued and submitted together in a single batch.
+// Returns null if io_uring (or one of those features) is not available on this system, in which
+// case the caller should fall back to a regular socket.
+Wsocket *createSocketUring(const char *hostName, int32_t port, const WsocketOptions &options);
+
+}
@@ -11,6 +11,7 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <signal.h>
+#include <errno.h>
 #endif
 
 namespace wplatform
@@ -66,4 +67,30 @@ namespace wplatform
 		std::this_thread::sleep_for(std::chrono::nanoseconds(nanoSeconds)); // s
 	}
 
+	uint32_t getProcessId(void)
+	{
+#ifdef _MSC_VER
+		return uint32_t(GetCurrentProcessId());
+#else
+		return uint32_t(getpid());
+#endif
+	}
+
+	bool isProcessAlive(uint32_t processId)
+	{
+#ifdef _MSC_VER
+		bool ret = false;
+		HANDLE h = OpenProcess(SYNCHRONIZE, FALSE, DWORD(processId));
+		if (h)
+		{
+			ret = WaitForSingleObject(h, 0) == WAIT_TIMEOUT;
+			CloseHandle(h);
+		}
+		return ret;
+#else
+		// Signal 0 only checks the process exists; EPERM means it does but belongs to someone else
+		return kill(pid_t(processId), 0) == 0 || errno == EPERM;
+#endif
+	}
+
 }
\ No newline at end of file
@@ -18,4 +18,10 @@ namespace wplatform
 
 	void sleepNano(uint64_t nanoSeconds);
 
+	// Returns the id of the calling process
+	uint32_t getProcessId(void);
+
+	// Returns false once no process with this id exists; used to notice peers which died without closing
+	bool isProcessAlive(uint32_t processId);
+
 }
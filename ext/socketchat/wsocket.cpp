@@ -1,7 +1,18 @@
 #include "wsocket.h"
 #include "wplatform.h"
 #include "socketsharedmemory.h"
+#include "socketuring.h"
+#include "Capture.h"
 #include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #ifdef _MSC_VER
 #pragma warning(disable:4996)
@@ -45,18 +56,29 @@ typedef unsigned __int64 uint64_t;
 #define socketerrno WSAGetLastError()
 #define SOCKET_EAGAIN_EINPROGRESS WSAEINPROGRESS
 #define SOCKET_EWOULDBLOCK WSAEWOULDBLOCK
+#define SOCKET_CONNECT_STARTED WSAEWOULDBLOCK
+#define SOCKET_EINTR WSAEINTR
+#define SOCKET_ECONNABORTED WSAECONNRESET
+#define SOCKET_EMFILE WSAEMFILE
+#define SOCKET_ENFILE WSAEMFILE
+#define SOCKET_ENOBUFS WSAENOBUFS
+#define SOCKET_ENOMEM WSAENOBUFS
+#define pollsocket WSAPoll
 #else
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <limits.h>
 #ifndef _SOCKET_T_DEFINED
 typedef int socket_t;
 #define _SOCKET_T_DEFINED
@@ -72,63 +94,305 @@ typedef int socket_t;
 #define socketerrno errno
 #define SOCKET_EAGAIN_EINPROGRESS EAGAIN
 #define SOCKET_EWOULDBLOCK EWOULDBLOCK
+#define SOCKET_CONNECT_STARTED EINPROGRESS
+#define SOCKET_EINTR EINTR
+#define SOCKET_ECONNABORTED ECONNABORTED
+#define SOCKET_EMFILE EMFILE
+#define SOCKET_ENFILE ENFILE
+#define SOCKET_ENOBUFS ENOBUFS
+#define SOCKET_ENOMEM ENOMEM
+#define pollsocket ::poll
 #endif
 
 #ifdef _MSC_VER
 #pragma warning(disable:4100)
 #endif
 
-//#define SAVE_RECEIVE "f:\\SocketReceive.bin"
-//#define SAVE_SEND "f:\\SocketSend.bin"
+//#define IO_URING_SERVER					// Route 'server' connections through io_uring when it is available
 
 #define SHARED_SERVER "sharedserver"
 #define SHARED_CLIENT "sharedclient"
 
+#define CONNECT_STAGGER 250				// Milliseconds an address has to answer before the next is tried alongside it
+#define CONNECT_MAX_ADDRESSES 16		// Most addresses of one host name which are tried
+#define CONNECT_WAIT 50					// Longest a synchronous connect sleeps between looks at its name lookup
+#define RESOLVE_CACHE_SIZE 64			// Host names whose addresses are remembered
+#define RESOLVE_CACHE_TIME 30			// Seconds they are remembered for
+
+#if defined(IOV_MAX) && IOV_MAX < WSOCKET_MAX_IOV
+#error "WSOCKET_MAX_IOV is larger than the operating system allows for a single sendmsg"
+#endif
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL		// A peer which has gone away is reported as an error rather than SIGPIPE
+#else
+#define SEND_FLAGS 0
+#endif
+
 namespace wsocket
 {
 
+// One address to try connecting to
+struct ConnectAddress
+{
+	sockaddr_storage	mAddress;
+	socklen_t			mLength;
+};
+
+typedef std::vector< ConnectAddress > ConnectAddresses;
+
+// Looks up 'host'; the addresses are ordered for happy eyeballs, alternating between address families
+// while keeping the system's preference within each, and starting with the family it likes best
+static bool getAddresses(const char *host, const char *port, int flags, ConnectAddresses &addresses)
+{
+	addrinfo hints;
+	addrinfo *result;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = flags;
+	int ret = getaddrinfo(host, port, &hints, &result);
+	if (ret != 0)
+	{
+		if (!(flags & AI_NUMERICHOST))
+		{
+#ifdef _MSC_VER
+			fprintf(stderr, "getaddrinfo: %s\n", gai_strerrorA(ret));
+#else
+			fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+#endif
+		}
+		return false;
+	}
+	ConnectAddresses preferred;
+	ConnectAddresses others;
+	for (addrinfo *p = result; p != NULL; p = p->ai_next)
+	{
+		if (p->ai_addrlen > sizeof(sockaddr_storage))
+		{
+			continue;
+		}
+		ConnectAddress address;
+		memset(&address, 0, sizeof(address));
+		memcpy(&address.mAddress, p->ai_addr, p->ai_addrlen);
+		address.mLength = socklen_t(p->ai_addrlen);
+		(p->ai_family == result->ai_family ? preferred : others).push_back(address);
+	}
+	freeaddrinfo(result);
+	addresses.clear();
+	for (size_t i = 0; (i < preferred.size() || i < others.size()) && addresses.size() < CONNECT_MAX_ADDRESSES; i++)
+	{
+		if (i < preferred.size())
+		{
+			addresses.push_back(preferred[i]);
+		}
+		if (i < others.size() && addresses.size() < CONNECT_MAX_ADDRESSES)
+		{
+			addresses.push_back(others[i]);
+		}
+	}
+	return !addresses.empty();
+}
+
+// A host name waiting to be looked up, shared by the socket which asked and the resolver thread
+struct ResolveRequest
+{
+	void release(void)
+	{
+		if (--mRefCount == 0)
+		{
+			delete this;
+		}
+	}
+
+	std::string				mHost;
+	std::string				mPort;
+	ConnectAddresses		mAddresses;				// Empty if the name did not resolve
+	std::atomic<bool>		mDone{ false };
+	std::atomic<uint32_t>	mRefCount{ 2 };
+};
+
+// Looks up host names for the whole process on a thread of its own, so an asynchronous connect never
+// waits on DNS, and remembers the answers for a while, so a burst of connections to the same host
+// costs one lookup. Addresses given as numbers are converted in place without involving the thread.
+class HostResolver
+{
+public:
+	static HostResolver &get(void)
+	{
+		// Never deleted: the thread may be stuck in a lookup when the process exits
+		static HostResolver *resolver = new HostResolver;
+		return *resolver;
+	}
+
+	// Waits for the answer in the calling thread
+	bool resolve(const char *host, int32_t port, ConnectAddresses &addresses)
+	{
+		char sport[16];
+		wplatform::stringFormat(sport, 16, "%d", port);
+		if (getAddresses(host, sport, AI_NUMERICHOST, addresses) || lookup(host, sport, addresses))
+		{
+			return true;
+		}
+		if (!getAddresses(host, sport, 0, addresses))
+		{
+			return false;
+		}
+		remember(host, sport, addresses);
+		return true;
+	}
+
+	// Hands the lookup to the resolver thread; the request is already done if the answer was at hand.
+	// The caller releases the request whether or not it is done.
+	ResolveRequest *resolveAsync(const char *host, int32_t port)
+	{
+		ResolveRequest *request = new ResolveRequest;
+		request->mHost = host;
+		char sport[16];
+		wplatform::stringFormat(sport, 16, "%d", port);
+		request->mPort = sport;
+		if (getAddresses(host, sport, AI_NUMERICHOST, request->mAddresses) || lookup(host, sport, request->mAddresses))
+		{
+			request->mDone = true;
+			request->mRefCount--;
+			return request;
+		}
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (!mThread)
+		{
+			mThread = new std::thread([this]()
+			{
+				run();
+			});
+			mThread->detach();
+		}
+		mRequests.push_back(request);
+		mWake.notify_one();
+		return request;
+	}
+
+private:
+	struct CacheEntry
+	{
+		ConnectAddresses						mAddresses;
+		std::chrono::steady_clock::time_point	mExpires;
+	};
+
+	bool lookup(const std::string &host, const std::string &port, ConnectAddresses &addresses)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		auto found = mCache.find(host + ":" + port);
+		if (found == mCache.end())
+		{
+			return false;
+		}
+		if (found->second.mExpires < std::chrono::steady_clock::now())
+		{
+			mCache.erase(found);
+			return false;
+		}
+		addresses = found->second.mAddresses;
+		return true;
+	}
+
+	void remember(const std::string &host, const std::string &port, const ConnectAddresses &addresses)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (mCache.size() >= RESOLVE_CACHE_SIZE)
+		{
+			auto oldest = mCache.begin();
+			for (auto i = mCache.begin(); i != mCache.end(); ++i)
+			{
+				if (i->second.mExpires < oldest->second.mExpires)
+				{
+					oldest = i;
+				}
+			}
+			mCache.erase(oldest);
+		}
+		CacheEntry &entry = mCache[host + ":" + port];
+		entry.mAddresses = addresses;
+		entry.mExpires = std::chrono::steady_clock::now() + std::chrono::seconds(RESOLVE_CACHE_TIME);
+	}
+
+	// One lookup at a time; requests queued behind one for the same name are answered from the cache
+	void run(void)
+	{
+		for (;;)
+		{
+			ResolveRequest *request;
+			{
+				std::unique_lock<std::mutex> lock(mMutex);
+				mWake.wait(lock, [this]()
+				{
+					return !mRequests.empty();
+				});
+				request = mRequests.front();
+				mRequests.pop_front();
+			}
+			// Skipped if the socket which asked has already given up
+			if (request->mRefCount > 1 && !lookup(request->mHost, request->mPort, request->mAddresses) &&
+				getAddresses(request->mHost.c_str(), request->mPort.c_str(), 0, request->mAddresses))
+			{
+				remember(request->mHost, request->mPort, request->mAddresses);
+			}
+			request->mDone = true;
+			request->release();
+		}
+	}
+
+	std::thread											*mThread{ nullptr };
+	std::mutex											mMutex;		// guards everything below
+	std::condition_variable								mWake;
+	std::deque< ResolveRequest * >						mRequests;
+	std::unordered_map< std::string, CacheEntry >		mCache;		// keyed by 'host:port'
+};
+
 class WsocketImpl : public Wsocket
 {
 public:
-	WsocketImpl(socket_t socket)
+	WsocketImpl(socket_t socket, capture::CaptureWriter *capture)
 	{
 		mSocket = socket;
+		if (capture)
+		{
+			capture->addRef();
+			mCapture = capture;
+			mCaptureStream = capture->newStream();
+		}
 	}
 
-	WsocketImpl(const char *hostName, int32_t port)
+	WsocketImpl(const char *hostName, int32_t port, const WsocketOptions &options)
 	{
+		setBufferSizes(options);
 		if (strcmp(hostName, "server") == 0)
 		{
-			mSocket = server_connect(port);
+			mSocket = server_connect(port, options);
 			mIsServer = true;
+			mAcceptBatch = options.mAcceptBatch ? options.mAcceptBatch : 1;
 		}
 		else
 		{
-			mSocket = hostname_connect(hostName, port);
+			startConnect(hostName, port, options);
+		}
+		// A server keeps the writer for the sockets it accepts, which each record a stream of their own
+		if (options.mCaptureFile && isValid())
+		{
+			mCapture = capture::CaptureWriter::create(options.mCaptureFile);
+			if (mCapture && !mIsServer)
+			{
+				mCaptureStream = mCapture->newStream();
+			}
 		}
-#ifdef SAVE_RECEIVE
-        mReceiveFile = fopen(SAVE_RECEIVE, "wb");
-#endif
-#ifdef SAVE_SEND
-		mSendFile = fopen(SAVE_SEND, "wb");
-#endif
 	}
 
 	virtual ~WsocketImpl(void)
 	{
 		close();
-#ifdef SAVE_RECEIVE
-        if (mReceiveFile)
-        {
-            fclose(mReceiveFile);
-        }
-#endif
-#ifdef SAVE_SEND
-		if (mSendFile)
+		if (mCapture)
 		{
-			fclose(mSendFile);
+			mCapture->release();
 		}
-#endif
 	}
 
 	virtual void nullSelect(int32_t timeout) override final
@@ -139,6 +403,11 @@ public:
 
 	virtual void select(int32_t timeout, size_t txBufSize) override final
 	{
+		if (mConnectState == CONNECT_PENDING)
+		{
+			pollConnect(timeout);
+			return;
+		}
 		fd_set rfds;
 		fd_set wfds;
 		timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
@@ -159,34 +428,79 @@ public:
 		{
 			ret = ::recv(mSocket, (char *)dest, int(maxLen), 0);
 		}
-#ifdef SAVE_RECEIVE
-        if (mReceiveFile && ret > 0 )
-        {
-//            fwrite(&ret, sizeof(ret), 1, mReceiveFile);
-//            fwrite(&maxLen, sizeof(maxLen), 1, mReceiveFile);
-            fwrite(dest, ret, 1, mReceiveFile);
-            fflush(mReceiveFile);
-        }
-#endif
+		if (mCapture && ret > 0)
+		{
+			mCapture->record(mCaptureStream, CAPTURE_RECEIVE, dest, uint32_t(ret));
+		}
 		return ret;
 	}
 
 	virtual int32_t send(const void *data, uint32_t dataLen) override final
 	{
-		int32_t ret = ::send(mSocket, (const char *)data, int(dataLen), 0);
-#ifdef SAVE_SEND
-		if (mSendFile && ret > 0)
+		int32_t ret = ::send(mSocket, (const char *)data, int(dataLen), SEND_FLAGS);
+		if (mCapture && ret > 0)
+		{
+			mCapture->record(mCaptureStream, CAPTURE_SEND, data, uint32_t(ret));
+		}
+		return ret;
+	}
+
+	virtual int32_t sendv(const WsocketIovec *iov, uint32_t iovCount, bool moreToCome) override final
+	{
+		if (iovCount > WSOCKET_MAX_IOV)
+		{
+			iovCount = WSOCKET_MAX_IOV;
+		}
+#ifdef _WIN32
+		(void)moreToCome;
+		WSABUF buffers[WSOCKET_MAX_IOV];
+		for (uint32_t i = 0; i < iovCount; i++)
+		{
+			buffers[i].buf = (CHAR *)iov[i].mData;
+			buffers[i].len = ULONG(iov[i].mLength);
+		}
+		DWORD sent = 0;
+		int32_t ret = WSASend(mSocket, buffers, DWORD(iovCount), &sent, 0, nullptr, nullptr) == SOCKET_ERROR ? -1 : int32_t(sent);
+#else
+		iovec vec[WSOCKET_MAX_IOV];
+		for (uint32_t i = 0; i < iovCount; i++)
 		{
-			fwrite(data, ret, 1, mSendFile);
-			fflush(mSendFile);
+			vec[i].iov_base = (void *)iov[i].mData;
+			vec[i].iov_len = iov[i].mLength;
 		}
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = vec;
+		msg.msg_iovlen = iovCount;
+		int flags = SEND_FLAGS;
+#ifdef MSG_MORE
+		// Corks the connection for this call only; the final send of the burst pushes the packet out
+		if (moreToCome)
+		{
+			flags |= MSG_MORE;
+		}
+#else
+		(void)moreToCome;
 #endif
+		int32_t ret = int32_t(::sendmsg(mSocket, &msg, flags));
+#endif
+		if (mCapture && ret > 0)
+		{
+			mCapture->recordv(mCaptureStream, CAPTURE_SEND, iov, iovCount, uint32_t(ret));
+		}
 		return ret;
 	}
 
 	// Not sure what this is, but it's in the original code so making it available now.
+	// A socket still connecting has it done once it connects.
 	virtual void disableNaglesAlgorithm(void) override final
 	{
+		mNoDelay = true;
+		if (mConnectState == CONNECT_PENDING || mNoDelayApplied)
+		{
+			return;
+		}
+		mNoDelayApplied = true;
 		int flag = 1;
 		setsockopt(mSocket, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag)); // Disable Nagle's algorithm
 #ifdef _WIN32
@@ -197,6 +511,11 @@ public:
 #endif
 	}
 
+	virtual int64_t getSocketHandle(void) override final
+	{
+		return (mSocket == INVALID_SOCKET || mSocket == 0) ? -1 : int64_t(mSocket);
+	}
+
 	virtual void release(void) override final
 	{
 		delete this;
@@ -204,14 +523,101 @@ public:
 
 	bool isValid(void) const
 	{
-		return mSocket != INVALID_SOCKET;
+		return mSocket != INVALID_SOCKET || mConnectState == CONNECT_PENDING;
+	}
+
+	// A byte stream; messages are framed by the layer above
+	virtual bool supportsMessages(void) override final
+	{
+		return false;
+	}
+
+	virtual bool sendMessage(const void *data, uint32_t dataLen) override final
+	{
+		(void)data;
+		(void)dataLen;
+		return false;
+	}
+
+	virtual const void *receiveMessage(uint32_t &dataLen) override final
+	{
+		dataLen = 0;
+		return nullptr;
+	}
+
+	virtual void releaseMessage(void) override final
+	{
+	}
+
+	virtual ConnectState pollConnect(int32_t timeout) override final
+	{
+		if (mConnectState != CONNECT_PENDING)
+		{
+			return mConnectState;
+		}
+		if (mResolve)
+		{
+			if (!mResolve->mDone)
+			{
+				if (timeout > 0)
+				{
+					std::this_thread::sleep_for(std::chrono::milliseconds(timeout < CONNECT_WAIT ? timeout : CONNECT_WAIT));
+				}
+				if (std::chrono::steady_clock::now() >= mDeadline)
+				{
+					failConnect();
+				}
+				return mConnectState;
+			}
+			mAddresses.swap(mResolve->mAddresses);
+			mResolve->release();
+			mResolve = nullptr;
+		}
+		if (!checkAttempts(0))
+		{
+			startAttempts();
+		}
+		if (mConnectState == CONNECT_PENDING && timeout > 0 && !mAttempts.empty())
+		{
+			// Wake up for an answer, for the next address's turn, or for the deadline, whichever comes first
+			auto now = std::chrono::steady_clock::now();
+			auto until = mDeadline;
+			if (mNextAddress < mAddresses.size() && mNextAttempt < until)
+			{
+				until = mNextAttempt;
+			}
+			int64_t wait = until > now ? std::chrono::duration_cast<std::chrono::milliseconds>(until - now).count() + 1 : 0;
+			if (!checkAttempts(int32_t(wait < timeout ? wait : timeout)))
+			{
+				startAttempts();
+			}
+		}
+		if (mConnectState == CONNECT_PENDING && (mAttempts.empty() || std::chrono::steady_clock::now() >= mDeadline))
+		{
+			failConnect();
+		}
+		return mConnectState;
 	}
 
 	virtual void close(void) override final
 	{
+		if (mConnectState == CONNECT_PENDING)
+		{
+			failConnect();
+		}
+		for (size_t i = mNextAccepted; i < mAccepted.size(); i++)
+		{
+			closesocket(mAccepted[i]);
+		}
+		mAccepted.clear();
+		mNextAccepted = 0;
 		if (mSocket)
 		{
 			closesocket(mSocket);
+			if (mCapture && !mIsServer && mSocket != INVALID_SOCKET)
+			{
+				mCapture->record(mCaptureStream, CAPTURE_CLOSE, nullptr, 0);
+			}
 		}
 		mSocket = 0;
 	}
@@ -226,12 +632,24 @@ public:
 		return socketerrno == SOCKET_EAGAIN_EINPROGRESS;
 	}
 
-	socket_t server_connect(int port)
+	socket_t server_connect(int port, const WsocketOptions &options)
 	{
 		socket_t listenSocket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
 		if (listenSocket == INVALID_SOCKET)
 			return INVALID_SOCKET;
 
+		// Allow the server to be restarted while old connections are still in TIME_WAIT
+		int flag = 1;
+		setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, (char*)&flag, sizeof(flag));
+#ifdef SO_REUSEPORT
+		if (options.mReusePort)
+		{
+			setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, (char*)&flag, sizeof(flag));
+		}
+#endif
+
+		applyBufferSizes(listenSocket);
+
 		sockaddr_in addr = { 0 };
 		addr.sin_family = AF_INET;
 		addr.sin_port = htons(u_short(port));
@@ -258,45 +676,133 @@ public:
 		return listenSocket;
 	}
 
-	socket_t hostname_connect(const char *hostname, int port)
+	// Resolves the name (on the resolver thread if asynchronous) and starts on the first address.
+	// A synchronous connect then carries on until it knows how it went.
+	void startConnect(const char *hostName, int32_t port, const WsocketOptions &options)
 	{
-		addrinfo hints;
-		addrinfo *result;
-		addrinfo *p;
-		int ret;
-		socket_t sockfd = INVALID_SOCKET;
-		char sport[16];
-		memset(&hints, 0, sizeof(hints));
+		mConnectState = CONNECT_PENDING;
+		mDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(options.mConnectTimeout ? options.mConnectTimeout : WSOCKET_CONNECT_TIMEOUT);
+		if (options.mConnectAsync)
+		{
+			mResolve = HostResolver::get().resolveAsync(hostName, port);
+			pollConnect(0);
+			return;
+		}
+		if (!HostResolver::get().resolve(hostName, port, mAddresses))
+		{
+			mConnectState = CONNECT_FAILED;
+			return;
+		}
+		while (pollConnect(CONNECT_STAGGER) == CONNECT_PENDING)
+		{
+		}
+	}
 
-		hints.ai_family = AF_UNSPEC;
-		hints.ai_socktype = SOCK_STREAM;
-		wplatform::stringFormat(sport, 16, "%d", port);
+	// Starts the next address connecting if none is in flight, or if the last has had its turn
+	void startAttempts(void)
+	{
+		while (mConnectState == CONNECT_PENDING && mNextAddress < mAddresses.size() &&
+			(mAttempts.empty() || std::chrono::steady_clock::now() >= mNextAttempt))
+		{
+			const ConnectAddress &address = mAddresses[mNextAddress++];
+			socket_t s = socket(address.mAddress.ss_family, SOCK_STREAM, IPPROTO_TCP);
+			if (s == INVALID_SOCKET)
+			{
+				continue;
+			}
+			setBlockingInternal(s, false);
+			applyBufferSizes(s);
+			if (::connect(s, (const sockaddr *)&address.mAddress, address.mLength) == 0)
+			{
+				mAttempts.push_back(s);
+				connected(mAttempts.size() - 1);
+			}
+			else if (socketerrno == SOCKET_CONNECT_STARTED)
+			{
+				mAttempts.push_back(s);
+				mNextAttempt = std::chrono::steady_clock::now() + std::chrono::milliseconds(CONNECT_STAGGER);
+			}
+			else
+			{
+				closesocket(s);
+			}
+		}
+	}
 
-		if ((ret = getaddrinfo(hostname, sport, &hints, &result)) != 0)
+	// Waits up to 'timeout' milliseconds for an attempt to finish. The first to connect wins; those
+	// which fail are dropped, and the next address need not wait its turn. Returns true once connected.
+	bool checkAttempts(int32_t timeout)
+	{
+		pollfd fds[CONNECT_MAX_ADDRESSES];
+		size_t count = mAttempts.size();
+		if (!count)
 		{
-#ifdef _MSC_VER
-            fprintf(stderr, "getaddrinfo: %s\n", gai_strerrorA(ret));
-#else
-			fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
-#endif
-			return 1;
+			return false;
+		}
+		for (size_t i = 0; i < count; i++)
+		{
+			fds[i].fd = mAttempts[i];
+			fds[i].events = POLLOUT;
+			fds[i].revents = 0;
+		}
+		if (pollsocket(fds, (unsigned long)count, timeout) <= 0)
+		{
+			return false;
 		}
-		for (p = result; p != NULL; p = p->ai_next)
+		for (size_t i = count; i-- > 0;)
 		{
-			sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-			if (sockfd == INVALID_SOCKET)
+			if (!fds[i].revents)
 			{
 				continue;
 			}
-			if (connect(sockfd, p->ai_addr, int(p->ai_addrlen)) != SOCKET_ERROR)
+			int error = 0;
+			socklen_t len = sizeof(error);
+			getsockopt(mAttempts[i], SOL_SOCKET, SO_ERROR, (char *)&error, &len);
+			if (error == 0 && (fds[i].revents & POLLOUT))
 			{
-				break;
+				connected(i);
+				return true;
+			}
+			closesocket(mAttempts[i]);
+			mAttempts.erase(mAttempts.begin() + i);
+			mNextAttempt = std::chrono::steady_clock::now();
+		}
+		return false;
+	}
+
+	// Attempt 'index' won; the socket goes back to blocking, as a synchronous connect leaves it
+	void connected(size_t index)
+	{
+		mSocket = mAttempts[index];
+		for (size_t i = 0; i < mAttempts.size(); i++)
+		{
+			if (i != index)
+			{
+				closesocket(mAttempts[i]);
 			}
-			closesocket(sockfd);
-			sockfd = INVALID_SOCKET;
 		}
-		freeaddrinfo(result);
-		return sockfd;
+		mAttempts.clear();
+		mConnectState = CONNECT_DONE;
+		setBlockingInternal(mSocket, true);
+		if (mNoDelay)
+		{
+			disableNaglesAlgorithm();
+		}
+	}
+
+	void failConnect(void)
+	{
+		for (size_t i = 0; i < mAttempts.size(); i++)
+		{
+			closesocket(mAttempts[i]);
+		}
+		mAttempts.clear();
+		if (mResolve)
+		{
+			mResolve->release();
+			mResolve = nullptr;
+		}
+		mConnectState = CONNECT_FAILED;
 	}
 
 	// If we are a server, we poll for new connections.
@@ -308,10 +814,14 @@ public:
 
 		if (mIsServer && mSocket != INVALID_SOCKET)
 		{
-			socket_t clientSocket = ::accept(mSocket, 0, 0);
-			if (clientSocket != INVALID_SOCKET)
+			if (mNextAccepted == mAccepted.size())
+			{
+				acceptBatch();
+			}
+			if (mNextAccepted < mAccepted.size())
 			{
-				WsocketImpl *w = new WsocketImpl(clientSocket);
+				WsocketImpl *w = new WsocketImpl(mAccepted[mNextAccepted++], mCapture);
+				w->mNoDelay = w->mNoDelayApplied = true; // done by acceptBatch
 				ret = static_cast<Wsocket *>(w);
 			}
 		}
@@ -319,6 +829,75 @@ public:
 		return ret;
 	}
 
+	// Takes up to 'mAcceptBatch' connections off the accept queue, stopping early once it is empty,
+	// and sets each one up to be used straight away
+	void acceptBatch(void)
+	{
+		mAccepted.clear();
+		mNextAccepted = 0;
+		mAcceptStalled = false;
+		while (mAccepted.size() < mAcceptBatch)
+		{
+#ifdef __linux__
+			socket_t clientSocket = ::accept4(mSocket, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+			socket_t clientSocket = ::accept(mSocket, 0, 0);
+#endif
+			if (clientSocket == INVALID_SOCKET)
+			{
+				int err = socketerrno;
+				// A signal, or a client which gave up while queued; the rest are still waiting
+				if (err == SOCKET_EINTR || err == SOCKET_ECONNABORTED)
+				{
+					continue;
+				}
+				mAcceptStalled = err == SOCKET_EMFILE || err == SOCKET_ENFILE || err == SOCKET_ENOBUFS || err == SOCKET_ENOMEM;
+				break;
+			}
+#ifndef __linux__
+			setBlockingInternal(clientSocket, false);
+#ifndef _WIN32
+			fcntl(clientSocket, F_SETFD, FD_CLOEXEC);
+#endif
+#endif
+			int flag = 1;
+			setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag));
+			mAccepted.push_back(clientSocket);
+		}
+	}
+
+	void setBufferSizes(const WsocketOptions &options)
+	{
+		mSendBufferSize = options.mSendBufferSize;
+		mReceiveBufferSize = options.mReceiveBufferSize;
+	}
+
+	// Before 'listen' or 'connect', so the window scale the connection agrees on allows for them
+	void applyBufferSizes(socket_t socket)
+	{
+		if (mSendBufferSize)
+		{
+			int size = int(mSendBufferSize);
+			setsockopt(socket, SOL_SOCKET, SO_SNDBUF, (char*)&size, sizeof(size));
+		}
+		if (mReceiveBufferSize)
+		{
+			int size = int(mReceiveBufferSize);
+			setsockopt(socket, SOL_SOCKET, SO_RCVBUF, (char*)&size, sizeof(size));
+		}
+	}
+
+	virtual bool acceptStalled(void) override final
+	{
+		return mAcceptStalled;
+	}
+
+	// Readiness of regular sockets is reported through their handle
+	virtual int32_t pollReady(Wsocket **ready, uint32_t maxReady) override final
+	{
+		return -1;
+	}
+
 	void setBlockingInternal(socket_t socket, bool blocking)
 	{
 #ifdef _MSC_VER
@@ -336,26 +915,45 @@ public:
 
 	bool		mIsServer{ false };
 	socket_t	mSocket{ INVALID_SOCKET };
-#ifdef SAVE_RECEIVE
-    FILE        *mReceiveFile{ nullptr };
-#endif
-#ifdef SAVE_SEND
-	FILE		*mSendFile{ nullptr };
-#endif
+	capture::CaptureWriter	*mCapture{ nullptr };		// Where traffic is recorded, if anywhere
+	uint32_t				mCaptureStream{ 0 };
+	bool					mNoDelay{ false };			// disableNaglesAlgorithm was asked for
+	bool					mNoDelayApplied{ false };	// and has been done
+	uint32_t				mSendBufferSize{ 0 };		// SO_SNDBUF, or 0 for the default
+	uint32_t				mReceiveBufferSize{ 0 };	// SO_RCVBUF, or 0 for the default
+
+	// Accepting; see acceptBatch
+	uint32_t				mAcceptBatch{ WSOCKET_ACCEPT_BATCH };
+	std::vector< socket_t >	mAccepted;					// The last batch taken off the accept queue
+	size_t					mNextAccepted{ 0 };			// The next of them to hand out
+	bool					mAcceptStalled{ false };	// The last batch ran out of descriptors or memory
+
+	// Connecting; see startConnect
+	ConnectState							mConnectState{ CONNECT_DONE };
+	ResolveRequest							*mResolve{ nullptr };		// The name lookup, until it is done
+	ConnectAddresses						mAddresses;					// What it found
+	size_t									mNextAddress{ 0 };			// The next of them to try
+	std::vector< socket_t >					mAttempts;					// Connects in flight
+	std::chrono::steady_clock::time_point	mNextAttempt;				// When the next address gets its turn
+	std::chrono::steady_clock::time_point	mDeadline;					// When to give up
 };
 
+// Replays the receives of one stream of a capture file (see Capture.h), one captured receive per call
+// followed by a 'would block', so each 'poll' sees what one receive saw when it was recorded.
+// Either as fast as it is read, or at the pace it was captured. Sends are accepted and discarded.
+// The end of the stream reads as the peer closing the connection.
 class WsocketPlayback : public Wsocket
 {
 public:
-    WsocketPlayback(const char *playBackFile)
+    WsocketPlayback(const char *playBackFile, const WsocketOptions &options) : mStream(options.mPlaybackStream), mRealTime(options.mPlaybackRealTime)
     {
-        mPlaybackFile = fopen(playBackFile, "rb");
+        mReader = capture::CaptureReader::create(playBackFile);
     }
     virtual ~WsocketPlayback(void)
     {
-        if (mPlaybackFile)
+        if (mReader)
         {
-            fclose(mPlaybackFile);
+            mReader->release();
         }
     }
 
@@ -376,31 +974,63 @@ public:
     // A return code >0 is number of bytes received.
     virtual int32_t receive(void *dest, uint32_t maxLen) override final
     {
-        int32_t ret = -1;
-
-        // cannot read if we are waiting for a send
-        if (mPlaybackFile )
+        if (mPaused)
+        {
+            mPaused = false;
+            return -1;
+        }
+        if (!mRecord && !nextRecord())
+        {
+            return 0;
+        }
+        if (mRealTime)
         {
-            size_t r = fread(&ret, sizeof(ret), 1, mPlaybackFile);
-            if (r == 1)
+            uint64_t now = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+            if (!mReplayStart)
+            {
+                mReplayStart = now;
+                mCaptureStart = mRecord->mTime;
+            }
+            if (mRecord->mTime - mCaptureStart > now - mReplayStart)
             {
-                uint32_t _maxLen;
-                r = fread(&_maxLen, sizeof(_maxLen), 1, mPlaybackFile);
-                if (r == 1)
-                {
-                    if (ret > 0)
-                    {
-                        assert(ret <= int32_t(maxLen));
-                        if (ret <= int32_t(maxLen))
-                        {
-                            r = fread(dest, ret, 1, mPlaybackFile);
-                        }
-                    }
-                }
+                return -1; // not due yet
             }
         }
+        if (mRecord->mDirection == CAPTURE_CLOSE)
+        {
+            return 0;
+        }
+        uint32_t len = mRecord->mLength - mOffset;
+        if (len > maxLen)
+        {
+            len = maxLen;
+        }
+        memcpy(dest, mData + mOffset, len);
+        mOffset += len;
+        if (mOffset == mRecord->mLength)
+        {
+            mRecord = nullptr;
+            mPaused = true;
+        }
+        return int32_t(len);
+    }
 
-        return ret;
+    // Moves on to the next receive (or the close) of our stream
+    bool nextRecord(void)
+    {
+        mOffset = 0;
+        while ((mRecord = mReader->next(mData)) != nullptr)
+        {
+            if (mStream == CAPTURE_ANY_STREAM)
+            {
+                mStream = mRecord->mStream;
+            }
+            if (mRecord->mStream == mStream && (mRecord->mDirection == CAPTURE_RECEIVE || mRecord->mDirection == CAPTURE_CLOSE))
+            {
+                return true;
+            }
+        }
+        return false;
     }
 
     // Send this much data to the socket
@@ -409,6 +1039,46 @@ public:
         return int32_t(dataLen);
     }
 
+    virtual int32_t sendv(const WsocketIovec *iov, uint32_t iovCount, bool moreToCome) override final
+    {
+        (void)moreToCome;
+        uint32_t ret = 0;
+        for (uint32_t i = 0; i < iovCount; i++)
+        {
+            ret += iov[i].mLength;
+        }
+        return int32_t(ret);
+    }
+
+    // Playback replays a recorded byte stream
+    virtual bool supportsMessages(void) override final
+    {
+        return false;
+    }
+
+    virtual bool sendMessage(const void *data, uint32_t dataLen) override final
+    {
+        (void)data;
+        (void)dataLen;
+        return false;
+    }
+
+    virtual const void *receiveMessage(uint32_t &dataLen) override final
+    {
+        dataLen = 0;
+        return nullptr;
+    }
+
+    virtual void releaseMessage(void) override final
+    {
+    }
+
+    virtual ConnectState pollConnect(int32_t timeout) override final
+    {
+        (void)timeout;
+        return CONNECT_DONE;
+    }
+
     // Close the socket
     virtual void	close(void) override final
     {
@@ -433,6 +1103,12 @@ public:
 
     }
 
+    // Playback has no pollable handle
+    virtual int64_t getSocketHandle(void) override final
+    {
+        return -1;
+    }
+
     // Close the socket and release this class
     virtual void release(void) override final
     {
@@ -441,7 +1117,7 @@ public:
 
     bool isValid(void) const
     {
-        return mPlaybackFile ? true : false;
+        return mReader ? true : false;
     }
 
 	// If we are a server, we poll for new connections.
@@ -452,18 +1128,56 @@ public:
 		return nullptr;
 	}
 
+	virtual bool acceptStalled(void) override final
+	{
+		return false;
+	}
+
+	virtual int32_t pollReady(Wsocket **ready, uint32_t maxReady) override final
+	{
+		return -1;
+	}
+
 
-    FILE    *mPlaybackFile{ nullptr };
+    capture::CaptureReader                  *mReader{ nullptr };
+    const capture::CaptureRecordHeader      *mRecord{ nullptr };    // The record being replayed
+    const uint8_t                           *mData{ nullptr };      // and its bytes
+    uint32_t                                mOffset{ 0 };           // Bytes of it already returned
+    uint32_t                                mStream{ CAPTURE_ANY_STREAM };
+    bool                                    mRealTime{ false };
+    bool                                    mPaused{ false };       // Just returned the end of a record
+    uint64_t                                mReplayStart{ 0 };      // When the first record was replayed
+    uint64_t                                mCaptureStart{ 0 };     // and when it was captured
 };
 
 Wsocket *Wsocket::create(const char *hostName, int32_t port)
+{
+	WsocketOptions options;
+	return create(hostName, port, options);
+}
+
+Wsocket *Wsocket::create(const char *hostName, int32_t port, const WsocketOptions &options)
 {
 	if (strcmp(hostName, SHARED_SERVER) == 0 ||
 		strcmp(hostName, SHARED_CLIENT) == 0)
 	{
-		return createSocketSharedMemory(hostName, port);
+		return createSocketSharedMemory(hostName, port, options);
+	}
+#ifdef IO_URING_SERVER
+	bool tryUring = strcmp(hostName, SOCKET_SERVER) == 0 || strcmp(hostName, URING_SERVER) == 0;
+#else
+	bool tryUring = strcmp(hostName, URING_SERVER) == 0;
+#endif
+	if (tryUring)
+	{
+		Wsocket *uring = createSocketUring(hostName, port, options);
+		if (uring)
+		{
+			return uring;
+		}
+		hostName = SOCKET_SERVER; // io_uring is not available; use a regular server socket
 	}
-	auto ret = new WsocketImpl(hostName, port);
+	auto ret = new WsocketImpl(hostName, port, options);
 	if (!ret->isValid())
 	{
 		delete ret;
@@ -474,7 +1188,13 @@ Wsocket *Wsocket::create(const char *hostName, int32_t port)
 
 Wsocket *Wsocket::create(const char *playbackFile)
 {
-    auto ret = new WsocketPlayback(playbackFile);
+    WsocketOptions options;
+    return create(playbackFile, options);
+}
+
+Wsocket *Wsocket::create(const char *playbackFile, const WsocketOptions &options)
+{
+    auto ret = new WsocketPlayback(playbackFile, options);
     if (!ret->isValid())
     {
         delete ret;
@@ -5,21 +5,94 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "Capture.h"
+
 // To create a client/server connection using shared memory, use these host names
-#define SHARED_SERVER "sharedserver"	// Open a server connection using shared memory
-#define SHARED_CLIENT "sharedclient"	// Open a client connection using shared memory
+#define SHARED_SERVER "sharedserver"	// Open a server which accepts clients on the same machine through shared memory
+#define SHARED_CLIENT "sharedclient"	// Connect to the shared memory server on this port
 #define SOCKET_SERVER "server"			// Open a socket connection as a server
+#define URING_SERVER "uringserver"		// Open a server whose connections are driven by io_uring (falls back to 'server')
 
 namespace wsocket
 {
 
+#define WSOCKET_MAX_IOV 1024	// Most pieces 'sendv' accepts in one call (the Linux IOV_MAX)
+#define WSOCKET_CONNECT_TIMEOUT 60000	// Milliseconds a client socket keeps trying to connect, unless told otherwise
+#define WSOCKET_ACCEPT_BATCH 64			// Connections a server socket takes from the kernel at a time, unless told otherwise
+
+// How far a client socket has got with connecting (see WsocketOptions::mConnectAsync)
+enum ConnectState
+{
+	CONNECT_PENDING,	// Still resolving the host name, or waiting for one of its addresses to answer
+	CONNECT_DONE,		// Connected; every other kind of socket always reports this
+	CONNECT_FAILED,		// No address answered before the deadline, or the name did not resolve
+};
+
+// One piece of data for a gathered send
+struct WsocketIovec
+{
+	const void	*mData;
+	uint32_t	mLength;
+};
+
+// Optional settings used when creating a socket
+struct WsocketOptions
+{
+	// Server sockets only. Lets several listen sockets bind the same port (SO_REUSEPORT) so the kernel
+	// spreads incoming connections across them; used to give each worker thread its own listen socket.
+	// Ignored on platforms which do not support it.
+	bool	mReusePort{ false };
+
+	// Regular server sockets only. 'pollServer' takes up to this many connections off the kernel's accept
+	// queue at a time, then hands them out one per call. Accepted sockets come back ready to use:
+	// non-blocking, not inherited by child processes, and with Nagle's algorithm off.
+	uint32_t	mAcceptBatch{ WSOCKET_ACCEPT_BATCH };
+
+	// Regular sockets only. Kernel send and receive buffer sizes (SO_SNDBUF and SO_RCVBUF) in bytes, or 0
+	// for the system's default. A server sets them on its listen socket, so every connection it accepts
+	// inherits them, and early enough for the TCP window scale to take them into account.
+	uint32_t	mSendBufferSize{ 0 };
+	uint32_t	mReceiveBufferSize{ 0 };
+
+	// Shared memory servers only; clients use whatever their server chose.
+	// Bytes in each direction's ring of every connection, or 0 for the default.
+	uint32_t	mSharedRingSize{ 0 };
+	// Fault the whole region in up front instead of page by page on first use
+	bool		mSharedPopulate{ false };
+	// Lock the region into memory so it is never paged out (needs a high enough RLIMIT_MEMLOCK)
+	bool		mSharedLock{ false };
+	// Back the region with huge pages, if the system has them to give
+	bool		mSharedHugePages{ false };
+
+	// Regular client sockets only. Return from 'create' straight away and connect in the background:
+	// the host name is resolved on a worker thread, and its addresses are tried in the manner of
+	// "happy eyeballs", a new attempt starting whenever the last has had a while to answer, until one
+	// connects. Call 'pollConnect' until it stops returning CONNECT_PENDING. Without this, 'create'
+	// does the same but waits for the outcome, returning null if it fails.
+	bool		mConnectAsync{ false };
+	// Milliseconds to keep trying before giving up, or 0 for the default (WSOCKET_CONNECT_TIMEOUT)
+	uint32_t	mConnectTimeout{ 0 };
+
+	// Regular sockets only. Records everything sent and received to this capture file (see Capture.h).
+	// Sockets a server accepts share its file, each as a stream of its own.
+	const char	*mCaptureFile{ nullptr };
+
+	// Playback sockets only. Which stream of the capture file to replay, and whether to keep to the
+	// pace it was captured at rather than going as fast as it can.
+	uint32_t	mPlaybackStream{ CAPTURE_ANY_STREAM };
+	bool		mPlaybackRealTime{ false };
+};
+
 class Wsocket
 {
 public:
 	// Create's a socket for this hostname and port; returns null if it failed
 	// Use 'server' as the hostName to create a server connection
 	static Wsocket *create(const char *hostName,int32_t port);
+	static Wsocket *create(const char *hostName,int32_t port,const WsocketOptions &options);
+	// Replays a capture file as the receive side of a connection (see WsocketOptions for the choices)
     static Wsocket *create(const char *playbackFile);
+    static Wsocket *create(const char *playbackFile,const WsocketOptions &options);
 
 	// On some platforms the sockets interface has to be manually initialized once on startup and then shutdown
 	// These two methods perform that step if needed.
@@ -30,8 +103,20 @@ public:
 	// If we are a server, we poll for new connections.
 	// If a new connection is found, then we return an instance of a Wsocket with that connection.
 	// It is the caller's responsibility to release it when finished
+	// Call it until it returns null to take every connection waiting.
 	virtual Wsocket *pollServer(void) = 0;
 
+	// After 'pollServer' returns null: true if it stopped because the process ran out of descriptors or
+	// memory rather than because no connection was waiting. Those still waiting will not make the listen
+	// socket readable again, so try 'pollServer' again on a later pass.
+	virtual bool acceptStalled(void) = 0;
+
+	// Servers whose accepted sockets have no pollable handle, but whose transport tracks readiness
+	// itself (io_uring), report the accepted sockets which have had activity since the last call.
+	// Fills 'ready' with up to 'maxReady' sockets and returns the count. Returns -1 if this socket
+	// does not track readiness, in which case handle-less sockets have to be polled every pass.
+	virtual int32_t pollReady(Wsocket **ready, uint32_t maxReady) = 0;
+
 	// performs the select operation on this socket
 	virtual void select(int32_t timeOut,size_t txBufSize) = 0;
 
@@ -46,6 +131,34 @@ public:
 	// Send this much data to the socket
 	virtual int32_t send(const void *data, uint32_t dataLen) = 0;
 
+	// Send up to WSOCKET_MAX_IOV pieces of data with a single call. Return codes are the same as 'send';
+	// a short count means the socket is full, and may stop part way through any piece.
+	// Pass 'moreToCome' if another send follows straight away, so the transport can hold back a
+	// partially filled packet until the last piece of the burst (MSG_MORE).
+	virtual int32_t sendv(const WsocketIovec *iov, uint32_t iovCount, bool moreToCome) = 0;
+
+	// Message transports (shared memory) keep the boundaries of what is sent, so the layer above
+	// needs no framing of its own. Returns false for byte stream sockets, where the calls below do nothing.
+	virtual bool supportsMessages(void) = 0;
+
+	// Sends one whole message; the peer receives it as one piece. Returns false if the transport
+	// cannot take all of it right now, in which case call again later with the same message: a message
+	// too large for the transport in one piece may already be partly sent, and carries on from there.
+	virtual bool sendMessage(const void *data, uint32_t dataLen) = 0;
+
+	// Returns the next whole message in place, or null if there is none. It is followed by a zero byte
+	// which is not counted in 'dataLen', and stays valid until 'releaseMessage'. Bytes sent with
+	// 'send' or 'sendv' are still read with 'receive', in order with the messages around them.
+	virtual const void *receiveMessage(uint32_t &dataLen) = 0;
+
+	// Done with the message returned by 'receiveMessage'
+	virtual void releaseMessage(void) = 0;
+
+	// Carries on connecting a socket created with WsocketOptions::mConnectAsync, waiting up to 'timeout'
+	// milliseconds for it to get somewhere. Until it returns CONNECT_DONE the socket has no handle and
+	// must not be used for anything but 'pollConnect', 'select', 'close' and 'release'.
+	virtual ConnectState pollConnect(int32_t timeout) = 0;
+
 	// Close the socket
 	virtual void	close(void) = 0;
 
@@ -58,6 +171,11 @@ public:
 	// Not sure what this is, but it's in the original code so making it available now.
 	virtual void disableNaglesAlgorithm(void) = 0;
 
+	// Returns the underlying operating system handle (socket descriptor) so that the socket
+	// can be registered with an external event loop. Returns -1 if this socket type has no
+	// pollable handle (playback, shared memory) and must simply be polled every pass.
+	virtual int64_t getSocketHandle(void) = 0;
+
 	// Close the socket and release this class
 	virtual void release(void) = 0;
 protected: